@@ -67,6 +67,23 @@ public:
     float* operator()(const T& p, int64_t s)
     { return (*this)(p.x, p.y, s); }
 
+    /**
+     * @brief Returns a pointer to the means of the pixel (x,y).
+     *
+     * Only meaningful in the pixel statistics mode (see SampleLayout::setPixelStatistics()),
+     * where the tile has the mean and variance of each layout element per pixel.
+     */
+    float* mean(int64_t x, int64_t y) const
+    { return (*this)(x, y, 0); }
+
+    /**
+     * @brief Returns a pointer to the variances of the pixel (x,y).
+     *
+     * Only meaningful in the pixel statistics mode (see SampleLayout::setPixelStatistics()).
+     */
+    float* variance(int64_t x, int64_t y) const
+    { return (*this)(x, y, 1); }
+
     /**
      * @brief Returns the starting x position of the tile.
      */
@@ -145,6 +162,7 @@ public:
 
 private:
     friend class BenchmarkClient;
+    friend class TileStream;
 
     BufferTile(int64_t x, int64_t ex,
                int64_t y, int64_t ey,
@@ -177,6 +195,188 @@ private:
 };
 
 
+/**
+ * @brief Handle for a sample evaluation started with BenchmarkClient::evaluateSamplesAsync().
+ *
+ * Evaluation is a lightweight, copyable handle: copies refer to the same evaluation.
+ * A default-constructed Evaluation is invalid and behaves as an already finished evaluation.
+ */
+class Evaluation
+{
+public:
+    Evaluation();
+
+    /**
+     * @brief Returns true if this handle refers to an evaluation.
+     */
+    bool isValid() const;
+
+    /**
+     * @brief Returns true if the evaluation finished (all tiles were consumed or it was canceled).
+     *
+     * This method never blocks.
+     */
+    bool isFinished() const;
+
+    /**
+     * @brief Blocks until the evaluation finishes.
+     *
+     * If the evaluation failed (for example, the consumer callback threw an exception),
+     * the exception is rethrown here.
+     */
+    void wait() const;
+
+    /**
+     * @brief Requests the evaluation to be canceled.
+     *
+     * The consumer callback is not called anymore after this method returns, except for calls
+     * that were already running. The renderer is asked to stop, and the samples that were not
+     * delivered yet are refunded to the sample budget. An evaluation that was not started yet
+     * is dropped without requesting any sample. Call wait() to be sure the evaluation finished.
+     */
+    void cancel();
+
+    /**
+     * @brief Returns true if cancel() was called.
+     */
+    bool isCanceled() const;
+
+    /**
+     * @brief Returns the number of samples refunded to the budget by cancel().
+     *
+     * Only meaningful after the evaluation finished.
+     */
+    int64_t getNumRefundedSamples() const;
+
+private:
+    friend class BenchmarkClient;
+    struct State;
+
+    explicit Evaluation(std::shared_ptr<State> state);
+
+    std::shared_ptr<State> m_state;
+};
+
+
+/**
+ * @brief Pull-based sequence of tiles from a sample evaluation.
+ *
+ * A TileStream is returned by BenchmarkClient::streamSamples() and BenchmarkClient::streamInputSamples().
+ * Instead of receiving the tiles in a callback, you pull them from the stream, either with next()
+ * or with a range-based for loop:
+ *
+ * \code
+ * auto stream = client.streamSamples(SPP(4));
+ * for(const BufferTile& tile: stream)
+ *     accumulate(tile);
+ * \endcode
+ *
+ * Each tile is valid until the stream advances. Advancing the stream hands the previous tile back
+ * to the renderer, so the state of the consumer can live in normal local variables.
+ *
+ * For input streams, check isInputRequest() to know whether the current tile is waiting for input values
+ * (write them to the tile before advancing) or contains rendered samples.
+ *
+ * Only one stream can be open at a time, and the other BenchmarkClient methods can't be called while
+ * a stream is open. Destroying (or calling close() on) an unfinished stream drains its remaining tiles.
+ * If the BenchmarkClient is destroyed first, the evaluation of its open stream is canceled, and the stream
+ * then behaves as a finished one.
+ */
+class TileStream
+{
+public:
+    /**
+     * @brief Input iterator over the tiles of a stream.
+     */
+    class Iterator
+    {
+    public:
+        Iterator(TileStream* stream = nullptr): m_stream(stream) {}
+
+        Iterator& operator++() { if(!m_stream->next()) m_stream = nullptr; return *this; }
+        bool operator==(const Iterator& it) const { return m_stream == it.m_stream; }
+        bool operator!=(const Iterator& it) const { return m_stream != it.m_stream; }
+        const BufferTile& operator*() const { return m_stream->tile(); }
+        const BufferTile* operator->() const { return &m_stream->tile(); }
+
+    private:
+        TileStream* m_stream;
+    };
+
+    TileStream();
+
+    TileStream(const TileStream&) = delete;
+
+    TileStream(TileStream&& stream);
+
+    ~TileStream();
+
+    /**
+     * @brief Advances to the next tile.
+     *
+     * Must be called once before accessing the first tile.
+     *
+     * @return false if there are no more tiles (the stream is finished).
+     */
+    bool next();
+
+    /**
+     * @brief Returns the current tile.
+     */
+    const BufferTile& tile() const;
+
+    /**
+     * @brief Returns true if the current tile is an input request.
+     */
+    bool isInputRequest() const;
+
+    /**
+     * @brief Returns true if all tiles were pulled (or the stream is empty).
+     */
+    bool isFinished() const;
+
+    /**
+     * @brief Drains the remaining tiles and finishes the evaluation.
+     *
+     * Input requests drained this way are sent back to the renderer with whatever
+     * values are in the tile memory.
+     */
+    void close();
+
+    /**
+     * @brief Cancels the evaluation.
+     *
+     * The renderer is asked to stop, the stream finishes, and the samples that were not
+     * pulled yet are refunded to the sample budget.
+     *
+     * @return Number of refunded samples.
+     */
+    int64_t cancel();
+
+    /**
+     * @brief Advances the stream and returns an iterator to the current tile.
+     */
+    Iterator begin() { return next() ? Iterator(this) : Iterator(); }
+
+    /**
+     * @brief Returns the past-the-end iterator.
+     */
+    Iterator end() { return Iterator(); }
+
+    TileStream& operator=(const TileStream&) = delete;
+
+    TileStream& operator=(TileStream&& stream);
+
+private:
+    friend class BenchmarkClient;
+    struct State;
+
+    explicit TileStream(std::unique_ptr<State> state);
+
+    std::unique_ptr<State> m_state;
+};
+
+
 /**
  * \brief The BenchmarkClient class is used to communicate with the benchmark server.
  *
@@ -207,8 +407,15 @@ public:
      *
      *     --fbksd-renderer "<renderer_exec> <renderer_args> ..."
      *       Starts the renderer process with the given arguments.
+     *     --fbksd-renderer-plugin "<renderer_lib> <renderer_args> ..."
+     *       Loads the renderer shared library (see RendererPlugin.h) into the client process, with the
+     *       given arguments. There is no renderer process nor benchmark server: tiles are handed to the
+     *       client directly, and sendResult() saves the result to `result.exr`.
      *     --fbksd-spp <value>
      *       Sets the sample budget available to client.
+     *     --fbksd-session <id>
+     *       Runs in the given benchmark session (see getSessionId()), allowing several
+     *       bypass-mode clients to run concurrently on the same host.
      *
      * This allows you to run your client program directly (for debugging purposes, for example).
      */
@@ -216,7 +423,7 @@ public:
 
     BenchmarkClient(const BenchmarkClient&) = delete;
 
-    BenchmarkClient(BenchmarkClient&&) = default;
+    BenchmarkClient(BenchmarkClient&& client);
 
     ~BenchmarkClient();
 
@@ -242,10 +449,34 @@ public:
      * be laid out in memory.
      * Common data includes, for example, color RGB and (x,y) image plane position.
      *
-     * This method should be called just once.
+     * This method should be called just once. To use different layouts in different passes,
+     * see registerSampleLayout().
      */
     void setSampleLayout(const SampleLayout& layout);
 
+    /**
+     * \brief Registers a sample layout to be used by later passes.
+     *
+     * Techniques that need different data in different passes (e.g. features in a first pass, and only
+     * color in the refinement passes) can register all layouts up front, and switch between them with
+     * setSampleLayout(int) before each pass. Each pass only transfers the elements of its layout.
+     *
+     * The renderer prepares the layout when it's registered, so switching doesn't recompute it. However,
+     * the renderer's SetParameters callback is called on every switch (see RenderingServer::onSetParameters()),
+     * so switching costs whatever the renderer does there.
+     *
+     * @return The layout id.
+     * @throws std::invalid_argument if the layout is invalid.
+     */
+    int registerSampleLayout(const SampleLayout& layout);
+
+    /**
+     * \brief Makes the registered layout `layoutId` the current sample layout.
+     *
+     * @throws std::invalid_argument if the id was not returned by registerSampleLayout().
+     */
+    void setSampleLayout(int layoutId);
+
     /**
      * \brief Returns a pointer to the buffer where the result image is stored.
      *
@@ -273,6 +504,43 @@ public:
      */
     void evaluateSamples(SPP spp, const TileConsumer& consumer);
 
+    /**
+     * @brief Request samples only inside the given regions of the image.
+     *
+     * Each pixel inside the windows receives `spp` samples. Windows are clipped to the image,
+     * and pixels covered by more than one window are sampled only once. Exactly `spp` times the
+     * number of covered pixels is debited from the budget. If the budget is not enough, the spp
+     * is reduced to what fits (use BufferTile::getSPP()). If the budget can't cover a single
+     * sample per pixel, nothing is evaluated.
+     *
+     * The renderer must support region requests (see RenderingServer::onEvaluateRegions()),
+     * otherwise an exception is thrown.
+     *
+     * @param spp
+     * Number of samples per pixel inside the windows.
+     * @param windows
+     * Regions of the image to be sampled.
+     * @param consumer
+     * Callback function that will be called for each tile produced by the renderer.
+     */
+    void evaluateSamples(SPP spp, const std::vector<CropWindow>& windows, const TileConsumer& consumer);
+
+    /**
+     * @brief Request samples for the whole image as a single frame.
+     *
+     * Instead of delivering tiles, the renderer writes each sample directly at its final position
+     * in a frame-sized buffer, so the returned BufferTile covers the whole image and no tile
+     * reassembly is needed. If the budget is not enough, the spp is reduced to what fits (use
+     * BufferTile::getSPP()). If the budget can't cover a single sample per pixel, the returned
+     * tile is empty.
+     *
+     * The returned tile is valid until the next call to this method.
+     *
+     * @param spp
+     * Number of samples per pixel.
+     */
+    BufferTile evaluateFrame(SPP spp);
+
     /**
      * @brief Request samples.
      *
@@ -290,6 +558,45 @@ public:
      */
     void evaluateSamples(int64_t numSamples, const TileConsumer2& consumer);
 
+    /**
+     * @brief Request samples without blocking.
+     *
+     * Asynchronous version of evaluateSamples(SPP, const TileConsumer&). The method returns immediately,
+     * and the consumer callback is called from a worker thread owned by the BenchmarkClient.
+     * This allows your technique to do other work (e.g. reconstruct the previous pass) while
+     * samples are rendered.
+     *
+     * Async evaluations are executed in the order they are requested. Any other method that
+     * communicates with the server (setSampleLayout(), evaluateSamples(), sendResult(), etc.) first
+     * waits for all pending async evaluations to finish.
+     *
+     * @return Evaluation handle used to wait for, or cancel, the evaluation.
+     */
+    Evaluation evaluateSamplesAsync(SPP spp, const TileConsumer& consumer);
+
+    /**
+     * @brief Request samples without blocking.
+     *
+     * Asynchronous version of evaluateSamples(int64_t, const TileConsumer2&).
+     */
+    Evaluation evaluateSamplesAsync(int64_t numSamples, const TileConsumer2& consumer);
+
+    /**
+     * @brief Request samples and returns a stream to pull the tiles from.
+     *
+     * Pull-based alternative to evaluateSamples(SPP, const TileConsumer&). See TileStream.
+     * Consumer threads (setNumConsumerThreads()) and eager release don't apply to streams.
+     */
+    TileStream streamSamples(SPP spp);
+
+    /**
+     * @brief Request samples with input values and returns a stream to pull the tiles from.
+     *
+     * Pull-based alternative to evaluateInputSamples(SPP, const TileProducer&, const TileConsumer&).
+     * Use TileStream::isInputRequest() to tell input requests from rendered tiles.
+     */
+    TileStream streamInputSamples(SPP spp);
+
     /**
      * @brief Request samples with input values.
      *
@@ -322,6 +629,50 @@ public:
                               const TileProducer2& producer,
                               const TileConsumer2& consumer);
 
+    /**
+     * @brief Sets the number of threads used to consume tiles.
+     *
+     * By default (1 thread), the consumer callback is called for one tile at a time, by the thread
+     * that called evaluateSamples() (or by the async worker thread, for evaluateSamplesAsync()).
+     *
+     * With more threads, the tiles produced by evaluateSamples() and evaluateSamplesAsync() are
+     * consumed concurrently by a pool of worker threads, and each tile is handed back to the renderer
+     * as soon as its consumer call finishes (possibly out of order). The consumer callback must then be
+     * thread-safe. In the SPP variants, tiles never overlap, so writing per-pixel data is safe.
+     *
+     * evaluateInputSamples() always consumes the tiles sequentially.
+     *
+     * If the consumer throws, the remaining tiles are skipped and the exception is rethrown
+     * to the caller after the evaluation is finished.
+     *
+     * @param numThreads Number of threads (0 = number of hardware threads).
+     */
+    void setNumConsumerThreads(int numThreads);
+
+    /**
+     * @brief Returns the number of threads used to consume tiles.
+     */
+    int getNumConsumerThreads() const;
+
+    /**
+     * @brief Enables eager release of tiles.
+     *
+     * By default, the memory of a tile stays locked until the consumer callback returns, so a slow
+     * consumer also stalls the renderer. When eager release is enabled, the client copies each tile to
+     * its own memory, hands the tile back to the renderer immediately, and calls the consumer with the copy.
+     * This way, the renderer keeps working on the next tiles while the consumer runs.
+     *
+     * The copy costs some memory bandwidth, so it only pays off for consumers that do substantial work per tile.
+     * Only evaluateSamples() and evaluateSamplesAsync() are affected.
+     * The BufferTile passed to the consumer is valid only during the callback.
+     */
+    void setEagerTileRelease(bool enable);
+
+    /**
+     * @brief Returns true if eager release of tiles is enabled.
+     */
+    bool isEagerTileReleaseEnabled() const;
+
     /**
      * \brief Sends the final result (rgb image)
      *
@@ -331,9 +682,11 @@ public:
 
     BenchmarkClient& operator=(const BenchmarkClient&) = delete;
 
-    BenchmarkClient& operator=(BenchmarkClient&&) = default;
+    BenchmarkClient& operator=(BenchmarkClient&& client);
 
 private:
+    BufferTile makeBufferTile(const Tile& tile, int64_t spp, float* data) const;
+
     struct Imp;
     std::unique_ptr<Imp> m_imp;
 };
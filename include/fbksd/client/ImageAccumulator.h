@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef IMAGEACCUMULATOR_H
+#define IMAGEACCUMULATOR_H
+
+#include "fbksd/client/BenchmarkClient.h"
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup BenchmarkClient
+ * @{
+ */
+
+/**
+ * @brief Reconstructs an image (or a feature buffer) from samples.
+ *
+ * Accumulates a contiguous range of channels of the samples (e.g. COLOR_R, COLOR_G and COLOR_B, or the
+ * three components of NORMAL) weighted by a reconstruction filter, and writes the normalized result to
+ * a caller buffer with resolve(). With the default box filter of radius 0.5, the result is the per-pixel mean.
+ *
+ * add() is thread-safe, so it can be called directly from parallel tile consumers
+ * (see BenchmarkClient::setNumConsumerThreads()).
+ *
+ * Example:
+ * \code
+ * // layout: IMAGE_X, IMAGE_Y, COLOR_R, COLOR_G, COLOR_B
+ * ImageAccumulator color(width, height, layout.getSampleSize(), 2, 3, ImageAccumulator::GAUSSIAN, 1.5f);
+ * color.setPositionChannels(0, 1);
+ * client.evaluateSamples(SPP(spp), [&](const BufferTile& tile){ color.add(tile); });
+ * color.resolve(client.getResultBuffer());
+ * \endcode
+ */
+class ImageAccumulator
+{
+public:
+    /**
+     * @brief Reconstruction filter.
+     */
+    enum Filter
+    {
+        BOX,        ///< Constant weight inside the radius.
+        TENT,       ///< Weight decreases linearly to zero at the radius.
+        GAUSSIAN,   ///< Gaussian (alpha = 2) shifted to be zero at the radius.
+    };
+
+    /**
+     * @brief Creates an accumulator for an image of size `width` x `height`.
+     *
+     * @param sampleSize
+     * Number of floats in a sample (see SampleLayout::getSampleSize()).
+     * @param firstChannel
+     * Position in the sample of the first accumulated channel.
+     * @param numChannels
+     * Number of consecutive channels accumulated.
+     * @param filter
+     * Reconstruction filter.
+     * @param radius
+     * Filter radius in pixels.
+     */
+    ImageAccumulator(int64_t width,
+                     int64_t height,
+                     int64_t sampleSize,
+                     int firstChannel,
+                     int numChannels,
+                     Filter filter = BOX,
+                     float radius = 0.5f);
+
+    ImageAccumulator(const ImageAccumulator&) = delete;
+
+    /**
+     * @brief Sets the positions of IMAGE_X and IMAGE_Y in the sample.
+     *
+     * Without them, samples in BufferTiles are considered to be at their pixel centers, and
+     * add(int64_t, const float*) can't be used.
+     */
+    void setPositionChannels(int xIndex, int yIndex);
+
+    /**
+     * @brief Accumulates all samples of the tile.
+     */
+    void add(const BufferTile& tile);
+
+    /**
+     * @brief Accumulates `numSamples` samples that are not grouped by pixel.
+     *
+     * The signature matches BenchmarkClient::TileConsumer2. The position channels must be set.
+     */
+    void add(int64_t numSamples, const float* samples);
+
+    /**
+     * @brief Writes the reconstructed image to `out`.
+     *
+     * `out` has `numChannels` floats per pixel, in row-major order. Pixels without samples are set to zero.
+     */
+    void resolve(float* out) const;
+
+    /**
+     * @brief Discards the accumulated samples.
+     */
+    void clear();
+
+    ImageAccumulator& operator=(const ImageAccumulator&) = delete;
+
+private:
+    // Accumulation buffer covering the pixels [x, ex) x [y, ey) of the image.
+    struct Window
+    {
+        int64_t x, ex, y, ey;
+        float* sums;
+        float* weights;
+    };
+
+    bool isPixelMean() const;
+    float weight(float d) const;
+    void splat(const Window& window, float px, float py, const float* sample, const float* end);
+
+    int64_t m_width;
+    int64_t m_height;
+    int64_t m_sampleSize;
+    int m_firstChannel;
+    int m_numChannels;
+    int m_stride; // floats per pixel in m_sums (multiple of 4)
+    Filter m_filter;
+    float m_radius;
+    int m_xIndex = -1;
+    int m_yIndex = -1;
+    std::vector<float> m_sums;
+    std::vector<float> m_weights;
+    std::mutex m_mutex;
+};
+
+/**@}*/
+
+} // namespace fbksd
+
+#endif // IMAGEACCUMULATOR_H
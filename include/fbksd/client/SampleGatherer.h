@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef SAMPLEGATHERER_H
+#define SAMPLEGATHERER_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace fbksd
+{
+
+class ThreadPool;
+
+/**
+ * \addtogroup BenchmarkClient
+ * @{
+ */
+
+/**
+ * @brief Groups samples by pixel.
+ *
+ * Samples requested with a number of samples that is not in SPP (see BenchmarkClient::evaluateSamples(int64_t, const TileConsumer2&))
+ * are delivered as flat chunks in tile order. This class collects those chunks (from one or more passes) and
+ * sorts them by pixel, so that all samples of a pixel are contiguous in memory.
+ *
+ * The pixel of a sample is given by its IMAGE_X and IMAGE_Y values, whose positions in the sample are given at construction.
+ * Samples outside the image are assigned to the nearest border pixel, and a NaN coordinate is taken as 0.
+ *
+ * Example:
+ * \code
+ * SampleGatherer gatherer(width, height, layout.getSampleSize());
+ * client.evaluateSamples(numSamples, [&](int64_t n, float* samples){ gatherer.add(n, samples); });
+ * gatherer.gather();
+ * for(int64_t y = 0; y < height; ++y)
+ * for(int64_t x = 0; x < width; ++x)
+ * {
+ *     const float* samples = gatherer.getSamples(x, y);
+ *     for(int64_t s = 0; s < gatherer.getNumSamples(x, y); ++s)
+ *         process(&samples[s * sampleSize]);
+ * }
+ * \endcode
+ */
+class SampleGatherer
+{
+public:
+    /**
+     * @brief Creates a gatherer for an image of size `width` x `height`.
+     *
+     * @param width
+     * Image width.
+     * @param height
+     * Image height.
+     * @param sampleSize
+     * Number of floats in a sample (see SampleLayout::getSampleSize()).
+     * @param xIndex
+     * Position of IMAGE_X in the sample.
+     * @param yIndex
+     * Position of IMAGE_Y in the sample.
+     */
+    SampleGatherer(int64_t width, int64_t height, int sampleSize, int xIndex = 0, int yIndex = 1);
+
+    SampleGatherer(const SampleGatherer&) = delete;
+
+    ~SampleGatherer();
+
+    /**
+     * @brief Sets the number of threads used by gather().
+     *
+     * The default is the number of hardware threads.
+     */
+    void setNumThreads(int n);
+
+    /**
+     * @brief Copies `numSamples` samples to be sorted by the next call to gather().
+     *
+     * The signature matches BenchmarkClient::TileConsumer2, so it can be called directly from the consumer callback.
+     */
+    void add(int64_t numSamples, const float* samples);
+
+    /**
+     * @brief Sorts the added samples by pixel.
+     *
+     * Samples from previous gathers are kept, and the new ones are placed after them in each pixel,
+     * in the order they were added.
+     */
+    void gather();
+
+    /**
+     * @brief Removes all samples.
+     */
+    void clear();
+
+    /**
+     * @brief Returns the number of gathered samples in pixel (x, y).
+     */
+    int64_t getNumSamples(int64_t x, int64_t y) const
+    { auto p = y * m_width + x; return m_offsets[p + 1] - m_offsets[p]; }
+
+    /**
+     * @brief Returns a pointer to the first gathered sample of pixel (x, y).
+     *
+     * The samples of the pixel are contiguous, and the pointer is valid until the next call to gather() or clear().
+     */
+    const float* getSamples(int64_t x, int64_t y) const
+    { return m_samples.data() + m_offsets[y * m_width + x] * m_sampleSize; }
+
+    /**
+     * @brief Returns the total number of gathered samples.
+     */
+    int64_t getTotalNumSamples() const
+    { return m_offsets.back(); }
+
+    SampleGatherer& operator=(const SampleGatherer&) = delete;
+
+private:
+    int64_t getPixel(const float* sample) const;
+
+    int64_t m_width;
+    int64_t m_height;
+    int m_sampleSize;
+    int m_xIndex;
+    int m_yIndex;
+    int m_numThreads;
+    std::vector<float> m_samples; // gathered samples, sorted by pixel
+    std::vector<int64_t> m_offsets; // first sample of each pixel (plus the total at the end)
+    std::vector<float> m_pending; // samples added since the last gather
+    std::vector<float> m_buffer; // scatter destination, reused between gathers
+    std::unique_ptr<ThreadPool> m_pool;
+};
+
+/**@}*/
+
+} // namespace fbksd
+
+#endif // SAMPLEGATHERER_H
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef SAMPLESTORE_H
+#define SAMPLESTORE_H
+
+#include "fbksd/client/BenchmarkClient.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup BenchmarkClient
+ * @{
+ */
+
+/**
+ * @brief Pixel-indexed container that keeps the samples of several evaluation passes.
+ *
+ * Tiles are appended as whole blocks into large memory chunks, so storing a pass costs one copy per tile
+ * and no per-pixel allocations. The samples of a pixel are read as a sequence of contiguous spans,
+ * one per appended tile that covers the pixel, in the order the tiles were appended.
+ *
+ * Optionally, a memory cap can be set (see setMemoryCap()). When the chunks in memory exceed it, the oldest
+ * chunks are written to a temporary file and mapped back read-only, so the OS pages them in only when they are read.
+ *
+ * The store is not thread-safe: when consuming tiles in parallel (see BenchmarkClient::setNumConsumerThreads()),
+ * guard append() with a mutex.
+ *
+ * Example:
+ * \code
+ * SampleStore store(width, height, layout.getSampleSize());
+ * for(int pass = 0; pass < numPasses; ++pass)
+ *     client.evaluateSamples(SPP(1), [&](const BufferTile& tile){ store.append(tile); });
+ * store.forEachSpan(x, y, [&](const float* samples, int64_t numSamples)
+ * {
+ *     for(int64_t s = 0; s < numSamples; ++s)
+ *         process(&samples[s * sampleSize]);
+ * });
+ * \endcode
+ */
+class SampleStore
+{
+public:
+    /**
+     * @brief Creates an empty store for an image of size `width` x `height`.
+     *
+     * @param sampleSize
+     * Number of floats in a sample (see SampleLayout::getSampleSize()).
+     */
+    SampleStore(int64_t width, int64_t height, int64_t sampleSize);
+
+    SampleStore(const SampleStore&) = delete;
+
+    ~SampleStore();
+
+    /**
+     * @brief Limits the memory used by the chunks kept in memory.
+     *
+     * When the limit is exceeded, the oldest chunks are spilled to a temporary file in `spillDir`
+     * (or in the system temporary directory, if empty). A cap of 0 (the default) disables spilling.
+     */
+    void setMemoryCap(int64_t maxBytes, const std::string& spillDir = "");
+
+    /**
+     * @brief Copies all samples of the tile into the store.
+     *
+     * @throws std::invalid_argument if the tile sample size differs from the store's, or
+     * the tile is not inside the image.
+     * @throws std::runtime_error if spilling to disk fails.
+     */
+    void append(const BufferTile& tile);
+
+    /**
+     * @brief Calls `f(const float* samples, int64_t numSamples)` for each span of samples of pixel (x, y).
+     *
+     * The samples of a pixel are not compacted: each appended tile covering the pixel gives a separate span
+     * (e.g. a pixel has one span per evaluation pass), in the order the tiles were appended. Only the samples
+     * inside a span are contiguous.
+     */
+    template<typename F>
+    void forEachSpan(int64_t x, int64_t y, const F& f) const
+    {
+        for(int32_t id: m_cells[(y / CELL_SIZE) * m_numCellsX + x / CELL_SIZE])
+        {
+            const Block& b = m_blocks[id];
+            if(x < b.x || x >= b.ex || y < b.y || y >= b.ey)
+                continue;
+            f(m_chunks[b.chunk].data + b.offset + ((y - b.y) * (b.ex - b.x) + (x - b.x)) * b.spp * m_sampleSize, b.spp);
+        }
+    }
+
+    /**
+     * @brief Returns the number of samples stored for pixel (x, y).
+     */
+    int64_t getNumSamples(int64_t x, int64_t y) const;
+
+    /**
+     * @brief Returns the total number of samples stored.
+     */
+    int64_t getTotalNumSamples() const
+    { return m_numSamples; }
+
+    /**
+     * @brief Returns the number of bytes of the chunks kept in memory.
+     */
+    int64_t getResidentBytes() const
+    { return m_residentBytes; }
+
+    /**
+     * @brief Returns the number of bytes of the chunks spilled to disk.
+     */
+    int64_t getSpilledBytes() const
+    { return m_spilledBytes; }
+
+    /**
+     * @brief Removes all samples and frees the chunks.
+     */
+    void clear();
+
+    SampleStore& operator=(const SampleStore&) = delete;
+
+private:
+    // Side (in pixels) of the cells of the grid used to find the blocks covering a pixel.
+    static constexpr int64_t CELL_SIZE = 16;
+
+    struct Chunk
+    {
+        float* data;
+        int64_t capacity; // floats
+        int64_t used; // floats
+        bool spilled;
+    };
+
+    // A copy of a tile in a chunk.
+    struct Block
+    {
+        int64_t x, ex, y, ey, spp;
+        int32_t chunk;
+        int64_t offset; // floats from the chunk start
+    };
+
+    float* allocate(int64_t numFloats, int32_t* chunk, int64_t* offset);
+    void spillColdChunks();
+    void freeChunks();
+
+    int64_t m_width;
+    int64_t m_height;
+    int64_t m_sampleSize;
+    int64_t m_numCellsX;
+    std::vector<std::vector<int32_t>> m_cells; // blocks overlapping each cell
+    std::vector<Block> m_blocks;
+    std::vector<Chunk> m_chunks;
+    size_t m_firstResidentChunk = 0; // chunks before this one are spilled
+    int64_t m_numSamples = 0;
+    int64_t m_residentBytes = 0;
+    int64_t m_spilledBytes = 0;
+    int64_t m_memoryCap = 0;
+    std::string m_spillDir;
+    int m_spillFd = -1;
+};
+
+/**@}*/
+
+} // namespace fbksd
+
+#endif // SAMPLESTORE_H
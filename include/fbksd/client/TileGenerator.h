@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef TILEGENERATOR_H
+#define TILEGENERATOR_H
+
+/**
+ * \file
+ * \brief C++20 coroutine adapter for TileStream.
+ *
+ * This header is optional and only available when compiling the client with C++20 coroutine support.
+ * The client library itself doesn't depend on it.
+ */
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#include "fbksd/client/BenchmarkClient.h"
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup BenchmarkClient
+ * @{
+ */
+
+/**
+ * @brief Minimal synchronous generator of references to `T`.
+ *
+ * Yielded references are valid until the generator is resumed.
+ */
+template<typename T>
+class Generator
+{
+public:
+    struct promise_type
+    {
+        const T* value = nullptr;
+        std::exception_ptr error;
+
+        Generator get_return_object()
+        { return Generator(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const T& v) noexcept { value = &v; return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    class Iterator
+    {
+    public:
+        explicit Iterator(std::coroutine_handle<promise_type> handle = nullptr): m_handle(handle) {}
+
+        Iterator& operator++() { advance(); return *this; }
+        bool operator==(const Iterator& it) const { return m_handle == it.m_handle; }
+        bool operator!=(const Iterator& it) const { return m_handle != it.m_handle; }
+        const T& operator*() const { return *m_handle.promise().value; }
+
+        void advance()
+        {
+            m_handle.resume();
+            if(m_handle.promise().error)
+                std::rethrow_exception(m_handle.promise().error);
+            if(m_handle.done())
+                m_handle = nullptr;
+        }
+
+    private:
+        std::coroutine_handle<promise_type> m_handle;
+    };
+
+    Generator(Generator&& g) noexcept: m_handle(std::exchange(g.m_handle, nullptr)) {}
+
+    Generator(const Generator&) = delete;
+
+    ~Generator() { if(m_handle) m_handle.destroy(); }
+
+    Iterator begin()
+    {
+        Iterator it(m_handle);
+        it.advance();
+        return it;
+    }
+
+    Iterator end() { return Iterator(); }
+
+private:
+    explicit Generator(std::coroutine_handle<promise_type> handle): m_handle(handle) {}
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+/**
+ * @brief Wraps a TileStream in a coroutine generator.
+ *
+ * The stream is owned by the generator, and is closed (drained) when the generator is destroyed.
+ *
+ * \code
+ * for(const BufferTile& tile: tiles(client.streamSamples(SPP(4))))
+ *     accumulate(tile);
+ * \endcode
+ */
+inline Generator<BufferTile> tiles(TileStream stream)
+{
+    while(stream.next())
+        co_yield stream.tile();
+}
+
+/**@}*/
+
+} // namespace fbksd
+
+#endif
+
+#endif // TILEGENERATOR_H
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef TYPEDLAYOUT_H
+#define TYPEDLAYOUT_H
+
+#include "fbksd/client/BenchmarkClient.h"
+#include <cstdint>
+#include <stdexcept>
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup BenchmarkClient
+ * @{
+ */
+
+/**
+ * @brief Sample layout elements, used as TypedLayout arguments.
+ *
+ * See SampleLayout for the description of each element. Numbered elements (e.g. `WORLD_X_1`)
+ * correspond to enumerable features with the given number.
+ */
+enum class Element
+{
+    IMAGE_X, IMAGE_Y, LENS_U, LENS_V, TIME, LIGHT_X, LIGHT_Y,
+    COLOR_R, COLOR_G, COLOR_B,
+    DEPTH,
+    DIRECT_LIGHT_R, DIRECT_LIGHT_G, DIRECT_LIGHT_B,
+    WORLD_X, WORLD_Y, WORLD_Z,
+    NORMAL_X, NORMAL_Y, NORMAL_Z,
+    TEXTURE_COLOR_R, TEXTURE_COLOR_G, TEXTURE_COLOR_B,
+    WORLD_X_1, WORLD_Y_1, WORLD_Z_1,
+    NORMAL_X_1, NORMAL_Y_1, NORMAL_Z_1,
+    TEXTURE_COLOR_R_1, TEXTURE_COLOR_G_1, TEXTURE_COLOR_B_1,
+    WORLD_X_NS, WORLD_Y_NS, WORLD_Z_NS,
+    NORMAL_X_NS, NORMAL_Y_NS, NORMAL_Z_NS,
+    TEXTURE_COLOR_R_NS, TEXTURE_COLOR_G_NS, TEXTURE_COLOR_B_NS,
+    DIFFUSE_COLOR_R, DIFFUSE_COLOR_G, DIFFUSE_COLOR_B, // keep DIFFUSE_COLOR_B last (see detail::ELEMENT_NAMES)
+};
+
+namespace detail
+{
+
+// Name and number used in SampleLayout for an Element.
+struct ElementName
+{
+    Element element;
+    const char* name;
+    int number;
+};
+
+// Indexed by Element: each entry repeats its element, so the order is checked at compile time.
+constexpr ElementName ELEMENT_NAMES[] = {
+    {Element::IMAGE_X, "IMAGE_X", 0}, {Element::IMAGE_Y, "IMAGE_Y", 0},
+    {Element::LENS_U, "LENS_U", 0}, {Element::LENS_V, "LENS_V", 0}, {Element::TIME, "TIME", 0},
+    {Element::LIGHT_X, "LIGHT_X", 0}, {Element::LIGHT_Y, "LIGHT_Y", 0},
+    {Element::COLOR_R, "COLOR_R", 0}, {Element::COLOR_G, "COLOR_G", 0}, {Element::COLOR_B, "COLOR_B", 0},
+    {Element::DEPTH, "DEPTH", 0},
+    {Element::DIRECT_LIGHT_R, "DIRECT_LIGHT_R", 0}, {Element::DIRECT_LIGHT_G, "DIRECT_LIGHT_G", 0},
+    {Element::DIRECT_LIGHT_B, "DIRECT_LIGHT_B", 0},
+    {Element::WORLD_X, "WORLD_X", 0}, {Element::WORLD_Y, "WORLD_Y", 0}, {Element::WORLD_Z, "WORLD_Z", 0},
+    {Element::NORMAL_X, "NORMAL_X", 0}, {Element::NORMAL_Y, "NORMAL_Y", 0}, {Element::NORMAL_Z, "NORMAL_Z", 0},
+    {Element::TEXTURE_COLOR_R, "TEXTURE_COLOR_R", 0}, {Element::TEXTURE_COLOR_G, "TEXTURE_COLOR_G", 0},
+    {Element::TEXTURE_COLOR_B, "TEXTURE_COLOR_B", 0},
+    {Element::WORLD_X_1, "WORLD_X", 1}, {Element::WORLD_Y_1, "WORLD_Y", 1}, {Element::WORLD_Z_1, "WORLD_Z", 1},
+    {Element::NORMAL_X_1, "NORMAL_X", 1}, {Element::NORMAL_Y_1, "NORMAL_Y", 1}, {Element::NORMAL_Z_1, "NORMAL_Z", 1},
+    {Element::TEXTURE_COLOR_R_1, "TEXTURE_COLOR_R", 1}, {Element::TEXTURE_COLOR_G_1, "TEXTURE_COLOR_G", 1},
+    {Element::TEXTURE_COLOR_B_1, "TEXTURE_COLOR_B", 1},
+    {Element::WORLD_X_NS, "WORLD_X_NS", 0}, {Element::WORLD_Y_NS, "WORLD_Y_NS", 0},
+    {Element::WORLD_Z_NS, "WORLD_Z_NS", 0},
+    {Element::NORMAL_X_NS, "NORMAL_X_NS", 0}, {Element::NORMAL_Y_NS, "NORMAL_Y_NS", 0},
+    {Element::NORMAL_Z_NS, "NORMAL_Z_NS", 0},
+    {Element::TEXTURE_COLOR_R_NS, "TEXTURE_COLOR_R_NS", 0}, {Element::TEXTURE_COLOR_G_NS, "TEXTURE_COLOR_G_NS", 0},
+    {Element::TEXTURE_COLOR_B_NS, "TEXTURE_COLOR_B_NS", 0},
+    {Element::DIFFUSE_COLOR_R, "DIFFUSE_COLOR_R", 0}, {Element::DIFFUSE_COLOR_G, "DIFFUSE_COLOR_G", 0},
+    {Element::DIFFUSE_COLOR_B, "DIFFUSE_COLOR_B", 0},
+};
+
+constexpr bool isInElementOrder()
+{
+    for(int i = 0; i < static_cast<int>(sizeof(ELEMENT_NAMES) / sizeof(ELEMENT_NAMES[0])); ++i)
+        if(static_cast<int>(ELEMENT_NAMES[i].element) != i)
+            return false;
+    return true;
+}
+
+// DIFFUSE_COLOR_B is the last Element.
+static_assert(sizeof(ELEMENT_NAMES) / sizeof(ELEMENT_NAMES[0]) == static_cast<size_t>(Element::DIFFUSE_COLOR_B) + 1,
+              "ELEMENT_NAMES must have an entry for each Element.");
+static_assert(isInElementOrder(), "ELEMENT_NAMES must be in the order of Element.");
+
+inline ElementName getElementName(Element e)
+{
+    return ELEMENT_NAMES[static_cast<int>(e)];
+}
+
+template<Element E, Element... Es>
+constexpr int indexOf()
+{
+    const Element elements[] = {Es...};
+    for(int i = 0; i < static_cast<int>(sizeof...(Es)); ++i)
+        if(elements[i] == E)
+            return i;
+    return -1;
+}
+
+template<Element... Es>
+constexpr bool hasDuplicates()
+{
+    const Element elements[] = {Es...};
+    for(int i = 0; i < static_cast<int>(sizeof...(Es)); ++i)
+        for(int j = i + 1; j < static_cast<int>(sizeof...(Es)); ++j)
+            if(elements[i] == elements[j])
+                return true;
+    return false;
+}
+
+} // namespace detail
+
+
+/**
+ * @brief Sample layout defined at compile time.
+ *
+ * The same type produces the runtime SampleLayout sent to the server (see layout()) and the offsets used
+ * to read the samples, so they can't get out of sync. Offsets are compile-time constants, and asking
+ * for an element that is not in the layout is a compile error.
+ *
+ * Example:
+ * \code
+ * using Layout = TypedLayout<Element::IMAGE_X, Element::IMAGE_Y, Element::COLOR_R, Element::COLOR_G, Element::COLOR_B>;
+ * client.setSampleLayout(Layout::layout());
+ * client.evaluateSamples(SPP(spp), [&](const BufferTile& tile)
+ * {
+ *     Layout::View view(tile);
+ *     for(auto y = tile.beginY(); y < tile.endY(); ++y)
+ *     for(auto x = tile.beginX(); x < tile.endX(); ++x)
+ *     for(int64_t s = 0; s < tile.getSPP(); ++s)
+ *         sum += view(x, y, s).get<Element::COLOR_R>();
+ * });
+ * \endcode
+ *
+ * Input elements can be set in the runtime layout with SampleLayout::setElementIO().
+ */
+template<Element... Es>
+class TypedLayout
+{
+    static_assert(sizeof...(Es) > 0, "A layout needs at least one element.");
+    static_assert(!detail::hasDuplicates<Es...>(), "Layout elements must be unique.");
+
+public:
+    /**
+     * @brief Number of floats in a sample.
+     */
+    static constexpr int size = sizeof...(Es);
+
+    /**
+     * @brief Returns the position of element `E` in the sample.
+     */
+    template<Element E>
+    static constexpr int offset()
+    {
+        static_assert(detail::indexOf<E, Es...>() >= 0, "Element is not in the layout.");
+        return detail::indexOf<E, Es...>();
+    }
+
+    /**
+     * @brief Returns the runtime SampleLayout with the same elements (all OUTPUT).
+     */
+    static SampleLayout layout()
+    {
+        SampleLayout l;
+        const Element elements[] = {Es...};
+        for(Element e: elements)
+        {
+            auto name = detail::getElementName(e);
+            l(name.name)[name.number];
+        }
+        return l;
+    }
+
+    /**
+     * @brief Typed reference to a sample.
+     */
+    class Sample
+    {
+    public:
+        explicit Sample(float* data): m_data(data) {}
+
+        /**
+         * @brief Returns a reference to the value of element `E`.
+         */
+        template<Element E>
+        float& get() const { return m_data[offset<E>()]; }
+
+        /**
+         * @brief Returns a pointer to the sample data.
+         */
+        float* data() const { return m_data; }
+
+    private:
+        float* m_data;
+    };
+
+    /**
+     * @brief Returns the sample `i` of a buffer of samples with this layout (e.g. given to a BenchmarkClient::TileConsumer2).
+     */
+    static Sample at(float* samples, int64_t i)
+    { return Sample(samples + i * size); }
+
+    /**
+     * @brief Typed view over the samples of a BufferTile.
+     */
+    class View
+    {
+    public:
+        /**
+         * @throws std::invalid_argument if the tile sample size doesn't match the layout.
+         */
+        explicit View(const BufferTile& tile):
+            m_data(const_cast<float*>(*tile.begin())),
+            m_x(tile.beginX()),
+            m_y(tile.beginY()),
+            m_width(tile.width()),
+            m_spp(tile.getSPP()),
+            m_numSamples(tile.numPixels() * tile.getSPP())
+        {
+            if(tile.getSampleSize() != size)
+                throw std::invalid_argument("The tile sample size doesn't match the TypedLayout.");
+        }
+
+        /**
+         * @brief Returns the sample s of the pixel (x,y).
+         */
+        Sample operator()(int64_t x, int64_t y, int64_t s) const
+        { return (*this)[((y - m_y) * m_width + (x - m_x)) * m_spp + s]; }
+
+        /**
+         * @brief Returns the i-th sample of the tile.
+         */
+        Sample operator[](int64_t i) const
+        { return Sample(m_data + i * size); }
+
+        /**
+         * @brief Returns the number of samples in the tile.
+         */
+        int64_t numSamples() const
+        { return m_numSamples; }
+
+    private:
+        float* m_data;
+        int64_t m_x, m_y, m_width, m_spp, m_numSamples;
+    };
+};
+
+template<Element... Es>
+constexpr int TypedLayout<Es...>::size;
+
+/**@}*/
+
+} // namespace fbksd
+
+#endif // TYPEDLAYOUT_H
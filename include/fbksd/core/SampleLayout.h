@@ -163,12 +163,58 @@ public:
      */
     float getRoughnessThreshold() const;
 
-    MSGPACK_DEFINE_ARRAY(parameters, m_roughness)
+    /**
+     * @brief Enables the pixel statistics mode.
+     *
+     * In this mode, the renderer doesn't send individual samples. Instead, for each pixel and each
+     * element in the layout, it sends the mean and the (unbiased) variance of the pixel samples.
+     * The data for a pixel is laid out as `[<means of all elements>, <variances of all elements>]`,
+     * so a tile has the size of a tile with 2 samples per pixel (see BufferTile::mean() and BufferTile::variance()).
+     *
+     * The sample budget is debited as usual (the statistics of `spp` samples cost `spp` samples).
+     * The mode only supports sample requests given in SPP, and layouts without INPUT elements.
+     */
+    SampleLayout& setPixelStatistics(bool enable = true);
+
+    /**
+     * @brief Returns true if the pixel statistics mode is enabled.
+     */
+    bool isPixelStatistics() const;
+
+    /**
+     * @brief Returns true if the layout only has features of the primary hit.
+     *
+     * This is the case when the layout has DEPTH, WORLD, NORMAL or TEXTURE_COLOR elements of the first intersection,
+     * and otherwise only random parameters of the camera ray (IMAGE, LENS and TIME), e.g. a pre-pass that only reads
+     * NORMAL, DEPTH and TEXTURE_COLOR. Radiance elements, features of the second bounce (`*_1`) or of the first
+     * non-specular hit (`*_NS`), and light parameters need more than primary rays. Renderers that support it
+     * (see RenderingServer::EvaluationMode) can evaluate such samples by only tracing the primary rays, and these
+     * samples cost less of the budget (see the `features_only_cost_divisor` SceneInfo entry).
+     */
+    bool isFeaturesOnly() const;
+
+    /**
+     * @brief Makes the renderer generate the INPUT elements with an input generator plugin.
+     *
+     * `name` is the file name of the plugin (see #FBKSD_INPUT_GENERATOR) in the input generator directory of the
+     * renderer host (see #GENERATORS_ENV). Paths are refused. The INPUT elements are then written by the plugin inside the renderer,
+     * instead of the client, and the samples are requested as samples without input
+     * (e.g. BenchmarkClient::evaluateSamples()). An empty name (the default) disables the generator.
+     */
+    SampleLayout& setInputGenerator(const std::string& name);
+
+    /**
+     * @brief Returns the name of the input generator plugin (see setInputGenerator()).
+     */
+    const std::string& getInputGenerator() const;
+
+    MSGPACK_DEFINE_ARRAY(parameters, m_roughness, m_pixelStatistics, m_inputGenerator)
 private:
     friend class SampleAdapter;
     friend class SampleBuffer;
     friend class SamplesPipe;
     friend class BenchmarkManager;
+    friend class InProcessConnection;
     friend class TileSamplesPipe;
     friend class TilePool;
 
@@ -190,6 +236,8 @@ private:
     };
     std::vector<ParameterEntry> parameters;
     float m_roughness = 0.1f;
+    bool m_pixelStatistics = false;
+    std::string m_inputGenerator;
 };
 
 } // namespace fbksd
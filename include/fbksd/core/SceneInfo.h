@@ -30,16 +30,21 @@ namespace fbksd
  *
  * The available query names are:
  *
- * | Query             | Type       |
- * | ------------------|------------|
- * | width             | int64_t    |
- * | height            | int64_t    |
- * | has_motion_blur   | bool       |
- * | has_dof           | bool       |
- * | max_samples       | int64_t    |
- * | max_spp           | int64_t    |
- * | shutter_open      | float      |
- * | shutter_close     | float      |
+ * | Query                      | Type       |
+ * | ---------------------------|------------|
+ * | width                      | int64_t    |
+ * | height                     | int64_t    |
+ * | has_motion_blur            | bool       |
+ * | has_dof                    | bool       |
+ * | max_samples                | int64_t    |
+ * | max_spp                    | int64_t    |
+ * | shutter_open               | float      |
+ * | shutter_close              | float      |
+ * | features_only_cost_divisor | int64_t    |
+ *
+ * `features_only_cost_divisor` is only available when the renderer supports features-only evaluations
+ * (see SampleLayout::isFeaturesOnly()). It's the number of features-only samples that cost one sample of the budget
+ * in sample evaluations (region and frame evaluations are charged in full).
  *
  * @note Not all query names are available for all scenes.
  *
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef TILETRANSPORT_H
+#define TILETRANSPORT_H
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ * \brief Memory block a streamed tile is written to.
+ */
+enum class TileTarget : uint8_t
+{
+    TILES, ///< Tiles memory (see getTilesMemoryKey()).
+    FRAME  ///< Frame memory (see getFrameMemoryKey()).
+};
+
+
+/**
+ * \brief Sends the tiles of a remote rendering server over TCP (see REMOTE_ENV).
+ *
+ * The sender listens on a port, and the receiver of the benchmark manager connects to it. Tiles are
+ * queued by send() and written by a background thread, so the renderer can answer the tile request
+ * while the data is on its way (the receiver tells the manager when it's there).
+ *
+ * Large uncompressed tiles are sent with `MSG_ZEROCOPY` when the kernel supports it. With compression,
+ * tiles are compressed with LZ4 if both sides were built with it, and sent raw otherwise.
+ * Both hosts must have the same byte order.
+ */
+class TileStreamSender
+{
+public:
+    /**
+     * @brief Starts listening on an ephemeral port of the given address.
+     *
+     * @throws std::runtime_error if the port could not be opened.
+     */
+    TileStreamSender(const std::string& address, bool compress);
+
+    TileStreamSender(const TileStreamSender&) = delete;
+
+    /**
+     * @brief Closes the connection, dropping the tiles not sent yet.
+     */
+    ~TileStreamSender();
+
+    /**
+     * @brief Returns the port the receiver should connect to.
+     */
+    unsigned short port() const;
+
+    /**
+     * @brief Queues `size` floats of `data` to be written at `offset` (in floats) of the target memory.
+     *
+     * The data must not change until the receiver got it.
+     *
+     * @throws std::runtime_error if the connection failed.
+     */
+    void send(TileTarget target, int64_t offset, const float* data, int64_t size);
+
+    /**
+     * @brief Blocks until all queued tiles are written to the socket.
+     *
+     * @throws std::runtime_error if the connection failed.
+     */
+    void flush();
+
+    TileStreamSender& operator=(const TileStreamSender&) = delete;
+
+private:
+    struct Imp;
+    std::unique_ptr<Imp> m_imp;
+};
+
+
+/**
+ * \brief Receives the tiles sent by a TileStreamSender.
+ *
+ * Tiles are received by a background thread, directly into the memory given by the GetBuffer function.
+ * The tiles are counted in the order they were sent, so the manager knows a tile is there once the
+ * number of received tiles reaches its position in the stream.
+ */
+class TileStreamReceiver
+{
+public:
+    /**
+     * @brief Returns the memory where `size` floats at `offset` of the target are written.
+     *
+     * It's called from the receiving thread, and may throw if the tile doesn't fit the memory.
+     */
+    using GetBuffer = std::function<float*(TileTarget target, int64_t offset, int64_t size)>;
+
+    /**
+     * @brief Connects to the sender.
+     *
+     * @throws std::runtime_error if the connection failed.
+     */
+    TileStreamReceiver(const std::string& host, unsigned short port, const GetBuffer& getBuffer);
+
+    TileStreamReceiver(const TileStreamReceiver&) = delete;
+
+    ~TileStreamReceiver();
+
+    /**
+     * @brief Blocks until `count` tiles were received since the connection.
+     *
+     * @throws std::runtime_error if the connection failed or a tile could not be received.
+     */
+    void waitTiles(int64_t count);
+
+    TileStreamReceiver& operator=(const TileStreamReceiver&) = delete;
+
+private:
+    struct Imp;
+    std::unique_ptr<Imp> m_imp;
+};
+
+/**@}*/
+
+} // namespace fbksd
+
+#endif // TILETRANSPORT_H
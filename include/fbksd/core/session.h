@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <string>
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup Core
+ * @{
+ */
+
+/**
+ * \brief Name of the environment variable that holds the benchmark session id.
+ *
+ * A session is a renderer/filter pair driven by one benchmark manager. Every process in a session
+ * uses the same session id, so that several sessions can run concurrently on the same host without
+ * sharing TCP ports or shared memory blocks.
+ *
+ * Processes started by the benchmark manager (renderer and filter) inherit the variable from it.
+ */
+constexpr const char* SESSION_ENV = "FBKSD_SESSION";
+
+/**
+ * \brief Name of the environment variable used for the readiness handshake.
+ *
+ * When a process that spawns a rendering server wants to know when it's ready, it sets this variable
+ * with the number of a loopback port it listens to. The RenderingServer connects to that port once it
+ * starts serving requests.
+ */
+constexpr const char* READY_PORT_ENV = "FBKSD_READY_PORT";
+
+/**
+ * \brief Name of the environment variable that enables sample recording.
+ *
+ * When set, the RenderingServer writes every tile it renders (along with the scene information and
+ * sample layouts) to the file given by the variable. The file can be served again by `fbksd-replay`.
+ */
+constexpr const char* RECORD_ENV = "FBKSD_RECORD";
+
+/**
+ * \brief Name of the environment variable that enables the sample cache.
+ *
+ * The variable holds the path of a record file (see #RECORD_ENV) used as a cache: evaluations already in
+ * the file are served from it without rendering, and new ones are rendered and appended to it.
+ * The benchmark manager sets it when started with a cache directory. It takes precedence over #RECORD_ENV.
+ */
+constexpr const char* CACHE_ENV = "FBKSD_CACHE";
+
+/**
+ * \brief Name of the environment variable that holds the consumer id of a filter process.
+ *
+ * A session can feed several filters with the same samples (see BenchmarkManager::runScene()). Each of
+ * them is a consumer with its own benchmark server port and result memory, while the tiles memory is
+ * shared by all. When the variable is not set, the filter is consumer 0.
+ */
+constexpr const char* CONSUMER_ENV = "FBKSD_CONSUMER";
+
+/**
+ * \brief Name of the environment variable that holds the shard id of a renderer process.
+ *
+ * The benchmark manager can split the evaluations of a scene among several instances of the renderer (see
+ * BenchmarkManager::setNumRendererShards()). Each of them is a shard with its own rendering server port and its
+ * own range of tile slots in the tiles memory of the session. When the variable is not set, the renderer is shard 0.
+ */
+constexpr const char* SHARD_ENV = "FBKSD_SHARD";
+
+/**
+ * \brief Name of the environment variable that makes a renderer process remote.
+ *
+ * The variable holds the IPv4 address the rendering server listens to. Instead of writing the tiles in the shared
+ * memory of the host, a remote rendering server keeps them in its own memory and streams them over TCP to the
+ * benchmark manager (see TileStreamSender), so the renderer can run in a different host than the manager and the filters.
+ */
+constexpr const char* REMOTE_ENV = "FBKSD_REMOTE";
+
+/**
+ * \brief Name of the environment variable that holds the input generator directory of a renderer process.
+ *
+ * The RenderingServer only loads the input generator plugins in this directory of the renderer host, named by the
+ * sample layouts (see SampleLayout::setInputGenerator()). When the variable is not set, input generators are disabled.
+ */
+constexpr const char* GENERATORS_ENV = "FBKSD_INPUT_GENERATORS";
+
+/**
+ * \brief Maximum number of concurrent sessions in a host.
+ */
+constexpr int MAX_SESSIONS = 1024;
+
+/**
+ * \brief Maximum number of consumers in a session.
+ */
+constexpr int MAX_CONSUMERS = 15;
+
+/**
+ * \brief Maximum number of renderer shards in a session.
+ */
+constexpr int MAX_SHARDS = 8;
+
+/**
+ * \brief Returns the session id of the current process.
+ *
+ * The id is read from the #SESSION_ENV environment variable. If the variable is not set, 0 is returned,
+ * which corresponds to the default ports and shared memory keys.
+ *
+ * @throws std::invalid_argument if the variable contains an invalid id.
+ */
+int getSessionId();
+
+/**
+ * \brief Sets the session id of the current process.
+ *
+ * The id is exported to the #SESSION_ENV environment variable, so that child processes started after
+ * this call belong to the same session.
+ *
+ * @throws std::invalid_argument if `id` is not in the [0, MAX_SESSIONS) range.
+ */
+void setSessionId(int id);
+
+/**
+ * \brief Returns the consumer id of the current process.
+ *
+ * The id is read from the #CONSUMER_ENV environment variable. If the variable is not set, 0 is returned.
+ *
+ * @throws std::invalid_argument if the variable contains an invalid id.
+ */
+int getConsumerId();
+
+/**
+ * \brief Returns the shard id of the current process.
+ *
+ * The id is read from the #SHARD_ENV environment variable. If the variable is not set, 0 is returned.
+ *
+ * @throws std::invalid_argument if the variable contains an invalid id.
+ */
+int getShardId();
+
+/**
+ * \brief Returns the TCP port of the benchmark server for the given session and consumer.
+ *
+ * @throws std::invalid_argument if `consumer` is not in the [0, MAX_CONSUMERS) range.
+ */
+unsigned short getBenchmarkServerPort(int session, int consumer = 0);
+
+/**
+ * \brief Returns the TCP port of the rendering server for the given session and shard.
+ *
+ * @throws std::invalid_argument if `shard` is not in the [0, MAX_SHARDS) range.
+ */
+unsigned short getRenderingServerPort(int session, int shard = 0);
+
+/**
+ * \brief Returns the key of the shared memory used to transfer sample tiles in the given session.
+ */
+std::string getTilesMemoryKey(int session);
+
+/**
+ * \brief Returns the key of the shared memory used to transfer the result image of a consumer in the given session.
+ */
+std::string getResultMemoryKey(int session, int consumer = 0);
+
+/**
+ * \brief Returns the key of the shared memory used to transfer full frames of samples in the given session.
+ */
+std::string getFrameMemoryKey(int session);
+
+/**@}*/
+
+} // namespace fbksd
+
+#endif // SESSION_H
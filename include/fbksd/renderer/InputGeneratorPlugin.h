@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef INPUTGENERATORPLUGIN_H
+#define INPUTGENERATORPLUGIN_H
+
+#include <cstdint>
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup RenderingServer
+ * @{
+ */
+
+/**
+ * \brief Name of the function exported by input generator plugins (see #FBKSD_INPUT_GENERATOR).
+ */
+constexpr const char* INPUT_GENERATOR_FUNCTION = "fbksd_generate_input";
+
+extern "C"
+{
+/**
+ * \brief Tile of samples whose INPUT elements are generated by an input generator plugin.
+ */
+struct InputTile
+{
+    int64_t beginX; ///< First pixel of the tile.
+    int64_t beginY;
+    int64_t endX;   ///< One past the last pixel of the tile.
+    int64_t endY;
+    int64_t numSamples; ///< Number of samples in the tile.
+    /**
+     * Samples per pixel of the evaluation. Sample `i` of the tile is then the sample `i % spp` of pixel `i / spp`
+     * of the tile (in row-major order). It's 0 when the pixels have different numbers of samples (requests in number
+     * of samples): the pixel of a sample is then given by the IMAGE_X and IMAGE_Y elements.
+     */
+    int64_t spp;
+    /**
+     * Index of the first sample of each pixel in this evaluation. It grows with each evaluation, so a sequence
+     * continues where the previous evaluations of the scene stopped.
+     */
+    int64_t firstSample;
+};
+
+/**
+ * \brief Signature of the function exported by input generator plugins.
+ *
+ * The function writes the value of each INPUT element of sample `sample` of the tile: `values[i]` is the value
+ * of the RandomParameter `parameters[i]`. Image positions (IMAGE_X, IMAGE_Y) are in pixels, and the other
+ * parameters in [0, 1).
+ *
+ * The function must be pure: it's called concurrently by the rendering threads, in any order, and a sample
+ * may be generated again (e.g. by the sample cache).
+ */
+using InputGeneratorFunction = void(*)(const InputTile* tile,
+                                       int64_t sample,
+                                       const int32_t* parameters,
+                                       int32_t numParameters,
+                                       float* values);
+}
+
+/**@}*/
+
+} // namespace fbksd
+
+
+/**
+ * \brief Exports a sample generator as a plugin, that generates the INPUT elements of a layout inside the renderer.
+ *
+ * The elements a filter marks as INPUT are normally written by the client for each tile, and the renderer waits
+ * for them (see BenchmarkClient::evaluateInputSamples()). When the values come from a deterministic sequence
+ * (e.g. Sobol, blue-noise masks), the sequence can be built as a shared library and named in the layout (see
+ * SampleLayout::setInputGenerator()): the renderer loads it and generates the values itself, without a round trip
+ * to the client per tile. The library must be in the input generator directory of the renderer host (see #GENERATORS_ENV). The samples are then requested with BenchmarkClient::evaluateSamples().
+ *
+ * `function` has the signature `void function(const fbksd::InputTile& tile, int64_t sample, const int32_t* parameters,
+ * int32_t numParameters, float* values)` (see InputGeneratorFunction):
+ * \code{.cpp}
+ * void generate(const InputTile& tile, int64_t sample, const int32_t* parameters, int32_t numParameters, float* values)
+ * {
+ *     const int64_t pixel = sample / tile.spp;
+ *     const int64_t index = tile.firstSample + sample % tile.spp;
+ *     for(int32_t i = 0; i < numParameters; ++i)
+ *         values[i] = sobol(index, parameters[i]);
+ *     ...
+ * }
+ * FBKSD_INPUT_GENERATOR(generate)
+ * \endcode
+ *
+ * \ingroup RenderingServer
+ */
+#define FBKSD_INPUT_GENERATOR(function) \
+    extern "C" __attribute__((visibility("default"))) \
+    void fbksd_generate_input(const fbksd::InputTile* tile, \
+                              int64_t sample, \
+                              const int32_t* parameters, \
+                              int32_t numParameters, \
+                              float* values) \
+    { function(*tile, sample, parameters, numParameters, values); }
+
+#endif // INPUTGENERATORPLUGIN_H
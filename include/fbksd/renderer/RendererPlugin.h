@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef RENDERERPLUGIN_H
+#define RENDERERPLUGIN_H
+
+#include "RenderingServer.h"
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup RenderingServer
+ * @{
+ */
+
+/**
+ * \brief Name of the function exported by renderer plugins (see #FBKSD_RENDERER_PLUGIN).
+ */
+constexpr const char* RENDERER_PLUGIN_SETUP = "fbksd_renderer_setup";
+
+extern "C"
+{
+/**
+ * \brief Signature of the function exported by renderer plugins.
+ *
+ * The function registers the renderer callbacks in the given server. `argv` holds the renderer
+ * arguments, starting with the plugin path.
+ */
+using RendererPluginSetup = void(*)(RenderingServer* server, int argc, char* argv[]);
+}
+
+/**@}*/
+
+} // namespace fbksd
+
+
+/**
+ * \brief Exports a renderer as a plugin, that can be loaded into the client process.
+ *
+ * A renderer built as a shared library can run inside the client process (see the `--fbksd-renderer-plugin`
+ * option of BenchmarkClient), without sockets, shared memory or a separate process. This is useful for
+ * development loops and tests.
+ *
+ * `setup` is a function with the signature `void setup(fbksd::RenderingServer& server, int argc, char* argv[])`
+ * that registers the callbacks in the server. The callbacks outlive the call, so the renderer state must be
+ * owned by them. The same function can be used by the renderer executable:
+ * \code{.cpp}
+ * void setup(RenderingServer& server, int argc, char* argv[])
+ * {
+ *     auto renderer = std::make_shared<Renderer>(argv[1]);
+ *     server.onGetSceneInfo([renderer](){ return renderer->getSceneInfo(); });
+ *     ...
+ * }
+ * FBKSD_RENDERER_PLUGIN(setup)
+ *
+ * int main(int argc, char* argv[])
+ * {
+ *     RenderingServer server;
+ *     setup(server, argc, argv);
+ *     server.run();
+ * }
+ * \endcode
+ *
+ * \ingroup RenderingServer
+ */
+#define FBKSD_RENDERER_PLUGIN(setup) \
+    extern "C" __attribute__((visibility("default"))) \
+    void fbksd_renderer_setup(fbksd::RenderingServer* server, int argc, char* argv[]) \
+    { setup(*server, argc, argv); }
+
+#endif // RENDERERPLUGIN_H
@@ -37,6 +37,15 @@ namespace fbksd
 class RenderingServer
 {
 public:
+    /**
+     * @brief Kind of evaluation requested by the client.
+     */
+    enum EvaluationMode
+    {
+        FULL,           ///< Samples need full light transport.
+        FEATURES_ONLY,  ///< The layout only has primary-hit features (see SampleLayout::isFeaturesOnly()): tracing primary rays is enough.
+    };
+
     using GetTileSize
         = std::function<int()>;
     using GetSceneInfo
@@ -45,6 +54,10 @@ public:
         = std::function<void(const SampleLayout& layout)>;
     using EvaluateSamples
         = std::function<void(int64_t spp, int64_t remainingCount, int pipeSize)>;
+    using EvaluateSamplesWithMode
+        = std::function<void(int64_t spp, int64_t remainingCount, int pipeSize, EvaluationMode mode)>;
+    using EvaluateRegions
+        = std::function<void(int64_t spp, const std::vector<CropWindow>& windows, int pipeSize)>;
     using LastTileConsumed
         = std::function<void()>;
     using Finish
@@ -52,6 +65,8 @@ public:
 
     /**
      * @brief Creates a rendering server.
+     *
+     * The server uses the port and shared memory keys of the current session (see getSessionId()).
      */
     RenderingServer();
 
@@ -87,6 +102,9 @@ public:
      * The callback is called when the client sets the sample layout.
      * The sample layout is passed to the callback.
      *
+     * It's also called each time the client switches to a registered layout (see
+     * BenchmarkClient::setSampleLayout(int)), so it should be cheap.
+     *
      * Callback signature:
      * \code{.cpp}
      * void callback(const SampleLayout& layout);
@@ -105,6 +123,9 @@ public:
      *
      * The callback should return true on success.
      *
+     * The client may cancel the evaluation before all samples are consumed. Renderers that
+     * render asynchronously should check SamplesPipe::isCanceled() and stop early.
+     *
      * Callback signature:
      * \code{.cpp}
      * bool callback(int64_t spp, int64_t remainingCount);
@@ -112,10 +133,44 @@ public:
      */
     void onEvaluateSamples(const EvaluateSamples& callback);
 
+    /**
+     * @brief Sets the EvaluateSamples callback, with the evaluation mode.
+     *
+     * Same as onEvaluateSamples(const EvaluateSamples&), but the callback also receives the evaluation mode
+     * derived from the current sample layout. Registering this callback tells the client that the renderer
+     * handles EvaluationMode::FEATURES_ONLY cheaply, so such sample evaluations cost less of the budget.
+     * Region and frame evaluations don't receive the mode, so they are charged in full.
+     *
+     * Callback signature:
+     * \code{.cpp}
+     * void callback(int64_t spp, int64_t remainingCount, int pipeSize, RenderingServer::EvaluationMode mode);
+     * \endcode
+     */
+    void onEvaluateSamplesWithMode(const EvaluateSamplesWithMode& callback);
+
+    /**
+     * @brief Sets the EvaluateRegions callback (optional).
+     *
+     * The callback is called when the client requests samples only inside some regions of the image.
+     * The parameters passed to the callback are:
+     * - spp: number of requested samples per pixel
+     * - windows: regions to be sampled. They are inside the image, non-empty, and don't overlap.
+     * - pipeSize: maximum number of samples allowable when creating a SamplesPipe.
+     *
+     * Exactly `spp` samples should be produced for each pixel inside the windows, and none outside.
+     * If this callback is not registered, region requests fail.
+     *
+     * Callback signature:
+     * \code{.cpp}
+     * bool callback(int64_t spp, const std::vector<CropWindow>& windows, int pipeSize);
+     * \endcode
+     */
+    void onEvaluateRegions(const EvaluateRegions& callback);
+
     /**
      * @brief Sets the LastTileConsumed callback.
      *
-     * The callback is called when the client consumes the last tile.
+     * The callback is called when the client consumes the last tile, or cancels the evaluation.
      */
     void onLastTileConsumed(const LastTileConsumed& callback);
 
@@ -131,8 +186,25 @@ public:
      */
     void onFinish(const Finish& callback);
 
+    /**
+     * @brief Renders each evaluation with `numWorkers` processes.
+     *
+     * For each evaluation, the server forks `numWorkers` processes that run the EvaluateSamples (or EvaluateRegions)
+     * callback and write their pipes to the same tiles memory. Tiles are sent to the client as soon as any worker releases
+     * them, so the workers split the work dynamically by calling SamplesPipe::claimWork() for each work unit.
+     * Each worker calls the LastTileConsumed callback once the evaluation is finished, and then exits: changes made by
+     * the evaluation callbacks to the renderer state are not seen by the next evaluations.
+     *
+     * Sample recording and the sample cache are disabled with more than one worker.
+     *
+     * @throws std::logic_error if the server was loaded into the client process (see RendererPlugin.h).
+     */
+    void setNumWorkers(int numWorkers);
+
     /**
      * @brief run
+     *
+     * @throws std::logic_error if the server was loaded into the client process (see RendererPlugin.h).
      */
     void run();
 
@@ -141,6 +213,12 @@ public:
     RenderingServer& operator=(RenderingServer&&) = default;
 
 private:
+    friend class InProcessRenderer;
+    struct InProcess {};
+
+    // Creates a server called directly by the client process, without RPC or shared memory.
+    explicit RenderingServer(InProcess);
+
     struct Imp;
     std::unique_ptr<Imp> m_imp;
 };
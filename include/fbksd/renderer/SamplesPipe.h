@@ -20,6 +20,9 @@ namespace fbksd
 // This is need for the next classes due to the static members
 #define EXPORT_LIB __attribute__((visibility("default")))
 
+class TileRecorder;
+class InputGenerator;
+
 
 /**
  * \brief A SampleBuffer stores data for one sample and is used to get/send data to a SamplesPipe.
@@ -80,8 +83,6 @@ public:
 private:
     friend class SamplesPipe;
 
-    static void setLayout(const SampleLayout& layout);
-
     // ioMask is only for random parameters, since features are always OUTPUT.
     static std::array<bool, NUM_RANDOM_PARAMETERS> m_ioMask;
     std::array<float, NUM_RANDOM_PARAMETERS> m_paramentersBuffer;
@@ -106,6 +107,10 @@ private:
  * Several rendering threads can work in parallel, each one having their own pipe.
  * In this case, they have to make sure that a pipe position is not written by
  * different threads.
+ *
+ * If the client enabled the pixel statistics mode (see SampleLayout::setPixelStatistics()),
+ * the pipe accumulates the samples of each pixel instead of storing them. The usage is the same,
+ * but all samples of a pixel must be inserted in sequence after seeking to it.
  */
 class EXPORT_LIB SamplesPipe
 {
@@ -155,7 +160,8 @@ public:
      * @brief Returns a SampleBuffer for the current pipe position.
      *
      * If the client specified a sample layout with input random parameters,
-     * the returned sample buffer will contain the written by the client.
+     * the returned sample buffer will contain the written by the client
+     * (or by the input generator named in the layout, see SampleLayout::setInputGenerator()).
      */
     SampleBuffer getBuffer();
 
@@ -165,16 +171,76 @@ public:
      */
     SamplesPipe& operator<<(const SampleBuffer& buffer);
 
+    /**
+     * @brief Writes `numSamples` samples that are already in the format of the current layout.
+     *
+     * `samples` holds the samples of the pipe pixel by pixel, in row-major order. In pixel statistics mode, it holds
+     * the mean and the sum of squared deviations of each pixel. Input random parameters are left untouched.
+     *
+     * This is meant for serving samples rendered before (see `fbksd-replay`), and replaces any sample inserted so far.
+     */
+    void write(const float* samples, int64_t numSamples);
+
+    /**
+     * @brief Returns true if the client canceled the current evaluation.
+     *
+     * Rendering threads should check this periodically (e.g. before acquiring a new pipe) and stop
+     * rendering when it returns true. Pipes released after the cancellation are discarded, so they
+     * may contain fewer samples than informed at construction.
+     */
+    static bool isCanceled();
+
+    /**
+     * @brief Claims the next work unit (e.g. a tile) for this renderer process.
+     *
+     * When the server renders with several worker processes (see RenderingServer::setNumWorkers()), each worker
+     * runs the whole evaluation callback. The workers split the work by calling this once per work unit, in the
+     * same order and from the same thread, and rendering only the units for which it returns true:
+     * \code{.cpp}
+     * for(auto& tile: tiles)
+     *     if(SamplesPipe::claimWork())
+     *         renderTile(tile);
+     * \endcode
+     * With a single process, it always returns true.
+     */
+    static bool claimWork();
+
 private:
     SamplesPipe(const SamplesPipe&) = delete;
     SamplesPipe& operator=(const SamplesPipe&) = delete;
 
+    // Offset tables computed from a SampleLayout, so registered layouts can be switched without recomputing them.
+    struct LayoutTables
+    {
+        InputGenerator* inputGenerator = nullptr; // generates the input parameters instead of the client
+        int64_t sampleSize = 0;
+        bool pixelStatistics = false;
+        std::array<bool, NUM_RANDOM_PARAMETERS> ioMask;
+        std::vector<std::pair<int, int>> inputParameterIndices;
+        std::vector<std::pair<int, int>> outputParameterIndices;
+        std::vector<std::pair<int, int>> outputFeatureIndices;
+    };
+
     static void setLayout(const SampleLayout& layout);
+    static LayoutTables makeLayoutTables(const SampleLayout& layout);
+    static void setLayoutTables(const LayoutTables& tables);
+
+    int64_t getPixelSize() const;
+    int64_t getPackedSize() const;
+    void pack(float* out) const;
+    void accumulate(const SampleBuffer& buffer);
+    void endPixel();
+    void finalizeStatistics();
+    void generateInput();
 
     friend class RenderingServer;
     friend class TilePool;
+    friend class TileRecorder;
+    static TileRecorder* sm_recorder;
+    static InputGenerator* sm_inputGenerator;
     static int64_t sm_sampleSize;
     static int64_t sm_numSamples;
+    static bool sm_pixelStatistics;
     static std::vector<std::pair<int, int>> sm_inputParameterIndices;
     static std::vector<std::pair<int, int>> sm_outputParameterIndices;
     static std::vector<std::pair<int, int>> sm_outputFeatureIndices;
@@ -183,8 +249,12 @@ private:
     Point2l m_begin;
     Point2l m_end;
     int64_t m_width;
+    int64_t m_rowStride; // pixels between two consecutive rows (the frame width in frame mode)
+    int64_t m_rowGap = 0; // floats skipped at the end of a row (non-zero only in frame mode)
+    int64_t m_column = 0;
     int64_t m_informedNumSamples = 0;
     int64_t m_numSamples = 0;
+    int64_t m_pixelNumSamples = 0; // samples written in the current pixel (statistics or frame mode)
 };
 
 } // namespace fbksd
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include "SamplesPipe.h"
+#include "fbksd/core/definitions.h"
+#include <functional>
+#include <memory>
+#include <vector>
+
+namespace fbksd
+{
+
+/**
+ * \addtogroup RenderingServer
+ * @{
+ */
+
+/**
+ * \brief A tile of an evaluation, rendered with a single SamplesPipe (see TileScheduler).
+ */
+struct EXPORT_LIB TileTask
+{
+    /**
+     * \brief Returns the number of samples of the pixel.
+     *
+     * It is `spp`, plus one for the pixels that take the remaining samples of the evaluation.
+     * The remaining samples are spread evenly over the image.
+     */
+    int64_t getPixelNumSamples(int64_t x, int64_t y) const;
+
+    CropWindow window;          ///< Pixels of the tile.
+    int64_t spp = 0;            ///< Samples of every pixel.
+    int64_t numSamples = 0;     ///< Total number of samples in the tile.
+    int64_t remainingCount = 0; ///< Remaining samples of the whole evaluation.
+    int64_t imageWidth = 0;
+    int64_t imageHeight = 0;
+};
+
+
+/**
+ * \brief Renders evaluations tile by tile with a pool of threads.
+ *
+ * The renderer only provides a function that renders a tile into a SamplesPipe; the scheduler splits the
+ * evaluation in tiles that fit the pipe size (spreading the remaining samples over the image), orders them
+ * along a Morton curve, and renders them with a work-stealing thread pool. Each thread starts with a contiguous
+ * run of tiles, so neighbouring tiles are rendered by the same thread, and steals tiles from the others when
+ * its run is over. The number of threads is at most the number of tile slots of the server, since pipes
+ * block until a slot is free.
+ *
+ * When the server renders with several worker processes (see RenderingServer::setNumWorkers()), the tiles are
+ * claimed with SamplesPipe::claimWork() instead, so they are split among the workers.
+ *
+ * The evaluation methods return immediately, and wait() must be called from the LastTileConsumed callback:
+ * \code{.cpp}
+ * auto scheduler = std::make_shared<TileScheduler>(width, height);
+ * auto render = [](SamplesPipe& pipe, const TileTask& tile, int thread)
+ * {
+ *     for(int64_t y = tile.window.begin.y; y < tile.window.end.y; ++y)
+ *     for(int64_t x = tile.window.begin.x; x < tile.window.end.x; ++x)
+ *     for(int64_t s = 0; s < tile.getPixelNumSamples(x, y); ++s)
+ *     {
+ *         SampleBuffer sample = pipe.getBuffer();
+ *         ...
+ *         pipe << sample;
+ *     }
+ * };
+ * server.onEvaluateSamples([=](int64_t spp, int64_t remainingCount, int pipeSize)
+ * { scheduler->evaluateSamples(spp, remainingCount, pipeSize, render); });
+ * server.onEvaluateRegions([=](int64_t spp, const std::vector<CropWindow>& windows, int pipeSize)
+ * { scheduler->evaluateRegions(spp, windows, pipeSize, render); });
+ * server.onLastTileConsumed([=](){ scheduler->wait(); });
+ * \endcode
+ */
+class EXPORT_LIB TileScheduler
+{
+public:
+    /**
+     * \brief Renders a tile.
+     *
+     * The function must insert exactly `tile.numSamples` samples in the pipe, pixel by pixel, in row-major order,
+     * unless the evaluation was canceled (see SamplesPipe::isCanceled()). `thread` is the index of the calling thread,
+     * in `[0, getNumThreads())`.
+     */
+    using RenderTile = std::function<void(SamplesPipe& pipe, const TileTask& tile, int thread)>;
+
+    /**
+     * \brief Creates a scheduler for images of the given size.
+     *
+     * \param numThreads  Number of rendering threads (0 means the number of hardware threads).
+     */
+    TileScheduler(int64_t imageWidth, int64_t imageHeight, int numThreads = 0);
+
+    TileScheduler(const TileScheduler&) = delete;
+
+    /**
+     * \brief Waits for the current evaluation.
+     */
+    ~TileScheduler();
+
+    /**
+     * \brief Returns the maximum number of rendering threads.
+     */
+    int getNumThreads() const;
+
+    /**
+     * \brief Starts rendering the samples of an EvaluateSamples request.
+     *
+     * The parameters are the ones received by the callback (see RenderingServer::onEvaluateSamples()).
+     */
+    void evaluateSamples(int64_t spp, int64_t remainingCount, int pipeSize, const RenderTile& render);
+
+    /**
+     * \brief Starts rendering the samples of an EvaluateRegions request.
+     *
+     * The parameters are the ones received by the callback (see RenderingServer::onEvaluateRegions()).
+     */
+    void evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows, int pipeSize, const RenderTile& render);
+
+    /**
+     * \brief Blocks until the current evaluation is rendered (or canceled).
+     *
+     * An exception thrown by the render function cancels the evaluation (see SamplesPipe::isCanceled()),
+     * so the other threads stop and the client gets an error instead of waiting for the missing tiles.
+     *
+     * \throws The first exception thrown by the render function, if any.
+     */
+    void wait();
+
+    /**
+     * \brief Splits the image in tiles for an EvaluateSamples request, in Morton order.
+     */
+    static std::vector<TileTask> splitImage(int64_t imageWidth,
+                                            int64_t imageHeight,
+                                            int64_t spp,
+                                            int64_t remainingCount,
+                                            int pipeSize);
+
+    /**
+     * \brief Splits the windows in tiles for an EvaluateRegions request, in Morton order inside each window.
+     */
+    static std::vector<TileTask> splitRegions(int64_t imageWidth,
+                                              int64_t imageHeight,
+                                              int64_t spp,
+                                              const std::vector<CropWindow>& windows,
+                                              int pipeSize);
+
+    TileScheduler& operator=(const TileScheduler&) = delete;
+
+private:
+    void start(std::vector<TileTask>&& tiles, const RenderTile& render);
+
+    struct Imp;
+    std::unique_ptr<Imp> m_imp;
+};
+
+/**@}*/
+
+} // namespace fbksd
+
+#endif // TILESCHEDULER_H
@@ -34,6 +34,7 @@ iqa_metrics_dir    = os.path.join(os.getcwd(), 'iqa')
 configs_dir        = os.path.join(os.getcwd(), 'configs')
 current_config     = os.path.join(configs_dir, '.current.json')
 page_dir           = os.path.join(os.getcwd(), '.page')
+samples_cache_dir  = os.path.join(os.getcwd(), '.samples-cache')
 results_dir        = os.path.join(os.getcwd(), 'results')
 current_slot_dir   = os.path.join(results_dir, '.current')
 scenes_file        = os.path.join(scenes_dir, '.fbksd-scenes-cache.json')
@@ -680,6 +681,11 @@ def cmd_run(args):
     print('Running configuration \'' + current_config_name(current_config) + '\'\n')
 
     benchmark_exec = os.path.join(install_prefix_dir, 'bin/fbksd-benchmark')
+    extra_args = []
+    if args.cache:
+        extra_args = ['--cache', samples_cache_dir, '--cache-size', str(args.cache_size)]
+    if args.shards > 1:
+        extra_args += ['--shards', str(args.shards)]
     run_techniques(
         benchmark_exec,
         denoisers_dir,
@@ -687,7 +693,8 @@ def cmd_run(args):
         g_filters_names,
         os.path.join(current_slot_dir, 'denoisers'),
         config_filename,
-        args.overwrite
+        args.overwrite,
+        extra_args
     )
 
     run_techniques(
@@ -697,7 +704,8 @@ def cmd_run(args):
         g_samplers_names,
         os.path.join(current_slot_dir, 'samplers'),
         config_filename,
-        args.overwrite
+        args.overwrite,
+        extra_args
     )
 
     print('Benchmark finished. Run \'fbksd results compute\' to compute result errors.')
@@ -1252,6 +1260,12 @@ if __name__ == "__main__":
         description='Run the benchmark with the current configuration.')
     parserRun.set_defaults(func=cmd_run)
     parserRun.add_argument('--overwrite', action='store_true', help='Overwrites previous results.')
+    parserRun.add_argument('--cache', action='store_true',
+        help='Reuses the samples rendered for a technique in the next ones (kept in \'.samples-cache\').')
+    parserRun.add_argument('--cache-size', type=int, default=10240, metavar='MIB',
+        help='Maximum size of the samples cache, in MiB (default: 10240).')
+    parserRun.add_argument('--shards', type=int, default=1, metavar='N',
+        help='Number of renderer instances that render each scene, each one a band of the image (default: 1).')
 
     # results
     parserResults = subparsers.add_parser('results', help='Manipulate results.')
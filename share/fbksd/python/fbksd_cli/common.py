@@ -556,7 +556,7 @@ def current_config_name(current_config_link):
     return os.path.splitext(os.readlink(current_config_link))[0]
 
 
-def run_techniques(benchmark_exec, techniques_prefix, techiques, g_techiques_names, slot_prefix, config_filename, overwrite):
+def run_techniques(benchmark_exec, techniques_prefix, techiques, g_techiques_names, slot_prefix, config_filename, overwrite, extra_args = []):
     # clear old shared memory files
     if os.path.isfile('/dev/shm/SAMPLES_MEMORY'):
         os.remove('/dev/shm/SAMPLES_MEMORY')
@@ -577,6 +577,7 @@ def run_techniques(benchmark_exec, techniques_prefix, techiques, g_techiques_nam
             benchmark_args = [benchmark_exec, '--config', config_filename, '--filter', filter_exec, '--output', out_folder]
             if not overwrite:
                 benchmark_args.append('--resume')
+            benchmark_args += extra_args
             p = Popen(benchmark_args, stdout=PIPE, stderr=STDOUT, universal_newlines=True)
 
             while p.poll() is None:
@@ -8,6 +8,7 @@
  */
 
 #include "BenchmarkManager.h"
+#include "fbksd/core/session.h"
 using namespace fbksd;
 
 #include <QCoreApplication>
@@ -59,9 +60,11 @@ int main(int argc, char *argv[])
     parser.addOption(rendererOption);
     QCommandLineOption sceneOption("scene", "Scene file", "scene_file");
     parser.addOption(sceneOption);
-    QCommandLineOption clientOption("filter", "Executable file of the filter to run the benchmark on.", "executable");
+    QCommandLineOption clientOption("filter", "Executable file of the filter to run the benchmark on. "
+                                    "Give it several times to feed several filters with the same samples.", "executable");
     parser.addOption(clientOption);
-    QCommandLineOption outputOption("output", "Folder where the results will be saved (current directory is the default).", "folder");
+    QCommandLineOption outputOption("output", "Folder where the results will be saved (current directory is the default). "
+                                    "With several filters, give one for each filter (in the same order).", "folder");
     parser.addOption(outputOption);
     QCommandLineOption resumeOption("resume", "Skip scenes that already have results in the 'output' directory.");
     parser.addOption(resumeOption);
@@ -69,6 +72,19 @@ int main(int argc, char *argv[])
     parser.addOption(repeatOption);
     QCommandLineOption sppOption("spp", "Number of samples per pixel", "spp");
     parser.addOption(sppOption);
+    QCommandLineOption sessionOption("session", "Session id. Sessions with different ids can run concurrently.", "id");
+    parser.addOption(sessionOption);
+    QCommandLineOption recordOption("record", "Record the samples rendered for the scene to a file, to be served later by fbksd-replay.", "file");
+    parser.addOption(recordOption);
+    QCommandLineOption cacheOption("cache", "Directory of the sample cache. Evaluations already rendered for the same renderer and scene are served from it.", "folder");
+    parser.addOption(cacheOption);
+    QCommandLineOption cacheSizeOption("cache-size", "Maximum size of the sample cache in MiB (default: 10240).", "size");
+    parser.addOption(cacheSizeOption);
+    QCommandLineOption shardsOption("shards", "Number of renderer instances that render each scene, each one a band of the image (default: 1).", "n");
+    parser.addOption(shardsOption);
+    QCommandLineOption transportOption("tile-transport", "How the renderer sends the tiles: shm (shared memory, default), "
+                                       "tcp, or tcp-lz4 (tcp with LZ4 compression).", "transport");
+    parser.addOption(transportOption);
 
     parser.process(app);
     setlocale(LC_NUMERIC,"C");
@@ -79,14 +95,75 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if(parser.isSet(sessionOption))
+    {
+        bool ok = false;
+        int session = parser.value(sessionOption).toInt(&ok);
+        if(!ok || session < 0 || session >= MAX_SESSIONS)
+        {
+            std::cout << "Invalid session id." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        // The renderer and filter processes inherit the session from the environment.
+        setSessionId(session);
+    }
+
     if(parser.isSet(clientOption))
     {
-        QString asrClient = parser.value(clientOption);
-        QString outputFolder;
-        if(parser.isSet(outputOption))
-            outputFolder = parser.value(outputOption);
-        else
-            outputFolder = QDir::currentPath();
+        QStringList asrClients = parser.values(clientOption);
+        QStringList outputFolders = parser.values(outputOption);
+        if(asrClients.size() > MAX_CONSUMERS)
+        {
+            std::cout << "At most " << MAX_CONSUMERS << " filters can run together." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if(outputFolders.isEmpty() && asrClients.size() == 1)
+            outputFolders.append(QDir::currentPath());
+        if(outputFolders.size() != asrClients.size())
+        {
+            std::cout << "Give one output folder for each filter." << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        int64_t cacheSize = INT64_C(10240) << 20;
+        if(parser.isSet(cacheSizeOption))
+        {
+            bool ok = false;
+            qint64 size = parser.value(cacheSizeOption).toLongLong(&ok);
+            if(!ok || size < 0)
+            {
+                std::cout << "Invalid cache size." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            cacheSize = static_cast<int64_t>(size) << 20;
+        }
+
+        int numShards = 1;
+        if(parser.isSet(shardsOption))
+        {
+            bool ok = false;
+            numShards = parser.value(shardsOption).toInt(&ok);
+            if(!ok || numShards < 1 || numShards > MAX_SHARDS)
+            {
+                std::cout << "The number of shards should be between 1 and " << MAX_SHARDS << "." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        auto transport = BenchmarkManager::TileTransport::SHARED_MEMORY;
+        if(parser.isSet(transportOption))
+        {
+            QString value = parser.value(transportOption);
+            if(value == "tcp")
+                transport = BenchmarkManager::TileTransport::TCP;
+            else if(value == "tcp-lz4")
+                transport = BenchmarkManager::TileTransport::TCP_LZ4;
+            else if(value != "shm")
+            {
+                std::cout << "The tile transport should be shm, tcp or tcp-lz4." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
 
         int n = 1;
         if(parser.isSet(repeatOption))
@@ -113,10 +190,18 @@ int main(int argc, char *argv[])
                     spp = tn;
             }
 
-            if(sanitizeArgs({renderer, scene, asrClient}, {outputFolder}))
+            // The renderer inherits the variable and records its tiles (see RECORD_ENV).
+            if(parser.isSet(recordOption))
+                setenv(RECORD_ENV, parser.value(recordOption).toStdString().c_str(), 1);
+
+            if(sanitizeArgs(QStringList{renderer, scene} + asrClients, outputFolders))
             {
                 std::unique_ptr<BenchmarkManager> manager(new BenchmarkManager());
-                manager->runScene(renderer, scene, asrClient, outputFolder, n, spp);
+                if(parser.isSet(cacheOption))
+                    manager->setSampleCache(parser.value(cacheOption), cacheSize);
+                manager->setNumRendererShards(numShards);
+                manager->setTileTransport(transport);
+                manager->runScene(renderer, scene, asrClients, outputFolders, n, spp);
             }
             else
                 app.exit(EXIT_FAILURE);
@@ -125,10 +210,14 @@ int main(int argc, char *argv[])
         {
             QString configFileName = parser.value(configOption);
 
-            if(sanitizeArgs({configFileName, asrClient}, {outputFolder}))
+            if(sanitizeArgs(QStringList{configFileName} + asrClients, outputFolders))
             {
                 std::unique_ptr<BenchmarkManager> manager(new BenchmarkManager());
-                manager->runAll(configFileName, asrClient, outputFolder, n, parser.isSet(resumeOption));
+                if(parser.isSet(cacheOption))
+                    manager->setSampleCache(parser.value(cacheOption), cacheSize);
+                manager->setNumRendererShards(numShards);
+                manager->setTileTransport(transport);
+                manager->runAll(configFileName, asrClients, outputFolders, n, parser.isSet(resumeOption));
             }
             else
                 app.exit(EXIT_FAILURE);
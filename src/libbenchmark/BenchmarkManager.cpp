@@ -11,9 +11,12 @@
 
 #include "BenchmarkServer.h"
 #include "RenderClient.h"
+#include "TileFanOut.h"
+#include "TileMerger.h"
 #include "exr_utils.h"
 #include "tcp_utils.h"
 #include "fbksd/renderer/samples.h"
+#include "fbksd/core/session.h"
 using namespace fbksd;
 
 #include <iostream>
@@ -28,6 +31,10 @@ using namespace fbksd;
 #include <QDir>
 #include <QJsonObject>
 #include <QJsonDocument>
+#include <QProcessEnvironment>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <utime.h>
 
 
 // ==========================================================
@@ -63,6 +70,10 @@ int64_t getPixelCount(const SceneInfo& info)
     return w*h;
 }
 
+// Number of features-only samples (see SampleLayout::isFeaturesOnly()) that cost one sample of the budget.
+// A features-only sample only needs the primary ray, while a full sample traces a whole path.
+constexpr int64_t FEATURES_ONLY_COST_DIVISOR = 8;
+
 int64_t getInitSampleBudget(const SceneInfo& info)
 {
     return info.get<int64_t>("max_spp") * getPixelCount(info);
@@ -73,44 +84,95 @@ int64_t getInitSampleBudget(const SceneInfo& info)
 // ==========================================================
 // BenchmarkManager
 // ==========================================================
+BenchmarkManager::Consumer::Consumer(int session, int id):
+    id(id),
+    server(std::make_unique<BenchmarkServer>(id)),
+    resultMemory(getResultMemoryKey(session, id))
+{}
+
 BenchmarkManager::BenchmarkManager():
-    m_tilesMemory("TILES_MEMORY"),
-    m_resultMemory("RESULT_MEMORY")
-{
-    m_benchmarkServer = std::make_unique<BenchmarkServer>();
-    m_benchmarkServer->onGetSceneInfo([this]()
-        {return onGetSceneInfo();} );
-    m_benchmarkServer->onSetParameters([this](const SampleLayout& layout)
-        {onSetSampleLayout(layout);});
-    m_benchmarkServer->onEvaluateSamples([this](bool isSpp, int64_t numSamples)
-        {return onEvaluateSamples(isSpp, numSamples);});
-    m_benchmarkServer->onGetNextTile([this](int64_t index)
-        {return m_renderClient->getNextTile(index);});
-    m_benchmarkServer->onEvaluateInputSamples([this](bool isSpp, int64_t numSamples)
-        {return onEvaluateInputSamples(isSpp, numSamples);});
-    m_benchmarkServer->onGetNextInputTile([this](int64_t index, bool wasInput)
-        {return m_renderClient->getNextInputTile(index, wasInput);});
-    m_benchmarkServer->onLastTileConsumed([this](int64_t index)
-        {m_renderClient->lastTileConsumed(index);});
-    m_benchmarkServer->onSendResult([this]()
-        {onSendResult();});
-}
-
-BenchmarkManager::~BenchmarkManager() = default;
+    m_session(getSessionId()),
+    m_tilesMemory(getTilesMemoryKey(m_session)),
+    m_frameMemory(getFrameMemoryKey(m_session))
+{
+    addConsumer();
+}
+
+BenchmarkManager::~BenchmarkManager()
+{
+    stopRendererShards(false);
+}
+
+BenchmarkManager::Consumer& BenchmarkManager::addConsumer()
+{
+    m_consumers.push_back(std::make_unique<Consumer>(m_session, static_cast<int>(m_consumers.size())));
+    Consumer& c = *m_consumers.back();
+    BenchmarkServer& server = *c.server;
+    server.onGetSceneInfo([this, &c]()
+        {return onGetSceneInfo(c);} );
+    server.onSetParameters([this, &c](const SampleLayout& layout)
+        {onSetSampleLayout(c, layout);});
+    server.onRegisterSampleLayout([this, &c](const SampleLayout& layout)
+        {return onRegisterSampleLayout(c, layout);});
+    server.onSelectSampleLayout([this, &c](int id)
+        {return onSelectSampleLayout(c, id);});
+    server.onEvaluateSamples([this, &c](bool isSpp, int64_t numSamples)
+        {return onEvaluateSamples(c, isSpp, numSamples);});
+    server.onEvaluateRegions([this, &c](int64_t spp, const std::vector<CropWindow>& windows)
+        {return onEvaluateRegions(c, spp, windows);});
+    server.onEvaluateFrame([this, &c](int64_t spp)
+        {return onEvaluateFrame(c, spp);});
+    server.onGetNextTile([this, &c](int64_t index)
+        {return onGetNextTile(c, index);});
+    server.onEvaluateInputSamples([this, &c](bool isSpp, int64_t numSamples)
+        {return onEvaluateInputSamples(c, isSpp, numSamples);});
+    server.onGetNextInputTile([this, &c](int64_t index, bool wasInput)
+        {return onGetNextInputTile(c, index, wasInput);});
+    server.onLastTileConsumed([this, &c](int64_t index)
+        {onLastTileConsumed(c, index);});
+    server.onReleaseAndGetNextTile([this, &c](const std::vector<int64_t>& indices)
+        {return onReleaseAndGetNextTile(c, indices);});
+    server.onReleaseLastTiles([this, &c](const std::vector<int64_t>& indices)
+        {onReleaseLastTiles(c, indices);});
+    server.onCancelEvaluation([this, &c](const std::vector<int64_t>& indices)
+        {return onCancelEvaluation(c, indices);});
+    server.onSendResult([this, &c]()
+        {onSendResult(c);});
+    return c;
+}
+
+void BenchmarkManager::setupConsumers(const QStringList& filterPaths, const QStringList& resultPaths)
+{
+    if(filterPaths.size() > MAX_CONSUMERS)
+        throw std::invalid_argument("At most " + std::to_string(MAX_CONSUMERS) + " filters can share a renderer.");
+    if(filterPaths.size() != resultPaths.size())
+        throw std::invalid_argument("Each filter needs a result folder.");
+
+    while(static_cast<int>(m_consumers.size()) < filterPaths.size())
+        addConsumer();
+    for(int i = 0; i < filterPaths.size(); ++i)
+    {
+        m_consumers[i]->filterPath = filterPaths[i];
+        m_consumers[i]->resultPath = resultPaths[i];
+        m_consumers[i]->server->run();
+    }
+}
 
 void BenchmarkManager::runPassive(int spp)
 {
     m_passiveMode = true;
-    m_benchmarkServer->run(/*2226*/);
-    m_renderClient = std::make_unique<RenderClient>(2227);
-    m_tileSize = m_renderClient->getTileSize();
-    m_currentSceneInfo = m_renderClient->getSceneInfo();
+    Consumer& c = *m_consumers.front();
+    c.server->run();
+    if(m_rendererHost != "127.0.0.1" && m_tileTransport == TileTransport::SHARED_MEMORY)
+        throw std::logic_error("A renderer in another host needs a TCP tile transport.");
+    m_renderClient = connectRenderer(0);
+    fetchRendererInfo();
     m_currentSceneInfo.set<int64_t>("max_spp", spp);
     m_currentSceneInfo.set<int64_t>("max_samples", spp * getPixelCount(m_currentSceneInfo));
     allocateResultShm(getPixelCount(m_currentSceneInfo));
-    m_currentSampleBudget = getInitSampleBudget(m_currentSceneInfo);
-    m_currentExecTime = 0;
-    m_timer.start();
+    c.sampleBudget = getInitSampleBudget(m_currentSceneInfo);
+    c.execTime = 0;
+    c.timer.start();
 }
 
 void BenchmarkManager::runScene(const QString& rendererPath,
@@ -120,19 +182,24 @@ void BenchmarkManager::runScene(const QString& rendererPath,
                                 int n,
                                 int spp)
 {
-    // Start the benchmark server
-    m_benchmarkServer->run(/*2226*/);
+    runScene(rendererPath, scenePath, QStringList{filterPath}, QStringList{resultPath}, n, spp);
+}
+
+void BenchmarkManager::runScene(const QString& rendererPath,
+                                const QString& scenePath,
+                                const QStringList& filterPaths,
+                                const QStringList& resultPaths,
+                                int n,
+                                int spp)
+{
+    // Start the benchmark servers
+    setupConsumers(filterPaths, resultPaths);
 
     // Start rendering server with the given scene
     QProcess renderingServer;
-    startProcess(rendererPath, scenePath, renderingServer);
-
-    // Start the render client
-    // FIXME: setting client port manually here. Maybe all renderers should use the same port anyway?
-    waitPortOpen(2227);
-    m_renderClient = std::make_unique<RenderClient>(2227);
-    m_tileSize = m_renderClient->getTileSize();
-    m_currentSceneInfo = m_renderClient->getSceneInfo();
+    if(!startRenderingServer(rendererPath, scenePath, renderingServer))
+        return;
+    fetchRendererInfo();
     if(spp)
     {
         m_currentSceneInfo.set<int64_t>("max_spp", spp);
@@ -140,39 +207,53 @@ void BenchmarkManager::runScene(const QString& rendererPath,
     }
     allocateResultShm(getPixelCount(m_currentSceneInfo));
 
-    int exitType = FILTER_SUCCESS;
-    for(int i = 0; i < n; ++i)
+    // Filters that fail don't run the remaining iterations.
+    std::vector<Consumer*> consumers;
+    for(int i = 0; i < filterPaths.size(); ++i)
+        consumers.push_back(m_consumers[i].get());
+
+    bool rendererCrashed = false;
+    for(int i = 0; i < n && !consumers.empty(); ++i)
     {
         qDebug("running %d of %d", i+1, n);
-        m_currentSampleBudget = getInitSampleBudget(m_currentSceneInfo);
-        // Start benchmark client
-        QProcess filterApp;
-        startProcess(filterPath, "", filterApp);
-
-        m_currentExecTime = 0;
-        m_timer.start();
-
-        exitType = startEventLoop(&renderingServer, &filterApp);
-        if(exitType == FILTER_SUCCESS)
+        for(Consumer* c: consumers)
+            c->sampleBudget = getInitSampleBudget(m_currentSceneInfo);
+        if(!m_cacheDir.isEmpty())
+            m_renderClient->beginRun(i);
+        // Start benchmark clients
+        startFilters(consumers);
+        startEventLoop(&renderingServer, consumers);
+        m_fanOut.reset();
+
+        std::vector<Consumer*> succeeded;
+        for(Consumer* c: consumers)
         {
+            rendererCrashed = rendererCrashed || c->exitStatus == RENDERER_CRASH;
+            if(c->exitStatus != FILTER_SUCCESS)
+                continue;
+            succeeded.push_back(c);
             QString currentDir = QDir::currentPath();
-            QDir::setCurrent(resultPath);
-            QString baseResultFilename = QFileInfo(rendererPath).baseName() + "_" + QFileInfo(scenePath).baseName() + "_" + QFileInfo(filterPath).baseName();
+            QDir::setCurrent(c->resultPath);
+            QString baseResultFilename = QFileInfo(rendererPath).baseName() + "_" + QFileInfo(scenePath).baseName() + "_" + QFileInfo(c->filterPath).baseName();
             baseResultFilename.append("_" + QString::number(i));
-            saveResult(baseResultFilename, exitType != FILTER_SUCCESS);
+            saveResult(*c, baseResultFilename, false);
             QDir::setCurrent(currentDir);
         }
-        else
+        consumers = succeeded;
+        if(rendererCrashed)
             break;
     }
 
     // Finish rendering server and client
-    if(exitType != RENDERER_CRASH)
+    if(!rendererCrashed)
     {
+        stopRendererShards(true);
         m_renderClient->finishRender();
         renderingServer.kill();
         renderingServer.waitForFinished();
     }
+    if(!m_cacheDir.isEmpty())
+        trimSampleCache(m_cacheDir, m_cacheMaxBytes, QString());
 }
 
 void BenchmarkManager::runAll(const QString& configPath,
@@ -180,6 +261,15 @@ void BenchmarkManager::runAll(const QString& configPath,
                               const QString& resultPath,
                               int n,
                               bool resume)
+{
+    runAll(configPath, QStringList{filterPath}, QStringList{resultPath}, n, resume);
+}
+
+void BenchmarkManager::runAll(const QString& configPath,
+                              const QStringList& filterPaths,
+                              const QStringList& resultPaths,
+                              int n,
+                              bool resume)
 {
     try{ m_config = loadConfig(configPath); }
     catch(const std::runtime_error& error)
@@ -188,10 +278,14 @@ void BenchmarkManager::runAll(const QString& configPath,
         return;
     }
 
-    // Start the benchmark server
-    m_benchmarkServer->run(/*2226*/);
+    // Start the benchmark servers
+    setupConsumers(filterPaths, resultPaths);
 
-    std::string filterName = QFileInfo(filterPath).baseName().toStdString();
+    auto getFilterName = [](const Consumer* c)
+    { return QFileInfo(c->filterPath).baseName().toStdString(); };
+    std::string filterNames;
+    for(int i = 0; i < filterPaths.size(); ++i)
+        filterNames += (i > 0 ? ", " : "") + getFilterName(m_consumers[i].get());
 
     // Launch the ASR app for each renderer, scene and spp.
     for(m_currentRenderIndex = 0; m_currentRenderIndex < m_config.renderers.size(); ++m_currentRenderIndex)
@@ -205,48 +299,57 @@ void BenchmarkManager::runAll(const QString& configPath,
             QProcess renderingServer;
             bool startRenderer = true;
 
-            bool skipRemainingSPPs = false;
-            for(m_currentSppIndex = 0; m_currentSppIndex < scene.spps.size(); ++m_currentSppIndex)
+            // Filters that crash skip the remaining spps of the scene.
+            std::vector<Consumer*> sceneConsumers;
+            for(int i = 0; i < filterPaths.size(); ++i)
+                sceneConsumers.push_back(m_consumers[i].get());
+
+            for(m_currentSppIndex = 0; m_currentSppIndex < scene.spps.size() && !sceneConsumers.empty(); ++m_currentSppIndex)
             {
-                if(resume)
+                std::vector<Consumer*> consumers;
+                for(Consumer* c: sceneConsumers)
                 {
-                    // If the log file exists and does not indicate a crash, skip to next iteration
-                    int spp = scene.spps[m_currentSppIndex];
-                    //TODO: support the case with multiple iterations
-                    QString baseFilename = scene.name +
-                            "/" + QString::number(spp) + "_0_log.json";
-                    QFileInfo fileInfo(resultPath, baseFilename);
-                    if(fileInfo.exists())
+                    if(resume)
                     {
-                        QFile file(fileInfo.filePath());
-                        if(!file.open(QIODevice::ReadOnly))
-                            qDebug() << "Couldn't open log file.";
-                        else
+                        // If the log file exists and does not indicate a crash, skip to next iteration
+                        int spp = scene.spps[m_currentSppIndex];
+                        //TODO: support the case with multiple iterations
+                        QString baseFilename = scene.name +
+                                "/" + QString::number(spp) + "_0_log.json";
+                        QFileInfo fileInfo(c->resultPath, baseFilename);
+                        if(fileInfo.exists())
                         {
-                            QJsonDocument doc(QJsonDocument::fromJson(file.readAll()));
-                            QJsonObject obj = doc.object();
-                            if(!obj.contains("aborted") || !obj["aborted"].toBool())
+                            QFile file(fileInfo.filePath());
+                            if(!file.open(QIODevice::ReadOnly))
+                                qDebug() << "Couldn't open log file.";
+                            else
                             {
-                                std::cout << "Filter: " << filterName << ". ";
-                                std::cout << "Scene: " << scene.name.toStdString() << ". ";
-                                std::cout << "SPP: " << scene.spps[m_currentSppIndex] << ". ";
-                                std::cout << "Iteration: 1/" << n << ". (skipping: already has results saved)" << std::endl;
-                                continue;
+                                QJsonDocument doc(QJsonDocument::fromJson(file.readAll()));
+                                QJsonObject obj = doc.object();
+                                if(!obj.contains("aborted") || !obj["aborted"].toBool())
+                                {
+                                    std::cout << "Filter: " << getFilterName(c) << ". ";
+                                    std::cout << "Scene: " << scene.name.toStdString() << ". ";
+                                    std::cout << "SPP: " << scene.spps[m_currentSppIndex] << ". ";
+                                    std::cout << "Iteration: 1/" << n << ". (skipping: already has results saved)" << std::endl;
+                                    continue;
+                                }
                             }
                         }
                     }
+                    consumers.push_back(c);
                 }
+                if(consumers.empty())
+                    continue;
 
                 // Start current rendering server with the current scene
                 if(startRenderer)
                 {
+                    // Renderer failed to start: skip this scene
+                    if(!startRenderingServer(renderAtt.path, scene.path, renderingServer))
+                        break;
                     startRenderer = false;
-                    startProcess(renderAtt.path, scene.path, renderingServer);
-                    // Start the render client
-                    waitPortOpen(2227);
-                    m_renderClient = std::make_unique<RenderClient>(2227);
-                    m_tileSize = m_renderClient->getTileSize();
-                    m_currentSceneInfo = m_renderClient->getSceneInfo();
+                    fetchRendererInfo();
                     allocateResultShm(getPixelCount(m_currentSceneInfo));
                 }
 
@@ -258,76 +361,180 @@ void BenchmarkManager::runAll(const QString& configPath,
                 auto sampleBudget = getInitSampleBudget(m_currentSceneInfo);
                 m_currentSceneInfo.set("max_samples", sampleBudget);
 
-                for(int i = 0; i < n; ++i)
+                for(int i = 0; i < n && !consumers.empty(); ++i)
                 {
-                    std::cout << "Filter: " << filterName << ". ";
+                    std::cout << "Filter: " << (consumers.size() == 1 ? getFilterName(consumers.front()) : filterNames) << ". ";
                     std::cout << "Scene: " << scene.name.toStdString() << ". ";
                     std::cout << "SPP: " << scene.spps[m_currentSppIndex] << ". ";
                     std::cout << "Iteration: " << i+1 << "/" << n << "." << std::endl;
 
-                    m_currentSampleBudget = sampleBudget;
-                    // Start benchmark client
-                    QProcess filterApp;
-                    startProcess(filterPath, "", filterApp);
-                    m_currentExecTime = 0;
-                    m_timer.start();
+                    for(Consumer* c: consumers)
+                        c->sampleBudget = sampleBudget;
+                    if(!m_cacheDir.isEmpty())
+                        m_renderClient->beginRun(i);
+                    // Start benchmark clients
+                    startFilters(consumers);
+                    startEventLoop(&renderingServer, consumers);
+                    m_fanOut.reset();
 
-                    ProcessExitStatus exitType = startEventLoop(&renderingServer, &filterApp);
                     int spp = scene.spps[m_currentSppIndex];
                     QString sceneName = scene.name;
-                    QString prevCurrentDir = QDir::currentPath();
-                    QDir::setCurrent(resultPath);
-                    QDir::current().mkdir(sceneName);
                     QString baseFilename = sceneName + "/" + QString::number(spp);
                     baseFilename.append("_" + QString::number(i));
-                    saveResult(baseFilename, exitType != FILTER_SUCCESS);
-                    QDir::setCurrent(prevCurrentDir);
-                    //move output text files
-                    {
-                        QString destRendererLog = QFileInfo(resultPath, baseFilename + "_renderer_output.log").filePath();
-                        if(QFile::exists(destRendererLog))
-                            QFile::remove(destRendererLog);
-                        QFile rendererLog(QFileInfo(renderAtt.path).baseName() + ".log");
-                        if(rendererLog.exists())
-                            rendererLog.rename(destRendererLog);
-
-                        QString destFilterLog = QFileInfo(resultPath, baseFilename + "_filter_output.log").filePath();
-                        if(QFile::exists(destFilterLog))
-                            QFile::remove(destFilterLog);
-                        QFile filterLog(QString::fromStdString(filterName) + ".log");
-                        if(filterLog.exists())
-                            filterLog.rename(destFilterLog);
-                    }
-                    if(exitType == FILTER_CRASH)
+                    QFile rendererLog(QFileInfo(renderAtt.path).baseName() + ".log");
+                    std::vector<Consumer*> remaining;
+                    for(Consumer* c: consumers)
                     {
-                        skipRemainingSPPs = true;
-                        break;
+                        QString prevCurrentDir = QDir::currentPath();
+                        QDir::setCurrent(c->resultPath);
+                        QDir::current().mkdir(sceneName);
+                        saveResult(*c, baseFilename, c->exitStatus != FILTER_SUCCESS);
+                        QDir::setCurrent(prevCurrentDir);
+                        //move output text files
+                        {
+                            QString destRendererLog = QFileInfo(c->resultPath, baseFilename + "_renderer_output.log").filePath();
+                            if(QFile::exists(destRendererLog))
+                                QFile::remove(destRendererLog);
+                            if(rendererLog.exists())
+                                rendererLog.copy(destRendererLog);
+
+                            QString destFilterLog = QFileInfo(c->resultPath, baseFilename + "_filter_output.log").filePath();
+                            if(QFile::exists(destFilterLog))
+                                QFile::remove(destFilterLog);
+                            QFile filterLog(getFilterLogFilename(*c));
+                            if(filterLog.exists())
+                                filterLog.rename(destFilterLog);
+                        }
+                        if(c->exitStatus == FILTER_CRASH)
+                            sceneConsumers.erase(std::find(sceneConsumers.begin(), sceneConsumers.end(), c));
+                        else
+                            remaining.push_back(c);
+                        if(c->exitStatus == RENDERER_CRASH)
+                            startRenderer = true;
                     }
-                    if(exitType == RENDERER_CRASH)
-                    {
-                        startRenderer = true;
+                    rendererLog.remove();
+                    consumers = remaining;
+                    if(startRenderer)
                         break;
-                    }
                 }
-
-                if(skipRemainingSPPs)
-                    break;
             }
 
             // Finish rendering server and client
             if(!startRenderer)
             {
+                stopRendererShards(true);
                 m_renderClient->finishRender();
                 renderingServer.kill();
                 renderingServer.waitForFinished();
             }
         }
     }
+    if(!m_cacheDir.isEmpty())
+        trimSampleCache(m_cacheDir, m_cacheMaxBytes, QString());
+}
+
+void BenchmarkManager::setSampleCache(const QString& dir, int64_t maxBytes)
+{
+    if(!QDir().mkpath(dir))
+    {
+        qWarning() << "Couldn't create the sample cache directory" << dir;
+        return;
+    }
+    m_cacheDir = QDir(dir).absolutePath();
+    m_cacheMaxBytes = maxBytes;
+}
+
+void BenchmarkManager::setNumRendererShards(int numShards)
+{
+    if(numShards < 1 || numShards > MAX_SHARDS)
+        throw std::invalid_argument("The number of renderer shards should be in the range [1, " + std::to_string(MAX_SHARDS) + "].");
+    m_numShards = numShards;
+}
+
+void BenchmarkManager::setTileTransport(TileTransport transport)
+{
+    m_tileTransport = transport;
+}
+
+void BenchmarkManager::setRendererHost(const std::string& host)
+{
+    m_rendererHost = host;
+}
+
+std::vector<CropWindow> BenchmarkManager::clipWindows(const std::vector<CropWindow>& windows, int64_t width, int64_t height)
+{
+    std::vector<CropWindow> result;
+    std::vector<CropWindow> pending(windows.rbegin(), windows.rend());
+    while(!pending.empty())
+    {
+        CropWindow w = pending.back();
+        pending.pop_back();
+        w.begin.x = std::max<int64_t>(w.begin.x, 0);
+        w.begin.y = std::max<int64_t>(w.begin.y, 0);
+        w.end.x = std::min<int64_t>(w.end.x, width);
+        w.end.y = std::min<int64_t>(w.end.y, height);
+        if(w.width() <= 0 || w.height() <= 0)
+            continue;
+
+        auto overlapping = std::find_if(result.begin(), result.end(), [&](const CropWindow& r)
+        {
+            return w.begin.x < r.end.x && r.begin.x < w.end.x &&
+                   w.begin.y < r.end.y && r.begin.y < w.end.y;
+        });
+        if(overlapping == result.end())
+        {
+            result.push_back(w);
+            continue;
+        }
+
+        // Split w in up to 4 pieces around the overlapping window and check them again.
+        const CropWindow r = *overlapping;
+        if(w.begin.y < r.begin.y)
+            pending.push_back(CropWindow(w.begin, {w.end.x, r.begin.y}));
+        if(r.end.y < w.end.y)
+            pending.push_back(CropWindow({w.begin.x, r.end.y}, w.end));
+        int64_t midBegin = std::max(w.begin.y, r.begin.y);
+        int64_t midEnd = std::min(w.end.y, r.end.y);
+        if(w.begin.x < r.begin.x)
+            pending.push_back(CropWindow({w.begin.x, midBegin}, {r.begin.x, midEnd}));
+        if(r.end.x < w.end.x)
+            pending.push_back(CropWindow({r.end.x, midBegin}, {w.end.x, midEnd}));
+    }
+    return result;
+}
+
+void BenchmarkManager::fetchRendererInfo()
+{
+    m_tileSize = m_renderClient->getTileSize();
+    m_currentSceneInfo = m_renderClient->getSceneInfo();
+    m_supportsFeaturesOnly = m_renderClient->supportsFeaturesOnly();
+    m_supportsRegions = m_renderClient->supportsRegions();
+    if(m_supportsFeaturesOnly)
+        m_currentSceneInfo.set<int64_t>("features_only_cost_divisor", FEATURES_ONLY_COST_DIVISOR);
 }
 
-void BenchmarkManager::allocateTilesMemory(int spp)
+// Only sample evaluations pass the evaluation mode to the renderer (see RenderingServer::EvaluationMode),
+// so they are the only ones charged at the features-only cost.
+int64_t BenchmarkManager::getSamplesCost(const Consumer& c, int64_t numSamples) const
 {
-    auto tileSize = m_tileSize * m_tileSize * spp * m_currentSampleSize * NUM_TILES;
+    if(c.evalFeaturesOnly)
+        return (numSamples + FEATURES_ONLY_COST_DIVISOR - 1) / FEATURES_ONLY_COST_DIVISOR;
+    return numSamples;
+}
+
+int64_t BenchmarkManager::getAffordableSamples(const Consumer& c) const
+{
+    return c.evalFeaturesOnly ? c.sampleBudget * FEATURES_ONLY_COST_DIVISOR : c.sampleBudget;
+}
+
+void BenchmarkManager::allocateTilesMemory(const Consumer& c, int spp)
+{
+    // Pixel statistics take the space of two samples (mean and variance) per pixel.
+    if(c.pixelStatistics)
+        spp = 2;
+    // Each shard has its own range of slots.
+    auto numShards = static_cast<int64_t>(m_shardClients.size() + 1);
+    auto tileSize = m_tileSize * m_tileSize * spp * c.sampleSize * NUM_TILES * numShards;
     auto prevSize = m_tilesMemory.size();
     auto newSize = tileSize * sizeof(float);
     if(newSize > prevSize)
@@ -338,14 +545,90 @@ void BenchmarkManager::allocateTilesMemory(int spp)
     }
 }
 
-SceneInfo BenchmarkManager::onGetSceneInfo()
+void BenchmarkManager::allocateFrameMemory(const Consumer& c, int64_t spp)
+{
+    if(c.pixelStatistics)
+        spp = 2;
+    auto newSize = getPixelCount(m_currentSceneInfo) * spp * c.sampleSize * sizeof(float);
+    if(newSize > m_frameMemory.size())
+    {
+        m_frameMemory.detach();
+        if(!m_frameMemory.create(newSize))
+            qDebug() << "Couldn't allocate frame memory: " << m_frameMemory.error().c_str();
+    }
+}
+
+int64_t BenchmarkManager::request(Consumer& c, const std::string& key, const std::function<int64_t()>& call)
+{
+    if(m_fanOut)
+        return m_fanOut->request(c.id, key, call);
+    return call();
+}
+
+TilePkg BenchmarkManager::evaluate(Consumer& c, const std::string& key, const std::function<TilePkg()>& call)
+{
+    if(m_fanOut)
+        return m_fanOut->evaluate(c.id, key, call);
+    return call();
+}
+
+TilePkg BenchmarkManager::evaluateShards(int64_t spp, const std::vector<CropWindow>& windows)
+{
+    if(!m_merger)
+        return m_renderClient->evaluateRegions(spp, windows);
+
+    // Each shard renders the part of the windows inside its rows.
+    int64_t width = 0;
+    int64_t height = 0;
+    getResolution(m_currentSceneInfo, &width, &height);
+    const int numShards = static_cast<int>(m_shardClients.size() + 1);
+    std::vector<int> shards;
+    for(int shard = 0; shard < numShards; ++shard)
+        if(!TileMerger::getShardWindows(windows, height, shard, numShards).empty())
+            shards.push_back(shard);
+    return m_merger->evaluate(shards, [&](int shard)
+    {
+        return getRenderClient(shard).evaluateRegions(spp, TileMerger::getShardWindows(windows, height, shard, numShards));
+    });
+}
+
+TilePkg BenchmarkManager::evaluateFirstShard(const std::function<TilePkg()>& call)
+{
+    if(!m_merger)
+        return call();
+    return m_merger->evaluate({0}, [&](int){ return call(); });
+}
+
+TilePkg BenchmarkManager::releaseAndGetNextTile(const std::vector<int64_t>& consumedTileIndices)
 {
-    m_currentExecTime += m_timer.elapsed();
-    m_timer.start();
+    if(m_merger)
+        return m_merger->releaseAndGetNextTile(consumedTileIndices);
+    return m_renderClient->releaseAndGetNextTile(consumedTileIndices);
+}
+
+void BenchmarkManager::releaseLastTiles(const std::vector<int64_t>& consumedTileIndices)
+{
+    if(m_merger)
+        m_merger->releaseLastTiles(consumedTileIndices);
+    else
+        m_renderClient->releaseLastTiles(consumedTileIndices);
+}
+
+int64_t BenchmarkManager::cancelEvaluation(const std::vector<int64_t>& consumedTileIndices)
+{
+    if(m_merger)
+        return m_merger->cancelEvaluation(consumedTileIndices);
+    return m_renderClient->cancelEvaluation(consumedTileIndices);
+}
+
+SceneInfo BenchmarkManager::onGetSceneInfo(Consumer& c)
+{
+    c.execTime += c.timer.elapsed();
+    c.timer.start();
     return m_currentSceneInfo;
 }
 
-int BenchmarkManager::onSetSampleLayout(const SampleLayout& layout)
+int BenchmarkManager::onSetSampleLayout(Consumer& c, const SampleLayout& layout)
 {
     enum ReturnCode
     {
@@ -354,7 +637,7 @@ int BenchmarkManager::onSetSampleLayout(const SampleLayout& layout)
         SHARED_MEMORY_ERROR,
     };
 
-    m_currentExecTime += m_timer.elapsed();
+    c.execTime += c.timer.elapsed();
 
     if(!layout.isValid(getAllElements()))
     {
@@ -362,129 +645,597 @@ int BenchmarkManager::onSetSampleLayout(const SampleLayout& layout)
         return INVALID_LAYOUT; // invalid layout
     }
 
-    m_currentSampleSize = layout.getSampleSize();
-    m_renderClient->setParameters(layout);
+    c.sampleSize = layout.getSampleSize();
+    c.pixelStatistics = layout.isPixelStatistics();
+    c.featuresOnly = m_supportsFeaturesOnly && layout.isFeaturesOnly();
+    c.layout = std::make_unique<SampleLayout>(layout);
+    c.layoutId = -1;
+    request(c, TileFanOut::makeKey("SET_PARAMETERS", layout), [&]()
+    {
+        m_renderClient->setParameters(layout);
+        for(auto& client: m_shardClients)
+            client->setParameters(layout);
+        return INT64_C(0);
+    });
 
-    m_timer.start();
+    c.timer.start();
     return OK;
 }
 
-TilePkg BenchmarkManager::onEvaluateSamples(bool isSPP, int64_t numSamples)
+int BenchmarkManager::onRegisterSampleLayout(Consumer& c, const SampleLayout& layout)
+{
+    c.execTime += c.timer.elapsed();
+
+    int id = -1;
+    if(layout.isValid(getAllElements()))
+    {
+        id = static_cast<int>(request(c, TileFanOut::makeKey("REGISTER_LAYOUT", layout), [&]()
+        {
+            // The shards register the same layouts in the same order, so they give the same ids.
+            for(auto& client: m_shardClients)
+                client->registerLayout(layout);
+            return static_cast<int64_t>(m_renderClient->registerLayout(layout));
+        }));
+        c.layouts[id] = layout;
+    }
+    else
+        qDebug() << "ERROR: Invalid SampleLayout registered!";
+
+    c.timer.start();
+    return id;
+}
+
+bool BenchmarkManager::onSelectSampleLayout(Consumer& c, int id)
 {
-    m_currentExecTime += m_timer.elapsed();
+    auto registered = c.layouts.find(id);
+    if(registered == c.layouts.end())
+        return false;
+
+    c.execTime += c.timer.elapsed();
+
+    const SampleLayout& layout = registered->second;
+    c.sampleSize = layout.getSampleSize();
+    c.pixelStatistics = layout.isPixelStatistics();
+    c.featuresOnly = m_supportsFeaturesOnly && layout.isFeaturesOnly();
+    c.layout = std::make_unique<SampleLayout>(layout);
+    c.layoutId = id;
+    request(c, TileFanOut::makeKey("SELECT_LAYOUT", id), [&]()
+    {
+        m_renderClient->selectLayout(id);
+        for(auto& client: m_shardClients)
+            client->selectLayout(id);
+        return INT64_C(0);
+    });
+
+    c.timer.start();
+    return true;
+}
 
+TilePkg BenchmarkManager::onEvaluateSamples(Consumer& c, bool isSPP, int64_t numSamples)
+{
+    if(c.pixelStatistics && !isSPP)
+        throw std::logic_error("Pixel statistics mode only supports SPP requests.");
+
+    c.execTime += c.timer.elapsed();
+
+    c.evalFeaturesOnly = c.featuresOnly;
     auto numPixels = getPixelCount(m_currentSceneInfo);
-    auto numGenSamples = std::min(m_currentSampleBudget, isSPP ? numSamples * numPixels : numSamples);
-    m_currentSampleBudget = m_currentSampleBudget - numGenSamples;
+    auto numGenSamples = std::min(getAffordableSamples(c), isSPP ? numSamples * numPixels : numSamples);
+    // Statistics are per pixel, so only whole spp are given.
+    if(c.pixelStatistics)
+        numGenSamples -= numGenSamples % numPixels;
+    c.sampleBudget = c.sampleBudget - getSamplesCost(c, numGenSamples);
+    c.evalNumSamples = numGenSamples;
     if(numGenSamples == 0)
         return {};
 
     auto spp = numGenSamples / numPixels;
     auto remaining = numGenSamples % numPixels;
-    allocateTilesMemory(std::max(spp, 1L));
-    TilePkg tilePkg = m_renderClient->evaluateSamples(spp, remaining);
+    TilePkg tilePkg = evaluate(c, TileFanOut::makeKey("EVALUATE_SAMPLES", spp, remaining), [&]()
+    {
+        allocateTilesMemory(c, std::max(spp, 1L));
+        // Without remaining samples, the request is the same as a region request for the whole image,
+        // which can be split among the shards.
+        if(m_merger && remaining == 0 && m_supportsRegions)
+        {
+            int64_t width = 0;
+            int64_t height = 0;
+            getResolution(m_currentSceneInfo, &width, &height);
+            return evaluateShards(spp, {CropWindow({0, 0}, {width, height})});
+        }
+        return evaluateFirstShard([&](){ return m_renderClient->evaluateSamples(spp, remaining); });
+    });
 
-    m_timer.start();
+    c.timer.start();
     return tilePkg;
 }
 
-TilePkg BenchmarkManager::onEvaluateInputSamples(bool isSPP, int64_t numSamples)
+TilePkg BenchmarkManager::onEvaluateInputSamples(Consumer& c, bool isSPP, int64_t numSamples)
 {
-    m_currentExecTime += m_timer.elapsed();
+    // The input of one filter can't be given to the others.
+    if(m_fanOut)
+        throw std::logic_error("Input samples are not supported when several filters share the renderer.");
+    if(m_merger)
+        throw std::logic_error("Input samples are not supported with renderer shards.");
 
+    c.execTime += c.timer.elapsed();
+
+    c.evalFeaturesOnly = false;
     auto numPixels = getPixelCount(m_currentSceneInfo);
-    auto numGenSamples = std::min(m_currentSampleBudget, isSPP ? numSamples * numPixels : numSamples);
-    m_currentSampleBudget = m_currentSampleBudget - numGenSamples;
+    auto numGenSamples = std::min(getAffordableSamples(c), isSPP ? numSamples * numPixels : numSamples);
+    c.sampleBudget = c.sampleBudget - getSamplesCost(c, numGenSamples);
+    c.evalNumSamples = numGenSamples;
     if(numGenSamples == 0)
         return {};
 
     auto spp = numGenSamples / numPixels;
     auto remaining = numGenSamples % numPixels;
-    allocateTilesMemory(std::max(spp, 1L));
+    allocateTilesMemory(c, std::max(spp, 1L));
     TilePkg tilePkg = m_renderClient->evaluateInputSamples(spp, remaining);
 
-    m_timer.start();
+    c.timer.start();
+    return tilePkg;
+}
+
+TilePkg BenchmarkManager::onEvaluateRegions(Consumer& c, int64_t spp, std::vector<CropWindow> windows)
+{
+    // Checked before any memory is allocated or budget debited.
+    if(!m_supportsRegions)
+        throw std::runtime_error("The renderer doesn't support region evaluation.");
+
+    c.execTime += c.timer.elapsed();
+
+    c.evalFeaturesOnly = false;
+    int64_t width = 0;
+    int64_t height = 0;
+    getResolution(m_currentSceneInfo, &width, &height);
+    windows = clipWindows(windows, width, height);
+    int64_t area = 0;
+    for(auto& w: windows)
+        area += w.width() * w.height();
+
+    // Only whole spp are given, so the renderer produces exactly what is debited.
+    if(area > 0)
+        spp = std::min(spp, getAffordableSamples(c) / area);
+    if(area == 0 || spp <= 0)
+    {
+        c.timer.start();
+        return {};
+    }
+
+    TilePkg tilePkg;
+    try
+    {
+        tilePkg = evaluate(c, TileFanOut::makeKey("EVALUATE_REGIONS", spp, windows), [&]()
+        {
+            allocateTilesMemory(c, spp);
+            return evaluateShards(spp, windows);
+        });
+    }
+    catch(...)
+    {
+        // Nothing was debited, and the filter's time runs again.
+        c.timer.start();
+        throw;
+    }
+    c.evalNumSamples = spp * area;
+    c.sampleBudget -= getSamplesCost(c, c.evalNumSamples);
+
+    c.timer.start();
     return tilePkg;
 }
 
-void BenchmarkManager::onLastTileConsumed(int64_t prevTileIndex)
+TilePkg BenchmarkManager::onEvaluateFrame(Consumer& c, int64_t spp)
 {
-    m_currentExecTime += m_timer.elapsed();
-    m_renderClient->lastTileConsumed(prevTileIndex);
-    m_timer.start();
+    c.execTime += c.timer.elapsed();
+
+    c.evalFeaturesOnly = false;
+    // Only whole spp are given, since every pixel of the frame has the same number of samples.
+    spp = std::min(spp, getAffordableSamples(c) / getPixelCount(m_currentSceneInfo));
+    if(spp <= 0)
+    {
+        c.timer.start();
+        return {};
+    }
+
+    TilePkg tilePkg = evaluate(c, TileFanOut::makeKey("EVALUATE_FRAME", spp), [&]()
+    {
+        allocateFrameMemory(c, spp);
+        return evaluateFirstShard([&](){ return m_renderClient->evaluateFrame(spp); });
+    });
+    c.evalNumSamples = spp * getPixelCount(m_currentSceneInfo);
+    c.sampleBudget -= getSamplesCost(c, c.evalNumSamples);
+
+    c.timer.start();
+    return tilePkg;
+}
+
+TilePkg BenchmarkManager::onGetNextTile(Consumer& c, int64_t prevTileIndex)
+{
+    // Waiting for the renderer (or for the other filters) is not this filter's time, with one filter or several.
+    c.execTime += c.timer.elapsed();
+    TilePkg tilePkg;
+    if(m_fanOut)
+        tilePkg = m_fanOut->releaseAndGetNextTile(c.id, {prevTileIndex});
+    else if(m_merger)
+        tilePkg = m_merger->releaseAndGetNextTile({prevTileIndex});
+    else
+        tilePkg = m_renderClient->getNextTile(prevTileIndex);
+    c.timer.start();
+    return tilePkg;
+}
+
+TilePkg BenchmarkManager::onGetNextInputTile(Consumer& c, int64_t prevTileIndex, bool prevWasInput)
+{
+    if(m_fanOut)
+        throw std::logic_error("Input samples are not supported when several filters share the renderer.");
+    if(m_merger)
+        throw std::logic_error("Input samples are not supported with renderer shards.");
+    c.execTime += c.timer.elapsed();
+    TilePkg tilePkg = m_renderClient->getNextInputTile(prevTileIndex, prevWasInput);
+    c.timer.start();
+    return tilePkg;
+}
+
+void BenchmarkManager::onLastTileConsumed(Consumer& c, int64_t prevTileIndex)
+{
+    c.execTime += c.timer.elapsed();
+    if(m_fanOut)
+        m_fanOut->releaseLastTiles(c.id, {prevTileIndex});
+    else if(m_merger)
+        m_merger->releaseLastTiles({prevTileIndex});
+    else
+        m_renderClient->lastTileConsumed(prevTileIndex);
+    c.timer.start();
 }
 
-void BenchmarkManager::onSendResult()
+TilePkg BenchmarkManager::onReleaseAndGetNextTile(Consumer& c, const std::vector<int64_t>& consumedTileIndices)
 {
-    m_currentExecTime += m_timer.elapsed();
+    c.execTime += c.timer.elapsed();
+    TilePkg tilePkg;
+    if(m_fanOut)
+        tilePkg = m_fanOut->releaseAndGetNextTile(c.id, consumedTileIndices);
+    else
+        tilePkg = releaseAndGetNextTile(consumedTileIndices);
+    c.timer.start();
+    return tilePkg;
+}
+
+void BenchmarkManager::onReleaseLastTiles(Consumer& c, const std::vector<int64_t>& consumedTileIndices)
+{
+    c.execTime += c.timer.elapsed();
+    if(m_fanOut)
+        m_fanOut->releaseLastTiles(c.id, consumedTileIndices);
+    else
+        releaseLastTiles(consumedTileIndices);
+    c.timer.start();
+}
+
+int64_t BenchmarkManager::onCancelEvaluation(Consumer& c, const std::vector<int64_t>& consumedTileIndices)
+{
+    c.execTime += c.timer.elapsed();
+
+    // Samples that were not delivered to the client are given back to the budget.
+    int64_t numDelivered = 0;
+    if(m_fanOut)
+        numDelivered = m_fanOut->cancelEvaluation(c.id, consumedTileIndices);
+    else
+        numDelivered = cancelEvaluation(consumedTileIndices);
+    auto refund = std::max(getSamplesCost(c, c.evalNumSamples) - getSamplesCost(c, numDelivered), INT64_C(0));
+    c.sampleBudget += refund;
+    c.evalNumSamples = 0;
+
+    c.timer.start();
+    return refund;
+}
+
+void BenchmarkManager::onSendResult(Consumer& c)
+{
+    c.execTime += c.timer.elapsed();
     int h, m, s, ms;
-    convertMillisecons(m_currentExecTime, &h, &m, &s, &ms);
+    convertMillisecons(c.execTime, &h, &m, &s, &ms);
     qDebug("Execution time = %02d:%02d:%02d:%03d", h, m, s, ms);
 
     if(m_passiveMode)
-        saveResult("result", false);
+        saveResult(c, "result", false);
 }
 
 void BenchmarkManager::allocateResultShm(int64_t pixelCount)
 {
-    if(m_resultMemory.isAttached())
-        m_resultMemory.detach();
-
     int64_t resultMemorySize = pixelCount * 3 * static_cast<int64_t>(sizeof(float));
-    if(!m_resultMemory.create(resultMemorySize))
+    for(auto& c: m_consumers)
     {
-        qDebug() << "Couldn't create result memory: " << m_resultMemory.error().c_str();
-        return;
+        SharedMemory& resultMemory = c->resultMemory;
+        if(resultMemory.isAttached())
+            resultMemory.detach();
+
+        if(!resultMemory.create(resultMemorySize))
+        {
+            qDebug() << "Couldn't create result memory: " << resultMemory.error().c_str();
+            continue;
+        }
+
+        auto* resultPtr = static_cast<float*>(resultMemory.data());
+        memset(resultPtr, 0, resultMemorySize);
+    }
+}
+
+void BenchmarkManager::startFilters(const std::vector<Consumer*>& consumers)
+{
+    // The tiles of a renderer are only shared when there are several filters.
+    if(consumers.size() > 1)
+    {
+        m_fanOut = std::make_unique<TileFanOut>(static_cast<int>(m_consumers.size()), NUM_TILES,
+            [this](const std::vector<int64_t>& indices){ return releaseAndGetNextTile(indices); },
+            [this](const std::vector<int64_t>& indices){ releaseLastTiles(indices); },
+            [this](const std::vector<int64_t>& indices){ return cancelEvaluation(indices); },
+            [this](int consumer){ restoreLayout(*m_consumers[consumer]); });
+        for(auto& c: m_consumers)
+            if(std::find(consumers.begin(), consumers.end(), c.get()) == consumers.end())
+                m_fanOut->removeConsumer(c->id);
     }
 
-    auto* resultPtr = static_cast<float*>(m_resultMemory.data());
-    memset(resultPtr, 0, resultMemorySize);
+    for(Consumer* c: consumers)
+    {
+        c->process = std::make_unique<QProcess>();
+        QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+        env.insert(CONSUMER_ENV, QString::number(c->id));
+        c->process->setProcessEnvironment(env);
+        c->layout.reset();
+        c->layoutId = -1;
+        startProcess(c->filterPath, "", *c->process, getFilterLogFilename(*c));
+        c->execTime = 0;
+        c->timer.start();
+    }
+}
+
+void BenchmarkManager::restoreLayout(const Consumer& c)
+{
+    if(c.layoutId != -1)
+    {
+        m_renderClient->selectLayout(c.layoutId);
+        for(auto& client: m_shardClients)
+            client->selectLayout(c.layoutId);
+    }
+    else if(c.layout)
+    {
+        m_renderClient->setParameters(*c.layout);
+        for(auto& client: m_shardClients)
+            client->setParameters(*c.layout);
+    }
 }
 
-BenchmarkManager::ProcessExitStatus BenchmarkManager::startEventLoop(QProcess *renderer, QProcess *asr)
+void BenchmarkManager::startEventLoop(QProcess *renderer, const std::vector<Consumer*>& consumers)
 {
-    ProcessExitStatus exitType = FILTER_SUCCESS;
     QEventLoop eventLoop;
     void (QProcess::*finishedSignal)(int, QProcess::ExitStatus) = &QProcess::finished;
+    std::vector<QMetaObject::Connection> filterConnections;
+    size_t numRunning = consumers.size();
+    for(Consumer* c: consumers)
+        c->exitStatus = FILTER_SUCCESS;
 
-    m_rendererConnection = QObject::connect(renderer, finishedSignal, [&](int, QProcess::ExitStatus status)
+    // A crash of any renderer shard stops the filters.
+    auto onRendererFinished = [&](int, QProcess::ExitStatus status)
     {
-        if(status == QProcess::CrashExit && asr->state() == QProcess::Running)
+        if(status == QProcess::CrashExit && numRunning > 0)
         {
             qDebug() << "Rendering server crashed! Killing filter process trying next spp.";
-            QObject::disconnect(m_asrConnection);
-            asr->kill();
-            asr->waitForFinished();
-            exitType = RENDERER_CRASH;
+            for(auto& connection: filterConnections)
+                QObject::disconnect(connection);
+            for(Consumer* c: consumers)
+            {
+                if(c->process->state() == QProcess::NotRunning)
+                    continue;
+                c->process->kill();
+                c->process->waitForFinished();
+                c->exitStatus = RENDERER_CRASH;
+            }
             eventLoop.quit();
         }
-    });
+    };
+    m_rendererConnections.clear();
+    m_rendererConnections.push_back(QObject::connect(renderer, finishedSignal, onRendererFinished));
+    for(auto& shard: m_shardProcesses)
+        m_rendererConnections.push_back(QObject::connect(shard.get(), finishedSignal, onRendererFinished));
 
-    m_asrConnection = QObject::connect(asr, finishedSignal, [&](int exitCode, QProcess::ExitStatus status)
+    for(Consumer* c: consumers)
     {
-        QObject::disconnect(m_rendererConnection);
-        if(status == QProcess::NormalExit && exitCode != 0)
+        filterConnections.push_back(QObject::connect(c->process.get(), finishedSignal, [&, c](int exitCode, QProcess::ExitStatus status)
         {
-            qDebug() << "Filter finished with code != 0. Trying next spp.";
-            exitType = FILTER_ERROR;
+            if(status == QProcess::NormalExit && exitCode != 0)
+            {
+                qDebug() << "Filter finished with code != 0. Trying next spp.";
+                c->exitStatus = FILTER_ERROR;
+            }
+            else if(status == QProcess::CrashExit)
+            {
+                qDebug() << "Filter process crashed! Trying next scene.";
+                c->exitStatus = FILTER_CRASH;
+            }
+            // The other filters don't wait for it anymore.
+            if(m_fanOut)
+                m_fanOut->removeConsumer(c->id);
+            if(--numRunning == 0)
+            {
+                for(auto& connection: m_rendererConnections)
+                    QObject::disconnect(connection);
+                eventLoop.quit();
+            }
+        }));
+    }
+
+    eventLoop.exec();
+    for(auto& connection: m_rendererConnections)
+        QObject::disconnect(connection);
+    m_rendererConnections.clear();
+    for(auto& connection: filterConnections)
+        QObject::disconnect(connection);
+}
+
+bool BenchmarkManager::startRenderingServer(const QString& execPath, const QString& scenePath, QProcess& process)
+{
+    // Processes left by a crash of one of the shards.
+    stopRendererShards(false);
+    if(process.state() != QProcess::NotRunning)
+    {
+        process.kill();
+        process.waitForFinished();
+    }
+
+    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+    if(m_numShards > 1 && (!m_cacheDir.isEmpty() || env.contains(RECORD_ENV)))
+    {
+        // Each shard would keep only the samples of its rows.
+        qWarning() << "Sample recording and cache are not supported with renderer shards: rendering without them.";
+        env.remove(RECORD_ENV);
+    }
+    else if(!m_cacheDir.isEmpty())
+    {
+        QString cacheFile = getCacheFile(execPath, scenePath);
+        trimSampleCache(m_cacheDir, m_cacheMaxBytes, cacheFile);
+        // The modification time tells the least recently used files.
+        utime(cacheFile.toLocal8Bit().constData(), nullptr);
+        env.insert(CACHE_ENV, cacheFile);
+    }
+    if(m_tileTransport != TileTransport::SHARED_MEMORY)
+        env.insert(REMOTE_ENV, "127.0.0.1");
+    if(!startRendererProcess(execPath, scenePath, env, process, QString()))
+        return false;
+    m_renderClient = connectRenderer(0);
+
+    for(int shard = 1; shard < m_numShards; ++shard)
+    {
+        env.insert(SHARD_ENV, QString::number(shard));
+        auto shardProcess = std::make_unique<QProcess>();
+        QString logFilename = QFileInfo(execPath).baseName() + "_shard" + QString::number(shard) + ".log";
+        if(!startRendererProcess(execPath, scenePath, env, *shardProcess, logFilename))
+        {
+            stopRendererShards(false);
+            process.kill();
+            process.waitForFinished();
+            return false;
         }
-        else if(status == QProcess::CrashExit)
+        m_shardProcesses.push_back(std::move(shardProcess));
+        m_shardClients.push_back(connectRenderer(shard));
+    }
+    if(m_numShards > 1)
+    {
+        m_merger = std::make_unique<TileMerger>(static_cast<int>(m_shardClients.size() + 1), static_cast<int>(NUM_TILES),
+            [this](int shard, const std::vector<int64_t>& indices){ return getRenderClient(shard).releaseAndGetNextTile(indices); },
+            [this](int shard, const std::vector<int64_t>& indices){ getRenderClient(shard).releaseLastTiles(indices); },
+            [this](int shard, const std::vector<int64_t>& indices){ return getRenderClient(shard).cancelEvaluation(indices); });
+    }
+
+    // The new renderer has no registered layouts.
+    for(auto& c: m_consumers)
+    {
+        c->layouts.clear();
+        c->layout.reset();
+        c->layoutId = -1;
+    }
+    return true;
+}
+
+bool BenchmarkManager::startRendererProcess(const QString& execPath,
+                                            const QString& scenePath,
+                                            const QProcessEnvironment& env,
+                                            QProcess& process,
+                                            const QString& logFilename)
+{
+    // The renderer connects to the listener as soon as its server is ready (see READY_PORT_ENV).
+    ReadyListener listener;
+    QProcessEnvironment processEnv = env;
+    processEnv.insert(READY_PORT_ENV, QString::number(listener.port()));
+    process.setProcessEnvironment(processEnv);
+    startProcess(execPath, scenePath, process, logFilename);
+
+    while(!listener.wait(100))
+    {
+        if(process.waitForFinished(0))
         {
-            qDebug() << "Filter process crashed! Trying next scene.";
-            exitType = FILTER_CRASH;
+            qDebug() << "Rendering server " << execPath << " finished before becoming ready.";
+            return false;
         }
-        eventLoop.quit();
-    });
+    }
+    return true;
+}
 
-    eventLoop.exec();
-    return exitType;
+void BenchmarkManager::stopRendererShards(bool finish)
+{
+    m_merger.reset();
+    if(finish)
+    {
+        for(auto& client: m_shardClients)
+            client->finishRender();
+    }
+    m_shardClients.clear();
+    for(auto& process: m_shardProcesses)
+    {
+        process->kill();
+        process->waitForFinished();
+    }
+    m_shardProcesses.clear();
+}
+
+RenderClient& BenchmarkManager::getRenderClient(int shard)
+{
+    return shard == 0 ? *m_renderClient : *m_shardClients.at(shard - 1);
+}
+
+std::unique_ptr<RenderClient> BenchmarkManager::connectRenderer(int shard)
+{
+    auto client = std::make_unique<RenderClient>(getRenderingServerPort(m_session, shard), m_rendererHost);
+    if(m_tileTransport != TileTransport::SHARED_MEMORY)
+    {
+        client->openTileStream(m_tileTransport == TileTransport::TCP_LZ4,
+            [this](TileTarget target, int64_t offset, int64_t size){ return getStreamBuffer(target, offset, size); });
+    }
+    return client;
+}
+
+float* BenchmarkManager::getStreamBuffer(TileTarget target, int64_t offset, int64_t size)
+{
+    // The memory is allocated before the evaluation is requested, so it doesn't change while tiles arrive.
+    SharedMemory& memory = target == TileTarget::TILES ? m_tilesMemory : m_frameMemory;
+    if(offset < 0 || size < 0 || static_cast<size_t>(offset + size) * sizeof(float) > memory.size())
+        throw std::runtime_error("The streamed tile doesn't fit the " + memory.key() + " memory.");
+    return static_cast<float*>(memory.data()) + offset;
 }
 
-void BenchmarkManager::startProcess(const QString& execPath, const QString& arg, QProcess& process)
+QString BenchmarkManager::getCacheFile(const QString& rendererPath, const QString& scenePath) const
+{
+    // Changing the renderer or the scene invalidates the cached samples.
+    QFileInfo renderer(rendererPath);
+    QFileInfo scene(scenePath);
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    hash.addData(renderer.absoluteFilePath().toUtf8());
+    hash.addData(QByteArray::number(renderer.lastModified().toMSecsSinceEpoch()));
+    hash.addData(scene.absoluteFilePath().toUtf8());
+    hash.addData(QByteArray::number(scene.lastModified().toMSecsSinceEpoch()));
+    QString name = renderer.baseName() + "_" + scene.baseName() + "_" + hash.result().toHex().left(16) + ".fbksdrec";
+    return QFileInfo(m_cacheDir, name).absoluteFilePath();
+}
+
+void BenchmarkManager::trimSampleCache(const QString& dir, int64_t maxBytes, const QString& keep)
+{
+    // Most recently used first.
+    auto files = QDir(dir).entryInfoList({"*.fbksdrec"}, QDir::Files, QDir::Time);
+    int64_t totalBytes = 0;
+    for(const auto& file: files)
+    {
+        totalBytes += file.size();
+        if(totalBytes > maxBytes && file.absoluteFilePath() != keep)
+        {
+            totalBytes -= file.size();
+            QFile::remove(file.absoluteFilePath());
+        }
+    }
+}
+
+void BenchmarkManager::startProcess(const QString& execPath, const QString& arg, QProcess& process, const QString& logFilename)
 {
-    QString logFilename = QFileInfo(execPath).baseName().append(".log");
     process.setProcessChannelMode(QProcess::MergedChannels);
-    process.setStandardOutputFile(logFilename);
+    process.setStandardOutputFile(logFilename.isEmpty() ? QFileInfo(execPath).baseName().append(".log") : logFilename);
     process.setWorkingDirectory(QFileInfo(execPath).absolutePath());
     process.start(QFileInfo(execPath).absoluteFilePath(), {QFileInfo(arg).absoluteFilePath()}, QIODevice::ReadOnly | QIODevice::Truncate);
     if(!process.waitForStarted(-1))
@@ -495,8 +1246,16 @@ void BenchmarkManager::startProcess(const QString& execPath, const QString& arg,
     }
 }
 
+QString BenchmarkManager::getFilterLogFilename(const Consumer& c) const
+{
+    // Filters sharing a renderer may have the same executable name.
+    QString name = QFileInfo(c.filterPath).baseName();
+    if(c.id > 0)
+        name.append("_" + QString::number(c.id));
+    return name.append(".log");
+}
 
-void BenchmarkManager::saveResult(const QString& filename, bool aborted)
+void BenchmarkManager::saveResult(Consumer& c, const QString& filename, bool aborted)
 {
     // Write execution time log
     QFile file(filename + "_log.json");
@@ -508,12 +1267,12 @@ void BenchmarkManager::saveResult(const QString& filename, bool aborted)
         logObj["date"] = QDateTime::currentDateTime().toString();
         logObj["spp_budget"] = static_cast<qint64>(m_currentSceneInfo.get<int64_t>("max_spp"));
         logObj["samples_budget"] = static_cast<qint64>(getInitSampleBudget(m_currentSceneInfo));
-        logObj["used_samples"] = static_cast<qint64>(getInitSampleBudget(m_currentSceneInfo) - m_currentSampleBudget);
+        logObj["used_samples"] = static_cast<qint64>(getInitSampleBudget(m_currentSceneInfo) - c.sampleBudget);
         logObj["aborted"] = aborted;
         int h, m, s, ms;
         {
             QJsonObject execTimeObj;
-            int time = aborted ? 0 : m_currentExecTime;
+            int time = aborted ? 0 : c.execTime;
             execTimeObj["time_ms"] = time;
             convertMillisecons(time, &h, &m, &s, &ms);
             execTimeObj["time_str"] = QTime(h, m, s, ms).toString("hh:mm:ss.zzz");
@@ -524,7 +1283,7 @@ void BenchmarkManager::saveResult(const QString& filename, bool aborted)
     }
 
     // Write resulting image
-    auto result = static_cast<float*>(m_resultMemory.data());
+    auto result = static_cast<float*>(c.resultMemory.data());
     int64_t xres, yres;
     getResolution(m_currentSceneInfo, &xres, &yres);
     saveExr((filename + ".exr").toStdString(), result, xres, yres);
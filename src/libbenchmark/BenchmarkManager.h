@@ -15,8 +15,11 @@
 #include "RenderClient.h"
 #include "CfgParser.h"
 
+#include <functional>
+#include <map>
 #include <memory>
 #include <QObject>
+#include <QStringList>
 #include <QTime>
 #include <QProcess>
 #include <QEventLoop>
@@ -25,11 +28,29 @@ namespace fbksd
 {
 
 class BenchmarkServer;
+class TileFanOut;
+class TileMerger;
 
 
 class BenchmarkManager
 {
 public:
+    /**
+     * \brief How the tiles of the renderer get to the tiles memory of the manager.
+     */
+    enum class TileTransport
+    {
+        SHARED_MEMORY, ///< The renderer writes the tiles in the tiles memory (same host).
+        TCP,           ///< The renderer streams the tiles over TCP (see REMOTE_ENV).
+        TCP_LZ4        ///< As TCP, with the tiles compressed with LZ4.
+    };
+
+    /**
+     * @brief Creates a manager for the session of the current process (see getSessionId()).
+     *
+     * The session determines the ports and shared memory keys used by the manager. The renderer
+     * and filter processes started by the manager inherit the session.
+     */
     BenchmarkManager();
 
     ~BenchmarkManager();
@@ -38,6 +59,8 @@ public:
      * @brief runPassive
      *
      * @pre Rendering server started.
+     *
+     * The rendering server may run in another host (see setRendererHost()).
      */
     void runPassive(int spp);
 
@@ -58,6 +81,25 @@ public:
                   int n,
                   int spp);
 
+    /**
+     * \brief Runs the benchmark for several filters at once, feeding all of them with the same samples.
+     *
+     * Each filter is a consumer (see CONSUMER_ENV) of the same renderer: an evaluation is rendered once and
+     * its tiles are given to every filter (see TileFanOut). Filters that make the same requests share them; a
+     * filter that makes a different request (e.g. an adaptive one) gets its own evaluations from then on. Budget and execution
+     * time are accounted per filter. As with a single filter, the time a filter waits for tiles (for the
+     * renderer, or for the others to release shared tiles) is not part of its execution time.
+     *
+     * \param filterPaths   Paths of the filter executables (up to MAX_CONSUMERS)
+     * \param resultPaths   Paths of the folders where to save the results of each filter
+     */
+    void runScene(const QString& rendererPath,
+                  const QString& scenePath,
+                  const QStringList& filterPaths,
+                  const QStringList& resultPaths,
+                  int n,
+                  int spp);
+
     /**
      * \brief Runs the benchmark for all renderers/scenes in the configuration file.
      */
@@ -67,6 +109,75 @@ public:
                 int n,
                 bool resume = false);
 
+    /**
+     * \brief Runs the benchmark for all renderers/scenes in the configuration file, for several filters at once.
+     *
+     * See runScene() for how the filters share the samples. With `resume`, a filter is skipped for the scenes
+     * that already have results in its folder.
+     */
+    void runAll(const QString& configPath,
+                const QStringList& filterPaths,
+                const QStringList& resultPaths,
+                int n,
+                bool resume = false);
+
+    /**
+     * \brief Enables the sample cache.
+     *
+     * The samples rendered for each renderer and scene are kept in a file in `dir` (see CACHE_ENV), so that
+     * later runs requesting the same evaluations (e.g. other filters with the same configuration) are served
+     * from the cache instead of being rendered again. When the files exceed `maxBytes`, the least recently
+     * used ones are removed.
+     *
+     * The index of the run (see runScene()'s `n`) is part of the cache key, so repeated runs get different samples,
+     * and each of them shares its samples with the runs of the same index of other filters.
+     */
+    void setSampleCache(const QString& dir, int64_t maxBytes);
+
+    /**
+     * \brief Renders each scene with several instances (shards) of the renderer.
+     *
+     * Each shard is a renderer process with its own id (see SHARD_ENV), and renders a band of rows of the image:
+     * SPP requests and region requests are split among the shards as region requests (see TileMerger). Their tiles
+     * are merged in the single stream seen by the filters, and the budget is accounted as with one renderer.
+     * Requests that can't be split (remaining samples, frames, renderers without region support) are
+     * rendered by shard 0 alone. Input samples, sample recording and the sample cache are not supported with shards.
+     *
+     * @throws std::invalid_argument if `numShards` is not in the [1, MAX_SHARDS] range.
+     */
+    void setNumRendererShards(int numShards);
+
+    /**
+     * \brief Sets how the tiles get from the renderer to the manager.
+     *
+     * With a TCP transport, the renderers started by the manager are remote (see REMOTE_ENV) and listen on the
+     * loopback interface. Input samples are not supported with them.
+     */
+    void setTileTransport(TileTransport transport);
+
+    /**
+     * \brief Sets the host of the rendering server used by runPassive().
+     *
+     * The server must be a remote rendering server (see REMOTE_ENV) and the transport TCP or TCP_LZ4.
+     */
+    void setRendererHost(const std::string& host);
+
+    /**
+     * \brief Clips the windows of a region request to the image.
+     *
+     * Empty windows and the parts that overlap previous windows are removed, so each pixel is sampled
+     * at most once per request.
+     */
+    static std::vector<CropWindow> clipWindows(const std::vector<CropWindow>& windows, int64_t width, int64_t height);
+
+    /**
+     * \brief Removes the least recently used (by modification time) record files of the cache directory `dir`,
+     * until the remaining ones fit in `maxBytes`.
+     *
+     * The file `keep` is never removed, even if it doesn't fit.
+     */
+    static void trimSampleCache(const QString& dir, int64_t maxBytes, const QString& keep);
+
 
 private:
     enum ProcessExitStatus
@@ -77,39 +188,111 @@ private:
         RENDERER_CRASH
     };
 
-    void allocateTilesMemory(int spp);
+    // A filter fed by the renderer, with its own benchmark server and result memory (see CONSUMER_ENV).
+    struct Consumer
+    {
+        Consumer(int session, int id);
+
+        int id = 0;
+        QString filterPath;
+        QString resultPath;
+        std::unique_ptr<BenchmarkServer> server;
+        SharedMemory resultMemory;
+        std::unique_ptr<QProcess> process;
+        ProcessExitStatus exitStatus = FILTER_SUCCESS;
+        std::map<int, SampleLayout> layouts; // registered layouts, by id (same ids as the renderer)
+        std::unique_ptr<SampleLayout> layout; // current layout
+        int layoutId = -1; // id of the current layout, if it was selected among the registered ones
+        QTime timer; // tracks the technique execution time (accumulated in execTime)
+        int execTime = 0;
+        int64_t sampleBudget = 0;
+        int64_t evalNumSamples = 0; // samples debited by the current evaluation
+        bool evalFeaturesOnly = false; // the current evaluation is charged at the features-only cost
+        int sampleSize = 0;
+        bool pixelStatistics = false;
+        bool featuresOnly = false; // the current layout is features-only (and supported)
+    };
+
+    Consumer& addConsumer();
+    void setupConsumers(const QStringList& filterPaths, const QStringList& resultPaths);
+    void startFilters(const std::vector<Consumer*>& consumers);
+    void restoreLayout(const Consumer& c);
+    void fetchRendererInfo();
+    int64_t getSamplesCost(const Consumer& c, int64_t numSamples) const;
+    int64_t getAffordableSamples(const Consumer& c) const;
+    void allocateTilesMemory(const Consumer& c, int spp);
+    void allocateFrameMemory(const Consumer& c, int64_t spp);
     void allocateResultShm(int64_t);
-    ProcessExitStatus startEventLoop(QProcess* renderer, QProcess* asr);
-    void startProcess(const QString& execPath, const QString& arg, QProcess& process);
-    void saveResult(const QString& filename, bool aborted);
+    void startEventLoop(QProcess* renderer, const std::vector<Consumer*>& consumers);
+    void startProcess(const QString& execPath, const QString& arg, QProcess& process, const QString& logFilename = QString());
+    QString getFilterLogFilename(const Consumer& c) const;
+    bool startRenderingServer(const QString& execPath, const QString& scenePath, QProcess& process);
+    bool startRendererProcess(const QString& execPath,
+                              const QString& scenePath,
+                              const QProcessEnvironment& env,
+                              QProcess& process,
+                              const QString& logFilename);
+    void stopRendererShards(bool finish);
+    RenderClient& getRenderClient(int shard);
+    std::unique_ptr<RenderClient> connectRenderer(int shard);
+    float* getStreamBuffer(TileTarget target, int64_t offset, int64_t size);
+    QString getCacheFile(const QString& rendererPath, const QString& scenePath) const;
+    void saveResult(Consumer& c, const QString& filename, bool aborted);
+
+    // Requests to the renderer. With several consumers, they go through the fan-out.
+    int64_t request(Consumer& c, const std::string& key, const std::function<int64_t()>& call);
+    TilePkg evaluate(Consumer& c, const std::string& key, const std::function<TilePkg()>& call);
+
+    // Evaluations and tile requests to the renderer. With several shards, they go through the merger.
+    TilePkg evaluateShards(int64_t spp, const std::vector<CropWindow>& windows);
+    TilePkg evaluateFirstShard(const std::function<TilePkg()>& call);
+    TilePkg releaseAndGetNextTile(const std::vector<int64_t>& consumedTileIndices);
+    void releaseLastTiles(const std::vector<int64_t>& consumedTileIndices);
+    int64_t cancelEvaluation(const std::vector<int64_t>& consumedTileIndices);
 
     // Methods used by the BenchmarkServer
-    SceneInfo onGetSceneInfo();
-    int onSetSampleLayout(const SampleLayout& layout);
-    TilePkg onEvaluateSamples(bool isSPP, int64_t numSamples);
-    TilePkg onEvaluateInputSamples(bool isSPP, int64_t numSamples);
-    void onLastTileConsumed(int64_t prevTileIndex);
-    void onSendResult();
-
-    std::unique_ptr<BenchmarkServer> m_benchmarkServer;
+    SceneInfo onGetSceneInfo(Consumer& c);
+    int onSetSampleLayout(Consumer& c, const SampleLayout& layout);
+    int onRegisterSampleLayout(Consumer& c, const SampleLayout& layout);
+    bool onSelectSampleLayout(Consumer& c, int id);
+    TilePkg onEvaluateSamples(Consumer& c, bool isSPP, int64_t numSamples);
+    TilePkg onEvaluateInputSamples(Consumer& c, bool isSPP, int64_t numSamples);
+    TilePkg onEvaluateRegions(Consumer& c, int64_t spp, std::vector<CropWindow> windows);
+    TilePkg onEvaluateFrame(Consumer& c, int64_t spp);
+    TilePkg onGetNextTile(Consumer& c, int64_t prevTileIndex);
+    TilePkg onGetNextInputTile(Consumer& c, int64_t prevTileIndex, bool prevWasInput);
+    void onLastTileConsumed(Consumer& c, int64_t prevTileIndex);
+    TilePkg onReleaseAndGetNextTile(Consumer& c, const std::vector<int64_t>& consumedTileIndices);
+    void onReleaseLastTiles(Consumer& c, const std::vector<int64_t>& consumedTileIndices);
+    int64_t onCancelEvaluation(Consumer& c, const std::vector<int64_t>& consumedTileIndices);
+    void onSendResult(Consumer& c);
+
+    int m_session = 0;
+    std::vector<std::unique_ptr<Consumer>> m_consumers; // consumer 0 always exists
+    std::unique_ptr<TileFanOut> m_fanOut; // set while several consumers run
     BenchmarkConfig m_config;
     int m_currentRenderIndex = 0;
     int m_currentSceneIndex = 0;
     int m_currentSppIndex = 0;
-    int64_t m_currentSampleBudget = 0;
-    int m_currentSampleSize = 0;
+    bool m_supportsFeaturesOnly = false; // the renderer evaluates features-only layouts cheaply
+    bool m_supportsRegions = false; // the renderer evaluates regions
     int m_tileSize = 0;
     SceneInfo m_currentSceneInfo;
     SharedMemory m_tilesMemory;
-    SharedMemory m_resultMemory;
+    SharedMemory m_frameMemory;
 
-    QMetaObject::Connection m_rendererConnection;
-    QMetaObject::Connection m_asrConnection;
+    std::vector<QMetaObject::Connection> m_rendererConnections;
 
-    std::unique_ptr<RenderClient> m_renderClient;
-    QTime m_timer; // tracks the technique execution time (accumulated in m_currentExecTime)
-    int m_currentExecTime = 0;
+    std::unique_ptr<RenderClient> m_renderClient; // shard 0
+    int m_numShards = 1;
+    std::vector<std::unique_ptr<QProcess>> m_shardProcesses; // shards 1 and up
+    std::vector<std::unique_ptr<RenderClient>> m_shardClients; // shards 1 and up
+    std::unique_ptr<TileMerger> m_merger; // set while several shards run
+    TileTransport m_tileTransport = TileTransport::SHARED_MEMORY;
+    std::string m_rendererHost = "127.0.0.1";
     bool m_passiveMode = false;
+    QString m_cacheDir; // sample cache directory (empty if disabled)
+    int64_t m_cacheMaxBytes = 0;
 };
 
 } // namespace fbksd
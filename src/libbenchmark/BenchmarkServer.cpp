@@ -10,12 +10,13 @@
 #include "BenchmarkServer.h"
 #include "BenchmarkManager.h"
 #include "version.h"
+#include "fbksd/core/session.h"
 #include <rpc/server.h>
 using namespace fbksd;
 
 
-BenchmarkServer::BenchmarkServer():
-    m_server(std::make_unique<rpc::server>("127.0.0.1", 2226))
+BenchmarkServer::BenchmarkServer(int consumer):
+    m_server(std::make_unique<rpc::server>("127.0.0.1", getBenchmarkServerPort(getSessionId(), consumer)))
 {
     m_server->bind("GET_VERSION", []()
     { return std::make_pair(FBKSD_VERSION_MAJOR, FBKSD_VERSION_MINOR); });
@@ -35,12 +36,32 @@ void BenchmarkServer::onSetParameters(const SetParameters& callback)
     m_server->bind("SET_SAMPLE_LAYOUT", callback);
 }
 
+void BenchmarkServer::onRegisterSampleLayout(const RegisterSampleLayout& callback)
+{
+    m_server->bind("REGISTER_SAMPLE_LAYOUT", callback);
+}
+
+void BenchmarkServer::onSelectSampleLayout(const SelectSampleLayout& callback)
+{
+    m_server->bind("SELECT_SAMPLE_LAYOUT", callback);
+}
+
 void BenchmarkServer::onEvaluateSamples(const EvaluateSamples& callback)
 {
     m_evalSamplesSet = true;
     m_server->bind("EVALUATE_SAMPLES", callback);
 }
 
+void BenchmarkServer::onEvaluateRegions(const EvaluateRegions& callback)
+{
+    m_server->bind("EVALUATE_REGIONS", callback);
+}
+
+void BenchmarkServer::onEvaluateFrame(const EvaluateFrame& callback)
+{
+    m_server->bind("EVALUATE_FRAME", callback);
+}
+
 void BenchmarkServer::onGetNextTile(const GetNextTile &callback)
 {
     m_getNextTile = true;
@@ -63,6 +84,21 @@ void BenchmarkServer::onLastTileConsumed(const LastTileConsumed &callback)
     m_server->bind("LAST_TILE_CONSUMED", callback);
 }
 
+void BenchmarkServer::onReleaseAndGetNextTile(const ReleaseAndGetNextTile& callback)
+{
+    m_server->bind("RELEASE_AND_GET_NEXT_TILE", callback);
+}
+
+void BenchmarkServer::onReleaseLastTiles(const ReleaseLastTiles& callback)
+{
+    m_server->bind("RELEASE_LAST_TILES", callback);
+}
+
+void BenchmarkServer::onCancelEvaluation(const CancelEvaluation& callback)
+{
+    m_server->bind("CANCEL_EVALUATION", callback);
+}
+
 void BenchmarkServer::onSendResult(const SendResult& callback)
 {
     m_sendResultSet = true;
@@ -12,6 +12,7 @@
 
 #include "fbksd/core/definitions.h"
 #include <functional>
+#include <vector>
 
 namespace rpc { class server; }
 
@@ -35,18 +36,35 @@ public:
         = std::function<SceneInfo()>;
     using SetParameters
         = std::function<void(const SampleLayout& layout)>;
+    using RegisterSampleLayout
+        = std::function<int(const SampleLayout& layout)>;
+    using SelectSampleLayout
+        = std::function<bool(int id)>;
     using EvaluateSamples
         = std::function<TilePkg(bool isSPP, int64_t numSamples)>;
+    using EvaluateRegions
+        = std::function<TilePkg(int64_t spp, const std::vector<CropWindow>& windows)>;
+    using EvaluateFrame
+        = std::function<TilePkg(int64_t spp)>;
     using GetNextTile
         = std::function<TilePkg(int64_t prevTileIndex)>;
     using GetNextInputTile
         = std::function<TilePkg(int64_t prevTileIndex, bool prevWasInput)>;
     using LastTileConsumed
         = std::function<void(int64_t tileIndex)>;
+    using ReleaseAndGetNextTile
+        = std::function<TilePkg(const std::vector<int64_t>& consumedTileIndices)>;
+    using ReleaseLastTiles
+        = std::function<void(const std::vector<int64_t>& consumedTileIndices)>;
+    using CancelEvaluation
+        = std::function<int64_t(const std::vector<int64_t>& consumedTileIndices)>;
     using SendResult
         = std::function<void()>;
 
-    BenchmarkServer();
+    /**
+     * @brief Creates the server of the given consumer (see CONSUMER_ENV) of the current session.
+     */
+    explicit BenchmarkServer(int consumer = 0);
 
     ~BenchmarkServer();
 
@@ -54,8 +72,16 @@ public:
 
     void onSetParameters(const SetParameters& callback);
 
+    void onRegisterSampleLayout(const RegisterSampleLayout& callback);
+
+    void onSelectSampleLayout(const SelectSampleLayout& callback);
+
     void onEvaluateSamples(const EvaluateSamples& callback);
 
+    void onEvaluateRegions(const EvaluateRegions& callback);
+
+    void onEvaluateFrame(const EvaluateFrame& callback);
+
     void onGetNextTile(const GetNextTile& callback);
 
     void onEvaluateInputSamples(const EvaluateSamples& callback);
@@ -64,6 +90,12 @@ public:
 
     void onLastTileConsumed(const LastTileConsumed& callback);
 
+    void onReleaseAndGetNextTile(const ReleaseAndGetNextTile& callback);
+
+    void onReleaseLastTiles(const ReleaseLastTiles& callback);
+
+    void onCancelEvaluation(const CancelEvaluation& callback);
+
     void onSendResult(const SendResult& callback);
 
     void run();
@@ -14,8 +14,9 @@
 using namespace fbksd;
 
 
-RenderClient::RenderClient(int port):
-    m_client(std::make_unique<rpc::client>("127.0.0.1", port))
+RenderClient::RenderClient(int port, const std::string& host):
+    m_client(std::make_unique<rpc::client>(host, port)),
+    m_host(host)
 {
     auto version = m_client->call("GET_VERSION").as<std::pair<int,int>>();
     if(version.first != FBKSD_VERSION_MAJOR)
@@ -44,14 +45,52 @@ void RenderClient::setParameters(const SampleLayout& layout)
     m_client->call("SET_PARAMETERS", layout);
 }
 
+int RenderClient::registerLayout(const SampleLayout& layout)
+{
+    return m_client->call("REGISTER_LAYOUT", layout).as<int>();
+}
+
+bool RenderClient::supportsFeaturesOnly()
+{
+    return m_client->call("SUPPORTS_FEATURES_ONLY").as<bool>();
+}
+
+bool RenderClient::supportsRegions()
+{
+    return m_client->call("SUPPORTS_REGIONS").as<bool>();
+}
+
+void RenderClient::openTileStream(bool compress, const TileStreamReceiver::GetBuffer& getBuffer)
+{
+    m_stream.reset();
+    auto port = m_client->call("OPEN_TILE_STREAM", compress).as<unsigned short>();
+    m_stream = std::make_unique<TileStreamReceiver>(m_host, port, getBuffer);
+    m_numTiles = 0;
+}
+
+void RenderClient::selectLayout(int id)
+{
+    m_client->call("SELECT_LAYOUT", id);
+}
+
 TilePkg RenderClient::evaluateSamples(int64_t spp, int64_t remainintCount)
 {
-    return m_client->call("EVALUATE_SAMPLES", spp, remainintCount).as<TilePkg>();
+    return receive(m_client->call("EVALUATE_SAMPLES", spp, remainintCount).as<TilePkg>());
+}
+
+TilePkg RenderClient::evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows)
+{
+    return receive(m_client->call("EVALUATE_REGIONS", spp, windows).as<TilePkg>());
+}
+
+TilePkg RenderClient::evaluateFrame(int64_t spp)
+{
+    return receive(m_client->call("EVALUATE_FRAME", spp).as<TilePkg>());
 }
 
 TilePkg RenderClient::getNextTile(int64_t prevTileIndex)
 {
-    return m_client->call("GET_NEXT_TILE", prevTileIndex).as<TilePkg>();
+    return receive(m_client->call("GET_NEXT_TILE", prevTileIndex).as<TilePkg>());
 }
 
 TilePkg RenderClient::evaluateInputSamples(int64_t spp, int64_t remainingCount)
@@ -69,7 +108,35 @@ void RenderClient::lastTileConsumed(int64_t prevTileIndex)
     m_client->call("LAST_TILE_CONSUMED", prevTileIndex);
 }
 
+TilePkg RenderClient::releaseAndGetNextTile(const std::vector<int64_t>& consumedTileIndices)
+{
+    return receive(m_client->call("RELEASE_AND_GET_NEXT_TILE", consumedTileIndices).as<TilePkg>());
+}
+
+void RenderClient::releaseLastTiles(const std::vector<int64_t>& consumedTileIndices)
+{
+    m_client->call("RELEASE_LAST_TILES", consumedTileIndices);
+}
+
+int64_t RenderClient::cancelEvaluation(const std::vector<int64_t>& consumedTileIndices)
+{
+    return m_client->call("CANCEL_EVALUATION", consumedTileIndices).as<int64_t>();
+}
+
+void RenderClient::beginRun(int seed)
+{
+    m_client->call("BEGIN_RUN", seed);
+}
+
 void RenderClient::finishRender()
 {
     m_client->async_call("FINISH_RENDER");
 }
+
+TilePkg RenderClient::receive(const TilePkg& pkg)
+{
+    // The renderer sends the data of each tile it returns, in order.
+    if(m_stream && pkg.isValid)
+        m_stream->waitTiles(++m_numTiles);
+    return pkg;
+}
@@ -11,7 +11,9 @@
 #define RENDERCLIENT_H
 
 #include "fbksd/core/definitions.h"
+#include "fbksd/core/TileTransport.h"
 
+#include <memory>
 #include <vector>
 #include <string>
 
@@ -30,7 +32,10 @@ class BenchmarkManager;
 class RenderClient
 {
 public:
-    RenderClient(int port);
+    /**
+     * @brief Connects to the rendering server listening to `port` in `host`.
+     */
+    RenderClient(int port, const std::string& host = "127.0.0.1");
 
     ~RenderClient();
 
@@ -54,11 +59,49 @@ public:
      */
     void setParameters(const SampleLayout& layout);
 
+    /**
+     * \brief Registers a layout to be selected later with selectLayout(). Returns its id.
+     */
+    int registerLayout(const SampleLayout& layout);
+
+    /**
+     * \brief Returns true if the renderer evaluates features-only layouts cheaply.
+     */
+    bool supportsFeaturesOnly();
+
+    /**
+     * \brief Returns true if the renderer supports region evaluation (see evaluateRegions()).
+     */
+    bool supportsRegions();
+
+    /**
+     * \brief Makes a remote renderer send its tiles through TCP (see REMOTE_ENV).
+     *
+     * The tiles are written to the memory given by `getBuffer`. From then on, the methods that return tiles
+     * only return once the data of the tile was received.
+     */
+    void openTileStream(bool compress, const TileStreamReceiver::GetBuffer& getBuffer);
+
+    /**
+     * \brief Makes the registered layout `id` the current layout.
+     */
+    void selectLayout(int id);
+
     /**
      * \brief Compute the samples values for the given samples positions.
      */
     TilePkg evaluateSamples(int64_t spp, int64_t remainingCount);
 
+    /**
+     * \brief Compute samples only inside the given windows.
+     */
+    TilePkg evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows);
+
+    /**
+     * \brief Compute `spp` samples for each pixel, written at their final position in the frame memory.
+     */
+    TilePkg evaluateFrame(int64_t spp);
+
     TilePkg getNextTile(int64_t prevTileIndex);
 
     TilePkg evaluateInputSamples(int64_t spp, int64_t remainingCount);
@@ -67,13 +110,45 @@ public:
 
     void lastTileConsumed(int64_t prevTileIndex);
 
+    /**
+     * @brief Releases the given consumed tiles (in any order) and returns the next tile.
+     */
+    TilePkg releaseAndGetNextTile(const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * @brief Releases the given consumed tiles, finishing the current evaluation.
+     */
+    void releaseLastTiles(const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * @brief Cancels the current evaluation, releasing the given consumed tiles.
+     *
+     * Blocks until the renderer stops working on the evaluation.
+     *
+     * @return Number of samples delivered to the client before the cancellation.
+     */
+    int64_t cancelEvaluation(const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * \brief Tells the renderer that a new filter execution starts.
+     *
+     * With the sample cache enabled (see CACHE_ENV), the evaluations rendered so far can be served from the cache again,
+     * to runs with the same `seed` (the index of the run).
+     */
+    void beginRun(int seed);
+
     /**
      * \brief Finishes the rendering system for the current scene.
      */
     void finishRender();
 
 private:
+    TilePkg receive(const TilePkg& pkg);
+
     std::unique_ptr<rpc::client> m_client;
+    std::string m_host;
+    std::unique_ptr<TileStreamReceiver> m_stream;
+    int64_t m_numTiles = 0; // tiles sent through the stream so far
 };
 
 } // namespace fbksd
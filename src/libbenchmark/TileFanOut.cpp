@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "TileFanOut.h"
+using namespace fbksd;
+
+#include <algorithm>
+
+
+TileFanOut::TileFanOut(int numConsumers,
+                       int numSlots,
+                       const ReleaseAndGetNextTile& getNextTile,
+                       const ReleaseLastTiles& releaseLastTiles,
+                       const CancelEvaluation& cancelEvaluation,
+                       const RestoreState& restoreState):
+    m_getNextTile(getNextTile),
+    m_releaseLastTiles(releaseLastTiles),
+    m_cancelEvaluation(cancelEvaluation),
+    m_restoreState(restoreState),
+    m_numSlots(numSlots),
+    m_consumers(numConsumers)
+{}
+
+int64_t TileFanOut::request(int consumer, const std::string& key, const std::function<int64_t()>& call)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    checkConsumer(consumer);
+    const Consumer& c = m_consumers[consumer];
+    size_t step = c.step;
+    if(!beginStep(consumer, key, lock))
+        return m_steps[step].result;
+
+    int64_t result = 0;
+    std::string error = callRenderer(consumer, lock, [&](){ result = call(); });
+    if(!c.solo)
+    {
+        m_steps[step].result = result;
+        m_steps[step].error = error;
+        m_steps[step].done = true;
+    }
+    m_changed.notify_all();
+    if(!error.empty())
+        throw std::runtime_error(error);
+    return result;
+}
+
+TilePkg TileFanOut::evaluate(int consumer, const std::string& key, const std::function<TilePkg()>& call)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    checkConsumer(consumer);
+    const Consumer& c = m_consumers[consumer];
+    size_t step = c.step;
+    bool started = false;
+    if(beginStep(consumer, key, lock))
+    {
+        TilePkg first;
+        std::string error = callRenderer(consumer, lock, [&](){ first = call(); });
+        if(!c.solo)
+        {
+            m_steps[step].result = first.isValid;
+            m_steps[step].error = error;
+            m_steps[step].done = true;
+        }
+        if(first.isValid)
+            beginEvaluation(first, c.solo ? consumer : -1);
+        m_changed.notify_all();
+        if(!error.empty())
+            throw std::runtime_error(error);
+        started = first.isValid;
+    }
+    else
+        started = m_steps[step].result != 0;
+
+    // The request didn't start an evaluation (e.g. no samples).
+    if(!started)
+        return {};
+    return nextTile(consumer, lock);
+}
+
+TilePkg TileFanOut::releaseAndGetNextTile(int consumer, const std::vector<int64_t>& consumedTileIndices)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    checkConsumer(consumer);
+    release(consumer, consumedTileIndices);
+    return nextTile(consumer, lock);
+}
+
+void TileFanOut::releaseLastTiles(int consumer, const std::vector<int64_t>& consumedTileIndices)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    checkConsumer(consumer);
+    release(consumer, consumedTileIndices);
+    detach(consumer, lock);
+}
+
+int64_t TileFanOut::cancelEvaluation(int consumer, const std::vector<int64_t>& consumedTileIndices)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    checkConsumer(consumer);
+    release(consumer, consumedTileIndices);
+    int64_t numSamples = m_consumers[consumer].attached ? m_consumers[consumer].numSamples : 0;
+    detach(consumer, lock);
+    return numSamples;
+}
+
+void TileFanOut::removeConsumer(int consumer)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    checkConsumer(consumer);
+    if(!m_consumers[consumer].active)
+        return;
+    m_consumers[consumer].active = false;
+    try
+    {
+        detach(consumer, lock);
+    }
+    catch(const std::exception&)
+    {
+        // The renderer failed: the other consumers get the error in their own requests.
+    }
+    m_changed.notify_all();
+}
+
+bool TileFanOut::beginStep(int consumer, const std::string& key, std::unique_lock<std::mutex>& lock)
+{
+    Consumer& c = m_consumers[consumer];
+    // A new request waits for the current one, and for the current evaluation to be finished by all consumers.
+    auto idle = [&](){ return !c.active || (!m_busy && !m_evaluating); };
+    m_changed.wait(lock, [&]()
+    {
+        if(!c.solo && c.active && c.step < m_steps.size())
+            return m_steps[c.step].done;
+        return idle();
+    });
+    if(!c.active)
+        throw std::logic_error("The consumer was removed from the fan-out.");
+
+    if(!c.solo && c.step < m_steps.size())
+    {
+        const Step& step = m_steps[c.step];
+        if(step.key == key)
+        {
+            ++c.step;
+            if(!step.error.empty())
+                throw std::runtime_error(step.error);
+            return false;
+        }
+
+        // The consumer diverged from the group: it leaves the current evaluation, and waits for the renderer.
+        c.solo = true;
+        detach(consumer, lock);
+        m_changed.notify_all();
+        m_changed.wait(lock, idle);
+        if(!c.active)
+            throw std::logic_error("The consumer was removed from the fan-out.");
+    }
+    if(c.solo)
+    {
+        m_busy = true;
+        return true;
+    }
+
+    Step step;
+    step.key = key;
+    m_steps.push_back(step);
+    ++c.step;
+    m_busy = true;
+    return true;
+}
+
+std::string TileFanOut::callRenderer(int consumer, std::unique_lock<std::mutex>& lock, const std::function<void()>& call)
+{
+    // The renderer has the layout of the last party that made a request.
+    const int owner = m_consumers[consumer].solo ? consumer : -1;
+    const bool restore = owner != m_stateOwner;
+    m_stateOwner = owner;
+
+    lock.unlock();
+    std::string error;
+    try
+    {
+        if(restore)
+            m_restoreState(consumer);
+        call();
+    }
+    catch(const std::exception& e) { error = e.what(); }
+    lock.lock();
+    m_busy = false;
+    return error;
+}
+
+void TileFanOut::beginEvaluation(const TilePkg& first, int solo)
+{
+    m_evaluating = true;
+    m_entries.clear();
+    m_live.clear();
+    m_numAttached = 0;
+    for(size_t i = 0; i < m_consumers.size(); ++i)
+    {
+        Consumer& c = m_consumers[i];
+        // A solo evaluation is only given to its consumer, and a group evaluation to the group.
+        c.attached = c.active && (solo == -1 ? !c.solo : static_cast<int>(i) == solo);
+        c.nextTile = 0;
+        c.held.clear();
+        c.numSamples = 0;
+        if(c.attached)
+            ++m_numAttached;
+    }
+    addEntry(first);
+}
+
+void TileFanOut::addEntry(const TilePkg& pkg)
+{
+    Entry entry;
+    entry.pkg = pkg;
+    entry.refs = m_numAttached;
+    m_entries.push_back(entry);
+    if(entry.refs > 0)
+        m_live[pkg.tile.index] = m_entries.size() - 1;
+    else
+        m_released.push_back(pkg.tile.index);
+}
+
+TilePkg TileFanOut::nextTile(int consumer, std::unique_lock<std::mutex>& lock)
+{
+    Consumer& c = m_consumers[consumer];
+    while(true)
+    {
+        if(!c.active)
+            throw std::logic_error("The consumer was removed from the fan-out.");
+        if(!c.attached)
+            throw std::logic_error("The consumer has no evaluation in progress.");
+
+        if(c.nextTile < m_entries.size())
+        {
+            TilePkg pkg = m_entries[c.nextTile++].pkg;
+            c.held.push_back(pkg.tile.index);
+            c.numSamples += pkg.tile.numSamples;
+            return pkg;
+        }
+        if(!m_entries.back().pkg.hasNext)
+            throw std::logic_error("The evaluation has no more tiles.");
+
+        // While all slots are held by consumers, the renderer can't give another tile.
+        if(!m_busy && static_cast<int>(m_live.size()) < m_numSlots)
+        {
+            m_busy = true;
+            std::vector<int64_t> released;
+            released.swap(m_released);
+            lock.unlock();
+            TilePkg pkg;
+            try { pkg = m_getNextTile(released); }
+            catch(...)
+            {
+                lock.lock();
+                m_busy = false;
+                m_changed.notify_all();
+                throw;
+            }
+            lock.lock();
+            m_busy = false;
+            addEntry(pkg);
+            m_changed.notify_all();
+            continue;
+        }
+        m_changed.wait(lock);
+    }
+}
+
+void TileFanOut::release(int consumer, const std::vector<int64_t>& indices)
+{
+    Consumer& c = m_consumers[consumer];
+    for(auto index: indices)
+    {
+        auto held = std::find(c.held.begin(), c.held.end(), index);
+        if(held == c.held.end())
+            continue;
+        c.held.erase(held);
+        auto live = m_live.find(index);
+        if(live != m_live.end())
+            unref(live->second);
+    }
+    m_changed.notify_all();
+}
+
+void TileFanOut::unref(size_t entry)
+{
+    Entry& e = m_entries[entry];
+    if(--e.refs == 0)
+    {
+        m_live.erase(e.pkg.tile.index);
+        m_released.push_back(e.pkg.tile.index);
+    }
+}
+
+void TileFanOut::detach(int consumer, std::unique_lock<std::mutex>& lock)
+{
+    Consumer& c = m_consumers[consumer];
+    if(!c.attached)
+        return;
+
+    // Releases the tiles the consumer holds, and the ones it didn't get yet.
+    release(consumer, std::vector<int64_t>(c.held));
+    for(size_t i = c.nextTile; i < m_entries.size(); ++i)
+        unref(i);
+    c.attached = false;
+    --m_numAttached;
+    m_changed.notify_all();
+    if(m_numAttached > 0)
+        return;
+
+    // Nobody uses the evaluation anymore: finish it in the renderer.
+    m_changed.wait(lock, [this](){ return !m_busy; });
+    if(!m_evaluating || m_numAttached > 0)
+        return;
+    bool complete = !m_entries.back().pkg.hasNext;
+    std::vector<int64_t> released;
+    released.swap(m_released);
+    m_busy = true;
+    lock.unlock();
+    std::exception_ptr error;
+    try
+    {
+        if(complete)
+            m_releaseLastTiles(released);
+        else
+            m_cancelEvaluation(released);
+    }
+    catch(...)
+    {
+        error = std::current_exception();
+    }
+    lock.lock();
+    m_busy = false;
+    m_evaluating = false;
+    m_entries.clear();
+    m_live.clear();
+    m_changed.notify_all();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+void TileFanOut::checkConsumer(int consumer) const
+{
+    if(consumer < 0 || consumer >= static_cast<int>(m_consumers.size()))
+        throw std::invalid_argument("Invalid consumer id: " + std::to_string(consumer));
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef TILEFANOUT_H
+#define TILEFANOUT_H
+
+#include "fbksd/core/definitions.h"
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fbksd
+{
+
+/**
+ * \brief Feeds the tiles of one renderer to several consumers (filters).
+ *
+ * Consumers that make the same sequence of requests form a group. Each request of the group is sent to the
+ * renderer only once, by the first consumer that makes it, and the others get its result. The tiles of an
+ * evaluation are given to every consumer of the group, and a tile slot is released to the renderer only when
+ * all of them released it. A new request waits until the current evaluation is finished.
+ *
+ * A consumer that makes a different request (e.g. an adaptive filter) leaves the group and is served on its
+ * own from then on: its requests are sent to the renderer between the evaluations of the group, and their tiles
+ * are only given to it. Since the renderer has a single current layout, the layout of a consumer (or of the
+ * group) is restored before its requests when another one changed it since.
+ *
+ * All methods can be called concurrently, but only one call is made to the renderer at a time.
+ *
+ * \ingroup BenchmarkServer
+ */
+class TileFanOut
+{
+public:
+    using ReleaseAndGetNextTile
+        = std::function<TilePkg(const std::vector<int64_t>& consumedTileIndices)>;
+    using ReleaseLastTiles
+        = std::function<void(const std::vector<int64_t>& consumedTileIndices)>;
+    using CancelEvaluation
+        = std::function<int64_t(const std::vector<int64_t>& consumedTileIndices)>;
+    using RestoreState
+        = std::function<void(int consumer)>;
+
+    /**
+     * @param numConsumers      Number of consumers, with ids in [0, numConsumers).
+     * @param numSlots          Number of tile slots of the renderer.
+     * @param getNextTile       Releases tiles and gets the next one from the renderer.
+     * @param releaseLastTiles  Releases tiles, finishing the evaluation in the renderer.
+     * @param cancelEvaluation  Cancels the evaluation in the renderer.
+     * @param restoreState      Sets the renderer layout of a consumer again, before a request made for it.
+     */
+    TileFanOut(int numConsumers,
+               int numSlots,
+               const ReleaseAndGetNextTile& getNextTile,
+               const ReleaseLastTiles& releaseLastTiles,
+               const CancelEvaluation& cancelEvaluation,
+               const RestoreState& restoreState);
+
+    /**
+     * @brief Makes a request that doesn't produce tiles (e.g. setting the layout).
+     *
+     * `call` makes the request to the renderer, if the consumer is the first of its group to make it.
+     *
+     * @return The result of `call`.
+     */
+    int64_t request(int consumer, const std::string& key, const std::function<int64_t()>& call);
+
+    /**
+     * @brief Makes an evaluation request and returns its first tile.
+     *
+     * `call` makes the request to the renderer, if the consumer is the first of its group to make it.
+     */
+    TilePkg evaluate(int consumer, const std::string& key, const std::function<TilePkg()>& call);
+
+    /**
+     * @brief Releases the given tiles and returns the next tile of the current evaluation.
+     */
+    TilePkg releaseAndGetNextTile(int consumer, const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * @brief Releases the given tiles, finishing the current evaluation for the consumer.
+     */
+    void releaseLastTiles(int consumer, const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * @brief Releases the given tiles and leaves the current evaluation.
+     *
+     * The renderer evaluation is only canceled if no other consumer is using it.
+     *
+     * @return Number of samples given to the consumer in the evaluation.
+     */
+    int64_t cancelEvaluation(int consumer, const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * @brief Removes the consumer (e.g. its process finished), releasing its tiles.
+     */
+    void removeConsumer(int consumer);
+
+    /**
+     * @brief Returns a key that identifies a request with the given name and arguments.
+     */
+    template<typename... Args>
+    static std::string makeKey(const char* name, const Args&... args)
+    {
+        clmdep_msgpack::sbuffer buffer;
+        clmdep_msgpack::pack(buffer, std::make_tuple(std::string(name), args...));
+        return std::string(buffer.data(), buffer.size());
+    }
+
+private:
+    // A request made by the consumers.
+    struct Step
+    {
+        std::string key;
+        int64_t result = 0;
+        std::string error; // the request failed in the renderer
+        bool done = false;
+    };
+
+    // A tile of the current evaluation.
+    struct Entry
+    {
+        TilePkg pkg;
+        int refs = 0; // consumers that didn't release it yet
+    };
+
+    struct Consumer
+    {
+        bool active = true;
+        bool solo = false; // left the group, and is served on its own
+        bool attached = false; // takes part in the current evaluation
+        size_t step = 0; // next request
+        size_t nextTile = 0; // next entry of the current evaluation
+        std::vector<int64_t> held; // slots given and not released yet
+        int64_t numSamples = 0; // samples given in the current evaluation
+    };
+
+    bool beginStep(int consumer, const std::string& key, std::unique_lock<std::mutex>& lock);
+    std::string callRenderer(int consumer, std::unique_lock<std::mutex>& lock, const std::function<void()>& call);
+    void beginEvaluation(const TilePkg& first, int solo);
+    void addEntry(const TilePkg& pkg);
+    TilePkg nextTile(int consumer, std::unique_lock<std::mutex>& lock);
+    void release(int consumer, const std::vector<int64_t>& indices);
+    void unref(size_t entry);
+    void detach(int consumer, std::unique_lock<std::mutex>& lock);
+    void checkConsumer(int consumer) const;
+
+    ReleaseAndGetNextTile m_getNextTile;
+    ReleaseLastTiles m_releaseLastTiles;
+    CancelEvaluation m_cancelEvaluation;
+    RestoreState m_restoreState;
+    int m_numSlots;
+    std::vector<Consumer> m_consumers;
+    std::vector<Step> m_steps;
+    std::vector<Entry> m_entries; // tiles of the current evaluation, in the renderer order
+    std::map<int64_t, size_t> m_live; // slot -> entry, for entries not released by all consumers
+    std::vector<int64_t> m_released; // slots released by all consumers, not yet given back to the renderer
+    bool m_evaluating = false;
+    int m_numAttached = 0;
+    bool m_busy = false; // a call to the renderer is in progress
+    int m_stateOwner = -1; // solo consumer whose layout the renderer has, or -1 for the group
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+};
+
+} // namespace fbksd
+
+#endif // TILEFANOUT_H
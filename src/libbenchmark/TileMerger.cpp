@@ -0,0 +1,314 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "TileMerger.h"
+using namespace fbksd;
+
+#include <algorithm>
+#include <exception>
+#include <future>
+#include <stdexcept>
+
+
+TileMerger::TileMerger(int numShards,
+                       int numSlots,
+                       const ReleaseAndGetNextTile& getNextTile,
+                       const ReleaseLastTiles& releaseLastTiles,
+                       const CancelEvaluation& cancelEvaluation):
+    m_getNextTile(getNextTile),
+    m_releaseLastTiles(releaseLastTiles),
+    m_cancelEvaluation(cancelEvaluation),
+    m_numSlots(numSlots),
+    m_shards(numShards)
+{}
+
+TileMerger::~TileMerger()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    waitRequests(lock);
+}
+
+TilePkg TileMerger::evaluate(const std::vector<int>& shards, const Evaluate& call)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    waitRequests(lock);
+    reset();
+
+    std::vector<std::future<TilePkg>> firsts;
+    for(int shard: shards)
+        firsts.push_back(std::async(std::launch::async, call, shard));
+
+    std::exception_ptr error;
+    for(size_t i = 0; i < shards.size(); ++i)
+    {
+        TilePkg first;
+        try { first = firsts[i].get(); }
+        catch(...)
+        {
+            if(!error)
+                error = std::current_exception();
+            continue;
+        }
+        if(!first.isValid)
+            continue;
+        Shard& s = m_shards.at(shards[i]);
+        s.active = true;
+        s.hasNext = first.hasNext;
+        s.ready.push_back(first);
+        s.numHeld = 1;
+    }
+
+    if(error)
+    {
+        // The shards that started keep their slots until the evaluation is canceled.
+        for(size_t shard = 0; shard < m_shards.size(); ++shard)
+        {
+            Shard& s = m_shards[shard];
+            if(!s.active)
+                continue;
+            std::vector<int64_t> indices;
+            for(const auto& pkg: s.ready)
+                indices.push_back(pkg.tile.index);
+            try { m_cancelEvaluation(static_cast<int>(shard), indices); }
+            catch(const std::exception&) {}
+        }
+        reset();
+        std::rethrow_exception(error);
+    }
+
+    if(!hasMoreTiles())
+        return {};
+    return nextTile(lock);
+}
+
+TilePkg TileMerger::releaseAndGetNextTile(const std::vector<int64_t>& consumedTileIndices)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    release(consumedTileIndices);
+    return nextTile(lock);
+}
+
+void TileMerger::releaseLastTiles(const std::vector<int64_t>& consumedTileIndices)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    release(consumedTileIndices);
+    waitRequests(lock);
+    if(hasMoreTiles())
+        throw std::logic_error("The evaluation still has tiles.");
+
+    std::exception_ptr error;
+    for(size_t shard = 0; shard < m_shards.size(); ++shard)
+    {
+        Shard& s = m_shards[shard];
+        if(!s.active)
+            continue;
+        try { m_releaseLastTiles(static_cast<int>(shard), s.released); }
+        catch(...)
+        {
+            if(!error)
+                error = std::current_exception();
+        }
+    }
+    reset();
+    if(error)
+        std::rethrow_exception(error);
+}
+
+int64_t TileMerger::cancelEvaluation(const std::vector<int64_t>& consumedTileIndices)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    release(consumedTileIndices);
+    // The tiles of the requests in flight are released with the others.
+    waitRequests(lock);
+
+    // The shards count the tiles waiting here as delivered, so the samples given to the client are counted here.
+    const int64_t numSamples = m_numSamples;
+    std::exception_ptr error;
+    for(size_t shard = 0; shard < m_shards.size(); ++shard)
+    {
+        Shard& s = m_shards[shard];
+        if(!s.active)
+            continue;
+        for(const auto& pkg: s.ready)
+            s.released.push_back(pkg.tile.index);
+        try { m_cancelEvaluation(static_cast<int>(shard), s.released); }
+        catch(...)
+        {
+            if(!error)
+                error = std::current_exception();
+        }
+    }
+    reset();
+    if(error)
+        std::rethrow_exception(error);
+    return numSamples;
+}
+
+std::pair<int64_t, int64_t> TileMerger::getShardRows(int64_t height, int shard, int numShards)
+{
+    return {height * shard / numShards, height * (shard + 1) / numShards};
+}
+
+std::vector<CropWindow> TileMerger::getShardWindows(const std::vector<CropWindow>& windows,
+                                                    int64_t height,
+                                                    int shard,
+                                                    int numShards)
+{
+    const auto rows = getShardRows(height, shard, numShards);
+    std::vector<CropWindow> result;
+    for(CropWindow w: windows)
+    {
+        w.begin.y = std::max(w.begin.y, rows.first);
+        w.end.y = std::min(w.end.y, rows.second);
+        if(w.width() > 0 && w.height() > 0)
+            result.push_back(w);
+    }
+    return result;
+}
+
+TilePkg TileMerger::nextTile(std::unique_lock<std::mutex>& lock)
+{
+    const int numShards = static_cast<int>(m_shards.size());
+    for(;;)
+    {
+        // Tiles already received go first, in turns.
+        for(int i = 0; i < numShards; ++i)
+        {
+            int shard = (m_next + i) % numShards;
+            Shard& s = m_shards[shard];
+            if(s.active && !s.ready.empty())
+            {
+                TilePkg pkg = s.ready.front();
+                s.ready.pop_front();
+                requestTiles();
+                return deliver(shard, pkg);
+            }
+        }
+
+        for(auto& s: m_shards)
+        {
+            if(s.error)
+            {
+                auto error = s.error;
+                s.error = nullptr;
+                std::rethrow_exception(error);
+            }
+        }
+        if(!hasMoreTiles())
+            throw std::logic_error("The evaluation has no more tiles.");
+
+        // Whichever shard answers first. If the client holds all the slots of the shards that still have
+        // tiles, one of them is asked anyway and waits for the client, as with a single renderer.
+        if(!requestTiles())
+        {
+            auto s = std::find_if(m_shards.begin(), m_shards.end(), [](const Shard& s){ return s.active && s.hasNext; });
+            request(static_cast<int>(s - m_shards.begin()));
+        }
+        m_received.wait(lock);
+    }
+}
+
+bool TileMerger::requestTiles()
+{
+    // A shard is only asked for a tile while it has free slots, or the request would wait for the client.
+    bool pending = false;
+    for(size_t shard = 0; shard < m_shards.size(); ++shard)
+    {
+        Shard& s = m_shards[shard];
+        if(s.active && s.hasNext && !s.pending && s.numHeld < m_numSlots)
+            request(static_cast<int>(shard));
+        pending = pending || s.pending;
+    }
+    return pending;
+}
+
+void TileMerger::request(int shard)
+{
+    Shard& s = m_shards[shard];
+    s.pending = true;
+    std::vector<int64_t> released;
+    released.swap(s.released);
+    s.request = std::async(std::launch::async, [this, shard, released]()
+    {
+        TilePkg pkg;
+        std::exception_ptr error;
+        try
+        {
+            pkg = m_getNextTile(shard, released);
+            if(!pkg.isValid)
+                throw std::runtime_error("Renderer shard " + std::to_string(shard) + " returned an invalid tile.");
+        }
+        catch(...)
+        {
+            error = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Shard& s = m_shards[shard];
+        s.pending = false;
+        if(error)
+        {
+            s.error = error;
+            s.hasNext = false;
+        }
+        else
+        {
+            s.hasNext = pkg.hasNext;
+            s.ready.push_back(pkg);
+            ++s.numHeld;
+        }
+        m_received.notify_all();
+    });
+}
+
+void TileMerger::waitRequests(std::unique_lock<std::mutex>& lock)
+{
+    m_received.wait(lock, [this]()
+    {
+        return std::none_of(m_shards.begin(), m_shards.end(), [](const Shard& s){ return s.pending; });
+    });
+}
+
+TilePkg TileMerger::deliver(int shard, TilePkg pkg)
+{
+    m_owners[pkg.tile.index] = shard;
+    m_numSamples += pkg.tile.numSamples;
+    m_next = (shard + 1) % static_cast<int>(m_shards.size());
+    pkg.hasNext = hasMoreTiles();
+    return pkg;
+}
+
+void TileMerger::release(const std::vector<int64_t>& indices)
+{
+    for(auto index: indices)
+    {
+        auto owner = m_owners.find(index);
+        if(owner == m_owners.end())
+            throw std::logic_error("Released tile slot " + std::to_string(index) + " was not given to the client.");
+        Shard& s = m_shards[owner->second];
+        s.released.push_back(index);
+        --s.numHeld;
+        m_owners.erase(owner);
+    }
+}
+
+bool TileMerger::hasMoreTiles() const
+{
+    return std::any_of(m_shards.begin(), m_shards.end(), [](const Shard& s)
+    { return s.active && (s.hasNext || !s.ready.empty()); });
+}
+
+void TileMerger::reset()
+{
+    for(auto& s: m_shards)
+        s = Shard();
+    m_owners.clear();
+    m_next = 0;
+    m_numSamples = 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef TILEMERGER_H
+#define TILEMERGER_H
+
+#include "fbksd/core/definitions.h"
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <vector>
+
+namespace fbksd
+{
+
+/**
+ * \brief Merges the tiles of several renderer shards in a single stream.
+ *
+ * Each shard is an instance of the renderer that evaluates a part of the image (see SHARD_ENV). The shards
+ * write their tiles in separate slots of the same tiles memory, so a tile is given to the client as is,
+ * and the slots it releases are sent back to the shard that owns them.
+ *
+ * Each shard has a tile request in flight (in another thread) while it has free slots, so the client gets
+ * whichever tile is ready first instead of waiting for a slow shard. Tiles that are already here are given
+ * in turns, so a shard never waits for slots held by the client on behalf of the others for long. Released
+ * slots are given back in the next request made to their shard.
+ *
+ * The methods are meant to be called by one client at a time (e.g. through a TileFanOut).
+ *
+ * \ingroup BenchmarkServer
+ */
+class TileMerger
+{
+public:
+    using Evaluate = std::function<TilePkg(int shard)>;
+    using ReleaseAndGetNextTile
+        = std::function<TilePkg(int shard, const std::vector<int64_t>& consumedTileIndices)>;
+    using ReleaseLastTiles
+        = std::function<void(int shard, const std::vector<int64_t>& consumedTileIndices)>;
+    using CancelEvaluation
+        = std::function<int64_t(int shard, const std::vector<int64_t>& consumedTileIndices)>;
+
+    /**
+     * @param numShards         Number of shards, with ids in [0, numShards).
+     * @param numSlots          Number of tile slots of each shard.
+     * @param getNextTile       Releases tiles and gets the next one from a shard. It's called concurrently
+     *                          for different shards.
+     * @param releaseLastTiles  Releases tiles, finishing the evaluation in a shard.
+     * @param cancelEvaluation  Cancels the evaluation in a shard.
+     */
+    TileMerger(int numShards,
+               int numSlots,
+               const ReleaseAndGetNextTile& getNextTile,
+               const ReleaseLastTiles& releaseLastTiles,
+               const CancelEvaluation& cancelEvaluation);
+
+    TileMerger(const TileMerger&) = delete;
+
+    /**
+     * @brief Waits for the tile requests in flight.
+     */
+    ~TileMerger();
+
+    /**
+     * @brief Starts an evaluation in the given shards and returns its first tile.
+     *
+     * `call` starts the evaluation in a shard and returns its first tile. It's called concurrently for the
+     * shards, so they start rendering at the same time. Shards that return no tile don't take part in the
+     * evaluation. If a shard fails, the evaluation is canceled in the others and the error is rethrown.
+     */
+    TilePkg evaluate(const std::vector<int>& shards, const Evaluate& call);
+
+    /**
+     * @brief Releases the given tiles and returns the next tile of the current evaluation.
+     */
+    TilePkg releaseAndGetNextTile(const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * @brief Releases the given tiles, finishing the current evaluation in all shards.
+     */
+    void releaseLastTiles(const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * @brief Cancels the current evaluation in all shards, releasing the given tiles.
+     *
+     * @return Number of samples given to the client in the evaluation.
+     */
+    int64_t cancelEvaluation(const std::vector<int64_t>& consumedTileIndices);
+
+    /**
+     * @brief Returns the rows of the image rendered by a shard: [first, second).
+     */
+    static std::pair<int64_t, int64_t> getShardRows(int64_t height, int shard, int numShards);
+
+    /**
+     * @brief Clips the windows to the rows of a shard, removing the empty ones.
+     */
+    static std::vector<CropWindow> getShardWindows(const std::vector<CropWindow>& windows,
+                                                   int64_t height,
+                                                   int shard,
+                                                   int numShards);
+
+    TileMerger& operator=(const TileMerger&) = delete;
+
+private:
+    struct Shard
+    {
+        bool active = false; // takes part in the current evaluation
+        bool hasNext = false; // the shard has more tiles to give
+        std::deque<TilePkg> ready; // tiles received from the shard and not given to the client yet
+        std::vector<int64_t> released; // slots released by the client, not yet given back to the shard
+        int numHeld = 0; // slots in `ready` or held by the client
+        bool pending = false; // a tile request is in flight
+        std::future<void> request;
+        std::exception_ptr error; // the last request failed
+    };
+
+    TilePkg nextTile(std::unique_lock<std::mutex>& lock);
+    TilePkg deliver(int shard, TilePkg pkg);
+    bool requestTiles();
+    void request(int shard);
+    void waitRequests(std::unique_lock<std::mutex>& lock);
+    void release(const std::vector<int64_t>& indices);
+    bool hasMoreTiles() const;
+    void reset();
+
+    ReleaseAndGetNextTile m_getNextTile;
+    ReleaseLastTiles m_releaseLastTiles;
+    CancelEvaluation m_cancelEvaluation;
+    int m_numSlots;
+    std::vector<Shard> m_shards;
+    std::map<int64_t, int> m_owners; // slot -> shard, for tiles held by the client
+    int m_next = 0; // shard whose turn it is
+    int64_t m_numSamples = 0; // samples given to the client in the current evaluation
+    std::mutex m_mutex;
+    std::condition_variable m_received; // a tile request finished
+};
+
+} // namespace fbksd
+
+#endif // TILEMERGER_H
@@ -10,6 +10,14 @@
 #include "tcp_utils.h"
 #include <boost/asio.hpp>
 #include <thread>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
 
 
 void waitPortOpen(unsigned short port)
@@ -25,7 +33,65 @@ void waitPortOpen(unsigned short port)
             tcp::acceptor a(svc);
             a.open(tcp::v4(), ec) || a.bind({ tcp::v4(), port }, ec);
         }
-        std::this_thread::sleep_for(std::chrono::seconds(1));
+        if(ec != error::address_in_use)
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
     }
     while(ec != error::address_in_use);
 }
+
+
+ReadyListener::ReadyListener()
+{
+    m_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(m_fd == -1)
+        throw std::runtime_error(std::string("ReadyListener: socket() failed: ") + strerror(errno));
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0; // let the system choose a free port
+    socklen_t len = sizeof(addr);
+    if(bind(m_fd, reinterpret_cast<sockaddr*>(&addr), len) == -1 ||
+       listen(m_fd, 4) == -1 ||
+       getsockname(m_fd, reinterpret_cast<sockaddr*>(&addr), &len) == -1)
+    {
+        auto error = std::string("ReadyListener: couldn't open port: ") + strerror(errno);
+        close(m_fd);
+        throw std::runtime_error(error);
+    }
+    m_port = ntohs(addr.sin_port);
+}
+
+ReadyListener::~ReadyListener()
+{
+    if(m_fd != -1)
+        close(m_fd);
+}
+
+unsigned short ReadyListener::port() const
+{
+    return m_port;
+}
+
+bool ReadyListener::wait(int timeout)
+{
+    pollfd pfd;
+    pfd.fd = m_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int ret = 0;
+    do
+        ret = poll(&pfd, 1, timeout);
+    while(ret == -1 && errno == EINTR);
+
+    if(ret <= 0)
+        return false;
+
+    int conn = accept(m_fd, nullptr, nullptr);
+    if(conn == -1)
+        return false;
+    close(conn);
+    return true;
+}
@@ -14,7 +14,50 @@
  * @brief Waits for the given port to be in use.
  *
  * This can be used to wait for a server to open it's port.
+ * Prefer ReadyListener for processes started by FBKSD, since polling adds latency.
  */
 void waitPortOpen(unsigned short port);
 
+
+/**
+ * @brief Receives readiness notifications from child processes.
+ *
+ * The listener opens a port on the loopback interface. A process started with the port in the
+ * `FBKSD_READY_PORT` environment variable (see fbksd::READY_PORT_ENV) connects to it as soon as
+ * it is ready to serve requests (the RenderingServer does this when run() is called).
+ */
+class ReadyListener
+{
+public:
+    /**
+     * @brief Opens the listening port.
+     *
+     * @throws std::runtime_error if the port could not be opened.
+     */
+    ReadyListener();
+
+    ReadyListener(const ReadyListener&) = delete;
+
+    ~ReadyListener();
+
+    /**
+     * @brief Returns the port number the child process should connect to.
+     */
+    unsigned short port() const;
+
+    /**
+     * @brief Waits for a child process to signal readiness.
+     *
+     * @param timeout Maximum time to wait, in milliseconds (-1 waits indefinitely).
+     * @returns true if a notification was received, false if the timeout expired.
+     */
+    bool wait(int timeout);
+
+    ReadyListener& operator=(const ReadyListener&) = delete;
+
+private:
+    int m_fd = -1;
+    unsigned short m_port = 0;
+};
+
 #endif // TCP_UTILS_H
@@ -9,14 +9,23 @@
 
 #include "fbksd/client/BenchmarkClient.h"
 #include "fbksd/core/definitions.h"
-#include "fbksd/core/SharedMemory.h"
+#include "fbksd/core/session.h"
 #include "BenchmarkManager.h"
+#include "ServerConnection.h"
+#include "ThreadPool.h"
+#include "TileArena.h"
 #include "tcp_utils.h"
 #include "version.h"
 
-#include <rpc/client.h>
 #include <iostream>
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <map>
 #include <QFileInfo>
+#include <QProcessEnvironment>
 #include <boost/program_options.hpp>
 
 namespace po = boost::program_options;
@@ -44,6 +53,10 @@ using namespace fbksd;
 
 namespace
 {
+// Maximum number of tiles held by the client when consuming in parallel.
+// Must be less than the number of tile slots in the renderer (see TilePool).
+constexpr int MAX_TILES_IN_FLIGHT = 16;
+
 void startProcess(const QString& execPath, const QStringList& args, QProcess* process)
 {
     process->start(QFileInfo(execPath).absoluteFilePath(), args, QIODevice::NotOpen);
@@ -102,11 +115,46 @@ int64_t SPP::getValue() const
 // ======================================================
 // BenchmarkClient
 // ======================================================
+// Defined here because Imp creates the stream states.
+//
+// The callbacks refer to the client that opened the stream. The client tracks its open stream and
+// detaches it when destroyed (see detach()), so a stream that outlives the client is just finished.
+struct TileStream::State
+{
+    ~State()
+    {
+        if(unlink)
+            unlink();
+    }
+
+    // Finishes the stream without talking to the client anymore.
+    void detach()
+    {
+        finished = true;
+        tile.reset();
+        getNext = nullptr;
+        finish = nullptr;
+        cancel = nullptr;
+        unlink = nullptr;
+    }
+
+    std::function<TilePkg(int64_t prevIndex, bool prevWasInput)> getNext;
+    std::function<void(int64_t lastIndex)> finish;
+    std::function<int64_t(int64_t currentIndex)> cancel;
+    std::function<void()> unlink; // tells the client the stream is gone
+    float* buffer = nullptr;
+    int64_t sampleSize = 0;
+    int64_t spp = 0;
+    TilePkg tilePkg;
+    std::unique_ptr<BufferTile> tile;
+    bool started = false;
+    bool finished = false;
+};
+
+
 struct BenchmarkClient::Imp
 {
-    Imp(int argc, char* argv[]):
-        m_tilesMemory("TILES_MEMORY"),
-        m_resultMemory("RESULT_MEMORY")
+    Imp(int argc, char* argv[])
     {
         if(argc != 0 && argv != nullptr)
         {
@@ -114,7 +162,9 @@ struct BenchmarkClient::Imp
             desc.add_options()
                     ("fbksd-version", "Print version number.")
                     ("fbksd-renderer", po::value<std::string>(), "Calls a renderer server.")
-                    ("fbksd-spp", po::value<int>(), "Number of samples poer pixel.");
+                    ("fbksd-renderer-plugin", po::value<std::string>(), "Loads a renderer plugin into the process.")
+                    ("fbksd-spp", po::value<int>(), "Number of samples poer pixel.")
+                    ("fbksd-session", po::value<int>(), "Benchmark session id.");
 
             po::variables_map vm;
             po::store(po::command_line_parser(argc, argv).options(desc).allow_unregistered().run(), vm);
@@ -126,6 +176,26 @@ struct BenchmarkClient::Imp
                 exit(0);
             }
 
+            // Must be set before starting the renderer, so it inherits the session.
+            if(vm.count("fbksd-session"))
+                setSessionId(vm["fbksd-session"].as<int>());
+
+            if(vm.count("fbksd-renderer-plugin"))
+            {
+                std::cout << "(fbksd) Running in bypass mode with an in-process renderer." << std::endl;
+                auto values = QString::fromStdString(vm["fbksd-renderer-plugin"].as<std::string>()).split(" ");
+                std::vector<std::string> args;
+                for(int i = 1; i < values.size(); ++i)
+                    args.push_back(values[i].toStdString());
+
+                int spp = 1;
+                if(vm.count("fbksd-spp"))
+                    spp = vm["fbksd-spp"].as<int>();
+                std::cout << "(fbksd) spp = " << spp << std::endl;
+                m_server = std::make_unique<InProcessConnection>(values[0].toStdString(), args, spp);
+                return;
+            }
+
             if(vm.count("fbksd-renderer") || vm.count("fbksd-spp"))
             {
                 std::cout << "(fbksd) Running in bypass mode." << std::endl;
@@ -136,11 +206,31 @@ struct BenchmarkClient::Imp
                     auto values = renderCall.split(" ");
                     m_rendererProcess = std::make_unique<QProcess>();
                     auto args = values.mid(1, values.size()-1);
+
+                    // The renderer connects to the listener once it's ready (see READY_PORT_ENV)
+                    ReadyListener listener;
+                    QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+                    env.insert(READY_PORT_ENV, QString::number(listener.port()));
+                    m_rendererProcess->setProcessEnvironment(env);
                     startProcess(values[0], args, m_rendererProcess.get());
+                    std::cout << "(fbksd) Waiting for renderer..." << std::endl;
+                    while(!listener.wait(100))
+                    {
+                        if(m_rendererProcess->waitForFinished(0))
+                        {
+                            std::cerr << "(fbksd) Renderer finished before becoming ready." << std::endl;
+                            exit(EXIT_FAILURE);
+                        }
+                    }
+                    std::cout << "(fbksd) Renderer ready." << std::endl;
+                }
+                else
+                {
+                    // Renderer started by the user: we can only poll its port.
+                    std::cout << "(fbksd) Waiting for renderer port..." << std::endl;
+                    waitPortOpen(getRenderingServerPort(getSessionId()));
+                    std::cout << "(fbksd) Renderer port open." << std::endl;
                 }
-                std::cout << "(fbksd) Waiting for renderer port..." << std::endl;
-                waitPortOpen(2227);
-                std::cout << "(fbksd) Renderer port open." << std::endl;
 
                 int spp = 1;
                 if(vm.count("fbksd-spp"))
@@ -148,26 +238,33 @@ struct BenchmarkClient::Imp
                 std::cout << "(fbksd) spp = " << spp << std::endl;
 
                 m_bmkManager = std::make_unique<BenchmarkManager>();
+                // The benchmark server port is listening once runPassive() returns.
                 m_bmkManager->runPassive(spp);
-                waitPortOpen(2226);
             }
         }
 
-        m_client = std::make_unique<rpc::client>("127.0.0.1", 2226);
-
-        // verify server version compatibility
-        auto version = m_client->call("GET_VERSION").as<std::pair<int,int>>();
-        if(version.first != FBKSD_VERSION_MAJOR)
-        {
-            auto error = std::string("Benchmark server version (") +
-                    std::to_string(version.first) + ") is incompatible with client version (" +
-                    std::to_string(FBKSD_VERSION_MAJOR) + ").";
-            throw std::runtime_error(error);
-        }
+        m_server = std::make_unique<RpcConnection>(getSessionId(), getConsumerId());
     }
 
     ~Imp()
     {
+        // An open stream can't be drained anymore: its evaluation is canceled and the stream finished.
+        if(m_openStream)
+        {
+            TileStream::State* stream = m_openStream;
+            try
+            {
+                if(!stream->finished)
+                    stream->cancel(stream->tilePkg.tile.index);
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "Error canceling the open TileStream: " << e.what() << std::endl;
+            }
+            stream->detach();
+            m_openStream = nullptr;
+        }
+
         if(m_rendererProcess)
         {
             m_rendererProcess->kill();
@@ -177,35 +274,581 @@ struct BenchmarkClient::Imp
 
     void fetchSceneInfo()
     {
-        m_sceneInfo = m_client->call("GET_SCENE_DESCRIPTION").as<SceneInfo>();
+        m_sceneInfo = m_server->getSceneInfo();
         m_maxNumSamples = m_sceneInfo.get<int64_t>("max_samples");
         m_numPixels = m_sceneInfo.get<int64_t>("width") * m_sceneInfo.get<int64_t>("height");
+    }
+
+    BufferTile makeBufferTile(const Tile& tile, int64_t spp, float* data) const
+    {
+        // Pixel statistics tiles have two "samples" per pixel: mean and variance.
+        if(m_pixelStatistics)
+            spp = 2;
+        return BufferTile(tile.window.begin.x,
+                          tile.window.end.x,
+                          tile.window.begin.y,
+                          tile.window.end.y,
+                          m_sampleSize, spp, data);
+    }
+
+    void checkNoStream()
+    {
+        if(m_openStream)
+            throw std::logic_error("A TileStream is open. Finish or close it before making new requests.");
+    }
+
+    // Waits for the evaluations queued by the async methods.
+    // Every method that talks to the server must call this first, since the requests share one connection.
+    void waitAsync()
+    {
+        checkNoStream();
+        if(m_executor && !m_executor->isWorkerThread())
+            m_executor->wait();
+    }
+
+    ThreadPool& executor()
+    {
+        if(!m_executor)
+            m_executor = std::make_unique<ThreadPool>(1);
+        return *m_executor;
+    }
+
+    // Number of floats of a tile in the tiles memory.
+    int64_t getTileDataSize(const Tile& tile) const
+    {
+        // In pixel statistics mode, each pixel has a mean and a variance "sample".
+        if(m_pixelStatistics)
+            return 2 * m_sampleSize * (tile.window.end.x - tile.window.begin.x) * (tile.window.end.y - tile.window.begin.y);
+        return tile.numSamples * m_sampleSize;
+    }
+
+    // Updates the state that depends on the current sample layout.
+    void useLayout(const SampleLayout& layout)
+    {
+        if(layout.isPixelStatistics() && layout.hasInput())
+            throw std::invalid_argument("The pixel statistics mode doesn't support INPUT elements.");
+        m_sampleSize = layout.getSampleSize();
+        // With an input generator, the renderer writes the INPUT elements itself.
+        m_hasInputSamples = layout.hasInput() && layout.getInputGenerator().empty();
+        m_pixelStatistics = layout.isPixelStatistics();
+    }
+
+    // Cancels the current evaluation, releasing the given consumed tiles.
+    // Returns the number of samples refunded to the budget.
+    int64_t cancelEvaluation(const std::vector<int64_t>& consumedIndices)
+    {
+        return m_server->cancelEvaluation(consumedIndices);
+    }
+
+    // Requests samples (without input) and calls consumer(tile, tilePtr) for each tile.
+    //
+    // If `canceled` becomes true, the evaluation is canceled on the server before the next tile.
+    // Returns the number of samples refunded by a cancellation.
+    template<typename Consumer>
+    int64_t evaluate(bool isSPP, int64_t numSamples, const std::atomic<bool>* canceled, const Consumer& consumer)
+    {
+        if(m_hasInputSamples)
+            throw std::logic_error("evaluateSamples() doesn't support input samples, use evaluateInputSamples().");
+        if(m_pixelStatistics && !isSPP)
+            throw std::logic_error("The pixel statistics mode only supports SPP requests.");
+
+        auto tilePkg = m_server->evaluateSamples(isSPP, numSamples);
+        return consumeTiles(tilePkg, canceled, consumer);
+    }
+
+    // Consumes the tiles of an evaluation started with tilePkg (see evaluate()).
+    template<typename Consumer>
+    int64_t consumeTiles(TilePkg tilePkg, const std::atomic<bool>* canceled, const Consumer& consumer)
+    {
+        if(!tilePkg.isValid)
+            return 0;
+
+        float* buffer = m_server->getTilesData();
+        if(m_consumerPool)
+            return evaluateParallel(tilePkg, buffer, canceled, consumer);
+        if(m_eagerRelease)
+            return evaluateEager(tilePkg, buffer, canceled, consumer);
+
+        while(true)
+        {
+            int64_t tileIndex = tilePkg.tile.index;
+            if(canceled && *canceled)
+                return cancelEvaluation({tileIndex});
+            consumer(tilePkg.tile, &buffer[tileIndex]);
+
+            if(!tilePkg.hasNext)
+            {
+                m_server->lastTileConsumed(tileIndex);
+                return 0;
+            }
+            tilePkg = m_server->getNextTile(tileIndex);
+        }
+    }
+
+    // Copies each tile to the arena and releases its slot before calling the consumer.
+    //
+    // The release is sent together with the request for the next tile, so the renderer
+    // works on the next tile while the copy is consumed.
+    template<typename Consumer>
+    int64_t evaluateEager(TilePkg tilePkg, float* buffer, const std::atomic<bool>* canceled, const Consumer& consumer)
+    {
+        float* copy = nullptr;
+        int64_t copySize = 0;
+        int64_t refund = 0;
+        std::vector<int64_t> released(1);
+        while(true)
+        {
+            const Tile tile = tilePkg.tile;
+            released[0] = tile.index;
+            if(canceled && *canceled)
+            {
+                refund = cancelEvaluation(released);
+                break;
+            }
+
+            const int64_t size = getTileDataSize(tile);
+            if(size > copySize)
+            {
+                if(copy)
+                    m_arena.release(copy);
+                copy = m_arena.acquire(size);
+                copySize = size;
+            }
+            TileArena::copy(copy, &buffer[tile.index], size);
+
+            if(!tilePkg.hasNext)
+            {
+                m_server->releaseLastTiles(released);
+                consumeCopy(tile, copy, consumer);
+                break;
+            }
+
+            auto next = m_server->releaseAndGetNextTileAsync(released);
+            try
+            {
+                consumer(tile, copy);
+            }
+            catch(...)
+            {
+                // The server already sent the next tile: it's canceled so the next evaluation
+                // starts in a clean state.
+                try
+                {
+                    cancelEvaluation({next.get().tile.index});
+                }
+                catch(const std::exception& e)
+                {
+                    std::cerr << "Error canceling the evaluation: " << e.what() << std::endl;
+                }
+                m_arena.release(copy);
+                throw;
+            }
+            tilePkg = next.get();
+        }
+
+        if(copy)
+            m_arena.release(copy);
+        return refund;
+    }
+
+    // Calls the consumer with the last tile copy, releasing the copy if the consumer throws.
+    //
+    // The last tile was already released, so the server has nothing else to cancel.
+    template<typename Consumer>
+    void consumeCopy(const Tile& tile, float* copy, const Consumer& consumer)
+    {
+        try
+        {
+            consumer(tile, copy);
+        }
+        catch(...)
+        {
+            m_arena.release(copy);
+            throw;
+        }
+    }
+
+    // Consumes the tiles in the consumer pool, acknowledging them to the server as the workers finish.
+    //
+    // If a consumer throws, the evaluation is canceled and the exception is rethrown.
+    template<typename Consumer>
+    int64_t evaluateParallel(TilePkg tilePkg, float* buffer, const std::atomic<bool>* canceled, const Consumer& consumer)
+    {
+        // The renderer has a fixed number of tile slots, and a slot is only reused after we release it.
+        // Limit the tiles held by the client so the renderer always has free slots to keep working
+        // (in eager mode, this limits the number of copies instead).
+        const int maxTilesInFlight = std::min(2 * m_consumerPool->numThreads(), MAX_TILES_IN_FLIGHT);
+
+        std::mutex mutex;
+        std::condition_variable tileConsumed;
+        std::vector<int64_t> consumedIndices;
+        int numInFlight = 0;
+        std::exception_ptr error;
+
+        auto isCanceled = [&]()
+        {
+            if(canceled && *canceled)
+                return true;
+            std::lock_guard<std::mutex> lock(mutex);
+            return error != nullptr;
+        };
+
+        auto dispatch = [&](const Tile& tile)
+        {
+            // In eager mode, the tile is consumed from a copy and its slot is released right away.
+            float* data = &buffer[tile.index];
+            if(m_eagerRelease)
+            {
+                const int64_t size = getTileDataSize(tile);
+                data = m_arena.acquire(size);
+                TileArena::copy(data, &buffer[tile.index], size);
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            ++numInFlight;
+            if(m_eagerRelease)
+                consumedIndices.push_back(tile.index);
+            lock.unlock();
+
+            m_consumerPool->enqueue([&, tile, data]()
+            {
+                if(!isCanceled())
+                {
+                    try
+                    {
+                        consumer(tile, data);
+                    }
+                    catch(...)
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        if(!error)
+                            error = std::current_exception();
+                    }
+                }
+
+                if(m_eagerRelease)
+                    m_arena.release(data);
+
+                std::unique_lock<std::mutex> lock(mutex);
+                if(!m_eagerRelease)
+                    consumedIndices.push_back(tile.index);
+                --numInFlight;
+                lock.unlock();
+                tileConsumed.notify_one();
+            });
+        };
+
+        try
+        {
+            dispatch(tilePkg.tile);
+            while(tilePkg.hasNext && !isCanceled())
+            {
+                std::vector<int64_t> released;
+                std::unique_lock<std::mutex> lock(mutex);
+                tileConsumed.wait(lock, [&](){ return numInFlight < maxTilesInFlight; });
+                released.swap(consumedIndices);
+                lock.unlock();
+
+                tilePkg = m_server->releaseAndGetNextTile(released);
+                dispatch(tilePkg.tile);
+            }
+        }
+        catch(...)
+        {
+            // The queued tasks use the local state: wait for them before unwinding.
+            // The error makes them skip the consumer.
+            std::unique_lock<std::mutex> lock(mutex);
+            if(!error)
+                error = std::current_exception();
+            tileConsumed.wait(lock, [&](){ return numInFlight == 0; });
+            lock.unlock();
+
+            // The server may be unreachable, so the cancellation is only tried.
+            try
+            {
+                cancelEvaluation(consumedIndices);
+            }
+            catch(const std::exception& e)
+            {
+                std::cerr << "Error canceling the evaluation: " << e.what() << std::endl;
+            }
+            throw;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        tileConsumed.wait(lock, [&](){ return numInFlight == 0; });
+        lock.unlock();
+
+        int64_t refund = 0;
+        if(isCanceled())
+            refund = cancelEvaluation(consumedIndices);
+        else
+            m_server->releaseLastTiles(consumedIndices);
+
+        if(error)
+            std::rethrow_exception(error);
+        return refund;
+    }
+
+    std::unique_ptr<TileStream::State> openStream(bool isInput, int64_t spp)
+    {
+        auto tilePkg = isInput ? m_server->evaluateInputSamples(true, spp) : m_server->evaluateSamples(true, spp);
+
+        auto state = std::make_unique<TileStream::State>();
+        state->sampleSize = m_sampleSize;
+        state->spp = m_pixelStatistics ? 2 : spp;
+        if(!tilePkg.isValid)
+        {
+            state->finished = true;
+            return state;
+        }
+
+        state->buffer = m_server->getTilesData();
+        state->tilePkg = tilePkg;
+        state->getNext = [this, isInput](int64_t prevIndex, bool prevWasInput)
+        {
+            if(isInput)
+                return m_server->getNextInputTile(prevIndex, prevWasInput);
+            return m_server->getNextTile(prevIndex);
+        };
+        TileStream::State* stream = state.get();
+        state->finish = [this, stream](int64_t lastIndex)
+        {
+            unlinkStream(stream);
+            m_server->lastTileConsumed(lastIndex);
+        };
+        state->cancel = [this, stream](int64_t currentIndex)
+        {
+            unlinkStream(stream);
+            return cancelEvaluation({currentIndex});
+        };
+        state->unlink = [this, stream]()
+        {
+            if(m_openStream == stream)
+                m_openStream = nullptr;
+        };
+        m_openStream = state.get();
+        return state;
+    }
+
+    // Forgets a stream that finished: it doesn't refer to the client anymore.
+    void unlinkStream(TileStream::State* stream)
+    {
+        stream->unlink = nullptr;
+        if(m_openStream == stream)
+            m_openStream = nullptr;
+    }
+
+    // Requests samples with input and calls producer(tile, tilePtr) or consumer(tile, tilePtr) for each tile.
+    template<typename Producer, typename Consumer>
+    void evaluateInput(bool isSPP, int64_t numSamples, const Producer& producer, const Consumer& consumer)
+    {
+        auto tilePkg = m_server->evaluateInputSamples(isSPP, numSamples);
+        if(!tilePkg.isValid)
+            return;
 
-        if(!m_resultMemory.attach())
-            throw std::runtime_error("Couldn't attach result shared memory:\n - " + m_resultMemory.error());
+        float* buffer = m_server->getTilesData();
+        int64_t tileIndex = tilePkg.tile.index;
+        producer(tilePkg.tile, &buffer[tileIndex]);
+
+        while(tilePkg.hasNext)
+        {
+            bool prevWasInput = tilePkg.isInputRequest;
+            tilePkg = m_server->getNextInputTile(tileIndex, prevWasInput);
+            tileIndex = tilePkg.tile.index;
+            if(tilePkg.isInputRequest)
+                producer(tilePkg.tile, &buffer[tileIndex]);
+            else
+                consumer(tilePkg.tile, &buffer[tileIndex]);
+        }
+
+        m_server->lastTileConsumed(tileIndex);
     }
 
-    std::unique_ptr<rpc::client> m_client;
-    SharedMemory m_tilesMemory;
-    SharedMemory m_resultMemory;
+    std::unique_ptr<ServerConnection> m_server;
     SceneInfo m_sceneInfo;
     int64_t m_maxNumSamples = 0;
     int64_t m_sampleSize = 0;
     int64_t m_numPixels = 0;
     bool m_hasInputSamples = false;
+    bool m_pixelStatistics = false;
+    std::map<int, SampleLayout> m_layouts; // registered layouts
 
     //bypass mode
     std::unique_ptr<BenchmarkManager> m_bmkManager;
     std::unique_ptr<QProcess> m_rendererProcess;
+
+    // Stream being pulled, if any (see TileStream::State).
+    TileStream::State* m_openStream = nullptr;
+
+    // Holds tile copies in eager release mode (see setEagerTileRelease()).
+    TileArena m_arena;
+    bool m_eagerRelease = false;
+
+    // Consumes tiles in parallel (see setNumConsumerThreads()). Null means tiles are consumed by the calling thread.
+    std::unique_ptr<ThreadPool> m_consumerPool;
+
+    // Runs the async evaluations. Declared last so it's destroyed (finishing pending work) first.
+    std::unique_ptr<ThreadPool> m_executor;
 };
 
 
+// ======================================================
+// Evaluation
+// ======================================================
+struct Evaluation::State
+{
+    std::atomic<bool> canceled{false};
+    std::atomic<int64_t> numRefundedSamples{0};
+    std::shared_future<void> future;
+};
+
+Evaluation::Evaluation() = default;
+
+Evaluation::Evaluation(std::shared_ptr<State> state):
+    m_state(std::move(state))
+{}
+
+bool Evaluation::isValid() const
+{
+    return m_state != nullptr;
+}
+
+bool Evaluation::isFinished() const
+{
+    if(!m_state)
+        return true;
+    return m_state->future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+void Evaluation::wait() const
+{
+    if(m_state)
+        m_state->future.get();
+}
+
+void Evaluation::cancel()
+{
+    if(m_state)
+        m_state->canceled = true;
+}
+
+bool Evaluation::isCanceled() const
+{
+    return m_state && m_state->canceled;
+}
+
+int64_t Evaluation::getNumRefundedSamples() const
+{
+    return m_state ? m_state->numRefundedSamples.load() : 0;
+}
+
+
+// ======================================================
+// TileStream
+// ======================================================
+TileStream::TileStream() = default;
+
+TileStream::TileStream(std::unique_ptr<State> state):
+    m_state(std::move(state))
+{}
+
+TileStream::TileStream(TileStream&& stream) = default;
+
+TileStream::~TileStream()
+{
+    try
+    {
+        close();
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Error closing TileStream: " << e.what() << std::endl;
+    }
+}
+
+bool TileStream::next()
+{
+    if(!m_state || m_state->finished)
+        return false;
+
+    auto& s = *m_state;
+    if(!s.started)
+        s.started = true;
+    else if(!s.tilePkg.hasNext)
+    {
+        s.finished = true;
+        s.tile.reset();
+        s.finish(s.tilePkg.tile.index);
+        return false;
+    }
+    else
+        s.tilePkg = s.getNext(s.tilePkg.tile.index, s.tilePkg.isInputRequest);
+
+    const auto& tile = s.tilePkg.tile;
+    s.tile.reset(new BufferTile(tile.window.begin.x,
+                                tile.window.end.x,
+                                tile.window.begin.y,
+                                tile.window.end.y,
+                                s.sampleSize, s.spp, &s.buffer[tile.index]));
+    return true;
+}
+
+const BufferTile& TileStream::tile() const
+{
+    if(!m_state || !m_state->tile)
+        throw std::logic_error("TileStream has no current tile.");
+    return *m_state->tile;
+}
+
+bool TileStream::isInputRequest() const
+{
+    return m_state && m_state->tile && m_state->tilePkg.isInputRequest;
+}
+
+bool TileStream::isFinished() const
+{
+    return !m_state || m_state->finished;
+}
+
+void TileStream::close()
+{
+    while(next());
+}
+
+int64_t TileStream::cancel()
+{
+    if(!m_state || m_state->finished)
+        return 0;
+
+    auto& s = *m_state;
+    s.finished = true;
+    s.tile.reset();
+    return s.cancel(s.tilePkg.tile.index);
+}
+
+TileStream& TileStream::operator=(TileStream&& stream)
+{
+    if(this != &stream)
+    {
+        close();
+        m_state = std::move(stream.m_state);
+    }
+    return *this;
+}
+
+
+// ======================================================
+// BenchmarkClient
+// ======================================================
 BenchmarkClient::BenchmarkClient(int argc, char* argv[]):
     m_imp(std::make_unique<Imp>(argc, argv))
 {
     m_imp->fetchSceneInfo();
 }
 
+BenchmarkClient::BenchmarkClient(BenchmarkClient&& client) = default;
+
 BenchmarkClient::~BenchmarkClient() = default;
 
 SceneInfo BenchmarkClient::getSceneInfo()
@@ -215,135 +858,156 @@ SceneInfo BenchmarkClient::getSceneInfo()
 
 void BenchmarkClient::setSampleLayout(const SampleLayout& layout)
 {
-    m_imp->m_sampleSize = layout.getSampleSize();
-    m_imp->m_hasInputSamples = layout.hasInput();
-    m_imp->m_client->call("SET_SAMPLE_LAYOUT", layout);
+    m_imp->waitAsync();
+    m_imp->useLayout(layout);
+    m_imp->m_server->setSampleLayout(layout);
+}
+
+int BenchmarkClient::registerSampleLayout(const SampleLayout& layout)
+{
+    m_imp->waitAsync();
+    if(layout.isPixelStatistics() && layout.hasInput())
+        throw std::invalid_argument("The pixel statistics mode doesn't support INPUT elements.");
+    int id = m_imp->m_server->registerSampleLayout(layout);
+    if(id < 0)
+        throw std::invalid_argument("Invalid sample layout.");
+    m_imp->m_layouts[id] = layout;
+    return id;
+}
+
+void BenchmarkClient::setSampleLayout(int layoutId)
+{
+    m_imp->waitAsync();
+    auto it = m_imp->m_layouts.find(layoutId);
+    if(it == m_imp->m_layouts.end())
+        throw std::invalid_argument("Unknown sample layout id: " + std::to_string(layoutId));
+    m_imp->useLayout(it->second);
+    m_imp->m_server->selectSampleLayout(layoutId);
 }
 
 float *BenchmarkClient::getResultBuffer()
 {
-    return static_cast<float*>(m_imp->m_resultMemory.data());
+    return m_imp->m_server->getResultData();
 }
 
 void BenchmarkClient::evaluateSamples(SPP spp, const TileConsumer& consumer)
 {
+    m_imp->waitAsync();
+    m_imp->evaluate(true, spp.getValue(), nullptr, [&](const Tile& tile, float* data)
+    {
+        consumer(makeBufferTile(tile, spp.getValue(), data));
+    });
+}
+
+void BenchmarkClient::evaluateSamples(SPP spp, const std::vector<CropWindow>& windows, const TileConsumer& consumer)
+{
+    m_imp->waitAsync();
     if(m_imp->m_hasInputSamples)
         throw std::logic_error("evaluateSamples() doesn't support input samples, use evaluateInputSamples().");
 
-    auto tilePkg = m_imp->m_client->call("EVALUATE_SAMPLES", true, spp.getValue()).as<TilePkg>();
-    m_imp->m_tilesMemory.detach();
-    if(!m_imp->m_tilesMemory.attach())
-        throw std::runtime_error("error attaching tilesMemory");
+    auto tilePkg = m_imp->m_server->evaluateRegions(spp.getValue(), windows);
+    int64_t tileSpp = spp.getValue();
+    m_imp->consumeTiles(tilePkg, nullptr, [&](const Tile& tile, float* data)
+    {
+        // The server may reduce the spp to fit the budget.
+        if(tile.numSamples > 0)
+            tileSpp = tile.numSamples / ((tile.window.end.x - tile.window.begin.x) * (tile.window.end.y - tile.window.begin.y));
+        consumer(makeBufferTile(tile, tileSpp, data));
+    });
+}
 
-    auto buffer = static_cast<float*>(m_imp->m_tilesMemory.data());
-    const auto& tile = tilePkg.tile;
-    int64_t tileIndex = tile.index;
-    float* tilePtr = &buffer[tileIndex];
-    BufferTile bufferTile(tile.window.begin.x,
-                          tile.window.end.x,
-                          tile.window.begin.y,
-                          tile.window.end.y,
-                          m_imp->m_sampleSize, spp.getValue(), tilePtr);
-    consumer(bufferTile);
+BufferTile BenchmarkClient::evaluateFrame(SPP spp)
+{
+    m_imp->waitAsync();
+    if(m_imp->m_hasInputSamples)
+        throw std::logic_error("evaluateFrame() doesn't support input samples, use evaluateInputSamples().");
 
-    bool hasNext = tilePkg.hasNext;
-    while(hasNext)
-    {
-        tilePkg = m_imp->m_client->call("GET_NEXT_TILE", tileIndex).as<TilePkg>();
-        const auto& tile = tilePkg.tile;
-        tileIndex = tile.index;
-        hasNext = tilePkg.hasNext;
-        tilePtr = &buffer[tileIndex];
-        BufferTile bufferTile(tile.window.begin.x,
-                              tile.window.end.x,
-                              tile.window.begin.y,
-                              tile.window.end.y,
-                              m_imp->m_sampleSize, spp.getValue(), tilePtr);
-        consumer(bufferTile);
-    }
+    auto tilePkg = m_imp->m_server->evaluateFrame(spp.getValue());
+    const Tile& tile = tilePkg.tile;
+    if(!tilePkg.isValid)
+        return BufferTile(0, 0, 0, 0, m_imp->m_sampleSize, 0, nullptr);
+
+    float* frame = m_imp->m_server->getFrameData();
+    // The frame is complete: let the renderer finish the evaluation.
+    m_imp->m_server->lastTileConsumed(tile.index);
 
-    m_imp->m_client->call("LAST_TILE_CONSUMED", tileIndex);
+    int64_t frameSpp = tile.numSamples / ((tile.window.end.x - tile.window.begin.x) * (tile.window.end.y - tile.window.begin.y));
+    return makeBufferTile(tile, frameSpp, frame);
 }
 
 void BenchmarkClient::evaluateSamples(int64_t numSamples, const TileConsumer2 &consumer)
 {
     if(numSamples <= 0)
         return;
-    if(m_imp->m_hasInputSamples)
-        throw std::logic_error("evaluateSamples() doesn't support input samples, use evaluateInputSamples().");
 
-    auto tilePkg = m_imp->m_client->call("EVALUATE_SAMPLES", false, numSamples).as<TilePkg>();
-    if(!tilePkg.isValid)
-        return;
-
-    m_imp->m_tilesMemory.detach();
-    if(!m_imp->m_tilesMemory.attach())
-        throw std::runtime_error("error attaching tilesMemory");
+    m_imp->waitAsync();
+    m_imp->evaluate(false, numSamples, nullptr, [&](const Tile& tile, float* data)
+    {
+        consumer(tile.numSamples, data);
+    });
+}
 
-    auto buffer = static_cast<float*>(m_imp->m_tilesMemory.data());
-    const auto& tile = tilePkg.tile;
-    int64_t tileIndex = tile.index;
-    float* tilePtr = &buffer[tileIndex];
-    consumer(tilePkg.tile.numSamples, tilePtr);
+Evaluation BenchmarkClient::evaluateSamplesAsync(SPP spp, const TileConsumer& consumer)
+{
+    m_imp->checkNoStream();
+    auto state = std::make_shared<Evaluation::State>();
+    // The client may be moved while the task runs, but its Imp stays.
+    Imp* imp = m_imp.get();
+    auto task = std::make_shared<std::packaged_task<void()>>([imp, state, spp, consumer]()
+    {
+        if(state->canceled)
+            return;
+        state->numRefundedSamples = imp->evaluate(true, spp.getValue(), &state->canceled, [&](const Tile& tile, float* data)
+        {
+            consumer(imp->makeBufferTile(tile, spp.getValue(), data));
+        });
+    });
+    state->future = task->get_future().share();
+    m_imp->executor().enqueue([task](){ (*task)(); });
+    return Evaluation(state);
+}
 
-    bool hasNext = tilePkg.hasNext;
-    while(hasNext)
+Evaluation BenchmarkClient::evaluateSamplesAsync(int64_t numSamples, const TileConsumer2& consumer)
+{
+    m_imp->checkNoStream();
+    auto state = std::make_shared<Evaluation::State>();
+    Imp* imp = m_imp.get();
+    auto task = std::make_shared<std::packaged_task<void()>>([imp, state, numSamples, consumer]()
     {
-        tilePkg = m_imp->m_client->call("GET_NEXT_TILE", tileIndex).as<TilePkg>();
-        const auto& tile = tilePkg.tile;
-        tileIndex = tile.index;
-        hasNext = tilePkg.hasNext;
-        tilePtr = &buffer[tileIndex];
-        consumer(tilePkg.tile.numSamples, tilePtr);
-    }
+        if(state->canceled || numSamples <= 0)
+            return;
+        state->numRefundedSamples = imp->evaluate(false, numSamples, &state->canceled, [&](const Tile& tile, float* data)
+        {
+            consumer(tile.numSamples, data);
+        });
+    });
+    state->future = task->get_future().share();
+    m_imp->executor().enqueue([task](){ (*task)(); });
+    return Evaluation(state);
+}
+
+TileStream BenchmarkClient::streamSamples(SPP spp)
+{
+    m_imp->waitAsync();
+    if(m_imp->m_hasInputSamples)
+        throw std::logic_error("streamSamples() doesn't support input samples, use streamInputSamples().");
+    return TileStream(m_imp->openStream(false, spp.getValue()));
+}
 
-    m_imp->m_client->call("LAST_TILE_CONSUMED", tileIndex);
+TileStream BenchmarkClient::streamInputSamples(SPP spp)
+{
+    m_imp->waitAsync();
+    return TileStream(m_imp->openStream(true, spp.getValue()));
 }
 
 void BenchmarkClient::evaluateInputSamples(SPP spp,
                                            const TileProducer &producer,
                                            const TileConsumer &consumer)
 {
-    auto tilePkg = m_imp->m_client->call("EVALUATE_INPUT_SAMPLES", true, spp.getValue()).as<TilePkg>();
-    if(!tilePkg.isValid)
-        return;
-
-    m_imp->m_tilesMemory.detach();
-    if(!m_imp->m_tilesMemory.attach())
-        throw std::runtime_error("error attaching tilesMemory");
-
-    auto buffer = static_cast<float*>(m_imp->m_tilesMemory.data());
-    const auto& tile = tilePkg.tile;
-    int64_t tileIndex = tile.index;
-    float* tilePtr = &buffer[tileIndex];
-    BufferTile bufferTile(tile.window.begin.x,
-                          tile.window.end.x,
-                          tile.window.begin.y,
-                          tile.window.end.y,
-                          m_imp->m_sampleSize, spp.getValue(), tilePtr);
-    producer(bufferTile);
-
-    bool hasNext = tilePkg.hasNext;
-    while(hasNext)
-    {
-        bool prevWasInput = tilePkg.isInputRequest;
-        tilePkg = m_imp->m_client->call("GET_NEXT_INPUT_TILE", tileIndex, prevWasInput).as<TilePkg>();
-        const auto& tile = tilePkg.tile;
-        tileIndex = tile.index;
-        hasNext = tilePkg.hasNext;
-        tilePtr = &buffer[tileIndex];
-        BufferTile bufferTile(tile.window.begin.x,
-                              tile.window.end.x,
-                              tile.window.begin.y,
-                              tile.window.end.y,
-                              m_imp->m_sampleSize, spp.getValue(), tilePtr);
-        if(tilePkg.isInputRequest)
-            producer(bufferTile);
-        else
-            consumer(bufferTile);
-    }
-
-    m_imp->m_client->call("LAST_TILE_CONSUMED", tileIndex);
+    m_imp->waitAsync();
+    m_imp->evaluateInput(true, spp.getValue(),
+        [&](const Tile& tile, float* data){ producer(makeBufferTile(tile, spp.getValue(), data)); },
+        [&](const Tile& tile, float* data){ consumer(makeBufferTile(tile, spp.getValue(), data)); });
 }
 
 void BenchmarkClient::evaluateInputSamples(int64_t numSamples,
@@ -353,39 +1017,51 @@ void BenchmarkClient::evaluateInputSamples(int64_t numSamples,
     if(numSamples <= 0)
         return;
 
-    auto tilePkg = m_imp->m_client->call("EVALUATE_INPUT_SAMPLES", false, numSamples).as<TilePkg>();
-    if(!tilePkg.isValid)
-        return;
+    m_imp->waitAsync();
+    m_imp->evaluateInput(false, numSamples,
+        [&](const Tile& tile, float* data){ producer(tile.numSamples, data); },
+        [&](const Tile& tile, float* data){ consumer(tile.numSamples, data); });
+}
 
-    m_imp->m_tilesMemory.detach();
-    if(!m_imp->m_tilesMemory.attach())
-        throw std::runtime_error("error attaching tilesMemory");
+void BenchmarkClient::setNumConsumerThreads(int numThreads)
+{
+    if(numThreads < 0)
+        throw std::invalid_argument("The number of consumer threads can't be negative.");
+    if(numThreads == 0)
+        numThreads = std::max<int>(std::thread::hardware_concurrency(), 1);
 
-    auto buffer = static_cast<float*>(m_imp->m_tilesMemory.data());
-    const auto& tile = tilePkg.tile;
-    int64_t tileIndex = tile.index;
-    float* tilePtr = &buffer[tileIndex];
-    producer(tilePkg.tile.numSamples, tilePtr);
+    m_imp->waitAsync();
+    if(numThreads == 1)
+        m_imp->m_consumerPool.reset();
+    else if(!m_imp->m_consumerPool || m_imp->m_consumerPool->numThreads() != numThreads)
+        m_imp->m_consumerPool = std::make_unique<ThreadPool>(numThreads);
+}
 
-    bool hasNext = tilePkg.hasNext;
-    while(hasNext)
-    {
-        bool prevWasInput = tilePkg.isInputRequest;
-        tilePkg = m_imp->m_client->call("GET_NEXT_INPUT_TILE", tileIndex, prevWasInput).as<TilePkg>();
-        const auto& tile = tilePkg.tile;
-        tileIndex = tile.index;
-        hasNext = tilePkg.hasNext;
-        tilePtr = &buffer[tileIndex];
-        if(tilePkg.isInputRequest)
-            producer(tilePkg.tile.numSamples, tilePtr);
-        else
-            consumer(tilePkg.tile.numSamples, tilePtr);
-    }
+int BenchmarkClient::getNumConsumerThreads() const
+{
+    return m_imp->m_consumerPool ? m_imp->m_consumerPool->numThreads() : 1;
+}
 
-    m_imp->m_client->call("LAST_TILE_CONSUMED", tileIndex);
+void BenchmarkClient::setEagerTileRelease(bool enable)
+{
+    m_imp->waitAsync();
+    m_imp->m_eagerRelease = enable;
+}
+
+bool BenchmarkClient::isEagerTileReleaseEnabled() const
+{
+    return m_imp->m_eagerRelease;
 }
 
 void BenchmarkClient::sendResult()
 {
-    m_imp->m_client->call("SEND_RESULT");
+    m_imp->waitAsync();
+    m_imp->m_server->sendResult();
+}
+
+BenchmarkClient& BenchmarkClient::operator=(BenchmarkClient&& client) = default;
+
+BufferTile BenchmarkClient::makeBufferTile(const Tile& tile, int64_t spp, float* data) const
+{
+    return m_imp->makeBufferTile(tile, spp, data);
 }
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "fbksd/client/ImageAccumulator.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+using namespace fbksd;
+
+
+namespace
+{
+
+// acc[0, n) += w * v[0, n).
+// If `wide`, all `stride` floats after v are readable, and the channels are processed 4 at a time
+// (lanes past n only touch the padding of acc).
+inline void accumulate(float* acc, const float* v, int n, int stride, float w, bool wide)
+{
+#ifdef __SSE__
+    if(wide)
+    {
+        const __m128 ww = _mm_set1_ps(w);
+        for(int c = 0; c < stride; c += 4)
+            _mm_storeu_ps(acc + c, _mm_add_ps(_mm_loadu_ps(acc + c), _mm_mul_ps(ww, _mm_loadu_ps(v + c))));
+        return;
+    }
+#else
+    (void)stride;
+    (void)wide;
+#endif
+    for(int c = 0; c < n; ++c)
+        acc[c] += w * v[c];
+}
+
+// dst[0, stride) += src[0, stride)
+inline void addPixel(float* dst, const float* src, int stride)
+{
+#ifdef __SSE__
+    for(int c = 0; c < stride; c += 4)
+        _mm_storeu_ps(dst + c, _mm_add_ps(_mm_loadu_ps(dst + c), _mm_loadu_ps(src + c)));
+#else
+    for(int c = 0; c < stride; ++c)
+        dst[c] += src[c];
+#endif
+}
+
+}
+
+
+ImageAccumulator::ImageAccumulator(int64_t width,
+                                   int64_t height,
+                                   int64_t sampleSize,
+                                   int firstChannel,
+                                   int numChannels,
+                                   Filter filter,
+                                   float radius):
+    m_width(width),
+    m_height(height),
+    m_sampleSize(sampleSize),
+    m_firstChannel(firstChannel),
+    m_numChannels(numChannels),
+    m_stride((numChannels + 3) / 4 * 4),
+    m_filter(filter),
+    m_radius(radius),
+    m_sums(width * height * m_stride, 0.f),
+    m_weights(width * height, 0.f)
+{
+    if(firstChannel < 0 || numChannels <= 0 || firstChannel + numChannels > sampleSize)
+        throw std::invalid_argument("ImageAccumulator: the channels should be inside the sample.");
+    if(radius <= 0.f)
+        throw std::invalid_argument("ImageAccumulator: the filter radius should be positive.");
+}
+
+void ImageAccumulator::setPositionChannels(int xIndex, int yIndex)
+{
+    if(xIndex < 0 || xIndex >= m_sampleSize || yIndex < 0 || yIndex >= m_sampleSize)
+        throw std::invalid_argument("ImageAccumulator: the position channels should be inside the sample.");
+    m_xIndex = xIndex;
+    m_yIndex = yIndex;
+}
+
+void ImageAccumulator::add(const BufferTile& tile)
+{
+    if(tile.numPixels() == 0 || tile.getSPP() == 0)
+        return;
+    if(tile.getSampleSize() != m_sampleSize)
+        throw std::invalid_argument("ImageAccumulator: the tile sample size differs from the accumulator sample size.");
+
+    const float* end = *tile.end();
+    if(isPixelMean())
+    {
+        // Tiles of an evaluation don't overlap, but add(int64_t, const float*) and tiles of other
+        // evaluations can write the same pixels.
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for(int64_t y = tile.beginY(); y < tile.endY(); ++y)
+        for(int64_t x = tile.beginX(); x < tile.endX(); ++x)
+        {
+            const int64_t p = y * m_width + x;
+            float* acc = &m_sums[p * m_stride];
+            for(int64_t s = 0; s < tile.getSPP(); ++s)
+            {
+                const float* v = tile(x, y, s) + m_firstChannel;
+                accumulate(acc, v, m_numChannels, m_stride, 1.f, v + m_stride <= end);
+            }
+            m_weights[p] += tile.getSPP();
+        }
+        return;
+    }
+
+    // Splats into a private buffer covering the tile and the filter footprint around it,
+    // so the shared buffers are locked only for the final merge.
+    const auto margin = static_cast<int64_t>(std::ceil(m_radius));
+    Window local{std::max<int64_t>(tile.beginX() - margin, 0), std::min(tile.endX() + margin, m_width),
+                 std::max<int64_t>(tile.beginY() - margin, 0), std::min(tile.endY() + margin, m_height),
+                 nullptr, nullptr};
+    const int64_t localWidth = local.ex - local.x;
+    std::vector<float> sums(localWidth * (local.ey - local.y) * m_stride, 0.f);
+    std::vector<float> weights(localWidth * (local.ey - local.y), 0.f);
+    local.sums = sums.data();
+    local.weights = weights.data();
+
+    for(int64_t y = tile.beginY(); y < tile.endY(); ++y)
+    for(int64_t x = tile.beginX(); x < tile.endX(); ++x)
+    {
+        for(int64_t s = 0; s < tile.getSPP(); ++s)
+        {
+            const float* sample = tile(x, y, s);
+            float px = m_xIndex >= 0 ? sample[m_xIndex] : x + 0.5f;
+            float py = m_yIndex >= 0 ? sample[m_yIndex] : y + 0.5f;
+            splat(local, px, py, sample, end);
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(int64_t y = local.y; y < local.ey; ++y)
+    for(int64_t x = local.x; x < local.ex; ++x)
+    {
+        const int64_t lp = (y - local.y) * localWidth + (x - local.x);
+        const int64_t p = y * m_width + x;
+        addPixel(&m_sums[p * m_stride], &sums[lp * m_stride], m_stride);
+        m_weights[p] += weights[lp];
+    }
+}
+
+void ImageAccumulator::add(int64_t numSamples, const float* samples)
+{
+    if(m_xIndex < 0)
+        throw std::logic_error("ImageAccumulator: the position channels must be set to add samples not grouped by pixel.");
+
+    const float* end = samples + numSamples * m_sampleSize;
+    Window image{0, m_width, 0, m_height, m_sums.data(), m_weights.data()};
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for(int64_t i = 0; i < numSamples; ++i)
+    {
+        const float* sample = &samples[i * m_sampleSize];
+        if(isPixelMean())
+        {
+            auto x = std::min(std::max(static_cast<int64_t>(sample[m_xIndex]), INT64_C(0)), m_width - 1);
+            auto y = std::min(std::max(static_cast<int64_t>(sample[m_yIndex]), INT64_C(0)), m_height - 1);
+            const float* v = sample + m_firstChannel;
+            accumulate(&m_sums[(y * m_width + x) * m_stride], v, m_numChannels, m_stride, 1.f, v + m_stride <= end);
+            m_weights[y * m_width + x] += 1.f;
+        }
+        else
+            splat(image, sample[m_xIndex], sample[m_yIndex], sample, end);
+    }
+}
+
+void ImageAccumulator::resolve(float* out) const
+{
+    const int64_t numPixels = m_width * m_height;
+    const float* outEnd = out + numPixels * m_numChannels;
+    for(int64_t p = 0; p < numPixels; ++p)
+    {
+        const float w = m_weights[p];
+        const float inv = w > 0.f ? 1.f / w : 0.f;
+        const float* acc = &m_sums[p * m_stride];
+        float* o = out + p * m_numChannels;
+#ifdef __SSE__
+        // Lanes past the pixel channels are overwritten by the next pixel.
+        if(o + m_stride <= outEnd)
+        {
+            const __m128 vinv = _mm_set1_ps(inv);
+            for(int c = 0; c < m_stride; c += 4)
+                _mm_storeu_ps(o + c, _mm_mul_ps(_mm_loadu_ps(acc + c), vinv));
+            continue;
+        }
+#else
+        (void)outEnd;
+#endif
+        for(int c = 0; c < m_numChannels; ++c)
+            o[c] = acc[c] * inv;
+    }
+}
+
+void ImageAccumulator::clear()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::fill(m_sums.begin(), m_sums.end(), 0.f);
+    std::fill(m_weights.begin(), m_weights.end(), 0.f);
+}
+
+bool ImageAccumulator::isPixelMean() const
+{
+    return m_filter == BOX && m_radius <= 0.5f;
+}
+
+float ImageAccumulator::weight(float d) const
+{
+    switch(m_filter)
+    {
+    case BOX:
+        return d <= m_radius ? 1.f : 0.f;
+    case TENT:
+        return std::max(1.f - d / m_radius, 0.f);
+    case GAUSSIAN:
+        return std::max(std::exp(-2.f * d * d) - std::exp(-2.f * m_radius * m_radius), 0.f);
+    }
+    return 0.f;
+}
+
+void ImageAccumulator::splat(const Window& window, float px, float py, const float* sample, const float* end)
+{
+    const float* v = sample + m_firstChannel;
+    const bool wide = v + m_stride <= end;
+    const int64_t windowWidth = window.ex - window.x;
+    const auto x0 = std::max(static_cast<int64_t>(std::ceil(px - 0.5f - m_radius)), window.x);
+    const auto x1 = std::min(static_cast<int64_t>(std::floor(px - 0.5f + m_radius)), window.ex - 1);
+    const auto y0 = std::max(static_cast<int64_t>(std::ceil(py - 0.5f - m_radius)), window.y);
+    const auto y1 = std::min(static_cast<int64_t>(std::floor(py - 0.5f + m_radius)), window.ey - 1);
+    for(int64_t y = y0; y <= y1; ++y)
+    {
+        const float wy = weight(std::abs(y + 0.5f - py));
+        if(wy == 0.f)
+            continue;
+        for(int64_t x = x0; x <= x1; ++x)
+        {
+            const float w = wy * weight(std::abs(x + 0.5f - px));
+            if(w == 0.f)
+                continue;
+            const int64_t p = (y - window.y) * windowWidth + (x - window.x);
+            accumulate(&window.sums[p * m_stride], v, m_numChannels, m_stride, w, wide);
+            window.weights[p] += w;
+        }
+    }
+}
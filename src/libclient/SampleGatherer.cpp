@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "fbksd/client/SampleGatherer.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <thread>
+using namespace fbksd;
+
+
+namespace
+{
+
+// Below this number of samples per thread, splitting the work costs more than it saves.
+constexpr int64_t MIN_SAMPLES_PER_THREAD = 1 << 16;
+
+// Runs task(0), ..., task(n - 1) in the pool and waits for them.
+void runTasks(ThreadPool* pool, int n, const std::function<void(int)>& task)
+{
+    if(n == 1)
+    {
+        task(0);
+        return;
+    }
+    for(int i = 0; i < n; ++i)
+        pool->enqueue([&task, i](){ task(i); });
+    pool->wait();
+}
+
+}
+
+
+SampleGatherer::SampleGatherer(int64_t width, int64_t height, int sampleSize, int xIndex, int yIndex):
+    m_width(width),
+    m_height(height),
+    m_sampleSize(sampleSize),
+    m_xIndex(xIndex),
+    m_yIndex(yIndex),
+    m_numThreads(std::max<int>(std::thread::hardware_concurrency(), 1)),
+    m_offsets(width * height + 1, 0)
+{
+    if(width <= 0 || height <= 0)
+        throw std::invalid_argument("SampleGatherer: the image size should be positive.");
+    if(xIndex < 0 || xIndex >= sampleSize || yIndex < 0 || yIndex >= sampleSize)
+        throw std::invalid_argument("SampleGatherer: IMAGE_X and IMAGE_Y positions should be inside the sample.");
+}
+
+SampleGatherer::~SampleGatherer() = default;
+
+void SampleGatherer::setNumThreads(int n)
+{
+    m_numThreads = std::max(n, 1);
+    m_pool.reset();
+}
+
+void SampleGatherer::add(int64_t numSamples, const float* samples)
+{
+    m_pending.insert(m_pending.end(), samples, samples + numSamples * m_sampleSize);
+}
+
+void SampleGatherer::gather()
+{
+    const int64_t numPixels = m_width * m_height;
+    const int64_t numOld = m_offsets.back();
+    const int64_t numNew = static_cast<int64_t>(m_pending.size()) / m_sampleSize;
+    const int64_t numSamples = numOld + numNew;
+    if(numNew == 0)
+        return;
+
+    // The old samples are already sorted, so only the new ones are sorted, and each pixel gets its old samples
+    // followed by its new ones. The work is split twice: each task takes a range of the new samples to bucket
+    // them by pixel range, and then a pixel range to sort its bucket and write the output. This way, no task
+    // needs counters for the whole image.
+    const int numTasks = static_cast<int>(std::min<int64_t>({m_numThreads, std::max<int64_t>(numSamples / MIN_SAMPLES_PER_THREAD, 1), numPixels}));
+    if(numTasks > 1 && (!m_pool || m_pool->numThreads() < numTasks))
+        m_pool = std::make_unique<ThreadPool>(m_numThreads);
+    const int64_t pixelsPerRange = (numPixels + numTasks - 1) / numTasks;
+    auto pixelRangeBegin = [&](int range){ return std::min(range * pixelsPerRange, numPixels); };
+    auto sampleRangeBegin = [&](int task){ return numNew * task / numTasks; };
+    auto sampleAt = [&](int64_t i){ return &m_pending[i * m_sampleSize]; };
+
+    // Pass 1: each task counts its new samples per pixel range.
+    std::vector<int64_t> bucketCursors(numTasks * numTasks, 0);
+    runTasks(m_pool.get(), numTasks, [&](int task)
+    {
+        int64_t* taskCounts = &bucketCursors[task * numTasks];
+        for(int64_t i = sampleRangeBegin(task); i < sampleRangeBegin(task + 1); ++i)
+            ++taskCounts[getPixel(sampleAt(i)) / pixelsPerRange];
+    });
+
+    // Prefix sums: each bucket holds the samples of the tasks in order, so the order of the samples is kept.
+    std::vector<int64_t> bucketBegins(numTasks + 1, 0);
+    int64_t offset = 0;
+    for(int range = 0; range < numTasks; ++range)
+    {
+        bucketBegins[range] = offset;
+        for(int task = 0; task < numTasks; ++task)
+        {
+            int64_t count = bucketCursors[task * numTasks + range];
+            bucketCursors[task * numTasks + range] = offset;
+            offset += count;
+        }
+    }
+    bucketBegins[numTasks] = numNew;
+
+    // Pass 2: each task writes the indices of its new samples to the buckets.
+    std::vector<int64_t> buckets(numNew);
+    runTasks(m_pool.get(), numTasks, [&](int task)
+    {
+        int64_t* cursors = &bucketCursors[task * numTasks];
+        for(int64_t i = sampleRangeBegin(task); i < sampleRangeBegin(task + 1); ++i)
+            buckets[cursors[getPixel(sampleAt(i)) / pixelsPerRange]++] = i;
+    });
+
+    // The old offsets at the range limits, read before the tasks overwrite them.
+    std::vector<int64_t> oldRangeBegins(numTasks + 1);
+    for(int range = 0; range <= numTasks; ++range)
+        oldRangeBegins[range] = m_offsets[pixelRangeBegin(range)];
+
+    // Pass 3: each task merges the old and new samples of its pixel range.
+    const size_t sampleBytes = m_sampleSize * sizeof(float);
+    m_buffer.resize(numSamples * m_sampleSize);
+    runTasks(m_pool.get(), numTasks, [&](int range)
+    {
+        const int64_t begin = pixelRangeBegin(range);
+        const int64_t end = pixelRangeBegin(range + 1);
+        std::vector<int64_t> cursors(end - begin, 0);
+        for(int64_t b = bucketBegins[range]; b < bucketBegins[range + 1]; ++b)
+            ++cursors[getPixel(sampleAt(buckets[b])) - begin];
+
+        int64_t position = oldRangeBegins[range] + bucketBegins[range];
+        for(int64_t p = begin; p < end; ++p)
+        {
+            const int64_t oldBegin = m_offsets[p];
+            const int64_t oldEnd = p + 1 < end ? m_offsets[p + 1] : oldRangeBegins[range + 1];
+            m_offsets[p] = position;
+            if(oldEnd > oldBegin)
+                std::memcpy(m_buffer.data() + position * m_sampleSize, m_samples.data() + oldBegin * m_sampleSize, (oldEnd - oldBegin) * sampleBytes);
+            position += oldEnd - oldBegin;
+            const int64_t count = cursors[p - begin];
+            cursors[p - begin] = position;
+            position += count;
+        }
+
+        for(int64_t b = bucketBegins[range]; b < bucketBegins[range + 1]; ++b)
+        {
+            const float* sample = sampleAt(buckets[b]);
+            int64_t& cursor = cursors[getPixel(sample) - begin];
+            std::memcpy(&m_buffer[cursor * m_sampleSize], sample, sampleBytes);
+            ++cursor;
+        }
+    });
+    m_offsets[numPixels] = numSamples;
+
+    std::swap(m_samples, m_buffer);
+    m_pending.clear();
+}
+
+void SampleGatherer::clear()
+{
+    m_samples.clear();
+    m_pending.clear();
+    std::fill(m_offsets.begin(), m_offsets.end(), 0);
+}
+
+int64_t SampleGatherer::getPixel(const float* sample) const
+{
+    // Clamped before the conversion, which is undefined for NaN and out of range values.
+    auto toPixel = [](float v, int64_t size) -> int64_t
+    {
+        if(!(v >= 0.f)) // also true for NaN
+            return 0;
+        if(v >= static_cast<float>(size))
+            return size - 1;
+        return std::min(static_cast<int64_t>(v), size - 1);
+    };
+    return toPixel(sample[m_yIndex], m_height) * m_width + toPixel(sample[m_xIndex], m_width);
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "fbksd/client/SampleStore.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+using namespace fbksd;
+
+
+namespace
+{
+
+// Chunks are allocated with at least this size, so small tiles share them.
+constexpr int64_t CHUNK_BYTES = 16 << 20;
+
+std::string systemError(const std::string& what)
+{
+    return "SampleStore: " + what + ": " + std::strerror(errno);
+}
+
+// Rounds up to a multiple of the page size, so chunks can be mapped from the spill file.
+int64_t roundToPages(int64_t bytes)
+{
+    const int64_t page = sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
+}
+
+}
+
+
+constexpr int64_t SampleStore::CELL_SIZE;
+
+SampleStore::SampleStore(int64_t width, int64_t height, int64_t sampleSize):
+    m_width(width),
+    m_height(height),
+    m_sampleSize(sampleSize),
+    m_numCellsX((width + CELL_SIZE - 1) / CELL_SIZE),
+    m_cells(m_numCellsX * ((height + CELL_SIZE - 1) / CELL_SIZE))
+{}
+
+SampleStore::~SampleStore()
+{
+    freeChunks();
+    if(m_spillFd != -1)
+        close(m_spillFd);
+}
+
+void SampleStore::setMemoryCap(int64_t maxBytes, const std::string& spillDir)
+{
+    m_memoryCap = std::max(maxBytes, INT64_C(0));
+    m_spillDir = spillDir;
+    spillColdChunks();
+}
+
+void SampleStore::append(const BufferTile& tile)
+{
+    if(tile.numPixels() == 0 || tile.getSPP() == 0)
+        return;
+    if(tile.getSampleSize() != m_sampleSize)
+        throw std::invalid_argument("SampleStore: the tile sample size differs from the store sample size.");
+    if(tile.beginX() < 0 || tile.beginY() < 0 || tile.endX() > m_width || tile.endY() > m_height)
+        throw std::invalid_argument("SampleStore: the tile is outside the image.");
+
+    const int64_t numFloats = tile.numPixels() * tile.getSPP() * m_sampleSize;
+    Block block{tile.beginX(), tile.endX(), tile.beginY(), tile.endY(), tile.getSPP(), 0, 0};
+    float* dst = allocate(numFloats, &block.chunk, &block.offset);
+    std::memcpy(dst, *tile.begin(), numFloats * sizeof(float));
+
+    const auto id = static_cast<int32_t>(m_blocks.size());
+    m_blocks.push_back(block);
+    for(int64_t cy = block.y / CELL_SIZE; cy <= (block.ey - 1) / CELL_SIZE; ++cy)
+        for(int64_t cx = block.x / CELL_SIZE; cx <= (block.ex - 1) / CELL_SIZE; ++cx)
+            m_cells[cy * m_numCellsX + cx].push_back(id);
+    m_numSamples += tile.numPixels() * tile.getSPP();
+
+    spillColdChunks();
+}
+
+int64_t SampleStore::getNumSamples(int64_t x, int64_t y) const
+{
+    int64_t n = 0;
+    forEachSpan(x, y, [&](const float*, int64_t numSamples){ n += numSamples; });
+    return n;
+}
+
+void SampleStore::clear()
+{
+    freeChunks();
+    m_chunks.clear();
+    m_blocks.clear();
+    for(auto& cell: m_cells)
+        cell.clear();
+    m_firstResidentChunk = 0;
+    m_numSamples = 0;
+    m_residentBytes = 0;
+    m_spilledBytes = 0;
+    if(m_spillFd != -1)
+    {
+        close(m_spillFd);
+        m_spillFd = -1;
+    }
+}
+
+float* SampleStore::allocate(int64_t numFloats, int32_t* chunk, int64_t* offset)
+{
+    // Blocks are only appended to the last chunk, which is never spilled.
+    if(m_chunks.empty() || m_chunks.back().capacity - m_chunks.back().used < numFloats)
+    {
+        const int64_t bytes = roundToPages(std::max<int64_t>(numFloats * sizeof(float), CHUNK_BYTES));
+        void* data = nullptr;
+        if(posix_memalign(&data, sysconf(_SC_PAGESIZE), bytes) != 0)
+            throw std::bad_alloc();
+        m_chunks.push_back({static_cast<float*>(data), bytes / static_cast<int64_t>(sizeof(float)), 0, false});
+        m_residentBytes += bytes;
+    }
+
+    Chunk& c = m_chunks.back();
+    *chunk = static_cast<int32_t>(m_chunks.size() - 1);
+    *offset = c.used;
+    c.used += numFloats;
+    return c.data + *offset;
+}
+
+void SampleStore::spillColdChunks()
+{
+    if(m_memoryCap == 0)
+        return;
+
+    // The last chunk is still being filled, so it's never spilled.
+    while(m_residentBytes > m_memoryCap && m_firstResidentChunk + 1 < m_chunks.size())
+    {
+        if(m_spillFd == -1)
+        {
+            std::string dir = m_spillDir;
+            if(dir.empty())
+            {
+                const char* tmp = std::getenv("TMPDIR");
+                dir = tmp && *tmp ? tmp : "/tmp";
+            }
+            std::string path = dir + "/fbksd-samples-XXXXXX";
+            m_spillFd = mkstemp(&path[0]);
+            if(m_spillFd == -1)
+                throw std::runtime_error(systemError("couldn't create spill file in " + dir));
+            // The file is only reachable through the descriptor, and is removed when it's closed.
+            unlink(path.c_str());
+        }
+
+        Chunk& c = m_chunks[m_firstResidentChunk];
+        const int64_t bytes = c.capacity * sizeof(float);
+        const char* src = reinterpret_cast<const char*>(c.data);
+        for(int64_t written = 0; written < bytes;)
+        {
+            auto n = pwrite(m_spillFd, src + written, bytes - written, m_spilledBytes + written);
+            if(n == -1 && errno == EINTR)
+                continue;
+            if(n == -1)
+                throw std::runtime_error(systemError("couldn't write spill file"));
+            written += n;
+        }
+        void* mapped = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, m_spillFd, m_spilledBytes);
+        if(mapped == MAP_FAILED)
+            throw std::runtime_error(systemError("couldn't map spill file"));
+
+        std::free(c.data);
+        c.data = static_cast<float*>(mapped);
+        c.spilled = true;
+        m_residentBytes -= bytes;
+        m_spilledBytes += bytes;
+        ++m_firstResidentChunk;
+    }
+}
+
+void SampleStore::freeChunks()
+{
+    for(auto& c: m_chunks)
+    {
+        if(c.spilled)
+            munmap(c.data, c.capacity * sizeof(float));
+        else
+            std::free(c.data);
+    }
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "ServerConnection.h"
+#include "fbksd/core/session.h"
+#include "fbksd/renderer/samples.h"
+#include "BenchmarkManager.h"
+#include "InProcessRenderer.h"
+#include "exr_utils.h"
+#include "version.h"
+using namespace fbksd;
+
+#include <rpc/client.h>
+#include <algorithm>
+#include <iostream>
+
+
+// ======================================================
+// RpcConnection
+// ======================================================
+RpcConnection::RpcConnection(int session, int consumer):
+    m_client(std::make_unique<rpc::client>("127.0.0.1", getBenchmarkServerPort(session, consumer))),
+    m_tilesMemory(getTilesMemoryKey(session)),
+    m_frameMemory(getFrameMemoryKey(session)),
+    m_resultMemory(getResultMemoryKey(session, consumer))
+{
+    // verify server version compatibility
+    auto version = m_client->call("GET_VERSION").as<std::pair<int,int>>();
+    if(version.first != FBKSD_VERSION_MAJOR)
+    {
+        auto error = std::string("Benchmark server version (") +
+                std::to_string(version.first) + ") is incompatible with client version (" +
+                std::to_string(FBKSD_VERSION_MAJOR) + ").";
+        throw std::runtime_error(error);
+    }
+}
+
+RpcConnection::~RpcConnection() = default;
+
+SceneInfo RpcConnection::getSceneInfo()
+{
+    auto sceneInfo = m_client->call("GET_SCENE_DESCRIPTION").as<SceneInfo>();
+    // The result memory is allocated once the scene is known.
+    if(!m_resultMemory.isAttached() && !m_resultMemory.attach())
+        throw std::runtime_error("Couldn't attach result shared memory:\n - " + m_resultMemory.error());
+    return sceneInfo;
+}
+
+void RpcConnection::setSampleLayout(const SampleLayout& layout)
+{
+    m_client->call("SET_SAMPLE_LAYOUT", layout);
+}
+
+int RpcConnection::registerSampleLayout(const SampleLayout& layout)
+{
+    return m_client->call("REGISTER_SAMPLE_LAYOUT", layout).as<int>();
+}
+
+void RpcConnection::selectSampleLayout(int id)
+{
+    m_client->call("SELECT_SAMPLE_LAYOUT", id);
+}
+
+TilePkg RpcConnection::evaluateSamples(bool isSPP, int64_t numSamples)
+{
+    return m_client->call("EVALUATE_SAMPLES", isSPP, numSamples).as<TilePkg>();
+}
+
+TilePkg RpcConnection::evaluateInputSamples(bool isSPP, int64_t numSamples)
+{
+    return m_client->call("EVALUATE_INPUT_SAMPLES", isSPP, numSamples).as<TilePkg>();
+}
+
+TilePkg RpcConnection::evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows)
+{
+    return m_client->call("EVALUATE_REGIONS", spp, windows).as<TilePkg>();
+}
+
+TilePkg RpcConnection::evaluateFrame(int64_t spp)
+{
+    return m_client->call("EVALUATE_FRAME", spp).as<TilePkg>();
+}
+
+TilePkg RpcConnection::getNextTile(int64_t prevIndex)
+{
+    return m_client->call("GET_NEXT_TILE", prevIndex).as<TilePkg>();
+}
+
+TilePkg RpcConnection::getNextInputTile(int64_t prevIndex, bool prevWasInput)
+{
+    return m_client->call("GET_NEXT_INPUT_TILE", prevIndex, prevWasInput).as<TilePkg>();
+}
+
+void RpcConnection::lastTileConsumed(int64_t index)
+{
+    m_client->call("LAST_TILE_CONSUMED", index);
+}
+
+TilePkg RpcConnection::releaseAndGetNextTile(const std::vector<int64_t>& consumedIndices)
+{
+    return m_client->call("RELEASE_AND_GET_NEXT_TILE", consumedIndices).as<TilePkg>();
+}
+
+std::future<TilePkg> RpcConnection::releaseAndGetNextTileAsync(const std::vector<int64_t>& consumedIndices)
+{
+    auto response = std::make_shared<std::future<clmdep_msgpack::object_handle>>(
+        m_client->async_call("RELEASE_AND_GET_NEXT_TILE", consumedIndices));
+    return std::async(std::launch::deferred, [response](){ return response->get().as<TilePkg>(); });
+}
+
+void RpcConnection::releaseLastTiles(const std::vector<int64_t>& consumedIndices)
+{
+    m_client->call("RELEASE_LAST_TILES", consumedIndices);
+}
+
+int64_t RpcConnection::cancelEvaluation(const std::vector<int64_t>& consumedIndices)
+{
+    return m_client->call("CANCEL_EVALUATION", consumedIndices).as<int64_t>();
+}
+
+void RpcConnection::sendResult()
+{
+    m_client->call("SEND_RESULT");
+}
+
+float* RpcConnection::getTilesData()
+{
+    // The memory may have been reallocated by the server for the current evaluation.
+    m_tilesMemory.detach();
+    if(!m_tilesMemory.attach())
+        throw std::runtime_error("error attaching tilesMemory");
+    return static_cast<float*>(m_tilesMemory.data());
+}
+
+float* RpcConnection::getFrameData()
+{
+    m_frameMemory.detach();
+    if(!m_frameMemory.attach())
+        throw std::runtime_error("error attaching frameMemory");
+    return static_cast<float*>(m_frameMemory.data());
+}
+
+float* RpcConnection::getResultData()
+{
+    return static_cast<float*>(m_resultMemory.data());
+}
+
+
+// ======================================================
+// InProcessConnection
+// ======================================================
+InProcessConnection::InProcessConnection(const std::string& pluginPath, const std::vector<std::string>& args, int64_t spp):
+    m_renderer(std::make_unique<InProcessRenderer>(pluginPath, args))
+{
+    m_sceneInfo = m_renderer->getSceneInfo();
+    m_numPixels = m_sceneInfo.get<int64_t>("width") * m_sceneInfo.get<int64_t>("height");
+    m_sampleBudget = spp * m_numPixels;
+    m_sceneInfo.set<int64_t>("max_spp", spp);
+    m_sceneInfo.set<int64_t>("max_samples", m_sampleBudget);
+    m_result.resize(m_numPixels * 3);
+}
+
+InProcessConnection::~InProcessConnection() = default;
+
+SceneInfo InProcessConnection::getSceneInfo()
+{
+    return m_sceneInfo;
+}
+
+void InProcessConnection::setSampleLayout(const SampleLayout& layout)
+{
+    if(!layout.isValid(getAllElements()))
+        throw std::invalid_argument("Invalid sample layout.");
+    m_pixelStatistics = layout.isPixelStatistics();
+    m_renderer->setParameters(layout);
+}
+
+int InProcessConnection::registerSampleLayout(const SampleLayout& layout)
+{
+    if(!layout.isValid(getAllElements()))
+        return -1;
+    int id = m_renderer->registerLayout(layout);
+    m_layouts[id] = layout.isPixelStatistics();
+    return id;
+}
+
+void InProcessConnection::selectSampleLayout(int id)
+{
+    auto registered = m_layouts.find(id);
+    if(registered == m_layouts.end())
+        throw std::invalid_argument("Unknown sample layout id: " + std::to_string(id));
+    m_pixelStatistics = registered->second;
+    m_renderer->selectLayout(id);
+}
+
+int64_t InProcessConnection::debit(int64_t numSamples)
+{
+    numSamples = std::min(m_sampleBudget, numSamples);
+    m_sampleBudget -= numSamples;
+    m_evalNumSamples = numSamples;
+    return numSamples;
+}
+
+TilePkg InProcessConnection::evaluateSamples(bool isSPP, int64_t numSamples)
+{
+    numSamples = std::min(m_sampleBudget, isSPP ? numSamples * m_numPixels : numSamples);
+    // Statistics are per pixel, so only whole spp are given.
+    if(m_pixelStatistics)
+        numSamples -= numSamples % m_numPixels;
+    numSamples = debit(numSamples);
+    if(numSamples == 0)
+        return {};
+    return m_renderer->evaluateSamples(numSamples / m_numPixels, numSamples % m_numPixels);
+}
+
+TilePkg InProcessConnection::evaluateInputSamples(bool isSPP, int64_t numSamples)
+{
+    numSamples = debit(isSPP ? numSamples * m_numPixels : numSamples);
+    if(numSamples == 0)
+        return {};
+    return m_renderer->evaluateInputSamples(numSamples / m_numPixels, numSamples % m_numPixels);
+}
+
+TilePkg InProcessConnection::evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows)
+{
+    auto clipped = BenchmarkManager::clipWindows(windows,
+                                                 m_sceneInfo.get<int64_t>("width"),
+                                                 m_sceneInfo.get<int64_t>("height"));
+    int64_t area = 0;
+    for(auto& w: clipped)
+        area += w.width() * w.height();
+
+    // Only whole spp are given, so the renderer produces exactly what is debited.
+    if(area > 0)
+        spp = std::min(spp, m_sampleBudget / area);
+    if(area == 0 || spp <= 0)
+        return {};
+    // Debited only once the renderer accepted the request.
+    TilePkg tilePkg = m_renderer->evaluateRegions(spp, clipped);
+    debit(spp * area);
+    return tilePkg;
+}
+
+TilePkg InProcessConnection::evaluateFrame(int64_t spp)
+{
+    spp = std::min(spp, m_sampleBudget / m_numPixels);
+    if(spp <= 0)
+        return {};
+    debit(spp * m_numPixels);
+    return m_renderer->evaluateFrame(spp);
+}
+
+TilePkg InProcessConnection::getNextTile(int64_t prevIndex)
+{
+    return m_renderer->getNextTile(prevIndex);
+}
+
+TilePkg InProcessConnection::getNextInputTile(int64_t prevIndex, bool prevWasInput)
+{
+    return m_renderer->getNextInputTile(prevIndex, prevWasInput);
+}
+
+void InProcessConnection::lastTileConsumed(int64_t index)
+{
+    m_renderer->lastTileConsumed(index);
+}
+
+TilePkg InProcessConnection::releaseAndGetNextTile(const std::vector<int64_t>& consumedIndices)
+{
+    return m_renderer->releaseAndGetNextTile(consumedIndices);
+}
+
+std::future<TilePkg> InProcessConnection::releaseAndGetNextTileAsync(const std::vector<int64_t>& consumedIndices)
+{
+    // The renderer threads keep working while the caller consumes the previous tile.
+    return std::async(std::launch::async, [this, consumedIndices](){ return releaseAndGetNextTile(consumedIndices); });
+}
+
+void InProcessConnection::releaseLastTiles(const std::vector<int64_t>& consumedIndices)
+{
+    m_renderer->releaseLastTiles(consumedIndices);
+}
+
+int64_t InProcessConnection::cancelEvaluation(const std::vector<int64_t>& consumedIndices)
+{
+    // Samples that were not delivered to the client are given back to the budget.
+    int64_t numDelivered = m_renderer->cancelEvaluation(consumedIndices);
+    auto refund = std::max(m_evalNumSamples - numDelivered, INT64_C(0));
+    m_sampleBudget += refund;
+    m_evalNumSamples = 0;
+    return refund;
+}
+
+void InProcessConnection::sendResult()
+{
+    saveExr("result.exr", m_result.data(),
+            static_cast<int>(m_sceneInfo.get<int64_t>("width")),
+            static_cast<int>(m_sceneInfo.get<int64_t>("height")));
+    std::cout << "(fbksd) Result saved to result.exr" << std::endl;
+}
+
+float* InProcessConnection::getTilesData()
+{
+    return m_renderer->getTilesData();
+}
+
+float* InProcessConnection::getFrameData()
+{
+    return m_renderer->getFrameData();
+}
+
+float* InProcessConnection::getResultData()
+{
+    return m_result.data();
+}
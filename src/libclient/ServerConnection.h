@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef SERVERCONNECTION_H
+#define SERVERCONNECTION_H
+
+#include "fbksd/core/definitions.h"
+#include "fbksd/core/SharedMemory.h"
+#include <future>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rpc { class client; }
+
+namespace fbksd
+{
+
+class InProcessRenderer;
+
+/**
+ * @brief Requests made by the BenchmarkClient.
+ *
+ * The methods correspond to the benchmark server requests (see BenchmarkServer). The memory methods
+ * return the buffers where the tiles, frame and result are, and are valid until the next request.
+ */
+class ServerConnection
+{
+public:
+    virtual ~ServerConnection() = default;
+
+    virtual SceneInfo getSceneInfo() = 0;
+    virtual void setSampleLayout(const SampleLayout& layout) = 0;
+    virtual int registerSampleLayout(const SampleLayout& layout) = 0;
+    virtual void selectSampleLayout(int id) = 0;
+    virtual TilePkg evaluateSamples(bool isSPP, int64_t numSamples) = 0;
+    virtual TilePkg evaluateInputSamples(bool isSPP, int64_t numSamples) = 0;
+    virtual TilePkg evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows) = 0;
+    virtual TilePkg evaluateFrame(int64_t spp) = 0;
+    virtual TilePkg getNextTile(int64_t prevIndex) = 0;
+    virtual TilePkg getNextInputTile(int64_t prevIndex, bool prevWasInput) = 0;
+    virtual void lastTileConsumed(int64_t index) = 0;
+    virtual TilePkg releaseAndGetNextTile(const std::vector<int64_t>& consumedIndices) = 0;
+    // Sends the request without waiting for its result, so the caller can work in the meantime.
+    virtual std::future<TilePkg> releaseAndGetNextTileAsync(const std::vector<int64_t>& consumedIndices) = 0;
+    virtual void releaseLastTiles(const std::vector<int64_t>& consumedIndices) = 0;
+    virtual int64_t cancelEvaluation(const std::vector<int64_t>& consumedIndices) = 0;
+    virtual void sendResult() = 0;
+
+    virtual float* getTilesData() = 0;
+    virtual float* getFrameData() = 0;
+    virtual float* getResultData() = 0;
+};
+
+
+/**
+ * @brief Connection to a benchmark server, through RPC and shared memory.
+ */
+class RpcConnection: public ServerConnection
+{
+public:
+    /**
+     * @brief Connects to the benchmark server of the given session and consumer.
+     *
+     * @throws std::runtime_error if the server version is incompatible.
+     */
+    RpcConnection(int session, int consumer);
+
+    ~RpcConnection();
+
+    SceneInfo getSceneInfo() override;
+    void setSampleLayout(const SampleLayout& layout) override;
+    int registerSampleLayout(const SampleLayout& layout) override;
+    void selectSampleLayout(int id) override;
+    TilePkg evaluateSamples(bool isSPP, int64_t numSamples) override;
+    TilePkg evaluateInputSamples(bool isSPP, int64_t numSamples) override;
+    TilePkg evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows) override;
+    TilePkg evaluateFrame(int64_t spp) override;
+    TilePkg getNextTile(int64_t prevIndex) override;
+    TilePkg getNextInputTile(int64_t prevIndex, bool prevWasInput) override;
+    void lastTileConsumed(int64_t index) override;
+    TilePkg releaseAndGetNextTile(const std::vector<int64_t>& consumedIndices) override;
+    std::future<TilePkg> releaseAndGetNextTileAsync(const std::vector<int64_t>& consumedIndices) override;
+    void releaseLastTiles(const std::vector<int64_t>& consumedIndices) override;
+    int64_t cancelEvaluation(const std::vector<int64_t>& consumedIndices) override;
+    void sendResult() override;
+
+    float* getTilesData() override;
+    float* getFrameData() override;
+    float* getResultData() override;
+
+private:
+    std::unique_ptr<rpc::client> m_client;
+    SharedMemory m_tilesMemory;
+    SharedMemory m_frameMemory;
+    SharedMemory m_resultMemory;
+};
+
+
+/**
+ * @brief Connection to a renderer plugin loaded into the client process (bypass mode).
+ *
+ * There is no benchmark server: the connection keeps the sample budget itself, as the BenchmarkManager
+ * does in passive mode, and writes the result to `result.exr` in sendResult().
+ */
+class InProcessConnection: public ServerConnection
+{
+public:
+    /**
+     * @brief Loads the renderer plugin (see InProcessRenderer).
+     *
+     * @param spp  Sample budget, in samples per pixel.
+     */
+    InProcessConnection(const std::string& pluginPath, const std::vector<std::string>& args, int64_t spp);
+
+    ~InProcessConnection();
+
+    SceneInfo getSceneInfo() override;
+    void setSampleLayout(const SampleLayout& layout) override;
+    int registerSampleLayout(const SampleLayout& layout) override;
+    void selectSampleLayout(int id) override;
+    TilePkg evaluateSamples(bool isSPP, int64_t numSamples) override;
+    TilePkg evaluateInputSamples(bool isSPP, int64_t numSamples) override;
+    TilePkg evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows) override;
+    TilePkg evaluateFrame(int64_t spp) override;
+    TilePkg getNextTile(int64_t prevIndex) override;
+    TilePkg getNextInputTile(int64_t prevIndex, bool prevWasInput) override;
+    void lastTileConsumed(int64_t index) override;
+    TilePkg releaseAndGetNextTile(const std::vector<int64_t>& consumedIndices) override;
+    std::future<TilePkg> releaseAndGetNextTileAsync(const std::vector<int64_t>& consumedIndices) override;
+    void releaseLastTiles(const std::vector<int64_t>& consumedIndices) override;
+    int64_t cancelEvaluation(const std::vector<int64_t>& consumedIndices) override;
+    void sendResult() override;
+
+    float* getTilesData() override;
+    float* getFrameData() override;
+    float* getResultData() override;
+
+private:
+    // Debits the budget for a request of numSamples, returning the number of samples given.
+    int64_t debit(int64_t numSamples);
+
+    std::unique_ptr<InProcessRenderer> m_renderer;
+    SceneInfo m_sceneInfo;
+    int64_t m_numPixels = 0;
+    int64_t m_sampleBudget = 0;
+    int64_t m_evalNumSamples = 0; // samples debited by the current evaluation
+    bool m_pixelStatistics = false;
+    std::map<int, bool> m_layouts; // registered layouts (pixel statistics flag)
+    std::vector<float> m_result;
+};
+
+} // namespace fbksd
+
+#endif // SERVERCONNECTION_H
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "ThreadPool.h"
+#include <algorithm>
+using namespace fbksd;
+
+
+ThreadPool::ThreadPool(int numThreads)
+{
+    numThreads = std::max(numThreads, 1);
+    m_threads.reserve(numThreads);
+    for(int i = 0; i < numThreads; ++i)
+        m_threads.emplace_back([this](){ work(); });
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_hasTask.notify_all();
+    for(auto& t: m_threads)
+        t.join();
+}
+
+void ThreadPool::enqueue(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push(std::move(task));
+    }
+    m_hasTask.notify_one();
+}
+
+void ThreadPool::wait()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_isIdle.wait(lock, [this](){ return m_tasks.empty() && m_numRunning == 0; });
+}
+
+bool ThreadPool::isWorkerThread() const
+{
+    auto id = std::this_thread::get_id();
+    return std::any_of(m_threads.begin(), m_threads.end(),
+                       [&](const std::thread& t){ return t.get_id() == id; });
+}
+
+int ThreadPool::numThreads() const
+{
+    return static_cast<int>(m_threads.size());
+}
+
+void ThreadPool::work()
+{
+    while(true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_hasTask.wait(lock, [this](){ return m_stop || !m_tasks.empty(); });
+            // pending tasks are still executed when stopping
+            if(m_tasks.empty())
+                return;
+            task = std::move(m_tasks.front());
+            m_tasks.pop();
+            ++m_numRunning;
+        }
+
+        task();
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            --m_numRunning;
+            if(m_tasks.empty() && m_numRunning == 0)
+                m_isIdle.notify_all();
+        }
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <vector>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+namespace fbksd
+{
+
+/**
+ * @brief Simple fixed-size pool of worker threads executing tasks in FIFO order.
+ *
+ * With a single thread, tasks are executed sequentially in the order they were enqueued.
+ */
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int numThreads);
+
+    ThreadPool(const ThreadPool&) = delete;
+
+    /**
+     * @brief Waits for all enqueued tasks to finish and joins the threads.
+     */
+    ~ThreadPool();
+
+    /**
+     * @brief Enqueues a task to be executed by one of the threads.
+     */
+    void enqueue(std::function<void()> task);
+
+    /**
+     * @brief Blocks until there are no pending or running tasks.
+     *
+     * Should not be called from inside a task.
+     */
+    void wait();
+
+    /**
+     * @brief Returns true if the calling thread is one of the pool threads.
+     */
+    bool isWorkerThread() const;
+
+    int numThreads() const;
+
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+private:
+    void work();
+
+    std::vector<std::thread> m_threads;
+    std::queue<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_hasTask;
+    std::condition_variable m_isIdle;
+    int m_numRunning = 0;
+    bool m_stop = false;
+};
+
+} // namespace fbksd
+
+#endif // THREADPOOL_H
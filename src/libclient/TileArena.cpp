@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "TileArena.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+using namespace fbksd;
+
+
+namespace
+{
+constexpr size_t ALIGNMENT = 64;
+}
+
+
+TileArena::~TileArena()
+{
+    for(auto& b: m_free)
+        std::free(b.data);
+    for(auto& b: m_used)
+        std::free(b.data);
+}
+
+float* TileArena::acquire(int64_t numFloats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // Prefer the smallest free buffer that fits.
+    auto best = m_free.end();
+    for(auto it = m_free.begin(); it != m_free.end(); ++it)
+    {
+        if(it->capacity >= numFloats && (best == m_free.end() || it->capacity < best->capacity))
+            best = it;
+    }
+
+    Buffer buffer;
+    if(best != m_free.end())
+    {
+        buffer = *best;
+        m_free.erase(best);
+    }
+    else
+    {
+        // Nothing fits: drop the largest free buffer (if any) and allocate a new one.
+        if(!m_free.empty())
+        {
+            auto largest = std::max_element(m_free.begin(), m_free.end(),
+                [](const Buffer& a, const Buffer& b){ return a.capacity < b.capacity; });
+            std::free(largest->data);
+            m_free.erase(largest);
+        }
+        void* data = nullptr;
+        size_t numBytes = std::max<size_t>(numFloats * sizeof(float), ALIGNMENT);
+        if(posix_memalign(&data, ALIGNMENT, numBytes) != 0)
+            throw std::bad_alloc();
+        buffer = {static_cast<float*>(data), numFloats};
+    }
+
+    m_used.push_back(buffer);
+    return buffer.data;
+}
+
+void TileArena::release(float* data)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = std::find_if(m_used.begin(), m_used.end(), [&](const Buffer& b){ return b.data == data; });
+    if(it == m_used.end())
+        throw std::logic_error("Buffer doesn't belong to this arena.");
+    m_free.push_back(*it);
+    m_used.erase(it);
+}
+
+void TileArena::copy(float* dst, const float* src, int64_t numFloats)
+{
+#ifdef __SSE__
+    // dst is 64-byte aligned (see acquire()), src is only guaranteed to be float-aligned.
+    int64_t i = 0;
+    for(; i + 16 <= numFloats; i += 16)
+    {
+        __m128 a = _mm_loadu_ps(src + i);
+        __m128 b = _mm_loadu_ps(src + i + 4);
+        __m128 c = _mm_loadu_ps(src + i + 8);
+        __m128 d = _mm_loadu_ps(src + i + 12);
+        _mm_stream_ps(dst + i, a);
+        _mm_stream_ps(dst + i + 4, b);
+        _mm_stream_ps(dst + i + 8, c);
+        _mm_stream_ps(dst + i + 12, d);
+    }
+    for(; i + 4 <= numFloats; i += 4)
+        _mm_stream_ps(dst + i, _mm_loadu_ps(src + i));
+    // Non-temporal stores are weakly ordered: make them visible before the buffer is handed over.
+    _mm_sfence();
+    std::memcpy(dst + i, src + i, (numFloats - i) * sizeof(float));
+#else
+    std::memcpy(dst, src, numFloats * sizeof(float));
+#endif
+}
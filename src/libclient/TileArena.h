@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef TILEARENA_H
+#define TILEARENA_H
+
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+namespace fbksd
+{
+
+/**
+ * @brief Pool of client-owned buffers used to hold copies of tiles.
+ *
+ * Copying a tile out of the shared memory allows its slot to be released to the renderer
+ * before the tile is consumed. Buffers are recycled between tiles and evaluations, so the
+ * arena only allocates while its high-water mark grows.
+ *
+ * acquire() and release() are thread-safe.
+ */
+class TileArena
+{
+public:
+    TileArena() = default;
+
+    TileArena(const TileArena&) = delete;
+
+    ~TileArena();
+
+    /**
+     * @brief Returns a 64-byte aligned buffer with room for at least `numFloats` values.
+     */
+    float* acquire(int64_t numFloats);
+
+    /**
+     * @brief Gives back a buffer returned by acquire().
+     */
+    void release(float* buffer);
+
+    /**
+     * @brief Copies `numFloats` values from `src` to `dst`.
+     *
+     * Uses non-temporal stores when available, so the copy doesn't evict the consumer's working set
+     * from the cache. `dst` must be a buffer returned by acquire().
+     */
+    static void copy(float* dst, const float* src, int64_t numFloats);
+
+    TileArena& operator=(const TileArena&) = delete;
+
+private:
+    struct Buffer
+    {
+        float* data;
+        int64_t capacity;
+    };
+
+    std::vector<Buffer> m_free;
+    std::vector<Buffer> m_used;
+    std::mutex m_mutex;
+};
+
+} // namespace fbksd
+
+#endif // TILEARENA_H
@@ -98,10 +98,55 @@ float SampleLayout::getRoughnessThreshold() const
     return m_roughness;
 }
 
+SampleLayout& SampleLayout::setPixelStatistics(bool enable)
+{
+    m_pixelStatistics = enable;
+    return *this;
+}
+
+bool SampleLayout::isPixelStatistics() const
+{
+    return m_pixelStatistics;
+}
+
+bool SampleLayout::isFeaturesOnly() const
+{
+    // Features of the primary hit, and the random parameters of the camera ray.
+    static const std::set<std::string> primaryFeatures = {
+        "DEPTH", "WORLD_X", "WORLD_Y", "WORLD_Z", "NORMAL_X", "NORMAL_Y", "NORMAL_Z",
+        "TEXTURE_COLOR_R", "TEXTURE_COLOR_G", "TEXTURE_COLOR_B"
+    };
+    static const std::set<std::string> cameraParameters = {"IMAGE_X", "IMAGE_Y", "LENS_U", "LENS_V", "TIME"};
+
+    bool hasFeatures = false;
+    for(const auto& e: parameters)
+    {
+        if(primaryFeatures.count(e.name))
+            hasFeatures = true;
+        else if(!cameraParameters.count(e.name))
+            return false;
+    }
+    return hasFeatures;
+}
+
+SampleLayout& SampleLayout::setInputGenerator(const std::string& name)
+{
+    m_inputGenerator = name;
+    return *this;
+}
+
+const std::string& SampleLayout::getInputGenerator() const
+{
+    return m_inputGenerator;
+}
+
 bool SampleLayout::isValid(const std::set<std::string> &reference) const
 {
     std::set<std::string> counter;
 
+    if(m_pixelStatistics && hasInput())
+        return false;
+
     for(const auto& par: parameters)
     {
         // test invalid element
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "fbksd/core/TileTransport.h"
+using namespace fbksd;
+
+#include <condition_variable>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef FBKSD_HAS_LZ4
+#include <lz4.h>
+#endif
+
+
+namespace
+{
+
+constexpr uint32_t STREAM_MAGIC = 0x46425453; // "FBTS"
+constexpr uint32_t STREAM_VERSION = 1;
+constexpr uint32_t FLAG_LZ4 = 1;
+
+// Tiles smaller than this are copied to the socket: pinning their pages costs more than the copy.
+constexpr int64_t ZEROCOPY_MIN_BYTES = 64 * 1024;
+// Tiles smaller than this are not worth compressing.
+constexpr int64_t COMPRESS_MIN_BYTES = 4 * 1024;
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+enum Codec : uint8_t
+{
+    RAW,
+    LZ4
+};
+
+// Sent by the receiver when it connects.
+struct Hello
+{
+    uint32_t magic = STREAM_MAGIC;
+    uint32_t version = STREAM_VERSION;
+    uint32_t flags = 0;
+};
+
+// Precedes the payload of each tile.
+struct Header
+{
+    uint32_t magic = STREAM_MAGIC;
+    uint8_t target = 0;
+    uint8_t codec = RAW;
+    uint16_t reserved = 0;
+    int64_t offset = 0;  // in floats
+    int64_t size = 0;    // in floats
+    int64_t payload = 0; // in bytes
+};
+
+uint32_t getLocalFlags()
+{
+#ifdef FBKSD_HAS_LZ4
+    return FLAG_LZ4;
+#else
+    return 0;
+#endif
+}
+
+std::runtime_error socketError(const std::string& what)
+{
+    return std::runtime_error("Tile stream: " + what + ": " + strerror(errno));
+}
+
+// Writes the whole buffers, retrying on partial writes.
+void sendAll(int fd, iovec* iov, int iovcnt, int flags)
+{
+    while(iovcnt > 0)
+    {
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = static_cast<size_t>(iovcnt);
+        ssize_t n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            // Too many zero-copy notifications pending: the rest is copied.
+            if(errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+            {
+                flags &= ~MSG_ZEROCOPY;
+                continue;
+            }
+            throw socketError("send failed");
+        }
+        while(iovcnt > 0 && static_cast<size_t>(n) >= iov->iov_len)
+        {
+            n -= static_cast<ssize_t>(iov->iov_len);
+            ++iov;
+            --iovcnt;
+        }
+        if(iovcnt > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= static_cast<size_t>(n);
+        }
+    }
+}
+
+// Reads exactly `size` bytes. Returns false if the connection was closed before the first byte.
+bool recvAll(int fd, void* data, size_t size)
+{
+    char* p = static_cast<char*>(data);
+    size_t received = 0;
+    while(received < size)
+    {
+        ssize_t n = recv(fd, p + received, size - received, 0);
+        if(n == 0)
+        {
+            if(received == 0)
+                return false;
+            throw std::runtime_error("Tile stream: connection closed in the middle of a tile.");
+        }
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            throw socketError("receive failed");
+        }
+        received += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+}
+
+
+// ======================================================
+// TileStreamSender
+// ======================================================
+struct TileStreamSender::Imp
+{
+    struct Message
+    {
+        TileTarget target;
+        int64_t offset;
+        const float* data;
+        int64_t size;
+    };
+
+    void run()
+    {
+        try
+        {
+            connect();
+            while(true)
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_changed.wait(lock, [&](){ return m_stop || !m_queue.empty(); });
+                if(m_stop)
+                    return;
+                Message message = m_queue.front();
+                lock.unlock();
+
+                write(message);
+
+                lock.lock();
+                m_queue.pop_front();
+                m_changed.notify_all();
+            }
+        }
+        catch(const std::exception& e)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(!m_stop)
+                m_error = e.what();
+            m_queue.clear();
+            m_changed.notify_all();
+        }
+    }
+
+    void connect()
+    {
+        int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if(fd == -1)
+            throw socketError("accept failed");
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_fd = fd;
+            if(m_stop)
+                return;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Hello hello;
+        if(!recvAll(fd, &hello, sizeof(hello)) || hello.magic != STREAM_MAGIC || hello.version != STREAM_VERSION)
+            throw std::runtime_error("Tile stream: invalid receiver.");
+        m_compress = m_compress && (hello.flags & getLocalFlags() & FLAG_LZ4);
+        // Not every kernel supports it (Linux 4.14+); tiles are copied then.
+        m_zeroCopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
+
+    void write(const Message& message)
+    {
+        Header header;
+        header.target = static_cast<uint8_t>(message.target);
+        header.offset = message.offset;
+        header.size = message.size;
+        const int64_t bytes = message.size * static_cast<int64_t>(sizeof(float));
+        iovec iov[2];
+        iov[0] = {&header, sizeof(header)};
+
+#ifdef FBKSD_HAS_LZ4
+        if(m_compress && bytes >= COMPRESS_MIN_BYTES && bytes <= LZ4_MAX_INPUT_SIZE)
+        {
+            m_compressed.resize(LZ4_compressBound(static_cast<int>(bytes)));
+            int size = LZ4_compress_default(reinterpret_cast<const char*>(message.data), m_compressed.data(),
+                                            static_cast<int>(bytes), static_cast<int>(m_compressed.size()));
+            if(size > 0 && size < bytes)
+            {
+                header.codec = LZ4;
+                header.payload = size;
+                iov[1] = {m_compressed.data(), static_cast<size_t>(size)};
+                sendAll(m_fd, iov, 2, 0);
+                return;
+            }
+        }
+#endif
+
+        header.payload = bytes;
+        iov[1] = {const_cast<float*>(message.data), static_cast<size_t>(bytes)};
+        if(!m_zeroCopy || bytes < ZEROCOPY_MIN_BYTES)
+        {
+            sendAll(m_fd, iov, 2, 0);
+            return;
+        }
+
+        // The pages of the tile are sent without copying. The slot isn't reused before the receiver
+        // got the tile, so it's safe to only collect the completion notifications afterwards.
+        sendAll(m_fd, iov, 1, 0);
+        sendAll(m_fd, &iov[1], 1, MSG_ZEROCOPY);
+        drainCompletions();
+    }
+
+    // Reads the zero-copy completion notifications, so they don't fill the socket error queue.
+    void drainCompletions()
+    {
+        char control[128];
+        while(true)
+        {
+            msghdr msg = {};
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if(recvmsg(m_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+                return;
+        }
+    }
+
+    void checkError()
+    {
+        if(!m_error.empty())
+            throw std::runtime_error(m_error);
+    }
+
+    int m_listenFd = -1;
+    int m_fd = -1;
+    unsigned short m_port = 0;
+    bool m_compress = false;
+    bool m_zeroCopy = false;
+    std::vector<char> m_compressed;
+    std::deque<Message> m_queue; // the front is being written
+    std::string m_error;
+    bool m_stop = false;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::thread m_thread;
+};
+
+
+TileStreamSender::TileStreamSender(const std::string& address, bool compress):
+    m_imp(std::make_unique<Imp>())
+{
+    m_imp->m_compress = compress;
+#ifndef FBKSD_HAS_LZ4
+    if(compress)
+        std::cerr << "fbksd was built without LZ4 support: tiles are sent uncompressed." << std::endl;
+#endif
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    if(inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+        throw std::runtime_error("Tile stream: invalid address " + address);
+    addr.sin_port = 0;
+    socklen_t length = sizeof(addr);
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        throw socketError("socket failed");
+    if(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1 ||
+       listen(fd, 1) == -1 ||
+       getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &length) == -1)
+    {
+        auto error = socketError("listen failed");
+        close(fd);
+        throw error;
+    }
+    m_imp->m_listenFd = fd;
+    m_imp->m_port = ntohs(addr.sin_port);
+    m_imp->m_thread = std::thread(&Imp::run, m_imp.get());
+}
+
+TileStreamSender::~TileStreamSender()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_imp->m_mutex);
+        m_imp->m_stop = true;
+        // Wakes up the thread if it's blocked in accept or send.
+        shutdown(m_imp->m_listenFd, SHUT_RDWR);
+        if(m_imp->m_fd != -1)
+            shutdown(m_imp->m_fd, SHUT_RDWR);
+    }
+    m_imp->m_changed.notify_all();
+    m_imp->m_thread.join();
+    close(m_imp->m_listenFd);
+    if(m_imp->m_fd != -1)
+        close(m_imp->m_fd);
+}
+
+unsigned short TileStreamSender::port() const
+{
+    return m_imp->m_port;
+}
+
+void TileStreamSender::send(TileTarget target, int64_t offset, const float* data, int64_t size)
+{
+    std::lock_guard<std::mutex> lock(m_imp->m_mutex);
+    m_imp->checkError();
+    m_imp->m_queue.push_back({target, offset, data, size});
+    m_imp->m_changed.notify_all();
+}
+
+void TileStreamSender::flush()
+{
+    std::unique_lock<std::mutex> lock(m_imp->m_mutex);
+    m_imp->m_changed.wait(lock, [&](){ return m_imp->m_queue.empty(); });
+    m_imp->checkError();
+}
+
+
+// ======================================================
+// TileStreamReceiver
+// ======================================================
+struct TileStreamReceiver::Imp
+{
+    void run()
+    {
+        try
+        {
+            Header header;
+            while(recvAll(m_fd, &header, sizeof(header)))
+            {
+                if(header.magic != STREAM_MAGIC || header.size < 0 || header.payload < 0)
+                    throw std::runtime_error("Tile stream: invalid tile header.");
+                const int64_t bytes = header.size * static_cast<int64_t>(sizeof(float));
+                float* buffer = m_getBuffer(static_cast<TileTarget>(header.target), header.offset, header.size);
+
+                if(header.codec == RAW)
+                {
+                    if(header.payload != bytes)
+                        throw std::runtime_error("Tile stream: invalid tile size.");
+                    recvAll(m_fd, buffer, static_cast<size_t>(bytes));
+                }
+                else if(header.codec == LZ4)
+                {
+#ifdef FBKSD_HAS_LZ4
+                    m_compressed.resize(static_cast<size_t>(header.payload));
+                    recvAll(m_fd, m_compressed.data(), m_compressed.size());
+                    int size = LZ4_decompress_safe(m_compressed.data(), reinterpret_cast<char*>(buffer),
+                                                   static_cast<int>(header.payload), static_cast<int>(bytes));
+                    if(size != bytes)
+                        throw std::runtime_error("Tile stream: corrupted LZ4 tile.");
+#else
+                    throw std::runtime_error("Tile stream: the tile is compressed with LZ4, but fbksd was built without LZ4 support.");
+#endif
+                }
+                else
+                    throw std::runtime_error("Tile stream: unknown codec.");
+
+                std::lock_guard<std::mutex> lock(m_mutex);
+                ++m_numReceived;
+                m_changed.notify_all();
+            }
+            throw std::runtime_error("Tile stream: the renderer closed the connection.");
+        }
+        catch(const std::exception& e)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if(!m_stop)
+                m_error = e.what();
+            m_changed.notify_all();
+        }
+    }
+
+    int m_fd = -1;
+    GetBuffer m_getBuffer;
+    std::vector<char> m_compressed;
+    int64_t m_numReceived = 0;
+    std::string m_error;
+    bool m_stop = false;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::thread m_thread;
+};
+
+
+TileStreamReceiver::TileStreamReceiver(const std::string& host, unsigned short port, const GetBuffer& getBuffer):
+    m_imp(std::make_unique<Imp>())
+{
+    m_imp->m_getBuffer = getBuffer;
+
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    int status = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &result);
+    if(status != 0)
+        throw std::runtime_error("Tile stream: couldn't resolve " + host + ": " + gai_strerror(status));
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+    {
+        freeaddrinfo(result);
+        throw socketError("socket failed");
+    }
+    int connected = ::connect(fd, result->ai_addr, result->ai_addrlen);
+    freeaddrinfo(result);
+    Hello hello;
+    hello.flags = getLocalFlags();
+    iovec iov = {&hello, sizeof(hello)};
+    try
+    {
+        if(connected == -1)
+            throw socketError("couldn't connect to " + host);
+        sendAll(fd, &iov, 1, 0);
+    }
+    catch(...)
+    {
+        close(fd);
+        throw;
+    }
+
+    m_imp->m_fd = fd;
+    m_imp->m_thread = std::thread(&Imp::run, m_imp.get());
+}
+
+TileStreamReceiver::~TileStreamReceiver()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_imp->m_mutex);
+        m_imp->m_stop = true;
+    }
+    shutdown(m_imp->m_fd, SHUT_RDWR);
+    m_imp->m_thread.join();
+    close(m_imp->m_fd);
+}
+
+void TileStreamReceiver::waitTiles(int64_t count)
+{
+    std::unique_lock<std::mutex> lock(m_imp->m_mutex);
+    m_imp->m_changed.wait(lock, [&](){ return m_imp->m_numReceived >= count || !m_imp->m_error.empty(); });
+    if(m_imp->m_numReceived < count)
+        throw std::runtime_error(m_imp->m_error);
+}
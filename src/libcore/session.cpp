@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "fbksd/core/session.h"
+#include <cstdlib>
+#include <stdexcept>
+using namespace fbksd;
+
+
+namespace
+{
+
+// Ports used by session 0. These are the historical fixed FBKSD ports.
+constexpr int BENCHMARK_SERVER_PORT = 2226;
+constexpr int RENDERING_SERVER_PORT = 2227;
+
+// Each session reserves a contiguous block of ports: the benchmark server of consumer 0, the
+// rendering server, and the benchmark servers of the other consumers.
+constexpr int PORTS_PER_SESSION = 16;
+static_assert(MAX_CONSUMERS + 1 <= PORTS_PER_SESSION, "The consumer ports don't fit in the session ports.");
+
+// The rendering servers of the other shards don't fit in the session block, so they use a range after the
+// blocks of all sessions, with MAX_SHARDS - 1 ports per session.
+constexpr int SHARD_PORTS_BEGIN = BENCHMARK_SERVER_PORT + MAX_SESSIONS * PORTS_PER_SESSION;
+static_assert(SHARD_PORTS_BEGIN + MAX_SESSIONS * (MAX_SHARDS - 1) <= 32768, "The shard ports reach the ephemeral ports.");
+
+void checkSessionId(int id)
+{
+    if(id < 0 || id >= MAX_SESSIONS)
+        throw std::invalid_argument("Session id should be in the range [0, " + std::to_string(MAX_SESSIONS) + ").");
+}
+
+void checkConsumerId(int id)
+{
+    if(id < 0 || id >= MAX_CONSUMERS)
+        throw std::invalid_argument("Consumer id should be in the range [0, " + std::to_string(MAX_CONSUMERS) + ").");
+}
+
+void checkShardId(int id)
+{
+    if(id < 0 || id >= MAX_SHARDS)
+        throw std::invalid_argument("Shard id should be in the range [0, " + std::to_string(MAX_SHARDS) + ").");
+}
+
+// Session 0 keeps the historical key, so that sessionless tools keep working.
+std::string sessionKey(const std::string& base, int session)
+{
+    checkSessionId(session);
+    if(session == 0)
+        return base;
+    return base + "_" + std::to_string(session);
+}
+
+}
+
+
+int fbksd::getSessionId()
+{
+    const char* value = std::getenv(SESSION_ENV);
+    if(value == nullptr || *value == '\0')
+        return 0;
+
+    char* end = nullptr;
+    long id = std::strtol(value, &end, 10);
+    if(*end != '\0' || id < 0 || id >= MAX_SESSIONS)
+        throw std::invalid_argument(std::string("Invalid ") + SESSION_ENV + " value: " + value);
+    return static_cast<int>(id);
+}
+
+void fbksd::setSessionId(int id)
+{
+    checkSessionId(id);
+    setenv(SESSION_ENV, std::to_string(id).c_str(), 1);
+}
+
+int fbksd::getConsumerId()
+{
+    const char* value = std::getenv(CONSUMER_ENV);
+    if(value == nullptr || *value == '\0')
+        return 0;
+
+    char* end = nullptr;
+    long id = std::strtol(value, &end, 10);
+    if(*end != '\0' || id < 0 || id >= MAX_CONSUMERS)
+        throw std::invalid_argument(std::string("Invalid ") + CONSUMER_ENV + " value: " + value);
+    return static_cast<int>(id);
+}
+
+int fbksd::getShardId()
+{
+    const char* value = std::getenv(SHARD_ENV);
+    if(value == nullptr || *value == '\0')
+        return 0;
+
+    char* end = nullptr;
+    long id = std::strtol(value, &end, 10);
+    if(*end != '\0' || id < 0 || id >= MAX_SHARDS)
+        throw std::invalid_argument(std::string("Invalid ") + SHARD_ENV + " value: " + value);
+    return static_cast<int>(id);
+}
+
+unsigned short fbksd::getBenchmarkServerPort(int session, int consumer)
+{
+    checkSessionId(session);
+    checkConsumerId(consumer);
+    // Consumer 0 keeps the historical port, the others come after the rendering server port.
+    int offset = consumer == 0 ? 0 : RENDERING_SERVER_PORT - BENCHMARK_SERVER_PORT + consumer;
+    return static_cast<unsigned short>(BENCHMARK_SERVER_PORT + session * PORTS_PER_SESSION + offset);
+}
+
+unsigned short fbksd::getRenderingServerPort(int session, int shard)
+{
+    checkSessionId(session);
+    checkShardId(shard);
+    // Shard 0 keeps the port of the session block.
+    if(shard == 0)
+        return static_cast<unsigned short>(RENDERING_SERVER_PORT + session * PORTS_PER_SESSION);
+    return static_cast<unsigned short>(SHARD_PORTS_BEGIN + session * (MAX_SHARDS - 1) + shard - 1);
+}
+
+std::string fbksd::getTilesMemoryKey(int session)
+{
+    return sessionKey("TILES_MEMORY", session);
+}
+
+std::string fbksd::getResultMemoryKey(int session, int consumer)
+{
+    checkConsumerId(consumer);
+    if(consumer == 0)
+        return sessionKey("RESULT_MEMORY", session);
+    // The session is always in the key, so it doesn't clash with the keys of other sessions.
+    checkSessionId(session);
+    return "RESULT_MEMORY_" + std::to_string(session) + "_" + std::to_string(consumer);
+}
+
+std::string fbksd::getFrameMemoryKey(int session)
+{
+    return sessionKey("FRAME_MEMORY", session);
+}
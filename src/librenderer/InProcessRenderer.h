@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef INPROCESSRENDERER_H
+#define INPROCESSRENDERER_H
+
+#include "fbksd/renderer/RenderingServer.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace fbksd
+{
+
+#ifndef EXPORT_LIB
+#define EXPORT_LIB __attribute__((visibility("default")))
+#endif
+
+/**
+ * @brief Renderer plugin loaded into the client process (see RendererPlugin.h).
+ *
+ * The methods correspond to the requests of the rendering server, but are called directly: tiles are
+ * handed by the TilePool through its in-process queues, and are written to memory owned by the server.
+ *
+ * Calls must not be concurrent, as with the rendering server RPC.
+ */
+class EXPORT_LIB InProcessRenderer
+{
+public:
+    /**
+     * @brief Loads the plugin and registers its callbacks.
+     *
+     * @param pluginPath  Path of the renderer shared library.
+     * @param args        Renderer arguments (without the plugin path).
+     * @throws std::runtime_error if the plugin couldn't be loaded.
+     */
+    InProcessRenderer(const std::string& pluginPath, const std::vector<std::string>& args);
+
+    InProcessRenderer(const InProcessRenderer&) = delete;
+
+    /**
+     * @brief Finishes the renderer and unloads the plugin.
+     */
+    ~InProcessRenderer();
+
+    int getTileSize() const;
+    SceneInfo getSceneInfo();
+    void setParameters(const SampleLayout& layout);
+    bool supportsFeaturesOnly() const;
+    int registerLayout(const SampleLayout& layout);
+    void selectLayout(int id);
+    TilePkg evaluateSamples(int64_t spp, int64_t remainingCount);
+    TilePkg evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows);
+    TilePkg evaluateFrame(int64_t spp);
+    TilePkg evaluateInputSamples(int64_t spp, int64_t remainingCount);
+    TilePkg getNextTile(int64_t prevIndex);
+    TilePkg getNextInputTile(int64_t prevIndex, bool prevWasInput);
+    void lastTileConsumed(int64_t prevIndex);
+    TilePkg releaseAndGetNextTile(const std::vector<int64_t>& consumedIndices);
+    void releaseLastTiles(const std::vector<int64_t>& consumedIndices);
+    int64_t cancelEvaluation(const std::vector<int64_t>& consumedIndices);
+
+    /**
+     * @brief Memory of the tile slots of the current evaluation (tile indices are offsets in it).
+     */
+    float* getTilesData();
+
+    /**
+     * @brief Memory of the frame of the last evaluateFrame().
+     */
+    float* getFrameData();
+
+    InProcessRenderer& operator=(const InProcessRenderer&) = delete;
+
+private:
+    void* m_handle = nullptr;
+    std::unique_ptr<RenderingServer> m_server; // its callbacks are code of the plugin
+    std::vector<std::string> m_args; // the renderer may keep pointers to its arguments
+    std::vector<char*> m_argv;
+    int m_tileSize = 0;
+};
+
+} // namespace fbksd
+
+#endif // INPROCESSRENDERER_H
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "InputGenerator.h"
+#include "fbksd/core/session.h"
+using namespace fbksd;
+
+#include <stdexcept>
+#include <dlfcn.h>
+
+
+InputGenerator::InputGenerator(const std::string& name, const std::string& directory)
+{
+    if(directory.empty())
+        throw std::runtime_error("Input generators are disabled in this renderer (" + std::string(GENERATORS_ENV) + " is not set).");
+    if(name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos)
+        throw std::runtime_error("Invalid input generator name: " + name);
+
+    const std::string path = directory + "/" + name;
+    m_handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(m_handle == nullptr)
+        throw std::runtime_error("Couldn't load input generator plugin: " + std::string(dlerror()));
+    m_function = reinterpret_cast<InputGeneratorFunction>(dlsym(m_handle, INPUT_GENERATOR_FUNCTION));
+    if(m_function == nullptr)
+    {
+        dlclose(m_handle);
+        throw std::runtime_error(name + " is not an input generator plugin (" + INPUT_GENERATOR_FUNCTION + " not found).");
+    }
+}
+
+InputGenerator::~InputGenerator()
+{
+    dlclose(m_handle);
+}
+
+void InputGenerator::beginEvaluation(int64_t spp, int64_t remainingCount)
+{
+    m_spp = remainingCount == 0 ? spp : 0;
+    m_firstSample = m_nextSample;
+    // The remaining samples take at most one more sample in each pixel.
+    m_nextSample += spp + (remainingCount > 0 ? 1 : 0);
+}
+
+InputTile InputGenerator::makeTile(const Point2l& begin, const Point2l& end, int64_t numSamples) const
+{
+    InputTile tile;
+    tile.beginX = begin.x;
+    tile.beginY = begin.y;
+    tile.endX = end.x;
+    tile.endY = end.y;
+    tile.numSamples = numSamples;
+    tile.spp = m_spp;
+    tile.firstSample = m_firstSample;
+    return tile;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef INPUTGENERATOR_H
+#define INPUTGENERATOR_H
+
+#include "fbksd/renderer/InputGeneratorPlugin.h"
+#include "fbksd/core/Point.h"
+#include <string>
+
+namespace fbksd
+{
+
+/**
+ * @brief Input generator plugin loaded by the rendering server (see InputGeneratorPlugin.h).
+ *
+ * It generates the INPUT elements of the pipes of a layout that names it (see SampleLayout::setInputGenerator()),
+ * instead of the client.
+ */
+class InputGenerator
+{
+public:
+    /**
+     * @brief Loads the plugin.
+     *
+     * `name` is the file name of the shared library in `directory`. Since the name comes from the client, only
+     * plain file names are accepted, so the plugins that can be loaded are the ones in the directory.
+     *
+     * @throws std::runtime_error if `directory` is empty, `name` is not a file name, or the library can't be loaded or
+     * doesn't export the generator function.
+     */
+    InputGenerator(const std::string& name, const std::string& directory);
+
+    InputGenerator(const InputGenerator&) = delete;
+
+    ~InputGenerator();
+
+    /**
+     * @brief Starts an evaluation, advancing the first sample index of the pixels.
+     */
+    void beginEvaluation(int64_t spp, int64_t remainingCount);
+
+    /**
+     * @brief Returns the description of a tile of the current evaluation.
+     */
+    InputTile makeTile(const Point2l& begin, const Point2l& end, int64_t numSamples) const;
+
+    /**
+     * @brief Generates the given parameters of a sample of the tile.
+     */
+    void generate(const InputTile& tile, int64_t sample, const int32_t* parameters, int32_t numParameters, float* values) const
+    {
+        m_function(&tile, sample, parameters, numParameters, values);
+    }
+
+    InputGenerator& operator=(const InputGenerator&) = delete;
+
+private:
+    void* m_handle = nullptr;
+    InputGeneratorFunction m_function = nullptr;
+    int64_t m_spp = 0; // 0 if the pixels of the evaluation have different numbers of samples
+    int64_t m_firstSample = 0;
+    int64_t m_nextSample = 0;
+};
+
+} // namespace fbksd
+
+#endif // INPUTGENERATOR_H
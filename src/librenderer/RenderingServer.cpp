@@ -8,21 +8,320 @@
  */
 
 #include "fbksd/renderer/RenderingServer.h"
+#include "fbksd/renderer/RendererPlugin.h"
+#include "InProcessRenderer.h"
+#include "InputGenerator.h"
 #include "TilePool.h"
+#include "TileRecord.h"
 #include "version.h"
+#include "fbksd/core/session.h"
+#include "fbksd/core/TileTransport.h"
 using namespace fbksd;
 
 #include <rpc/server.h>
 #include <rpc/this_server.h>
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <csignal>
+#include <dlfcn.h>
+
+
+namespace
+{
+
+// Signals the parent process that the server is ready, if it asked for it (see READY_PORT_ENV).
+void notifyReady()
+{
+    const char* value = std::getenv(READY_PORT_ENV);
+    if(value == nullptr)
+        return;
+    int port = std::atoi(value);
+    unsetenv(READY_PORT_ENV);
+    if(port <= 0 || port > 65535)
+        return;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+        return;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    if(connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == -1)
+        std::cerr << "Couldn't notify readiness: " << strerror(errno) << std::endl;
+    close(fd);
+}
+
+// Returns the value of the variable and removes it, since renderers may start other
+// processes that also link this library.
+std::string takeEnv(const char* name)
+{
+    const char* value = std::getenv(name);
+    if(value == nullptr)
+        return std::string();
+    std::string str = value;
+    unsetenv(name);
+    return str;
+}
+
+}
 
 
 struct RenderingServer::Imp
 {
-    Imp():
-        m_server(std::make_unique<rpc::server>("127.0.0.1", 2227)),
-        m_tilesMemory("TILES_MEMORY")
-    {}
+    Imp(int session, int shard, bool inProcess):
+        m_cachePath(takeEnv(CACHE_ENV)),
+        m_generatorDir(takeEnv(GENERATORS_ENV)),
+        m_shard(shard)
+    {
+        if(!inProcess)
+        {
+            m_remote = takeEnv(REMOTE_ENV);
+            const std::string address = m_remote.empty() ? "127.0.0.1" : m_remote;
+            m_server = std::make_unique<rpc::server>(address, getRenderingServerPort(session, shard));
+            m_tilesMemory.setKey(getTilesMemoryKey(session));
+            m_frameMemory.setKey(getFrameMemoryKey(session));
+            // The memory of a remote server is private: the manager gets the tiles from the stream.
+            if(!m_remote.empty())
+            {
+                const std::string suffix = "_remote_" + std::to_string(getpid());
+                m_tilesMemory.setKey(m_tilesMemory.key() + suffix);
+                m_frameMemory.setKey(m_frameMemory.key() + suffix);
+            }
+        }
+        auto recordPath = takeEnv(RECORD_ENV);
+        if(!m_cachePath.empty())
+        {
+            // Another session may be using the same cache file.
+            m_cacheLockFd = open(m_cachePath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if(m_cacheLockFd == -1 || flock(m_cacheLockFd, LOCK_EX | LOCK_NB) == -1)
+            {
+                std::cerr << "Sample cache " << m_cachePath << " is not available: rendering without it." << std::endl;
+                m_cachePath.clear();
+            }
+        }
+        if(!m_cachePath.empty())
+            openCache();
+        else if(!recordPath.empty())
+            m_recorder = std::make_unique<TileRecorder>(recordPath);
+        SamplesPipe::sm_recorder = m_recorder.get();
+    }
+
+    ~Imp()
+    {
+        m_cacheReplayer.reset();
+        SamplesPipe::sm_recorder = nullptr;
+        SamplesPipe::sm_inputGenerator = nullptr;
+        if(m_cacheLockFd != -1)
+            close(m_cacheLockFd);
+    }
+
+    // (Re)opens the cache file, so evaluations rendered since the last call can be served from it.
+    void openCache()
+    {
+        m_cacheReplayer.reset();
+        SamplesPipe::sm_recorder = nullptr;
+        m_recorder.reset();
+        m_cacheReader.reset();
+
+        try
+        {
+            m_cacheReader = std::make_unique<TileRecordReader>(m_cachePath);
+        }
+        catch(const std::exception&)
+        {
+            // Missing, not a record file or corrupted index: start a new one.
+        }
+        if(m_cacheReader)
+        {
+            m_recorder = std::make_unique<TileRecorder>(m_cachePath, *m_cacheReader);
+            m_cacheReplayer = std::make_unique<TileReplayer>(*m_cacheReader);
+        }
+        else
+            m_recorder = std::make_unique<TileRecorder>(m_cachePath);
+        if(m_scene)
+            m_recorder->setScene(m_tileSize, *m_scene);
+        if(m_layout)
+            m_recorder->setLayout(*m_layout);
+        m_recorder->setSeed(m_seed);
+        SamplesPipe::sm_recorder = m_recorder.get();
+    }
+
+    void beginRun(int seed)
+    {
+        m_seed = seed;
+        if(!m_cachePath.empty())
+            openCache();
+    }
+
+    // Serves the evaluation from the sample cache (see CACHE_ENV), if it's there.
+    bool serveFromCache(int64_t spp, int64_t remainingCount, const std::vector<CropWindow>& windows)
+    {
+        if(!m_cacheReplayer || !m_layout)
+            return false;
+        m_cacheReplayer->join();
+        int layout = m_cacheReplayer->findLayout(*m_layout);
+        // Each run has its own samples, shared by the runs with the same seed (e.g. of other filters).
+        auto evaluation = m_cacheReplayer->find(layout, spp, remainingCount, windows, false, m_seed);
+        if(!evaluation)
+            return false;
+        m_recorder->skipEvaluation();
+        m_cacheReplayer->serve(*evaluation);
+        return true;
+    }
+
+    // Asks the renderer for the samples, unless the sample cache has them.
+    void render(int64_t spp, int64_t remainingCount, const std::vector<CropWindow>& windows, bool input, int pipeSize)
+    {
+        if(SamplesPipe::sm_inputGenerator)
+        {
+            SamplesPipe::sm_inputGenerator->beginEvaluation(spp, remainingCount);
+            // The generated input depends on the previous evaluations: the samples are recorded as input samples,
+            // that aren't served from the cache.
+            input = true;
+        }
+        if(!input && serveFromCache(spp, remainingCount, windows))
+            return;
+        if(m_recorder)
+            m_recorder->beginEvaluation(spp, remainingCount, windows, input);
+        auto evaluate = [&]()
+        {
+            if(windows.empty())
+                m_evalSamples(spp, remainingCount, pipeSize);
+            else
+                m_evalRegions(spp, windows, pipeSize);
+        };
+        if(m_numWorkers > 1)
+            forkWorkers(evaluate);
+        else
+            evaluate();
+    }
+
+    void setNumWorkers(int numWorkers)
+    {
+        if(!m_server)
+            throw std::logic_error("Worker processes are not supported when the server is loaded into the client process.");
+        if(numWorkers < 1)
+            throw std::invalid_argument("The number of workers must be at least 1.");
+        if(numWorkers > 1 && (m_recorder || !m_cachePath.empty()))
+        {
+            // Each worker would record only the pipes it rendered.
+            std::cerr << "Sample recording and cache are not supported with worker processes: rendering without them." << std::endl;
+            m_cacheReplayer.reset();
+            SamplesPipe::sm_recorder = nullptr;
+            m_recorder.reset();
+            m_cacheReader.reset();
+            m_cachePath.clear();
+            if(m_cacheLockFd != -1)
+                close(m_cacheLockFd);
+            m_cacheLockFd = -1;
+        }
+        m_numWorkers = numWorkers;
+        TilePool::setNumWorkers(numWorkers);
+    }
+
+    // Runs the evaluation in m_numWorkers processes, that share the tile pool initialized for it.
+    void forkWorkers(const std::function<void()>& evaluate)
+    {
+        joinWorkers();
+        // Otherwise, buffered output would be written by every worker.
+        std::cout.flush();
+        std::cerr.flush();
+        for(int i = 0; i < m_numWorkers; ++i)
+        {
+            pid_t pid = fork();
+            if(pid == -1)
+            {
+                int error = errno;
+                TilePool::cancel({});
+                joinWorkers();
+                throw std::runtime_error("Couldn't fork renderer worker: " + std::string(strerror(error)));
+            }
+            if(pid == 0)
+                runWorker(evaluate);
+            m_workers.push_back(pid);
+        }
+        TilePool::setWorkerMonitor([this](){ return checkWorkers(); });
+    }
+
+    [[noreturn]] void runWorker(const std::function<void()>& evaluate)
+    {
+        // Workers don't outlive the server.
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        int status = EXIT_SUCCESS;
+        try
+        {
+            evaluate();
+            // The callback may return while the renderer threads are still working, so LastTileConsumed
+            // is called at the end of the evaluation, as in a single process.
+            TilePool::waitFinished();
+            m_lastTileConsumed();
+        }
+        catch(const std::exception& e)
+        {
+            std::cerr << "Renderer worker error: " << e.what() << std::endl;
+            status = EXIT_FAILURE;
+        }
+        std::cout.flush();
+        std::cerr.flush();
+        // The rest of the process state (RPC server, shared memory) belongs to the parent.
+        _exit(status);
+    }
+
+    // Returns false if a worker exited (see TilePool::setWorkerMonitor()).
+    bool checkWorkers()
+    {
+        bool running = true;
+        auto it = m_workers.begin();
+        while(it != m_workers.end())
+        {
+            if(waitpid(*it, nullptr, WNOHANG) == *it)
+            {
+                it = m_workers.erase(it);
+                running = false;
+            }
+            else
+                ++it;
+        }
+        return running;
+    }
+
+    void joinWorkers()
+    {
+        for(auto pid: m_workers)
+        {
+            int status = 0;
+            pid_t result = 0;
+            do
+                result = waitpid(pid, &status, 0);
+            while(result == -1 && errno == EINTR);
+            if(result == pid && !(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS))
+                std::cerr << "Renderer worker " << pid << " failed." << std::endl;
+        }
+        m_workers.clear();
+        TilePool::setWorkerMonitor(nullptr);
+    }
+
+    // Called when the client is done with the evaluation.
+    void endEvaluation()
+    {
+        // Workers call LastTileConsumed themselves.
+        if(m_numWorkers > 1)
+            joinWorkers();
+        else
+            m_lastTileConsumed();
+    }
 
     int getTileSize()
     {
@@ -32,36 +331,245 @@ struct RenderingServer::Imp
     SceneInfo getSceneInfo()
     {
         SceneInfo scene = m_getSceneInfo();
-        m_pixelCount = scene.get<int64_t>("width") * scene.get<int64_t>("height");
+        m_imageWidth = scene.get<int64_t>("width");
+        m_imageHeight = scene.get<int64_t>("height");
+        m_pixelCount = m_imageWidth * m_imageHeight;
+        m_scene = std::make_unique<SceneInfo>(scene);
+        if(m_recorder)
+            m_recorder->setScene(m_tileSize, scene);
         return scene;
     }
 
     void setParameters(const SampleLayout& layout)
     {
-        SamplesPipe::setLayout(layout);
+        SamplesPipe::setLayoutTables(makeLayoutTables(layout));
+        m_evaluationMode = layout.isFeaturesOnly() ? FEATURES_ONLY : FULL;
+        m_layout = std::make_unique<SampleLayout>(layout);
+        if(m_recorder)
+            m_recorder->setLayout(layout);
         m_setParameters(layout);
     }
 
-    TilePkg evaluateSamples(int64_t spp, int64_t remainingCount)
+    int registerLayout(const SampleLayout& layout)
+    {
+        m_layouts.emplace_back(layout, makeLayoutTables(layout));
+        return static_cast<int>(m_layouts.size()) - 1;
+    }
+
+    void selectLayout(int id)
     {
+        if(id < 0 || id >= static_cast<int>(m_layouts.size()))
+            throw std::invalid_argument("Unknown sample layout id: " + std::to_string(id));
+        SamplesPipe::setLayoutTables(m_layouts[id].second);
+        m_evaluationMode = m_layouts[id].first.isFeaturesOnly() ? FEATURES_ONLY : FULL;
+        m_layout = std::make_unique<SampleLayout>(m_layouts[id].first);
+        if(m_recorder)
+            m_recorder->setLayout(m_layouts[id].first);
+        m_setParameters(m_layouts[id].first);
+    }
+
+    SamplesPipe::LayoutTables makeLayoutTables(const SampleLayout& layout)
+    {
+        auto tables = SamplesPipe::makeLayoutTables(layout);
+        const auto& name = layout.getInputGenerator();
+        if(!name.empty() && !tables.inputParameterIndices.empty())
+        {
+            // Loaded once, and kept while layouts may refer to it.
+            auto& generator = m_inputGenerators[name];
+            if(!generator)
+                generator = std::make_unique<InputGenerator>(name, m_generatorDir);
+            tables.inputGenerator = generator.get();
+        }
+        return tables;
+    }
+
+    // Number of floats in a tile slot. It must match the memory allocated by the BenchmarkManager.
+    int64_t getSlotSize(int64_t spp) const
+    {
+        // Pixel statistics take the space of two samples (mean and variance) per pixel.
+        if(SamplesPipe::sm_pixelStatistics)
+            spp = 2;
+        return std::max(spp, 1L) * m_tileSize * m_tileSize * SamplesPipe::sm_sampleSize;
+    }
+
+    // Maximum number of samples of a pipe. Renderers receive it as an int (see EvaluateSamples).
+    int getPipeMaxNumSamples(int64_t spp) const
+    {
+        const int64_t numSamples = std::max(spp, 1L) * m_tileSize * m_tileSize;
+        if(numSamples > std::numeric_limits<int>::max())
+            throw std::runtime_error("Too many samples per pixel for the tile size.");
+        return static_cast<int>(numSamples);
+    }
+
+    // Index of the first tile slot of the server: each shard has its own range of slots (see SHARD_ENV).
+    int getFirstSlot() const
+    {
+        return m_shard * TilePool::getNumTiles();
+    }
+
+    // Returns the memory of the tile slots, for tiles with the given spp.
+    float* getTilesBuffer(int64_t spp)
+    {
+        // In-process, the server owns the memory instead of the BenchmarkManager.
+        if(!m_server)
+        {
+            size_t size = TilePool::getNumTiles() * getSlotSize(spp);
+            if(m_localTiles.size() < size)
+                m_localTiles.resize(size);
+            return m_localTiles.data();
+        }
+        if(!m_remote.empty())
+            return getRemoteBuffer(m_tilesMemory, (getFirstSlot() + TilePool::getNumTiles()) * getSlotSize(spp));
+
         m_tilesMemory.detach();
         if(!m_tilesMemory.attach())
             throw std::runtime_error("Error attaching tiles shm: " + m_tilesMemory.error());
+        return static_cast<float*>(m_tilesMemory.data());
+    }
+
+    // Returns the memory of a frame with the given pixel size.
+    float* getFrameBuffer(int64_t pixelSize)
+    {
+        if(!m_server)
+        {
+            size_t size = m_pixelCount * pixelSize;
+            if(m_localFrame.size() < size)
+                m_localFrame.resize(size);
+            return m_localFrame.data();
+        }
+        if(!m_remote.empty())
+            return getRemoteBuffer(m_frameMemory, m_pixelCount * pixelSize);
+
+        m_frameMemory.detach();
+        if(!m_frameMemory.attach())
+            throw std::runtime_error("Error attaching frame shm: " + m_frameMemory.error());
+        return static_cast<float*>(m_frameMemory.data());
+    }
+
+    // Returns the private memory of a remote server, growing it to the given number of floats.
+    // It's shared memory anyway, so worker processes write to it too.
+    float* getRemoteBuffer(SharedMemory& memory, size_t size)
+    {
+        size *= sizeof(float);
+        if(!memory.isAttached() || memory.size() < size)
+        {
+            SharedMemory newMemory(memory.key());
+            memory.detach();
+            // Dropping the old memory unlinks it.
+            { SharedMemory old = std::move(memory); }
+            if(!newMemory.create(size))
+                throw std::runtime_error("Error creating remote tiles memory: " + newMemory.error());
+            memory = std::move(newMemory);
+        }
+        return static_cast<float*>(memory.data());
+    }
+
+    // Opens the stream the tiles of a remote server are sent through (see REMOTE_ENV).
+    unsigned short openTileStream(bool compress)
+    {
+        if(m_remote.empty())
+            throw std::logic_error("The rendering server is not remote: tiles are written to shared memory.");
+        m_stream.reset();
+        m_stream = std::make_unique<TileStreamSender>(m_remote, compress);
+        return m_stream->port();
+    }
+
+    // Sends the data of a tile to the manager, if the server is remote.
+    TilePkg streamTile(const TilePkg& pkg)
+    {
+        if(m_remote.empty() || !pkg.isValid)
+            return pkg;
+        if(!m_stream)
+            throw std::logic_error("The tile stream of the remote rendering server is not open.");
+
+        // Same size as read by the client.
+        const Tile& tile = pkg.tile;
+        int64_t size = tile.numSamples * SamplesPipe::sm_sampleSize;
+        if(SamplesPipe::sm_pixelStatistics)
+            size = 2 * SamplesPipe::sm_sampleSize * (tile.window.end.x - tile.window.begin.x) * (tile.window.end.y - tile.window.begin.y);
+        const float* tiles = static_cast<const float*>(m_tilesMemory.data());
+        m_stream->send(TileTarget::TILES, tile.index, tiles + tile.index, size);
+        return pkg;
+    }
+
+    void checkLocalTiles() const
+    {
+        if(!m_remote.empty())
+            throw std::logic_error("Input samples are not supported by remote rendering servers.");
+    }
+
+    TilePkg evaluateSamples(int64_t spp, int64_t remainingCount)
+    {
+        if(SamplesPipe::sm_pixelStatistics && remainingCount > 0)
+            throw std::logic_error("Pixel statistics mode only supports SPP requests.");
 
         SamplesPipe::sm_numSamples = spp;
-        const int pipeMaxNumSamples = std::max(spp, 1L) * m_tileSize * m_tileSize;
+        const int pipeMaxNumSamples = getPipeMaxNumSamples(spp);
         TilePool::init(spp * m_pixelCount + remainingCount,
                        pipeMaxNumSamples,
                        SamplesPipe::sm_sampleSize,
-                       static_cast<float*>(m_tilesMemory.data()),
-                       false);
+                       getSlotSize(spp),
+                       getTilesBuffer(spp),
+                       false,
+                       getFirstSlot());
 
-        m_evalSamples(spp, remainingCount, pipeMaxNumSamples);
+        render(spp, remainingCount, {}, false, pipeMaxNumSamples);
 
         bool hasNext = false;
         bool isInput = false;
         auto tile = TilePool::getClientTile(hasNext, isInput);
-        return {tile, hasNext, isInput};
+        return streamTile({tile, hasNext, isInput});
+    }
+
+    TilePkg evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows)
+    {
+        if(!m_evalRegions)
+            throw std::runtime_error("The renderer doesn't support region evaluation.");
+
+        int64_t numSamples = 0;
+        for(const auto& w: windows)
+            numSamples += spp * (w.end.x - w.begin.x) * (w.end.y - w.begin.y);
+
+        SamplesPipe::sm_numSamples = spp;
+        const int pipeMaxNumSamples = getPipeMaxNumSamples(spp);
+        TilePool::init(numSamples,
+                       pipeMaxNumSamples,
+                       SamplesPipe::sm_sampleSize,
+                       getSlotSize(spp),
+                       getTilesBuffer(spp),
+                       false,
+                       getFirstSlot());
+
+        render(spp, 0, windows, false, pipeMaxNumSamples);
+
+        bool hasNext = false;
+        bool isInput = false;
+        auto tile = TilePool::getClientTile(hasNext, isInput);
+        return streamTile({tile, hasNext, isInput});
+    }
+
+    TilePkg evaluateFrame(int64_t spp)
+    {
+        SamplesPipe::sm_numSamples = spp;
+        const int pipeMaxNumSamples = getPipeMaxNumSamples(spp);
+        const int64_t pixelSize = SamplesPipe::sm_sampleSize * (SamplesPipe::sm_pixelStatistics ? 2 : spp);
+        TilePool::initFrame(spp * m_pixelCount,
+                            pipeMaxNumSamples,
+                            SamplesPipe::sm_sampleSize,
+                            pixelSize,
+                            m_imageWidth,
+                            getFrameBuffer(pixelSize));
+
+        render(spp, 0, {}, false, pipeMaxNumSamples);
+
+        auto tile = TilePool::waitFrame({m_imageWidth, m_imageHeight});
+        if(!m_remote.empty())
+        {
+            if(!m_stream)
+                throw std::logic_error("The tile stream of the remote rendering server is not open.");
+            m_stream->send(TileTarget::FRAME, 0, static_cast<const float*>(m_frameMemory.data()), m_pixelCount * pixelSize);
+        }
+        return {tile, false, false};
     }
 
     TilePkg getNextTile(int64_t prevIndex)
@@ -70,29 +578,34 @@ struct RenderingServer::Imp
         bool hasNext = false;
         bool isInput = false;
         auto tile = TilePool::getClientTile(hasNext, isInput);
-        return {tile, hasNext, isInput};
+        return streamTile({tile, hasNext, isInput});
     }
 
     TilePkg evaluateInputSamples(int64_t spp, int64_t remainingCount)
     {
-        m_tilesMemory.detach();
-        if(!m_tilesMemory.attach())
-            throw std::runtime_error("Error attaching tiles shm: " + m_tilesMemory.error());
+        if(SamplesPipe::sm_pixelStatistics)
+            throw std::logic_error("Pixel statistics mode doesn't support input samples.");
+        // The client writes the input samples in the tiles memory, which the stream only sends the other way.
+        const bool waitInput = !SamplesPipe::sm_inputGenerator;
+        if(waitInput)
+            checkLocalTiles();
 
         SamplesPipe::sm_numSamples = spp;
-        const int pipeMaxNumSamples = std::max(spp, 1L) * m_tileSize * m_tileSize;
+        const int pipeMaxNumSamples = getPipeMaxNumSamples(spp);
         TilePool::init(spp * m_pixelCount + remainingCount,
                        pipeMaxNumSamples,
                        SamplesPipe::sm_sampleSize,
-                       static_cast<float*>(m_tilesMemory.data()),
-                       true);
+                       getSlotSize(spp),
+                       getTilesBuffer(spp),
+                       waitInput,
+                       getFirstSlot());
 
-        m_evalSamples(spp, remainingCount, pipeMaxNumSamples);
+        render(spp, remainingCount, {}, true, pipeMaxNumSamples);
 
         bool hasNext = false;
         bool isInput = false;
         auto tile = TilePool::getClientTile(hasNext, isInput);
-        return {tile, hasNext, isInput};
+        return streamTile({tile, hasNext, isInput});
     }
 
     TilePkg getNextInputTile(int64_t prevIndex, bool prevWasInput)
@@ -105,36 +618,107 @@ struct RenderingServer::Imp
         bool hasNext = false;
         bool isInput = false;
         auto tile = TilePool::getClientTile(hasNext, isInput);
-        return {tile, hasNext, isInput};
+        return streamTile({tile, hasNext, isInput});
     }
 
     void lastTileConsumed(int64_t prevIndex)
     {
         TilePool::releaseConsumedTile(prevIndex);
-        m_lastTileConsumed();
+        endEvaluation();
+    }
+
+    TilePkg releaseAndGetNextTile(const std::vector<int64_t>& consumedIndices)
+    {
+        for(auto index: consumedIndices)
+            TilePool::releaseConsumedTile(index);
+        bool hasNext = false;
+        bool isInput = false;
+        auto tile = TilePool::getClientTile(hasNext, isInput);
+        return streamTile({tile, hasNext, isInput});
+    }
+
+    void releaseLastTiles(const std::vector<int64_t>& consumedIndices)
+    {
+        for(auto index: consumedIndices)
+            TilePool::releaseConsumedTile(index);
+        endEvaluation();
+    }
+
+    int64_t cancelEvaluation(const std::vector<int64_t>& consumedIndices)
+    {
+        // The slots of the tiles still being sent are reused after the cancellation.
+        if(m_stream)
+            m_stream->flush();
+        int64_t numDelivered = TilePool::cancel(consumedIndices);
+        endEvaluation();
+        return numDelivered;
+    }
+
+    void checkCallbacks() const
+    {
+        if(!m_getTileSize)
+            throw std::logic_error("GetTileSize callback not registered.");
+        if(!m_getSceneInfo)
+            throw std::logic_error("GetSceneInfo callback not registered.");
+        if(!m_setParameters)
+            throw std::logic_error("SetParameters callback not registered.");
+        if(!m_evalSamples)
+            throw std::logic_error("EvaluateSamples callback not registered.");
     }
 
     void finishRender()
     {
+        if(!m_workers.empty())
+        {
+            TilePool::cancel({});
+            joinWorkers();
+        }
         m_finish();
-        rpc::this_server().stop();
+        if(m_recorder)
+            m_recorder->close();
+        if(m_server)
+            rpc::this_server().stop();
     }
 
-    std::unique_ptr<rpc::server> m_server;
+    std::unique_ptr<rpc::server> m_server; // null in-process
     SharedMemory m_tilesMemory;
+    SharedMemory m_frameMemory;
+    std::vector<float> m_localTiles; // tiles memory in-process
+    std::vector<float> m_localFrame; // frame memory in-process
+    std::string m_cachePath;
+    int m_seed = 0; // index of the current run (see beginRun())
+    std::string m_remote; // address of a remote server (see REMOTE_ENV)
+    std::unique_ptr<TileStreamSender> m_stream; // tiles stream of a remote server
+    std::string m_generatorDir; // directory of the input generators (see GENERATORS_ENV)
+    int m_shard = 0;
+    int m_cacheLockFd = -1;
+    std::unique_ptr<TileRecorder> m_recorder;
+    std::unique_ptr<TileRecordReader> m_cacheReader;
+    std::unique_ptr<TileReplayer> m_cacheReplayer;
+    std::unique_ptr<SceneInfo> m_scene; // last scene info given to the client
+    std::unique_ptr<SampleLayout> m_layout; // current layout
+    int64_t m_imageWidth = 0;
+    int64_t m_imageHeight = 0;
     int64_t m_pixelCount = 0;
     int64_t m_tileSize = 0;
+    std::vector<std::pair<SampleLayout, SamplesPipe::LayoutTables>> m_layouts; // registered layouts, indexed by id
+    std::map<std::string, std::unique_ptr<InputGenerator>> m_inputGenerators; // loaded input generators, by name
+    int m_numWorkers = 1;
+    std::vector<pid_t> m_workers; // worker processes of the current evaluation
     GetTileSize m_getTileSize;
     GetSceneInfo m_getSceneInfo;
     SetParameters m_setParameters;
     EvaluateSamples m_evalSamples;
+    EvaluationMode m_evaluationMode = FULL;
+    bool m_supportsFeaturesOnly = false;
+    EvaluateRegions m_evalRegions;
     LastTileConsumed m_lastTileConsumed = [](){};
     Finish m_finish = [](){};
 };
 
 
 RenderingServer::RenderingServer() :
-    m_imp(std::make_unique<Imp>())
+    m_imp(std::make_unique<Imp>(getSessionId(), getShardId(), false))
 {
     m_imp->m_server->bind("GET_VERSION", []()
     { return std::make_pair(FBKSD_VERSION_MAJOR, FBKSD_VERSION_MINOR); });
@@ -144,8 +728,22 @@ RenderingServer::RenderingServer() :
         [this](){return m_imp->getSceneInfo();});
     m_imp->m_server->bind("SET_PARAMETERS",
         [this](const SampleLayout& layout){ m_imp->setParameters(layout); });
+    m_imp->m_server->bind("SUPPORTS_FEATURES_ONLY",
+        [this](){ return m_imp->m_supportsFeaturesOnly; });
+    m_imp->m_server->bind("OPEN_TILE_STREAM",
+        [this](bool compress){ return m_imp->openTileStream(compress); });
+    m_imp->m_server->bind("SUPPORTS_REGIONS",
+        [this](){ return static_cast<bool>(m_imp->m_evalRegions); });
+    m_imp->m_server->bind("REGISTER_LAYOUT",
+        [this](const SampleLayout& layout){ return m_imp->registerLayout(layout); });
+    m_imp->m_server->bind("SELECT_LAYOUT",
+        [this](int id){ m_imp->selectLayout(id); });
     m_imp->m_server->bind("EVALUATE_SAMPLES",
         [this](int64_t spp, int64_t remainingCount){ return m_imp->evaluateSamples(spp, remainingCount); });
+    m_imp->m_server->bind("EVALUATE_REGIONS",
+        [this](int64_t spp, const std::vector<CropWindow>& windows){ return m_imp->evaluateRegions(spp, windows); });
+    m_imp->m_server->bind("EVALUATE_FRAME",
+        [this](int64_t spp){ return m_imp->evaluateFrame(spp); });
     m_imp->m_server->bind("GET_NEXT_TILE",
         [this](int64_t prevTileIndex){ return m_imp->getNextTile(prevTileIndex); });
     m_imp->m_server->bind("EVALUATE_INPUT_SAMPLES",
@@ -154,10 +752,22 @@ RenderingServer::RenderingServer() :
         [this](int64_t prevTileIndex, bool prevWasInput){ return m_imp->getNextInputTile(prevTileIndex, prevWasInput); });
     m_imp->m_server->bind("LAST_TILE_CONSUMED",
         [this](int64_t index){ return m_imp->lastTileConsumed(index); });
+    m_imp->m_server->bind("RELEASE_AND_GET_NEXT_TILE",
+        [this](const std::vector<int64_t>& indices){ return m_imp->releaseAndGetNextTile(indices); });
+    m_imp->m_server->bind("RELEASE_LAST_TILES",
+        [this](const std::vector<int64_t>& indices){ m_imp->releaseLastTiles(indices); });
+    m_imp->m_server->bind("CANCEL_EVALUATION",
+        [this](const std::vector<int64_t>& indices){ return m_imp->cancelEvaluation(indices); });
+    m_imp->m_server->bind("BEGIN_RUN",
+        [this](int seed){ m_imp->beginRun(seed); });
     m_imp->m_server->bind("FINISH_RENDER",
                           [this](){ m_imp->finishRender(); });
 }
 
+RenderingServer::RenderingServer(InProcess) :
+    m_imp(std::make_unique<Imp>(0, 0, true))
+{}
+
 RenderingServer::~RenderingServer() = default;
 
 void RenderingServer::onGetTileSize(const RenderingServer::GetTileSize &callback)
@@ -178,6 +788,20 @@ void RenderingServer::onSetParameters(const SetParameters& callback)
 void RenderingServer::onEvaluateSamples(const EvaluateSamples& callback)
 {
     m_imp->m_evalSamples = callback;
+    m_imp->m_supportsFeaturesOnly = false;
+}
+
+void RenderingServer::onEvaluateSamplesWithMode(const EvaluateSamplesWithMode& callback)
+{
+    Imp* imp = m_imp.get();
+    m_imp->m_evalSamples = [imp, callback](int64_t spp, int64_t remainingCount, int pipeSize)
+    { callback(spp, remainingCount, pipeSize, imp->m_evaluationMode); };
+    m_imp->m_supportsFeaturesOnly = true;
+}
+
+void RenderingServer::onEvaluateRegions(const EvaluateRegions& callback)
+{
+    m_imp->m_evalRegions = callback;
 }
 
 void RenderingServer::onLastTileConsumed(const LastTileConsumed &callback)
@@ -190,16 +814,162 @@ void RenderingServer::onFinish(const Finish& callback)
     m_imp->m_finish = callback;
 }
 
+void RenderingServer::setNumWorkers(int numWorkers)
+{
+    m_imp->setNumWorkers(numWorkers);
+}
+
 void RenderingServer::run()
 {
-    if(!m_imp->m_getTileSize)
-        throw std::logic_error("GetTileSize callback not registered.");
-    if(!m_imp->m_getSceneInfo)
-        throw std::logic_error("GetSceneInfo callback not registered.");
-    if(!m_imp->m_setParameters)
-        throw std::logic_error("SetParameters callback not registered.");
-    if(!m_imp->m_evalSamples)
-        throw std::logic_error("EvaluateSamples callback not registered.");
+    if(!m_imp->m_server)
+        throw std::logic_error("The server was loaded into the client process, it can't be run.");
+    m_imp->checkCallbacks();
 
+    // The server port is already listening at this point, so requests sent after
+    // the notification are queued until run() starts processing them.
+    notifyReady();
     m_imp->m_server->run();
 }
+
+
+// ======================================================
+// InProcessRenderer
+// ======================================================
+InProcessRenderer::InProcessRenderer(const std::string& pluginPath, const std::vector<std::string>& args)
+{
+    m_handle = dlopen(pluginPath.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if(m_handle == nullptr)
+        throw std::runtime_error("Couldn't load renderer plugin: " + std::string(dlerror()));
+    auto setup = reinterpret_cast<RendererPluginSetup>(dlsym(m_handle, RENDERER_PLUGIN_SETUP));
+    if(setup == nullptr)
+    {
+        dlclose(m_handle);
+        throw std::runtime_error(pluginPath + " is not a renderer plugin (" + RENDERER_PLUGIN_SETUP + " not found).");
+    }
+
+    // The renderer gets its arguments as in main().
+    m_args.push_back(pluginPath);
+    m_args.insert(m_args.end(), args.begin(), args.end());
+    for(auto& arg: m_args)
+        m_argv.push_back(&arg[0]);
+    m_argv.push_back(nullptr);
+
+    m_server.reset(new RenderingServer(RenderingServer::InProcess()));
+    try
+    {
+        setup(m_server.get(), static_cast<int>(m_args.size()), m_argv.data());
+        m_server->m_imp->checkCallbacks();
+        m_tileSize = m_server->m_imp->getTileSize();
+    }
+    catch(...)
+    {
+        m_server.reset();
+        dlclose(m_handle);
+        throw;
+    }
+}
+
+InProcessRenderer::~InProcessRenderer()
+{
+    try
+    {
+        m_server->m_imp->finishRender();
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Error finishing the renderer plugin: " << e.what() << std::endl;
+    }
+    // Destroys the callbacks before unloading their code.
+    m_server.reset();
+    dlclose(m_handle);
+}
+
+int InProcessRenderer::getTileSize() const
+{
+    return m_tileSize;
+}
+
+SceneInfo InProcessRenderer::getSceneInfo()
+{
+    return m_server->m_imp->getSceneInfo();
+}
+
+void InProcessRenderer::setParameters(const SampleLayout& layout)
+{
+    m_server->m_imp->setParameters(layout);
+}
+
+bool InProcessRenderer::supportsFeaturesOnly() const
+{
+    return m_server->m_imp->m_supportsFeaturesOnly;
+}
+
+int InProcessRenderer::registerLayout(const SampleLayout& layout)
+{
+    return m_server->m_imp->registerLayout(layout);
+}
+
+void InProcessRenderer::selectLayout(int id)
+{
+    m_server->m_imp->selectLayout(id);
+}
+
+TilePkg InProcessRenderer::evaluateSamples(int64_t spp, int64_t remainingCount)
+{
+    return m_server->m_imp->evaluateSamples(spp, remainingCount);
+}
+
+TilePkg InProcessRenderer::evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows)
+{
+    return m_server->m_imp->evaluateRegions(spp, windows);
+}
+
+TilePkg InProcessRenderer::evaluateFrame(int64_t spp)
+{
+    return m_server->m_imp->evaluateFrame(spp);
+}
+
+TilePkg InProcessRenderer::evaluateInputSamples(int64_t spp, int64_t remainingCount)
+{
+    return m_server->m_imp->evaluateInputSamples(spp, remainingCount);
+}
+
+TilePkg InProcessRenderer::getNextTile(int64_t prevIndex)
+{
+    return m_server->m_imp->getNextTile(prevIndex);
+}
+
+TilePkg InProcessRenderer::getNextInputTile(int64_t prevIndex, bool prevWasInput)
+{
+    return m_server->m_imp->getNextInputTile(prevIndex, prevWasInput);
+}
+
+void InProcessRenderer::lastTileConsumed(int64_t prevIndex)
+{
+    m_server->m_imp->lastTileConsumed(prevIndex);
+}
+
+TilePkg InProcessRenderer::releaseAndGetNextTile(const std::vector<int64_t>& consumedIndices)
+{
+    return m_server->m_imp->releaseAndGetNextTile(consumedIndices);
+}
+
+void InProcessRenderer::releaseLastTiles(const std::vector<int64_t>& consumedIndices)
+{
+    m_server->m_imp->releaseLastTiles(consumedIndices);
+}
+
+int64_t InProcessRenderer::cancelEvaluation(const std::vector<int64_t>& consumedIndices)
+{
+    return m_server->m_imp->cancelEvaluation(consumedIndices);
+}
+
+float* InProcessRenderer::getTilesData()
+{
+    return m_server->m_imp->m_localTiles.data();
+}
+
+float* InProcessRenderer::getFrameData()
+{
+    return m_server->m_imp->m_localFrame.data();
+}
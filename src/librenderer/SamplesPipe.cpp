@@ -9,8 +9,12 @@
 
 #include "fbksd/renderer/SamplesPipe.h"
 #include "TilePool.h"
+#include "TileRecord.h"
+#include "InputGenerator.h"
 using namespace fbksd;
 #include <cassert>
+#include <cstring>
+#include <exception>
 
 
 // ======================================================
@@ -55,17 +59,6 @@ float SampleBuffer::get(Feature f)
     return m_featuresBuffer[f];
 }
 
-void SampleBuffer::setLayout(const SampleLayout& layout)
-{
-    m_ioMask.fill(false);
-    RandomParameter p;
-    for(const auto& par: layout.parameters)
-    {
-        if(stringToRandomParameter(par.name, &p))
-            m_ioMask[p] = par.io;
-    }
-}
-
 
 
 // ======================================================
@@ -75,18 +68,30 @@ void SampleBuffer::setLayout(const SampleLayout& layout)
 // Static initialization
 int64_t SamplesPipe::sm_sampleSize = 0;
 int64_t SamplesPipe::sm_numSamples = 0;
+bool SamplesPipe::sm_pixelStatistics = false;
 std::vector<std::pair<int, int>> SamplesPipe::sm_inputParameterIndices;
 std::vector<std::pair<int, int>> SamplesPipe::sm_outputParameterIndices;
 std::vector<std::pair<int, int>> SamplesPipe::sm_outputFeatureIndices;
+TileRecorder* SamplesPipe::sm_recorder = nullptr;
+InputGenerator* SamplesPipe::sm_inputGenerator = nullptr;
 
 
 SamplesPipe::SamplesPipe(const Point2l &begin, const Point2l &end, int64_t numSamples):
     m_begin(begin),
     m_end(end),
     m_width(end.x - begin.x),
+    m_rowStride(m_width),
     m_informedNumSamples(numSamples)
 {
     m_samples = m_currentSamplePtr = TilePool::getFreeTile(begin, end, numSamples);
+    // In frame mode, the pipe writes directly in its rows of the frame.
+    if(TilePool::getFrameWidth() > 0)
+    {
+        m_rowStride = TilePool::getFrameWidth();
+        m_rowGap = (m_rowStride - m_width) * getPixelSize();
+    }
+    if(sm_inputGenerator && !TilePool::isCanceled())
+        generateInput();
 }
 
 SamplesPipe::SamplesPipe(SamplesPipe &&pipe)
@@ -96,11 +101,25 @@ SamplesPipe::SamplesPipe(SamplesPipe &&pipe)
     m_begin = pipe.m_begin;
     m_end = pipe.m_end;
     m_width = pipe.m_width;
+    m_rowStride = pipe.m_rowStride;
+    m_rowGap = pipe.m_rowGap;
+    m_column = pipe.m_column;
+    m_informedNumSamples = pipe.m_informedNumSamples;
+    m_numSamples = pipe.m_numSamples;
+    m_pixelNumSamples = pipe.m_pixelNumSamples;
     pipe.m_samples = pipe.m_currentSamplePtr = nullptr;
 }
 
 SamplesPipe::~SamplesPipe()
 {
+    // Destroyed by an exception thrown while rendering: the pipe may be incomplete, and the evaluation can't finish.
+    if(m_samples && std::uncaught_exception() && !isCanceled())
+        TilePool::cancel({});
+    // Recorded before finalizing the statistics, so the replayed pipe finalizes them again.
+    if(sm_recorder && m_samples && !isCanceled())
+        sm_recorder->add(*this);
+    if(sm_pixelStatistics && m_samples)
+        finalizeStatistics();
     TilePool::releaseWorkedTile(*this);
 }
 
@@ -110,9 +129,22 @@ void SamplesPipe::seek(int x, int y)
     assert(x < m_end.x);
     assert(m_begin.y <= y);
     assert(y < m_end.y);
-    auto index = int64_t(x - m_begin.x) * sm_sampleSize * sm_numSamples +
-                 int64_t(y - m_begin.y) * sm_sampleSize * sm_numSamples * m_width;
+    const int64_t pixelSize = getPixelSize();
+    auto index = int64_t(x - m_begin.x) * pixelSize +
+                 int64_t(y - m_begin.y) * pixelSize * m_rowStride;
     m_currentSamplePtr = &m_samples[index];
+    m_pixelNumSamples = 0;
+    m_column = x - m_begin.x;
+}
+
+bool SamplesPipe::isCanceled()
+{
+    return TilePool::isCanceled();
+}
+
+bool SamplesPipe::claimWork()
+{
+    return TilePool::claimWork();
 }
 
 size_t SamplesPipe::getPosition() const
@@ -135,33 +167,186 @@ SampleBuffer SamplesPipe::getBuffer()
 
 SamplesPipe& SamplesPipe::operator<<(const SampleBuffer& buffer)
 {
+    if(sm_pixelStatistics)
+    {
+        accumulate(buffer);
+        return *this;
+    }
+
     for(const auto& pair: sm_outputParameterIndices)
         m_currentSamplePtr[pair.second] = buffer.m_paramentersBuffer[pair.first];
     for(const auto& pair: sm_outputFeatureIndices)
         m_currentSamplePtr[pair.second] = buffer.m_featuresBuffer[pair.first];
     m_currentSamplePtr += sm_sampleSize;
     ++m_numSamples;
+    if(m_rowGap > 0 && ++m_pixelNumSamples == sm_numSamples)
+        endPixel();
     return *this;
 }
 
+void SamplesPipe::write(const float* samples, int64_t numSamples)
+{
+    const int64_t height = m_end.y - m_begin.y;
+    const int64_t rowSize = m_width * getPixelSize();
+    const int64_t numFloats = sm_pixelStatistics ? height * rowSize : numSamples * sm_sampleSize;
+
+    if(!sm_inputParameterIndices.empty())
+    {
+        // Only SPP requests without statistics have input, and they are never in frame mode.
+        for(int64_t s = 0; s < numSamples; ++s)
+        {
+            const float* src = &samples[s * sm_sampleSize];
+            float* dst = &m_samples[s * sm_sampleSize];
+            for(const auto& pair: sm_outputParameterIndices)
+                dst[pair.second] = src[pair.second];
+            for(const auto& pair: sm_outputFeatureIndices)
+                dst[pair.second] = src[pair.second];
+        }
+    }
+    else if(m_rowGap == 0)
+        std::memcpy(m_samples, samples, numFloats * sizeof(float));
+    else
+    {
+        for(int64_t y = 0; y < height; ++y)
+            std::memcpy(&m_samples[y * (rowSize + m_rowGap)], &samples[y * rowSize], rowSize * sizeof(float));
+    }
+
+    m_currentSamplePtr = m_samples + numFloats + (m_rowGap > 0 ? height * m_rowGap : 0);
+    m_numSamples = numSamples;
+    m_pixelNumSamples = 0;
+    m_column = 0;
+}
+
+int64_t SamplesPipe::getPixelSize() const
+{
+    // A pixel takes the space of two samples in pixel statistics mode.
+    return sm_sampleSize * (sm_pixelStatistics ? 2 : sm_numSamples);
+}
+
+int64_t SamplesPipe::getPackedSize() const
+{
+    if(sm_pixelStatistics)
+        return m_width * (m_end.y - m_begin.y) * getPixelSize();
+    return m_numSamples * sm_sampleSize;
+}
+
+void SamplesPipe::pack(float* out) const
+{
+    // Same format as write(): the row gaps of frame mode are removed.
+    if(m_rowGap == 0)
+    {
+        std::memcpy(out, m_samples, getPackedSize() * sizeof(float));
+        return;
+    }
+    const int64_t rowSize = m_width * getPixelSize();
+    for(int64_t y = 0; y < m_end.y - m_begin.y; ++y)
+        std::memcpy(&out[y * rowSize], &m_samples[y * (rowSize + m_rowGap)], rowSize * sizeof(float));
+}
+
+void SamplesPipe::accumulate(const SampleBuffer& buffer)
+{
+    // Welford's online algorithm: the pixel holds [means, M2s], with M2 = sum of squared deviations.
+    const int64_t n = ++m_pixelNumSamples;
+    float* mean = m_currentSamplePtr;
+    float* m2 = m_currentSamplePtr + sm_sampleSize;
+    auto add = [&](int i, float v)
+    {
+        if(n == 1)
+        {
+            mean[i] = v;
+            m2[i] = 0.f;
+            return;
+        }
+        float delta = v - mean[i];
+        mean[i] += delta / n;
+        m2[i] += delta * (v - mean[i]);
+    };
+
+    for(const auto& pair: sm_outputParameterIndices)
+        add(pair.second, buffer.m_paramentersBuffer[pair.first]);
+    for(const auto& pair: sm_outputFeatureIndices)
+        add(pair.second, buffer.m_featuresBuffer[pair.first]);
+    ++m_numSamples;
+
+    if(n == sm_numSamples)
+    {
+        m_currentSamplePtr += 2 * sm_sampleSize;
+        endPixel();
+    }
+}
+
+void SamplesPipe::endPixel()
+{
+    m_pixelNumSamples = 0;
+    if(++m_column == m_width)
+    {
+        m_column = 0;
+        m_currentSamplePtr += m_rowGap;
+    }
+}
+
+void SamplesPipe::finalizeStatistics()
+{
+    // Converts M2 to the unbiased variance.
+    const int64_t height = m_end.y - m_begin.y;
+    const float scale = sm_numSamples > 1 ? 1.f / (sm_numSamples - 1) : 0.f;
+    for(int64_t y = 0; y < height; ++y)
+    {
+        for(int64_t x = 0; x < m_width; ++x)
+        {
+            float* m2 = &m_samples[(2 * (y * m_rowStride + x) + 1) * sm_sampleSize];
+            for(int64_t i = 0; i < sm_sampleSize; ++i)
+                m2[i] *= scale;
+        }
+    }
+}
+
+void SamplesPipe::generateInput()
+{
+    const InputTile tile = sm_inputGenerator->makeTile(m_begin, m_end, m_informedNumSamples);
+    std::vector<int32_t> parameters;
+    for(const auto& pair: sm_inputParameterIndices)
+        parameters.push_back(pair.first);
+    std::vector<float> values(parameters.size());
+
+    const int64_t pixelSize = getPixelSize();
+    for(int64_t i = 0; i < tile.numSamples; ++i)
+    {
+        sm_inputGenerator->generate(tile, i, parameters.data(), static_cast<int32_t>(parameters.size()), values.data());
+        // In frame mode (always in spp), the pixels of the pipe are rows of the frame.
+        float* sample = &m_samples[i * sm_sampleSize];
+        if(m_rowGap > 0)
+        {
+            const int64_t pixel = i / tile.spp;
+            sample = &m_samples[((pixel / m_width) * m_rowStride + pixel % m_width) * pixelSize + (i % tile.spp) * sm_sampleSize];
+        }
+        for(size_t p = 0; p < values.size(); ++p)
+            sample[sm_inputParameterIndices[p].second] = values[p];
+    }
+}
+
 void SamplesPipe::setLayout(const SampleLayout& layout)
 {
-    SampleBuffer::setLayout(layout);
-    sm_sampleSize = layout.getSampleSize();
+    setLayoutTables(makeLayoutTables(layout));
+}
 
-    sm_inputParameterIndices.clear();
-    sm_outputParameterIndices.clear();
-    sm_outputFeatureIndices.clear();
+SamplesPipe::LayoutTables SamplesPipe::makeLayoutTables(const SampleLayout& layout)
+{
+    LayoutTables tables;
+    tables.sampleSize = layout.getSampleSize();
+    tables.pixelStatistics = layout.isPixelStatistics();
+    tables.ioMask.fill(false);
     for(size_t i = 0; i < layout.parameters.size(); ++i)
     {
         auto &par = layout.parameters[i];
         RandomParameter p;
         if(stringToRandomParameter(par.name, &p))
         {
+            tables.ioMask[p] = par.io;
             if(par.io == SampleLayout::INPUT)
-                sm_inputParameterIndices.emplace_back(p, i);
+                tables.inputParameterIndices.emplace_back(p, i);
             else
-                sm_outputParameterIndices.emplace_back(p, i);
+                tables.outputParameterIndices.emplace_back(p, i);
         }
         else
         {
@@ -169,8 +354,20 @@ void SamplesPipe::setLayout(const SampleLayout& layout)
             if(stringToFeature(par.name, &f))
             {
                 f = toNumbered(f, par.number);
-                sm_outputFeatureIndices.emplace_back(f, i);
+                tables.outputFeatureIndices.emplace_back(f, i);
             }
         }
     }
+    return tables;
+}
+
+void SamplesPipe::setLayoutTables(const LayoutTables& tables)
+{
+    sm_inputGenerator = tables.inputParameterIndices.empty() ? nullptr : tables.inputGenerator;
+    SampleBuffer::m_ioMask = tables.ioMask;
+    sm_sampleSize = tables.sampleSize;
+    sm_pixelStatistics = tables.pixelStatistics;
+    sm_inputParameterIndices = tables.inputParameterIndices;
+    sm_outputParameterIndices = tables.outputParameterIndices;
+    sm_outputFeatureIndices = tables.outputFeatureIndices;
 }
@@ -1,79 +1,340 @@
 #include "TilePool.h"
 using namespace fbksd;
 #include <iostream>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <time.h>
+
+
+namespace
+{
+
+constexpr int NUM_TILES = 20;
+
+// Fixed-capacity queue, so it can be placed in shared memory.
+template<typename T>
+class Ring
+{
+public:
+    bool empty() const
+    { return m_size == 0; }
+
+    void clear()
+    { m_head = m_size = 0; }
+
+    void push(const T& item)
+    {
+        if(m_size == NUM_TILES)
+            throw std::logic_error("Tile pool queue overflow.");
+        m_items[(m_head + m_size++) % NUM_TILES] = item;
+    }
+
+    const T& front() const
+    { return m_items[m_head]; }
+
+    const T& back() const
+    { return m_items[(m_head + m_size - 1) % NUM_TILES]; }
+
+    void pop()
+    {
+        m_head = (m_head + 1) % NUM_TILES;
+        --m_size;
+    }
+
+    void popBack()
+    { --m_size; }
+
+private:
+    T m_items[NUM_TILES];
+    int m_head = 0;
+    int m_size = 0;
+};
+
+// Lock of the pool state.
+//
+// The mutex is robust: if a worker died holding it, the lock is taken over and the evaluation
+// is canceled right after by the monitor (see TilePool::setWorkerMonitor()).
+class StateLock
+{
+public:
+    explicit StateLock(pthread_mutex_t& mutex):
+        m_mutex(mutex)
+    { lock(); }
+
+    ~StateLock()
+    {
+        if(m_locked)
+            pthread_mutex_unlock(&m_mutex);
+    }
+
+    void lock()
+    {
+        check(pthread_mutex_lock(&m_mutex));
+        m_locked = true;
+    }
+
+    void unlock()
+    {
+        pthread_mutex_unlock(&m_mutex);
+        m_locked = false;
+    }
+
+    template<typename Pred>
+    void wait(pthread_cond_t& cond, Pred pred)
+    {
+        while(!pred())
+            check(pthread_cond_wait(&cond, &m_mutex));
+    }
+
+    // Waits at most `ms` milliseconds, returning the predicate value.
+    template<typename Pred>
+    bool waitFor(pthread_cond_t& cond, long ms, Pred pred)
+    {
+        timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += ms * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while(!pred())
+        {
+            int error = pthread_cond_timedwait(&cond, &m_mutex, &deadline);
+            if(error == ETIMEDOUT)
+                return pred();
+            check(error);
+        }
+        return true;
+    }
+
+private:
+    void check(int error)
+    {
+        if(error == EOWNERDEAD)
+            pthread_mutex_consistent(&m_mutex);
+        else if(error != 0)
+            throw std::system_error(error, std::generic_category(), "Tile pool lock");
+    }
+
+    pthread_mutex_t& m_mutex;
+    bool m_locked = false;
+};
+
+}
+
+
+struct TilePool::State
+{
+    State()
+    {
+        pthread_mutexattr_t mutexAttr;
+        pthread_mutexattr_init(&mutexAttr);
+        pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&mutex, &mutexAttr);
+        pthread_mutexattr_destroy(&mutexAttr);
+
+        pthread_condattr_t condAttr;
+        pthread_condattr_init(&condAttr);
+        pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+        pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+        for(auto cond: {&hasFreeTile, &hasTileForClient, &isInputReady, &isFinished})
+            pthread_cond_init(cond, &condAttr);
+        pthread_condattr_destroy(&condAttr);
+    }
+
+    pthread_mutex_t mutex;
+    pthread_cond_t hasFreeTile;
+    pthread_cond_t hasTileForClient;
+    pthread_cond_t isInputReady;
+    pthread_cond_t isFinished;
+    Ring<int64_t> freeIndices; // indexes free to be written by the server (used as a stack)
+    Ring<Tile> waitingInputTiles;
+    Ring<int64_t> readyInputTiles;
+    Ring<Tile> workedIndices; // indexes waiting to be consumed by the client
+    int64_t numSamples = 0;
+    int64_t numWorkedSamples = 0;
+    int64_t numDeliveredSamples = 0;
+    std::atomic<bool> canceled{false};
+    std::atomic<int64_t> nextWorkUnit{0}; // units before it were claimed (see claimWork())
+};
 
 
 float* TilePool::sm_samples = nullptr;
 int64_t TilePool::sm_tileNumSamples = 0;
-int TilePool::sm_numTiles = 20;
-std::vector<int> TilePool::sm_freeIndices; // indexes free to be written by the server
-std::queue<Tile> TilePool::sm_waitingInputTiles;
-std::queue<int> TilePool::sm_readyInputTiles;
-std::queue<Tile> TilePool::sm_workedIndices; // indexes waiting to be consumed by the client
-std::mutex TilePool::sm_mutex;
-std::condition_variable TilePool::sm_hasFreeTile;
-std::condition_variable TilePool::sm_hasTileForClient;
-std::condition_variable TilePool::sm_isInputReady;
-int64_t TilePool::sm_numSamples = 0;
-int64_t TilePool::sm_numWorkedSamples = 0;
+int TilePool::sm_numTiles = NUM_TILES;
+int TilePool::sm_sampleSize = 0;
 bool TilePool::sm_waitInput = false;
+int64_t TilePool::sm_frameWidth = 0;
+int64_t TilePool::sm_pixelSize = 0;
+int TilePool::sm_numWorkers = 1;
+int64_t TilePool::sm_workUnit = 0;
+std::function<bool()> TilePool::sm_workerMonitor;
+
+
+namespace
+{
+
+// Waits on the client side of the pool. If there are worker processes, checks them periodically,
+// so the client gets an error instead of waiting forever for a worker that died.
+template<typename Pred>
+void waitClient(StateLock& lock, pthread_cond_t& cond, const std::function<bool()>& monitor, Pred pred)
+{
+    if(!monitor)
+    {
+        lock.wait(cond, pred);
+        return;
+    }
+
+    while(!lock.waitFor(cond, 100, pred))
+    {
+        if(!monitor())
+        {
+            lock.unlock();
+            TilePool::cancel({});
+            throw std::runtime_error("A renderer worker exited before finishing the evaluation.");
+        }
+    }
+}
 
+}
+
+
+TilePool::State& TilePool::state()
+{
+    // Mapped on first use, before any worker is forked, so all of them share it.
+    static State* state = []()
+    {
+        void* memory = mmap(nullptr, sizeof(State), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED)
+            throw std::runtime_error(std::string("Couldn't map the tile pool state: ") + strerror(errno));
+        return new(memory) State();
+    }();
+    return *state;
+}
 
-void TilePool::init(int64_t numSamples, int64_t tileNumSamples, int sampleSize, float* samples, bool waitInput)
+void TilePool::init(int64_t numSamples,
+                    int64_t tileNumSamples,
+                    int sampleSize,
+                    int64_t slotSize,
+                    float* samples,
+                    bool waitInput,
+                    int firstSlot)
 {
-    sm_numSamples = numSamples;
     sm_tileNumSamples = tileNumSamples;
-    sm_numWorkedSamples = 0;
+    sm_sampleSize = sampleSize;
     sm_samples = samples;
     sm_waitInput = waitInput;
+    sm_frameWidth = 0;
+    sm_workUnit = 0;
+
+    State& s = state();
+    StateLock lock(s.mutex);
+    s.numSamples = numSamples;
+    s.numWorkedSamples = 0;
+    s.numDeliveredSamples = 0;
+    s.canceled = false;
+    s.nextWorkUnit = 0;
+    s.workedIndices.clear();
+    s.waitingInputTiles.clear();
+    s.readyInputTiles.clear();
 
     // Initializes the free tiles list.
     // Each index in the position of a tile in the samples buffer.
-    sm_freeIndices.clear();
-    sm_freeIndices.reserve(sm_numTiles);
-    const size_t tileSize = tileNumSamples * sampleSize;
+    s.freeIndices.clear();
     for(int i = sm_numTiles - 1; i >= 0; --i)
-        sm_freeIndices.push_back(i * tileSize);
+        s.freeIndices.push((firstSlot + i) * slotSize);
+}
+
+void TilePool::initFrame(int64_t numSamples,
+                         int64_t tileNumSamples,
+                         int sampleSize,
+                         int64_t pixelSize,
+                         int64_t frameWidth,
+                         float* frame)
+{
+    init(numSamples, tileNumSamples, sampleSize, 0, frame, false);
+    StateLock lock(state().mutex);
+    state().freeIndices.clear();
+    sm_frameWidth = frameWidth;
+    sm_pixelSize = pixelSize;
+}
+
+Tile TilePool::waitFrame(const Point2l& frameEnd)
+{
+    State& s = state();
+    StateLock lock(s.mutex);
+    waitClient(lock, s.isFinished, sm_workerMonitor, [&](){
+        return s.canceled || s.numWorkedSamples == s.numSamples;});
+    s.numDeliveredSamples = s.numWorkedSamples;
+    return Tile(CropWindow({0, 0}, frameEnd), 0, s.numWorkedSamples);
+}
+
+int64_t TilePool::getFrameWidth()
+{
+    return sm_frameWidth;
+}
+
+int TilePool::getNumTiles()
+{
+    return sm_numTiles;
 }
 
 float* TilePool::getFreeTile(const Point2l& begin, const Point2l& end, int64_t numSamples)
 {
     assert(numSamples <= sm_tileNumSamples);
-    int tileIndex = 0;
+    if(sm_frameWidth > 0)
+        return &sm_samples[(begin.y * sm_frameWidth + begin.x) * sm_pixelSize];
+
+    int64_t tileIndex = 0;
     float* tmp = nullptr;
-    std::unique_lock<std::mutex> lock(sm_mutex);
-    sm_hasFreeTile.wait(lock, [&](){return !sm_freeIndices.empty();});
-    tileIndex = sm_freeIndices.back();
-    sm_freeIndices.pop_back();
+    State& s = state();
+    StateLock lock(s.mutex);
+    lock.wait(s.hasFreeTile, [&](){return !s.freeIndices.empty();});
+    tileIndex = s.freeIndices.back();
+    s.freeIndices.popBack();
     tmp = &sm_samples[tileIndex];
 
-    if(sm_waitInput)
+    if(sm_waitInput && !s.canceled)
     {
         Tile tile(CropWindow(begin, end), tileIndex, numSamples);
-        sm_waitingInputTiles.push(tile);
-        sm_hasTileForClient.notify_one();
-        sm_isInputReady.wait(lock, [&](){
-            return !sm_readyInputTiles.empty() &&
-                    sm_readyInputTiles.front() == tileIndex;
+        s.waitingInputTiles.push(tile);
+        pthread_cond_signal(&s.hasTileForClient);
+        lock.wait(s.isInputReady, [&](){
+            return s.canceled || (!s.readyInputTiles.empty() &&
+                                  s.readyInputTiles.front() == tileIndex);
         });
-        sm_readyInputTiles.pop();
+        if(!s.canceled)
+            s.readyInputTiles.pop();
     }
 
+    // The client won't provide input anymore.
+    if(sm_waitInput && s.canceled)
+        std::fill(tmp, tmp + numSamples * sm_sampleSize, 0.f);
+
     lock.unlock();
     return tmp;
 }
 
 Tile TilePool::getClientTile(bool& hasNext, bool& isInput)
 {
-    std::unique_lock<std::mutex> lock(sm_mutex);
-    sm_hasTileForClient.wait(lock, [&](){
-        return sm_waitingInputTiles.size() || sm_workedIndices.size();});
+    State& s = state();
+    StateLock lock(s.mutex);
+    waitClient(lock, s.hasTileForClient, sm_workerMonitor, [&](){
+        return s.canceled || !s.waitingInputTiles.empty() || !s.workedIndices.empty();});
+    // Canceled while waiting, e.g. the renderer failed to render a tile.
+    if(s.waitingInputTiles.empty() && s.workedIndices.empty())
+        throw std::runtime_error("The evaluation was canceled before all its tiles were rendered.");
 
     Tile tile;
-    if(sm_waitingInputTiles.size())
+    if(!s.waitingInputTiles.empty())
     {
-        tile = sm_waitingInputTiles.front();
-        sm_waitingInputTiles.pop();
+        tile = s.waitingInputTiles.front();
+        s.waitingInputTiles.pop();
         hasNext = true;
         isInput = true;
         lock.unlock();
@@ -81,9 +342,10 @@ Tile TilePool::getClientTile(bool& hasNext, bool& isInput)
     }
     else
     {
-        tile = sm_workedIndices.front();
-        sm_workedIndices.pop();
-        hasNext = (sm_numWorkedSamples < sm_numSamples) || (!sm_workedIndices.empty());
+        tile = s.workedIndices.front();
+        s.workedIndices.pop();
+        s.numDeliveredSamples += tile.numSamples;
+        hasNext = (s.numWorkedSamples < s.numSamples) || (!s.workedIndices.empty());
         isInput = false;
     }
 
@@ -93,10 +355,11 @@ Tile TilePool::getClientTile(bool& hasNext, bool& isInput)
 
 void TilePool::releaseInputTile(int index)
 {
-    std::unique_lock<std::mutex> lock(sm_mutex);
-    sm_readyInputTiles.push(index);
+    State& s = state();
+    StateLock lock(s.mutex);
+    s.readyInputTiles.push(index);
     lock.unlock();
-    sm_isInputReady.notify_all();
+    pthread_cond_broadcast(&s.isInputReady);
 }
 
 void TilePool::releaseWorkedTile(const SamplesPipe &pipe)
@@ -106,22 +369,106 @@ void TilePool::releaseWorkedTile(const SamplesPipe &pipe)
 
     auto index = pipe.m_samples - sm_samples;
     auto numSamples = pipe.getNumSamples();
-    if(sm_numWorkedSamples + numSamples > sm_numSamples)
+    State& s = state();
+    StateLock lock(s.mutex);
+    if(s.canceled && sm_frameWidth > 0)
+        return;
+    if(s.canceled)
+    {
+        // Nobody will consume it (and it may be incomplete): recycle the tile right away.
+        s.freeIndices.push(index);
+        lock.unlock();
+        pthread_cond_signal(&s.hasFreeTile);
+        return;
+    }
+    if(s.numWorkedSamples + numSamples > s.numSamples)
         throw std::logic_error("Rendererd samples exceed maximum quantity.");
     if(pipe.m_informedNumSamples != numSamples)
         throw std::logic_error("Number of rendered samples differ from informed at pipe construction.");
 
-    std::unique_lock<std::mutex> lock(sm_mutex);
-    sm_workedIndices.push(Tile({pipe.m_begin, pipe.m_end}, index, numSamples));
-    sm_numWorkedSamples += numSamples;
+    s.numWorkedSamples += numSamples;
+    bool finished = s.numWorkedSamples == s.numSamples;
+    // In frame mode, the samples are already in place: just wait for the rest of the frame.
+    if(sm_frameWidth == 0)
+        s.workedIndices.push(Tile({pipe.m_begin, pipe.m_end}, index, numSamples));
     lock.unlock();
-    sm_hasTileForClient.notify_one();
+    pthread_cond_signal(&s.hasTileForClient);
+    if(finished)
+        pthread_cond_broadcast(&s.isFinished);
 }
 
 void TilePool::releaseConsumedTile(int index)
 {
-    std::unique_lock<std::mutex> lock(sm_mutex);
-    sm_freeIndices.push_back(index);
+    if(sm_frameWidth > 0)
+        return;
+
+    State& s = state();
+    StateLock lock(s.mutex);
+    s.freeIndices.push(index);
+    lock.unlock();
+    pthread_cond_signal(&s.hasFreeTile);
+}
+
+int64_t TilePool::cancel(const std::vector<int64_t>& consumedIndices)
+{
+    State& s = state();
+    StateLock lock(s.mutex);
+    s.canceled = true;
+    for(auto index: consumedIndices)
+        s.freeIndices.push(index);
+    while(!s.workedIndices.empty())
+    {
+        s.freeIndices.push(s.workedIndices.front().index);
+        s.workedIndices.pop();
+    }
+    // Threads waiting for input hold their tiles, and release them as worked tiles.
+    s.waitingInputTiles.clear();
+    s.readyInputTiles.clear();
+    int64_t numDelivered = s.numDeliveredSamples;
     lock.unlock();
-    sm_hasFreeTile.notify_one();
+
+    pthread_cond_broadcast(&s.hasFreeTile);
+    pthread_cond_broadcast(&s.isInputReady);
+    pthread_cond_broadcast(&s.hasTileForClient);
+    pthread_cond_broadcast(&s.isFinished);
+    return numDelivered;
+}
+
+bool TilePool::isCanceled()
+{
+    return state().canceled;
+}
+
+void TilePool::setNumWorkers(int numWorkers)
+{
+    sm_numWorkers = numWorkers;
+}
+
+int TilePool::getNumWorkers()
+{
+    return sm_numWorkers;
+}
+
+bool TilePool::claimWork()
+{
+    if(sm_numWorkers <= 1)
+        return true;
+    // Units before nextWorkUnit were claimed. Every worker goes through all units, so nextWorkUnit
+    // is at least the unit of the caller, and the first worker to reach a unit claims it.
+    int64_t unit = sm_workUnit++;
+    int64_t expected = unit;
+    return state().nextWorkUnit.compare_exchange_strong(expected, unit + 1);
+}
+
+void TilePool::waitFinished()
+{
+    State& s = state();
+    StateLock lock(s.mutex);
+    lock.wait(s.isFinished, [&](){
+        return s.canceled || s.numWorkedSamples == s.numSamples;});
+}
+
+void TilePool::setWorkerMonitor(const std::function<bool()>& monitor)
+{
+    sm_workerMonitor = monitor;
 }
@@ -3,10 +3,9 @@
 
 #include "fbksd/renderer/SamplesPipe.h"
 #include "fbksd/core/definitions.h"
-#include <queue>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <vector>
 
 namespace fbksd
 {
@@ -17,6 +16,9 @@ namespace fbksd
 
 /**
  * @brief Manages a shared memory region in tiles.
+ *
+ * The pool state (queues, counters and synchronization) lives in a shared mapping with process-shared
+ * robust locks, so processes forked after init() can work on the same evaluation (see RenderingServer::setNumWorkers()).
  */
 class EXPORT_LIB TilePool
 {
@@ -33,16 +35,66 @@ public:
      * Maximum number of samples that fits in a tile.
      * @param sampleSize
      * Number of float values in a sample.
+     * @param slotSize
+     * Number of float values in a tile slot.
      * @param samples
      * Pointer to the shared memory block.
      * @param waitInput
      * true if the client has input samples.
+     * @param firstSlot
+     * Index of the first slot of the pool in the shared memory block (renderer shards use separate ranges of slots).
      */
     static void init(int64_t numSamples,
                      int64_t tileNumSamples,
                      int sampleSize,
+                     int64_t slotSize,
                      float* samples,
-                     bool waitInput);
+                     bool waitInput,
+                     int firstSlot = 0);
+
+    /**
+     * @brief Initializes the pool in frame mode.
+     *
+     * In frame mode there are no tile slots: pipes write directly at their final position in a
+     * frame-sized buffer, and the client receives the whole frame once all samples are worked
+     * (see waitFrame()).
+     *
+     * @param numSamples
+     * Total number of samples requested by the client.
+     * @param tileNumSamples
+     * Maximum number of samples in a pipe.
+     * @param sampleSize
+     * Number of float values in a sample.
+     * @param pixelSize
+     * Number of float values of a pixel in the frame.
+     * @param frameWidth
+     * Frame width in pixels.
+     * @param frame
+     * Pointer to the frame shared memory block.
+     */
+    static void initFrame(int64_t numSamples,
+                          int64_t tileNumSamples,
+                          int sampleSize,
+                          int64_t pixelSize,
+                          int64_t frameWidth,
+                          float* frame);
+
+    /**
+     * @brief Blocks until all samples of the frame were worked (or the evaluation was canceled).
+     *
+     * @return The tile covering the whole frame.
+     */
+    static fbksd::Tile waitFrame(const Point2l& frameEnd);
+
+    /**
+     * @brief Returns the frame width if in frame mode, or 0 otherwise.
+     */
+    static int64_t getFrameWidth();
+
+    /**
+     * @brief Returns the number of tile slots in the samples buffer.
+     */
+    static int getNumTiles();
 
     /**
      * @brief Get hold of a free tile to start working on it.
@@ -74,6 +126,8 @@ public:
      * @param[out] isInput
      * Is true if the returned tile is a input request tile. Input tiles must be released
      * using the releaseInputTile() method (instead of the releaseWorkedTile() method).
+     *
+     * @throws std::runtime_error if the evaluation is canceled while waiting (e.g. the renderer failed).
      */
     static fbksd::Tile getClientTile(bool& hasNext, bool& isInput);
 
@@ -88,7 +142,8 @@ public:
      * @brief Releases a worked tile.
      *
      * A worked tile is released when the renderer finished rendering it.
-     * The tile becomes available to getClientTile().
+     * The tile becomes available to getClientTile(). If the evaluation was canceled, the tile is
+     * recycled instead, even if it's incomplete.
      */
     static void releaseWorkedTile(const SamplesPipe& pipe);
 
@@ -100,21 +155,72 @@ public:
      */
     static void releaseConsumedTile(int index);
 
+    /**
+     * @brief Cancels the current evaluation.
+     *
+     * The given consumed tiles are released, worked tiles not yet sent to the client are discarded,
+     * and threads waiting for input are unblocked (with zeroed input). From now on, worked tiles are
+     * recycled without being sent to the client, so the renderer threads can run to completion.
+     *
+     * @return Number of samples sent to the client before the cancellation.
+     */
+    static int64_t cancel(const std::vector<int64_t>& consumedIndices);
+
+    /**
+     * @brief Returns true if the current evaluation was canceled.
+     */
+    static bool isCanceled();
+
+    /**
+     * @brief Sets the number of worker processes that render the next evaluations.
+     *
+     * It must be called before init(), and the workers forked after it.
+     */
+    static void setNumWorkers(int numWorkers);
+
+    /**
+     * @brief Returns the number of worker processes (see setNumWorkers()).
+     */
+    static int getNumWorkers();
+
+    /**
+     * @brief Claims the next work unit of the current evaluation for this process.
+     *
+     * All workers call it once per work unit, in the same order and from a single thread; each unit is
+     * given to the first worker that reaches it. With a single worker, every unit is claimed.
+     */
+    static bool claimWork();
+
+    /**
+     * @brief Blocks until all samples of the evaluation were worked (or the evaluation was canceled).
+     *
+     * Used by workers, that must keep their pipes' memory mapped until then.
+     */
+    static void waitFinished();
+
+    /**
+     * @brief Sets the function that checks the worker processes while the client waits for tiles.
+     *
+     * The function returns false if a worker exited before the evaluation was finished: the evaluation
+     * is then canceled and the waiting call throws std::runtime_error, instead of waiting forever.
+     */
+    static void setWorkerMonitor(const std::function<bool()>& monitor);
+
 private:
+    struct State;
+
+    static State& state();
+
     static float* sm_samples;
     static int64_t sm_tileNumSamples;
     static int sm_numTiles;
-    static std::vector<int> sm_freeIndices; // indexes free to be written by the server
-    static std::queue<fbksd::Tile> sm_waitingInputTiles;
-    static std::queue<int> sm_readyInputTiles;
-    static std::queue<fbksd::Tile> sm_workedIndices; // indexes waiting to be consumed by the client
-    static std::mutex sm_mutex;
-    static std::condition_variable sm_hasFreeTile;
-    static std::condition_variable sm_hasTileForClient;
-    static std::condition_variable sm_isInputReady;
-    static int64_t sm_numSamples;
-    static int64_t sm_numWorkedSamples;
+    static int sm_sampleSize;
     static bool sm_waitInput;
+    static int64_t sm_frameWidth;
+    static int64_t sm_pixelSize;
+    static int sm_numWorkers;
+    static int64_t sm_workUnit; // next work unit of this process
+    static std::function<bool()> sm_workerMonitor;
 };
 
 } // namespace fbksd
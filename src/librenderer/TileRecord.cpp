@@ -0,0 +1,559 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "TileRecord.h"
+#include "TilePool.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef FBKSD_HAS_ZSTD
+#include <zstd.h>
+#endif
+using namespace fbksd;
+
+
+namespace
+{
+
+constexpr char FILE_MAGIC[8] = {'F', 'B', 'K', 'S', 'D', 'R', 'E', 'C'};
+constexpr char FOOTER_MAGIC[8] = {'F', 'B', 'K', 'S', 'D', 'E', 'N', 'D'};
+constexpr uint32_t VERSION = 3; // 2: RecordedEvaluation::input, 3: RecordedEvaluation::seed
+constexpr size_t FILE_HEADER_SIZE = sizeof(FILE_MAGIC) + sizeof(uint32_t);
+constexpr size_t RECORD_HEADER_SIZE = sizeof(uint32_t) + sizeof(uint64_t);
+constexpr size_t FOOTER_SIZE = sizeof(uint64_t) + sizeof(FOOTER_MAGIC);
+
+// Fast level: recording shouldn't slow down the renderer much.
+constexpr int ZSTD_LEVEL = 1;
+
+enum RecordType : uint32_t
+{
+    SCENE = 1,
+    LAYOUT,
+    EVALUATION,
+    TILE,
+    INDEX,
+};
+
+struct RecordedScene
+{
+    int tileSize = 0;
+    SceneInfo scene;
+
+    MSGPACK_DEFINE_ARRAY(tileSize, scene)
+};
+
+std::string systemError(const std::string& what)
+{
+    return "TileRecord: " + what + ": " + std::strerror(errno);
+}
+
+template<typename T>
+std::string pack(const T& value)
+{
+    clmdep_msgpack::sbuffer buffer;
+    clmdep_msgpack::pack(buffer, value);
+    return std::string(buffer.data(), buffer.size());
+}
+
+template<typename T>
+T unpack(const char* data, size_t size)
+{
+    auto handle = clmdep_msgpack::unpack(data, size);
+    return handle.get().template as<T>();
+}
+
+template<typename T>
+T load(const char* data)
+{
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    return value;
+}
+
+// Groups the i-th bytes of all floats together. Exponents and high mantissa bytes of
+// neighbor samples are similar, so the planes compress much better than the floats.
+void shuffle(const float* in, int64_t n, char* out)
+{
+    auto bytes = reinterpret_cast<const unsigned char*>(in);
+    for(int64_t i = 0; i < n; ++i)
+        for(int b = 0; b < 4; ++b)
+            out[b * n + i] = bytes[i * 4 + b];
+}
+
+void unshuffle(const char* in, int64_t n, float* out)
+{
+    auto bytes = reinterpret_cast<unsigned char*>(out);
+    for(int64_t i = 0; i < n; ++i)
+        for(int b = 0; b < 4; ++b)
+            bytes[i * 4 + b] = in[b * n + i];
+}
+
+bool sameWindows(const std::vector<CropWindow>& a, const std::vector<CropWindow>& b)
+{
+    return std::equal(a.begin(), a.end(), b.begin(), b.end(), [](const CropWindow& wa, const CropWindow& wb)
+    {
+        return wa.begin.x == wb.begin.x && wa.begin.y == wb.begin.y &&
+               wa.end.x == wb.end.x && wa.end.y == wb.end.y;
+    });
+}
+
+// Returns the encoded data, or an empty string if it's better stored as RAW.
+std::string encode(const std::vector<float>& samples)
+{
+#ifdef FBKSD_HAS_ZSTD
+    const int64_t n = samples.size();
+    std::string shuffled(n * sizeof(float), '\0');
+    shuffle(samples.data(), n, &shuffled[0]);
+    std::string compressed(ZSTD_compressBound(shuffled.size()), '\0');
+    size_t size = ZSTD_compress(&compressed[0], compressed.size(), shuffled.data(), shuffled.size(), ZSTD_LEVEL);
+    if(ZSTD_isError(size) || size >= shuffled.size())
+        return std::string();
+    compressed.resize(size);
+    return compressed;
+#else
+    (void)samples;
+    return std::string();
+#endif
+}
+
+}
+
+
+// ======================================================
+//                      TileRecorder
+// ======================================================
+
+TileRecorder::TileRecorder(const std::string& path)
+{
+    m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(m_fd == -1)
+        throw std::runtime_error(systemError("couldn't create " + path));
+    writeBytes(FILE_MAGIC, sizeof(FILE_MAGIC));
+    writeBytes(&VERSION, sizeof(VERSION));
+}
+
+TileRecorder::TileRecorder(const std::string& path, const TileRecordReader& existing):
+    m_recording(existing.getRecording()),
+    m_offset(existing.getDataEnd())
+{
+    m_fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if(m_fd == -1)
+        throw std::runtime_error(systemError("couldn't open " + path));
+    // The old index is dropped: the reader doesn't touch it after opening the file.
+    if(ftruncate(m_fd, m_offset) == -1 || lseek(m_fd, m_offset, SEEK_SET) == -1)
+    {
+        ::close(m_fd);
+        m_fd = -1;
+        throw std::runtime_error(systemError("couldn't truncate " + path));
+    }
+    for(const auto& layout: m_recording.layouts)
+        m_packedLayouts.push_back(pack(layout));
+}
+
+TileRecorder::~TileRecorder()
+{
+    try
+    {
+        close();
+    }
+    catch(const std::exception&)
+    {}
+}
+
+void TileRecorder::setScene(int tileSize, const SceneInfo& scene)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_recording.tileSize = tileSize;
+    m_recording.scene = scene;
+    RecordedScene record{tileSize, scene};
+    auto data = pack(record);
+    writeRecord(SCENE, {{data.data(), data.size()}});
+}
+
+void TileRecorder::setLayout(const SampleLayout& layout)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto data = pack(layout);
+    for(size_t i = 0; i < m_packedLayouts.size(); ++i)
+    {
+        if(m_packedLayouts[i] == data)
+        {
+            m_currentLayout = static_cast<int>(i);
+            return;
+        }
+    }
+
+    m_currentLayout = static_cast<int>(m_packedLayouts.size());
+    m_packedLayouts.push_back(data);
+    m_recording.layouts.push_back(layout);
+    writeRecord(LAYOUT, {{data.data(), data.size()}});
+}
+
+void TileRecorder::setSeed(int64_t seed)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_seed = seed;
+}
+
+void TileRecorder::beginEvaluation(int64_t spp,
+                                   int64_t remainingCount,
+                                   const std::vector<CropWindow>& windows,
+                                   bool input)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_skipping = false;
+    RecordedEvaluation evaluation;
+    evaluation.layout = m_currentLayout;
+    evaluation.spp = spp;
+    evaluation.remainingCount = remainingCount;
+    evaluation.windows = windows;
+    evaluation.input = input;
+    evaluation.seed = m_seed;
+    auto data = pack(evaluation);
+    m_recording.evaluations.push_back(std::move(evaluation));
+    writeRecord(EVALUATION, {{data.data(), data.size()}});
+}
+
+void TileRecorder::skipEvaluation()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_skipping = true;
+}
+
+void TileRecorder::add(const SamplesPipe& pipe)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if(m_skipping)
+            return;
+    }
+
+    std::vector<float> samples(pipe.getPackedSize());
+    pipe.pack(samples.data());
+
+    RecordedTile tile;
+    tile.window = CropWindow(pipe.m_begin, pipe.m_end);
+    tile.numSamples = pipe.getNumSamples();
+    tile.numFloats = samples.size();
+    auto encoded = encode(samples);
+    const void* data = samples.data();
+    tile.size = samples.size() * sizeof(float);
+    if(!encoded.empty())
+    {
+        tile.codec = RecordedTile::SHUFFLE_ZSTD;
+        data = encoded.data();
+        tile.size = encoded.size();
+    }
+    auto meta = pack(tile);
+    const auto metaSize = static_cast<uint32_t>(meta.size());
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_fd == -1 || m_skipping || m_recording.evaluations.empty())
+        return;
+    tile.offset = m_offset + RECORD_HEADER_SIZE + sizeof(metaSize) + meta.size();
+    writeRecord(TILE, {{&metaSize, sizeof(metaSize)}, {meta.data(), meta.size()}, {data, static_cast<size_t>(tile.size)}});
+    m_recording.evaluations.back().tiles.push_back(tile);
+}
+
+void TileRecorder::close()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(m_fd == -1)
+        return;
+
+    const uint64_t indexOffset = m_offset;
+    auto index = pack(m_recording);
+    writeRecord(INDEX, {{index.data(), index.size()}});
+    writeBytes(&indexOffset, sizeof(indexOffset));
+    writeBytes(FOOTER_MAGIC, sizeof(FOOTER_MAGIC));
+    ::close(m_fd);
+    m_fd = -1;
+}
+
+void TileRecorder::writeRecord(uint32_t type, const std::vector<std::pair<const void*, size_t>>& parts)
+{
+    uint64_t size = 0;
+    for(const auto& part: parts)
+        size += part.second;
+    writeBytes(&type, sizeof(type));
+    writeBytes(&size, sizeof(size));
+    for(const auto& part: parts)
+        writeBytes(part.first, part.second);
+}
+
+void TileRecorder::writeBytes(const void* data, size_t size)
+{
+    auto bytes = static_cast<const char*>(data);
+    while(size > 0)
+    {
+        ssize_t n = write(m_fd, bytes, size);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            throw std::runtime_error(systemError("write failed"));
+        }
+        bytes += n;
+        size -= n;
+        m_offset += n;
+    }
+}
+
+
+// ======================================================
+//                      TileRecordReader
+// ======================================================
+
+TileRecordReader::TileRecordReader(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+        throw std::runtime_error(systemError("couldn't open " + path));
+    struct stat st;
+    if(fstat(fd, &st) == -1)
+    {
+        ::close(fd);
+        throw std::runtime_error(systemError("couldn't stat " + path));
+    }
+    m_size = st.st_size;
+    if(m_size < FILE_HEADER_SIZE)
+    {
+        ::close(fd);
+        throw std::runtime_error("TileRecord: " + path + " is not a record file.");
+    }
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if(data == MAP_FAILED)
+        throw std::runtime_error(systemError("couldn't map " + path));
+    m_data = static_cast<const char*>(data);
+
+    if(std::memcmp(m_data, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 ||
+       load<uint32_t>(m_data + sizeof(FILE_MAGIC)) != VERSION)
+    {
+        munmap(const_cast<char*>(m_data), m_size);
+        throw std::runtime_error("TileRecord: " + path + " is not a record file (or has an unsupported version).");
+    }
+
+    if(!readIndex())
+        scan();
+}
+
+TileRecordReader::~TileRecordReader()
+{
+    munmap(const_cast<char*>(m_data), m_size);
+}
+
+void TileRecordReader::read(const RecordedTile& tile, std::vector<float>& out) const
+{
+    if(tile.offset < 0 || tile.size < 0 || static_cast<size_t>(tile.offset + tile.size) > m_size)
+        throw std::runtime_error("TileRecord: tile data outside the file.");
+    out.resize(tile.numFloats);
+    const char* data = m_data + tile.offset;
+    const size_t rawSize = tile.numFloats * sizeof(float);
+
+    switch(tile.codec)
+    {
+    case RecordedTile::RAW:
+        if(static_cast<size_t>(tile.size) != rawSize)
+            throw std::runtime_error("TileRecord: corrupted tile.");
+        std::memcpy(out.data(), data, rawSize);
+        return;
+    case RecordedTile::SHUFFLE_ZSTD:
+    {
+#ifdef FBKSD_HAS_ZSTD
+        std::vector<char> shuffled(rawSize);
+        size_t size = ZSTD_decompress(shuffled.data(), shuffled.size(), data, tile.size);
+        if(ZSTD_isError(size) || size != rawSize)
+            throw std::runtime_error("TileRecord: corrupted tile.");
+        unshuffle(shuffled.data(), tile.numFloats, out.data());
+        return;
+#else
+        throw std::runtime_error("TileRecord: the file is compressed with zstd, but fbksd was built without zstd support.");
+#endif
+    }
+    default:
+        throw std::runtime_error("TileRecord: unknown codec " + std::to_string(tile.codec) + ".");
+    }
+}
+
+bool TileRecordReader::readIndex()
+{
+    if(m_size < FILE_HEADER_SIZE + FOOTER_SIZE ||
+       std::memcmp(m_data + m_size - sizeof(FOOTER_MAGIC), FOOTER_MAGIC, sizeof(FOOTER_MAGIC)) != 0)
+        return false;
+
+    const auto offset = load<uint64_t>(m_data + m_size - FOOTER_SIZE);
+    if(offset < FILE_HEADER_SIZE || offset + RECORD_HEADER_SIZE > m_size - FOOTER_SIZE ||
+       load<uint32_t>(m_data + offset) != INDEX)
+        return false;
+    const auto size = load<uint64_t>(m_data + offset + sizeof(uint32_t));
+    if(offset + RECORD_HEADER_SIZE + size > m_size - FOOTER_SIZE)
+        return false;
+    m_recording = unpack<Recording>(m_data + offset + RECORD_HEADER_SIZE, size);
+    m_dataEnd = offset;
+    return true;
+}
+
+void TileRecordReader::scan()
+{
+    // Records are read until the end of the file, or the first incomplete one.
+    size_t offset = FILE_HEADER_SIZE;
+    while(offset + RECORD_HEADER_SIZE <= m_size)
+    {
+        const auto type = load<uint32_t>(m_data + offset);
+        const auto size = load<uint64_t>(m_data + offset + sizeof(uint32_t));
+        const char* payload = m_data + offset + RECORD_HEADER_SIZE;
+        if(size > m_size - offset - RECORD_HEADER_SIZE || type == INDEX)
+            break;
+
+        switch(type)
+        {
+        case SCENE:
+        {
+            auto scene = unpack<RecordedScene>(payload, size);
+            m_recording.tileSize = scene.tileSize;
+            m_recording.scene = scene.scene;
+            break;
+        }
+        case LAYOUT:
+            m_recording.layouts.push_back(unpack<SampleLayout>(payload, size));
+            break;
+        case EVALUATION:
+            m_recording.evaluations.push_back(unpack<RecordedEvaluation>(payload, size));
+            break;
+        case TILE:
+        {
+            if(size < sizeof(uint32_t) || m_recording.evaluations.empty())
+                break;
+            const auto metaSize = load<uint32_t>(payload);
+            if(metaSize > size - sizeof(uint32_t))
+                break;
+            auto tile = unpack<RecordedTile>(payload + sizeof(uint32_t), metaSize);
+            tile.offset = payload + sizeof(uint32_t) + metaSize - m_data;
+            m_recording.evaluations.back().tiles.push_back(tile);
+            break;
+        }
+        default:
+            break;
+        }
+        offset += RECORD_HEADER_SIZE + size;
+    }
+    m_dataEnd = offset;
+}
+
+
+// ======================================================
+//                      TileReplayer
+// ======================================================
+
+TileReplayer::TileReplayer(const TileRecordReader& reader):
+    m_reader(reader),
+    m_used(reader.getRecording().evaluations.size(), false)
+{
+    for(const auto& layout: m_reader.getRecording().layouts)
+        m_packedLayouts.push_back(pack(layout));
+}
+
+TileReplayer::~TileReplayer()
+{
+    join();
+}
+
+int TileReplayer::findLayout(const SampleLayout& layout) const
+{
+    auto it = std::find(m_packedLayouts.begin(), m_packedLayouts.end(), pack(layout));
+    return it == m_packedLayouts.end() ? -1 : static_cast<int>(it - m_packedLayouts.begin());
+}
+
+const RecordedEvaluation* TileReplayer::find(int layout,
+                                             int64_t spp,
+                                             int64_t remainingCount,
+                                             const std::vector<CropWindow>& windows,
+                                             bool reuse,
+                                             int64_t seed)
+{
+    const auto& recording = m_reader.getRecording();
+    const auto& evaluations = recording.evaluations;
+    int64_t numSamples = remainingCount;
+    if(windows.empty())
+        numSamples += spp * recording.scene.get<int64_t>("width") * recording.scene.get<int64_t>("height");
+    for(const auto& w: windows)
+        numSamples += spp * (w.end.x - w.begin.x) * (w.end.y - w.begin.y);
+
+    // Evaluations canceled while recording are incomplete, and can't be served.
+    auto matches = [&](const RecordedEvaluation& e)
+    {
+        if(e.input || e.layout != layout || e.spp != spp || e.remainingCount != remainingCount || !sameWindows(e.windows, windows))
+            return false;
+        if(seed >= 0 && e.seed != seed)
+            return false;
+        int64_t n = 0;
+        for(const auto& tile: e.tiles)
+            n += tile.numSamples;
+        return n == numSamples;
+    };
+
+    for(size_t i = 0; i < evaluations.size(); ++i)
+    {
+        size_t index = (m_nextEvaluation + i) % evaluations.size();
+        if((reuse || !m_used[index]) && matches(evaluations[index]))
+        {
+            m_used[index] = true;
+            m_nextEvaluation = index + 1;
+            return &evaluations[index];
+        }
+    }
+    return nullptr;
+}
+
+void TileReplayer::serve(const RecordedEvaluation& evaluation)
+{
+    join();
+    // The pool blocks the producers until the client consumes the tiles, so they can't run in the caller thread.
+    m_nextTile = 0;
+    const int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    for(int i = 0; i < numThreads; ++i)
+        m_threads.emplace_back([this, &evaluation](){ serveTiles(evaluation); });
+}
+
+void TileReplayer::join()
+{
+    for(auto& thread: m_threads)
+        thread.join();
+    m_threads.clear();
+}
+
+void TileReplayer::serveTiles(const RecordedEvaluation& evaluation)
+{
+    std::vector<float> samples;
+    for(size_t i = m_nextTile++; i < evaluation.tiles.size() && !SamplesPipe::isCanceled(); i = m_nextTile++)
+    {
+        const RecordedTile& tile = evaluation.tiles[i];
+        try
+        {
+            m_reader.read(tile, samples);
+        }
+        catch(const std::exception& e)
+        {
+            // The client gets an error instead of wrong samples, and stops waiting for the remaining tiles.
+            std::cerr << "Couldn't read a recorded tile: " << e.what() << std::endl;
+            if(!SamplesPipe::isCanceled())
+                TilePool::cancel({});
+            return;
+        }
+        SamplesPipe pipe(tile.window.begin, tile.window.end, tile.numSamples);
+        pipe.write(samples.data(), tile.numSamples);
+    }
+}
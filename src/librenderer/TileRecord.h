@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#ifndef TILERECORD_H
+#define TILERECORD_H
+
+#include "fbksd/renderer/SamplesPipe.h"
+#include "fbksd/core/definitions.h"
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fbksd
+{
+
+#ifndef EXPORT_LIB
+#define EXPORT_LIB __attribute__((visibility("default")))
+#endif
+
+/*
+ * Record files keep the tiles rendered by a renderer, so they can be served again (see fbksd-replay).
+ *
+ * File layout (native byte order):
+ * - header: magic "FBKSDREC" and version (uint32);
+ * - records: type (uint32), payload size (uint64) and payload. The payload of SCENE, LAYOUT,
+ *   EVALUATION and INDEX records is msgpack. A TILE payload is the size of its metadata (uint32),
+ *   the msgpack'ed RecordedTile, and the (possibly compressed) sample data;
+ * - footer: offset of the INDEX record (uint64) and magic "FBKSDEND".
+ *
+ * The INDEX record and the footer are written when the recording is closed. Files without them
+ * (e.g. the renderer was killed) are still readable: the index is rebuilt by scanning the records.
+ */
+
+/**
+ * @brief Compressed sample data of a recorded tile.
+ */
+struct RecordedTile
+{
+    enum Codec
+    {
+        RAW,            ///< Floats as they are.
+        SHUFFLE_ZSTD,   ///< Byte planes of the floats, compressed with zstd.
+    };
+
+    CropWindow window;
+    int64_t numSamples = 0;
+    int64_t numFloats = 0; // uncompressed size
+    int codec = RAW;
+    int64_t offset = 0; // position of the data in the file
+    int64_t size = 0; // bytes in the file
+
+    MSGPACK_DEFINE_ARRAY(window, numSamples, numFloats, codec, offset, size)
+};
+
+/**
+ * @brief An evaluation request and the tiles rendered for it.
+ */
+struct RecordedEvaluation
+{
+    int layout = 0; // index in Recording::layouts
+    int64_t spp = 0;
+    int64_t remainingCount = 0;
+    std::vector<CropWindow> windows; // non-empty for region evaluations
+    bool input = false; // the samples depend on input given by the client
+    int64_t seed = 0; // run the evaluation was rendered for (see TileRecorder::setSeed())
+    std::vector<RecordedTile> tiles;
+
+    MSGPACK_DEFINE_ARRAY(layout, spp, remainingCount, windows, input, seed, tiles)
+};
+
+/**
+ * @brief Index of a record file.
+ */
+struct Recording
+{
+    int tileSize = 0;
+    SceneInfo scene;
+    std::vector<SampleLayout> layouts;
+    std::vector<RecordedEvaluation> evaluations;
+
+    MSGPACK_DEFINE_ARRAY(tileSize, scene, layouts, evaluations)
+};
+
+
+class TileRecordReader;
+
+/**
+ * @brief Writes a record file.
+ *
+ * add() can be called concurrently by the renderer threads: the tile data is compressed by the calling thread.
+ */
+class EXPORT_LIB TileRecorder
+{
+public:
+    /**
+     * @throws std::runtime_error if the file can't be created.
+     */
+    explicit TileRecorder(const std::string& path);
+
+    /**
+     * @brief Appends new records to an existing file, previously opened by `existing`.
+     *
+     * The index of the file is discarded (it's written again by close()), but `existing` can
+     * still read the recorded tiles.
+     *
+     * @throws std::runtime_error if the file can't be opened.
+     */
+    TileRecorder(const std::string& path, const TileRecordReader& existing);
+
+    TileRecorder(const TileRecorder&) = delete;
+
+    ~TileRecorder();
+
+    void setScene(int tileSize, const SceneInfo& scene);
+
+    /**
+     * @brief Sets the layout of the next evaluations.
+     *
+     * Layouts already recorded are not written again.
+     */
+    void setLayout(const SampleLayout& layout);
+
+    /**
+     * @brief Sets the seed of the next evaluations (e.g. the index of the benchmark run).
+     */
+    void setSeed(int64_t seed);
+
+    /**
+     * @brief Starts a new evaluation: the next tiles belong to it.
+     */
+    void beginEvaluation(int64_t spp,
+                         int64_t remainingCount,
+                         const std::vector<CropWindow>& windows = {},
+                         bool input = false);
+
+    /**
+     * @brief The tiles of the current evaluation are not recorded (e.g. they are already in the file).
+     */
+    void skipEvaluation();
+
+    /**
+     * @brief Records the samples of a finished pipe.
+     */
+    void add(const SamplesPipe& pipe);
+
+    /**
+     * @brief Writes the index and closes the file. Further calls do nothing.
+     */
+    void close();
+
+    TileRecorder& operator=(const TileRecorder&) = delete;
+
+private:
+    void writeRecord(uint32_t type, const std::vector<std::pair<const void*, size_t>>& parts);
+    void writeBytes(const void* data, size_t size);
+
+    Recording m_recording;
+    std::vector<std::string> m_packedLayouts; // to find already recorded layouts
+    int m_currentLayout = -1;
+    int64_t m_seed = 0;
+    bool m_skipping = false;
+    int m_fd = -1;
+    int64_t m_offset = 0;
+    std::mutex m_mutex;
+};
+
+
+/**
+ * @brief Reads a record file.
+ *
+ * The file is memory-mapped, and tiles are decoded on demand, so any tile can be read in any order.
+ * read() can be called concurrently.
+ */
+class EXPORT_LIB TileRecordReader
+{
+public:
+    /**
+     * @throws std::runtime_error if the file can't be opened or is not a record file.
+     */
+    explicit TileRecordReader(const std::string& path);
+
+    TileRecordReader(const TileRecordReader&) = delete;
+
+    ~TileRecordReader();
+
+    const Recording& getRecording() const
+    { return m_recording; }
+
+    /**
+     * @brief Decodes the samples of the tile into `out` (resized to RecordedTile::numFloats).
+     *
+     * @throws std::runtime_error if the data is corrupted or uses an unsupported codec.
+     */
+    void read(const RecordedTile& tile, std::vector<float>& out) const;
+
+    /**
+     * @brief Returns the size of the file without the index and the footer (or an incomplete last record).
+     */
+    int64_t getDataEnd() const
+    { return m_dataEnd; }
+
+    TileRecordReader& operator=(const TileRecordReader&) = delete;
+
+private:
+    bool readIndex();
+    void scan();
+
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+    int64_t m_dataEnd = 0;
+    Recording m_recording;
+};
+
+
+/**
+ * @brief Serves recorded evaluations through SamplesPipes, as a renderer would.
+ *
+ * Used by `fbksd-replay` and by the sample cache of the RenderingServer (see CACHE_ENV).
+ */
+class EXPORT_LIB TileReplayer
+{
+public:
+    explicit TileReplayer(const TileRecordReader& reader);
+
+    TileReplayer(const TileReplayer&) = delete;
+
+    ~TileReplayer();
+
+    /**
+     * @brief Returns the index of the layout in the recording, or -1 if it was not recorded.
+     */
+    int findLayout(const SampleLayout& layout) const;
+
+    /**
+     * @brief Finds a complete recorded evaluation for the given request.
+     *
+     * The search starts after the last evaluation found, so repeated requests get different evaluations,
+     * as long as there are enough of them. If `reuse` is false, an evaluation is never returned twice.
+     * If `seed` is not negative, only evaluations recorded with that seed are returned. Evaluations with input
+     * are never returned.
+     *
+     * @return The evaluation, or nullptr if there is none.
+     */
+    const RecordedEvaluation* find(int layout,
+                                   int64_t spp,
+                                   int64_t remainingCount,
+                                   const std::vector<CropWindow>& windows,
+                                   bool reuse,
+                                   int64_t seed);
+
+    /**
+     * @brief Starts serving the tiles of the evaluation in background threads.
+     */
+    void serve(const RecordedEvaluation& evaluation);
+
+    /**
+     * @brief Waits until the tiles being served are released.
+     */
+    void join();
+
+    TileReplayer& operator=(const TileReplayer&) = delete;
+
+private:
+    void serveTiles(const RecordedEvaluation& evaluation);
+
+    const TileRecordReader& m_reader;
+    std::vector<std::string> m_packedLayouts;
+    std::vector<bool> m_used;
+    size_t m_nextEvaluation = 0;
+    std::atomic<size_t> m_nextTile {0};
+    std::vector<std::thread> m_threads;
+};
+
+} // namespace fbksd
+
+#endif // TILERECORD_H
@@ -0,0 +1,328 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include "fbksd/renderer/TileScheduler.h"
+#include "TilePool.h"
+using namespace fbksd;
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+
+namespace
+{
+
+// Interleaves the bits of x and y.
+uint64_t mortonCode(uint32_t x, uint32_t y)
+{
+    auto spread = [](uint64_t v)
+    {
+        v = (v | (v << 16)) & 0x0000FFFF0000FFFFull;
+        v = (v | (v << 8)) & 0x00FF00FF00FF00FFull;
+        v = (v | (v << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        v = (v | (v << 2)) & 0x3333333333333333ull;
+        v = (v | (v << 1)) & 0x5555555555555555ull;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+// Number of remaining samples taken by the pixels with row-major index in [begin, end).
+// Pixel p takes floor((p+1)*R/N) - floor(p*R/N) of them, so they are spread evenly over the image.
+int64_t countRemaining(int64_t begin, int64_t end, int64_t remainingCount, int64_t numPixels)
+{
+    if(remainingCount == 0)
+        return 0;
+    return end * remainingCount / numPixels - begin * remainingCount / numPixels;
+}
+
+// Side of the square tiles, so that a tile with `pixelNumSamples` samples per pixel fits in a pipe.
+int64_t getTileSide(int64_t pixelNumSamples, int pipeSize)
+{
+    pixelNumSamples = std::max(pixelNumSamples, INT64_C(1));
+    int64_t side = static_cast<int64_t>(std::sqrt(static_cast<double>(pipeSize) / pixelNumSamples));
+    while(side * side * pixelNumSamples > pipeSize)
+        --side;
+    while((side + 1) * (side + 1) * pixelNumSamples <= pipeSize)
+        ++side;
+    if(side < 1)
+        throw std::logic_error("The pipe size is too small for a pixel.");
+    return side;
+}
+
+// Appends the tiles of the window, in Morton order.
+void splitWindow(const CropWindow& window, int64_t side, const TileTask& proto, std::vector<TileTask>& tiles)
+{
+    const int64_t numPixels = proto.imageWidth * proto.imageHeight;
+    const int64_t nx = (window.end.x - window.begin.x + side - 1) / side;
+    const int64_t ny = (window.end.y - window.begin.y + side - 1) / side;
+    std::vector<std::pair<uint64_t, TileTask>> ordered;
+    ordered.reserve(nx * ny);
+    for(int64_t j = 0; j < ny; ++j)
+    for(int64_t i = 0; i < nx; ++i)
+    {
+        TileTask tile = proto;
+        tile.window.begin = {window.begin.x + i * side, window.begin.y + j * side};
+        tile.window.end = {std::min(tile.window.begin.x + side, window.end.x),
+                           std::min(tile.window.begin.y + side, window.end.y)};
+        tile.numSamples = tile.spp * tile.window.width() * tile.window.height();
+        for(int64_t y = tile.window.begin.y; y < tile.window.end.y; ++y)
+            tile.numSamples += countRemaining(y * tile.imageWidth + tile.window.begin.x,
+                                              y * tile.imageWidth + tile.window.end.x,
+                                              tile.remainingCount,
+                                              numPixels);
+        ordered.emplace_back(mortonCode(static_cast<uint32_t>(i), static_cast<uint32_t>(j)), tile);
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const std::pair<uint64_t, TileTask>& a,
+                                                 const std::pair<uint64_t, TileTask>& b)
+    { return a.first < b.first; });
+    for(auto& pair: ordered)
+        tiles.push_back(pair.second);
+}
+
+}
+
+
+// ======================================================
+// TileTask
+// ======================================================
+int64_t TileTask::getPixelNumSamples(int64_t x, int64_t y) const
+{
+    const int64_t p = y * imageWidth + x;
+    return spp + countRemaining(p, p + 1, remainingCount, imageWidth * imageHeight);
+}
+
+
+// ======================================================
+// TileScheduler
+// ======================================================
+struct TileScheduler::Imp
+{
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> tiles;
+    };
+
+    // Gets the next tile of the thread: from its own queue, or stolen from the others.
+    bool next(int thread, size_t& index)
+    {
+        if(m_claimWork)
+        {
+            // Tiles are claimed in the same order in every worker process.
+            std::lock_guard<std::mutex> lock(m_claimMutex);
+            while(m_nextTile < m_tiles.size())
+            {
+                index = m_nextTile++;
+                if(SamplesPipe::claimWork())
+                    return true;
+            }
+            return false;
+        }
+
+        {
+            Queue& own = *m_queues[thread];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if(!own.tiles.empty())
+            {
+                index = own.tiles.front();
+                own.tiles.pop_front();
+                return true;
+            }
+        }
+        // Steals from the end of the other runs, far from where their owners are working.
+        const int numQueues = static_cast<int>(m_queues.size());
+        for(int i = 1; i < numQueues; ++i)
+        {
+            Queue& other = *m_queues[(thread + i) % numQueues];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if(!other.tiles.empty())
+            {
+                index = other.tiles.back();
+                other.tiles.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(int thread)
+    {
+        size_t index = 0;
+        while(!m_failed && !SamplesPipe::isCanceled() && next(thread, index))
+        {
+            const TileTask& tile = m_tiles[index];
+            try
+            {
+                SamplesPipe pipe(tile.window.begin, tile.window.end, tile.numSamples);
+                try
+                {
+                    m_render(pipe, tile, thread);
+                }
+                catch(const std::exception& e)
+                {
+                    // Handled while the pipe is alive: the evaluation is canceled before the incomplete pipe is released.
+                    fail(e);
+                }
+            }
+            catch(const std::exception& e)
+            {
+                fail(e);
+            }
+        }
+    }
+
+    // Called from a catch block.
+    void fail(const std::exception& e)
+    {
+        std::cerr << "Error rendering tile: " << e.what() << std::endl;
+        {
+            std::lock_guard<std::mutex> lock(m_errorMutex);
+            if(!m_error)
+                m_error = std::current_exception();
+        }
+        m_failed = true;
+        // The remaining tiles won't be rendered: the client gets an error instead of waiting for them.
+        if(!SamplesPipe::isCanceled())
+            TilePool::cancel({});
+    }
+
+    int64_t m_imageWidth = 0;
+    int64_t m_imageHeight = 0;
+    int m_numThreads = 0;
+    std::vector<TileTask> m_tiles; // tiles of the current evaluation
+    RenderTile m_render;
+    std::vector<std::unique_ptr<Queue>> m_queues; // tiles of each thread
+    bool m_claimWork = false; // tiles are split among worker processes
+    std::mutex m_claimMutex;
+    size_t m_nextTile = 0;
+    std::vector<std::thread> m_threads;
+    std::atomic<bool> m_failed{false};
+    std::mutex m_errorMutex;
+    std::exception_ptr m_error;
+};
+
+
+TileScheduler::TileScheduler(int64_t imageWidth, int64_t imageHeight, int numThreads):
+    m_imp(std::make_unique<Imp>())
+{
+    if(numThreads <= 0)
+        numThreads = static_cast<int>(std::max(std::thread::hardware_concurrency(), 1u));
+    // More threads would just wait for free tile slots.
+    m_imp->m_numThreads = std::min(numThreads, TilePool::getNumTiles());
+    m_imp->m_imageWidth = imageWidth;
+    m_imp->m_imageHeight = imageHeight;
+}
+
+TileScheduler::~TileScheduler()
+{
+    try
+    {
+        wait();
+    }
+    catch(...)
+    {}
+}
+
+int TileScheduler::getNumThreads() const
+{
+    return m_imp->m_numThreads;
+}
+
+void TileScheduler::evaluateSamples(int64_t spp, int64_t remainingCount, int pipeSize, const RenderTile& render)
+{
+    start(splitImage(m_imp->m_imageWidth, m_imp->m_imageHeight, spp, remainingCount, pipeSize), render);
+}
+
+void TileScheduler::evaluateRegions(int64_t spp, const std::vector<CropWindow>& windows, int pipeSize, const RenderTile& render)
+{
+    start(splitRegions(m_imp->m_imageWidth, m_imp->m_imageHeight, spp, windows, pipeSize), render);
+}
+
+void TileScheduler::wait()
+{
+    for(auto& thread: m_imp->m_threads)
+        thread.join();
+    m_imp->m_threads.clear();
+    if(m_imp->m_error)
+    {
+        auto error = m_imp->m_error;
+        m_imp->m_error = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+std::vector<TileTask> TileScheduler::splitImage(int64_t imageWidth,
+                                                int64_t imageHeight,
+                                                int64_t spp,
+                                                int64_t remainingCount,
+                                                int pipeSize)
+{
+    const int64_t numPixels = imageWidth * imageHeight;
+    TileTask proto;
+    proto.spp = spp;
+    proto.remainingCount = remainingCount;
+    proto.imageWidth = imageWidth;
+    proto.imageHeight = imageHeight;
+    // The pixels with remaining samples take at most this many samples.
+    const int64_t maxPixelNumSamples = spp + (remainingCount + numPixels - 1) / numPixels;
+
+    std::vector<TileTask> tiles;
+    splitWindow(CropWindow({0, 0}, {imageWidth, imageHeight}), getTileSide(maxPixelNumSamples, pipeSize), proto, tiles);
+    return tiles;
+}
+
+std::vector<TileTask> TileScheduler::splitRegions(int64_t imageWidth,
+                                                  int64_t imageHeight,
+                                                  int64_t spp,
+                                                  const std::vector<CropWindow>& windows,
+                                                  int pipeSize)
+{
+    TileTask proto;
+    proto.spp = spp;
+    proto.imageWidth = imageWidth;
+    proto.imageHeight = imageHeight;
+    const int64_t side = getTileSide(spp, pipeSize);
+
+    std::vector<TileTask> tiles;
+    for(const auto& window: windows)
+        splitWindow(window, side, proto, tiles);
+    return tiles;
+}
+
+void TileScheduler::start(std::vector<TileTask>&& tiles, const RenderTile& render)
+{
+    wait();
+    m_imp->m_tiles = std::move(tiles);
+    m_imp->m_render = render;
+    m_imp->m_failed = false;
+    m_imp->m_claimWork = TilePool::getNumWorkers() > 1;
+    m_imp->m_nextTile = 0;
+
+    // Each thread starts with a contiguous run of tiles.
+    const size_t numTiles = m_imp->m_tiles.size();
+    const int numThreads = static_cast<int>(std::min<size_t>(m_imp->m_numThreads, numTiles));
+    m_imp->m_queues.clear();
+    for(int i = 0; i < numThreads; ++i)
+    {
+        m_imp->m_queues.push_back(std::make_unique<Imp::Queue>());
+        for(size_t t = numTiles * i / numThreads; t < numTiles * (i + 1) / numThreads; ++t)
+            m_imp->m_queues.back()->tiles.push_back(t);
+    }
+
+    for(int i = 0; i < numThreads; ++i)
+        m_imp->m_threads.emplace_back(&Imp::work, m_imp.get(), i);
+}
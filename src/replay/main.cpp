@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+/*
+ * fbksd-replay: a renderer that serves the tiles of a record file (see RECORD_ENV) instead of rendering them.
+ *
+ * The record file is given in place of the scene file, e.g.:
+ *   fbksd-benchmark --renderer fbksd-replay --scene scene.fbksdrec --filter ...
+ *
+ * Each request is served with a recorded evaluation with the same layout and parameters. Evaluations are
+ * matched in the recorded order, so the filter should make the same requests it made when recording. A recorded
+ * evaluation is served only once: requests beyond the recorded ones fail.
+ */
+
+#include "TileRecord.h"
+#include <fbksd/renderer/RenderingServer.h>
+using namespace fbksd;
+
+#include <iostream>
+
+
+namespace
+{
+
+class Replayer
+{
+public:
+    explicit Replayer(const std::string& path):
+        m_reader(path),
+        m_replayer(m_reader)
+    {}
+
+    int getTileSize()
+    {
+        return m_reader.getRecording().tileSize;
+    }
+
+    SceneInfo getSceneInfo()
+    {
+        return m_reader.getRecording().scene;
+    }
+
+    void setLayout(const SampleLayout& layout)
+    {
+        // The input samples given now may differ from the recorded ones, so their outputs can't be replayed.
+        if(layout.hasInput())
+            throw std::runtime_error("fbksd-replay: layouts with INPUT elements can't be replayed.");
+        m_layout = m_replayer.findLayout(layout);
+        if(m_layout == -1)
+            throw std::runtime_error("fbksd-replay: the sample layout was not recorded.");
+    }
+
+    void evaluate(int64_t spp, int64_t remainingCount, const std::vector<CropWindow>& windows)
+    {
+        m_replayer.join();
+        // Serving the same samples again would make them look independent to the filter.
+        auto evaluation = m_replayer.find(m_layout, spp, remainingCount, windows, false, -1);
+        if(!evaluation)
+            throw std::runtime_error("fbksd-replay: not enough recorded evaluations for the request (spp = " +
+                                     std::to_string(spp) + ", remaining count = " + std::to_string(remainingCount) + ").");
+        m_replayer.serve(*evaluation);
+    }
+
+    void join()
+    {
+        m_replayer.join();
+    }
+
+private:
+    TileRecordReader m_reader;
+    TileReplayer m_replayer;
+    int m_layout = -1;
+};
+
+}
+
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        std::cerr << "Usage: fbksd-replay <record file>" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::unique_ptr<Replayer> replayer;
+    try
+    {
+        replayer = std::make_unique<Replayer>(argv[1]);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    RenderingServer server;
+    server.onGetTileSize([&](){ return replayer->getTileSize(); });
+    server.onGetSceneInfo([&](){ return replayer->getSceneInfo(); });
+    server.onSetParameters([&](const SampleLayout& layout){ replayer->setLayout(layout); });
+    server.onEvaluateSamples([&](int64_t spp, int64_t remainingCount, int)
+    { replayer->evaluate(spp, remainingCount, {}); });
+    server.onEvaluateRegions([&](int64_t spp, const std::vector<CropWindow>& windows, int)
+    { replayer->evaluate(spp, 0, windows); });
+    server.onLastTileConsumed([&](){ replayer->join(); });
+    server.onFinish([&](){ replayer->join(); });
+    server.run();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#include "fbksd/core/session.h"
+#include <QtTest>
+#include <cstdlib>
+using namespace fbksd;
+
+
+class TestSession : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void defaultSession()
+    {
+        unsetenv(SESSION_ENV);
+        QCOMPARE(getSessionId(), 0);
+        QCOMPARE(getBenchmarkServerPort(0), static_cast<unsigned short>(2226));
+        QCOMPARE(getRenderingServerPort(0), static_cast<unsigned short>(2227));
+        QCOMPARE(getTilesMemoryKey(0), std::string("TILES_MEMORY"));
+        QCOMPARE(getResultMemoryKey(0), std::string("RESULT_MEMORY"));
+    }
+
+    void setSession()
+    {
+        setSessionId(3);
+        QCOMPARE(getSessionId(), 3);
+        QCOMPARE(std::string(getenv(SESSION_ENV)), std::string("3"));
+        unsetenv(SESSION_ENV);
+    }
+
+    void uniqueEndpoints()
+    {
+        QVERIFY(getBenchmarkServerPort(1) != getBenchmarkServerPort(0));
+        QVERIFY(getBenchmarkServerPort(1) != getRenderingServerPort(0));
+        QVERIFY(getRenderingServerPort(1) != getRenderingServerPort(2));
+        QVERIFY(getTilesMemoryKey(1) != getTilesMemoryKey(2));
+        QVERIFY(getResultMemoryKey(1) != getResultMemoryKey(0));
+        QVERIFY(getFrameMemoryKey(1) != getFrameMemoryKey(0));
+    }
+
+    void consumerEndpoints()
+    {
+        unsetenv(CONSUMER_ENV);
+        QCOMPARE(getConsumerId(), 0);
+        QCOMPARE(getBenchmarkServerPort(0, 0), getBenchmarkServerPort(0));
+        QCOMPARE(getResultMemoryKey(0, 0), getResultMemoryKey(0));
+
+        // Consumer ports stay inside the ports of the session.
+        for(int c = 1; c < MAX_CONSUMERS; ++c)
+        {
+            QVERIFY(getBenchmarkServerPort(1, c) != getRenderingServerPort(1));
+            QVERIFY(getBenchmarkServerPort(1, c) != getBenchmarkServerPort(1, c - 1));
+            QVERIFY(getBenchmarkServerPort(1, c) < getBenchmarkServerPort(2));
+        }
+        QVERIFY(getResultMemoryKey(0, 1) != getResultMemoryKey(1));
+        QVERIFY(getResultMemoryKey(1, 2) != getResultMemoryKey(2, 1));
+
+        setenv(CONSUMER_ENV, "2", 1);
+        QCOMPARE(getConsumerId(), 2);
+        setenv(CONSUMER_ENV, "15", 1);
+        QVERIFY_EXCEPTION_THROWN(getConsumerId(), std::invalid_argument);
+        unsetenv(CONSUMER_ENV);
+        QVERIFY_EXCEPTION_THROWN(getBenchmarkServerPort(0, MAX_CONSUMERS), std::invalid_argument);
+    }
+
+    void shardEndpoints()
+    {
+        unsetenv(SHARD_ENV);
+        QCOMPARE(getShardId(), 0);
+        QCOMPARE(getRenderingServerPort(1, 0), getRenderingServerPort(1));
+
+        // Shard ports are outside the session blocks and don't clash between sessions.
+        const unsigned short lastBlockPort = getBenchmarkServerPort(MAX_SESSIONS - 1, MAX_CONSUMERS - 1);
+        for(int s = 1; s < MAX_SHARDS; ++s)
+        {
+            QVERIFY(getRenderingServerPort(0, s) > lastBlockPort);
+            QVERIFY(getRenderingServerPort(0, s) != getRenderingServerPort(0, s - 1));
+            QVERIFY(getRenderingServerPort(1, s) > getRenderingServerPort(0, MAX_SHARDS - 1));
+        }
+
+        setenv(SHARD_ENV, "3", 1);
+        QCOMPARE(getShardId(), 3);
+        setenv(SHARD_ENV, "8", 1);
+        QVERIFY_EXCEPTION_THROWN(getShardId(), std::invalid_argument);
+        unsetenv(SHARD_ENV);
+        QVERIFY_EXCEPTION_THROWN(getRenderingServerPort(0, MAX_SHARDS), std::invalid_argument);
+    }
+
+    void invalidSession()
+    {
+        QVERIFY_EXCEPTION_THROWN(setSessionId(-1), std::invalid_argument);
+        QVERIFY_EXCEPTION_THROWN(setSessionId(MAX_SESSIONS), std::invalid_argument);
+        setenv(SESSION_ENV, "abc", 1);
+        QVERIFY_EXCEPTION_THROWN(getSessionId(), std::invalid_argument);
+        unsetenv(SESSION_ENV);
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestSession)
+#include "TestSession.moc"
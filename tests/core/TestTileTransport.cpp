@@ -0,0 +1,108 @@
+#include "fbksd/core/TileTransport.h"
+#include <QtTest>
+#include <stdexcept>
+#include <vector>
+using namespace fbksd;
+
+
+namespace
+{
+
+// Memory of a manager, written by the receiver.
+struct Memory
+{
+    Memory():
+        tiles(1 << 20, -1.f),
+        frame(64, -1.f)
+    {}
+
+    TileStreamReceiver::GetBuffer getBuffer()
+    {
+        return [this](TileTarget target, int64_t offset, int64_t size)
+        {
+            auto& memory = target == TileTarget::TILES ? tiles : frame;
+            if(offset + size > static_cast<int64_t>(memory.size()))
+                throw std::runtime_error("Tile out of bounds.");
+            return memory.data() + offset;
+        };
+    }
+
+    std::vector<float> tiles;
+    std::vector<float> frame;
+};
+
+std::vector<float> makeTile(size_t size)
+{
+    std::vector<float> tile(size);
+    for(size_t i = 0; i < size; ++i)
+        tile[i] = static_cast<float>(i % 13);
+    return tile;
+}
+
+}
+
+
+class TestTileTransport : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void loopback_data()
+    {
+        QTest::addColumn<bool>("compress");
+        QTest::newRow("raw") << false;
+        QTest::newRow("lz4") << true;
+    }
+
+    void loopback()
+    {
+        QFETCH(bool, compress);
+        Memory memory;
+        TileStreamSender sender("127.0.0.1", compress);
+        TileStreamReceiver receiver("127.0.0.1", sender.port(), memory.getBuffer());
+
+        // A large tile (sent with zero-copy, if supported), a small one, and a frame.
+        auto large = makeTile(200000);
+        auto small = makeTile(10);
+        sender.send(TileTarget::TILES, 1000, large.data(), static_cast<int64_t>(large.size()));
+        sender.send(TileTarget::TILES, 0, small.data(), static_cast<int64_t>(small.size()));
+        sender.send(TileTarget::FRAME, 4, small.data(), 8);
+        receiver.waitTiles(3);
+
+        QVERIFY(std::equal(large.begin(), large.end(), memory.tiles.begin() + 1000));
+        QVERIFY(std::equal(small.begin(), small.end(), memory.tiles.begin()));
+        QCOMPARE(memory.tiles[10], -1.f);
+        QVERIFY(std::equal(small.begin(), small.begin() + 8, memory.frame.begin() + 4));
+        QCOMPARE(memory.frame[3], -1.f);
+        sender.flush();
+    }
+
+    void invalidTile()
+    {
+        Memory memory;
+        TileStreamSender sender("127.0.0.1", false);
+        TileStreamReceiver receiver("127.0.0.1", sender.port(), memory.getBuffer());
+
+        auto tile = makeTile(10);
+        sender.send(TileTarget::FRAME, 60, tile.data(), static_cast<int64_t>(tile.size()));
+        QVERIFY_EXCEPTION_THROWN(receiver.waitTiles(1), std::runtime_error);
+    }
+
+    void closedSender()
+    {
+        Memory memory;
+        auto sender = std::make_unique<TileStreamSender>("127.0.0.1", false);
+        TileStreamReceiver receiver("127.0.0.1", sender->port(), memory.getBuffer());
+        sender.reset();
+        QVERIFY_EXCEPTION_THROWN(receiver.waitTiles(1), std::runtime_error);
+    }
+
+    void invalidAddress()
+    {
+        QVERIFY_EXCEPTION_THROWN(TileStreamSender("not an address", false), std::runtime_error);
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestTileTransport)
+#include "TestTileTransport.moc"
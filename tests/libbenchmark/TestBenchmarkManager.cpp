@@ -1,5 +1,9 @@
 #include "BenchmarkManager.h"
 #include <QtTest>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <utime.h>
 using namespace fbksd;
 
 
@@ -11,11 +15,158 @@ private slots:
     {
     }
 
+    void clipWindows()
+    {
+        const int64_t width = 20;
+        const int64_t height = 10;
+        std::vector<CropWindow> windows = {
+            CropWindow({-5, -5}, {5, 5}), // partially outside the image
+            CropWindow({30, 0}, {40, 5}), // outside the image
+            CropWindow({8, 2}, {8, 9}),   // empty
+            CropWindow({3, 3}, {12, 8}),  // overlaps the first one
+            CropWindow({4, 4}, {6, 6}),   // inside the previous one
+        };
+        auto clipped = BenchmarkManager::clipWindows(windows, width, height);
+
+        // Each pixel of the union is covered exactly once.
+        std::vector<int> coverage(width * height, 0);
+        for(auto& w: clipped)
+        {
+            QVERIFY(w.width() > 0 && w.height() > 0);
+            QVERIFY(w.begin.x >= 0 && w.begin.y >= 0 && w.end.x <= width && w.end.y <= height);
+            for(int64_t y = w.begin.y; y < w.end.y; ++y)
+            for(int64_t x = w.begin.x; x < w.end.x; ++x)
+                ++coverage[y * width + x];
+        }
+        for(int64_t y = 0; y < height; ++y)
+        for(int64_t x = 0; x < width; ++x)
+        {
+            const bool covered = (x < 5 && y < 5) || (x >= 3 && x < 12 && y >= 3 && y < 8);
+            QCOMPARE(coverage[y * width + x], covered ? 1 : 0);
+        }
+
+        QVERIFY(BenchmarkManager::clipWindows({CropWindow({-3, 0}, {0, 5})}, width, height).empty());
+        QVERIFY(BenchmarkManager::clipWindows({}, width, height).empty());
+    }
+
+    void trimSampleCache()
+    {
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        // 100 bytes each, from the least to the most recently used.
+        const QStringList names = {"a.fbksdrec", "b.fbksdrec", "c.fbksdrec", "d.fbksdrec"};
+        for(int i = 0; i < names.size(); ++i)
+        {
+            QFile file(dir.filePath(names[i]));
+            QVERIFY(file.open(QIODevice::WriteOnly));
+            file.write(QByteArray(100, 'x'));
+            file.close();
+            utimbuf times {1000 + i * 100, 1000 + i * 100};
+            QCOMPARE(utime(file.fileName().toLocal8Bit().constData(), &times), 0);
+        }
+        // Not a record file: never removed.
+        QFile other(dir.filePath("other.txt"));
+        QVERIFY(other.open(QIODevice::WriteOnly));
+        other.write(QByteArray(1000, 'x'));
+        other.close();
+
+        // "b" is the least recently used file that doesn't fit. "a" is kept even so.
+        BenchmarkManager::trimSampleCache(dir.path(), 250, dir.filePath("a.fbksdrec"));
+        QVERIFY(QFile::exists(dir.filePath("a.fbksdrec")));
+        QVERIFY(!QFile::exists(dir.filePath("b.fbksdrec")));
+        QVERIFY(QFile::exists(dir.filePath("c.fbksdrec")));
+        QVERIFY(QFile::exists(dir.filePath("d.fbksdrec")));
+        QVERIFY(QFile::exists(dir.filePath("other.txt")));
+
+        BenchmarkManager::trimSampleCache(dir.path(), 250, QString());
+        QVERIFY(!QFile::exists(dir.filePath("a.fbksdrec")));
+        QVERIFY(QFile::exists(dir.filePath("c.fbksdrec")));
+        QVERIFY(QFile::exists(dir.filePath("d.fbksdrec")));
+    }
+
     void test()
     {
         BenchmarkManager manager;
         manager.runScene(RENDERER_FILE, "", CLIENT_FILE, "", 1, 8);
     }
+
+    void slowConsumer()
+    {
+        // 49 tiles and 20 slots: the fast filter waits for the slow one to release the shared tiles,
+        // but the wait is not part of its execution time.
+        QTemporaryDir fastDir;
+        QTemporaryDir slowDir;
+        QVERIFY(fastDir.isValid() && slowDir.isValid());
+        BenchmarkManager manager;
+        manager.runScene(RENDERER_FILE, "", QStringList{CLIENT_FILE, SLOW_CLIENT_FILE},
+                         QStringList{fastDir.path(), slowDir.path()}, 1, 8);
+        const int fastTime = getExecTime(fastDir.path());
+        const int slowTime = getExecTime(slowDir.path());
+        QVERIFY(fastTime >= 0);
+        QVERIFY(slowTime >= 49 * 50);
+        QVERIFY(fastTime < slowTime / 2);
+    }
+
+    void shards()
+    {
+        // Each mockrenderer process renders a third of the rows.
+        BenchmarkManager manager;
+        manager.setNumRendererShards(3);
+        manager.runScene(RENDERER_FILE, "", CLIENT_FILE, "", 1, 8);
+    }
+
+    void workers()
+    {
+        // Each evaluation is rendered by 3 mockrenderer processes.
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        BenchmarkManager manager;
+        manager.runScene(RENDERER_FILE, writeScene(dir, "workers", "--workers 3"), CLIENT_FILE, dir.path(), 1, 8);
+        QVERIFY(getExecTime(dir.path()) >= 0);
+
+        // A worker dies while rendering: the filter gets an error instead of waiting for its tiles forever,
+        // so the run finishes without a result.
+        QTemporaryDir killedDir;
+        QVERIFY(killedDir.isValid());
+        manager.runScene(RENDERER_FILE, writeScene(killedDir, "killed", "--workers 3 --kill-worker"),
+                         CLIENT_FILE, killedDir.path(), 1, 8);
+        QCOMPARE(getExecTime(killedDir.path()), -1);
+    }
+
+    void tcpTiles()
+    {
+        // The mockrenderer streams its tiles over loopback instead of writing them in the shared memory.
+        BenchmarkManager manager;
+        manager.setTileTransport(BenchmarkManager::TileTransport::TCP);
+        manager.runScene(RENDERER_FILE, "", CLIENT_FILE, "", 1, 8);
+
+        manager.setTileTransport(BenchmarkManager::TileTransport::TCP_LZ4);
+        manager.setNumRendererShards(2);
+        manager.runScene(RENDERER_FILE, "", CLIENT_FILE, "", 1, 8);
+    }
+
+private:
+    // Writes a mockrenderer scene file with the given options, and returns its path.
+    QString writeScene(const QTemporaryDir& dir, const QString& name, const QByteArray& options)
+    {
+        QFile file(dir.filePath(name + ".scene"));
+        if(file.open(QIODevice::WriteOnly))
+            file.write(options);
+        return file.fileName();
+    }
+
+    // Returns the execution time saved in the log of the single result in `dir`, or -1.
+    int getExecTime(const QString& dir)
+    {
+        auto logs = QDir(dir).entryList({"*_log.json"}, QDir::Files);
+        if(logs.size() != 1)
+            return -1;
+        QFile file(QDir(dir).filePath(logs[0]));
+        if(!file.open(QFile::ReadOnly))
+            return -1;
+        auto log = QJsonDocument::fromJson(file.readAll()).object();
+        return log["exec_time"].toObject()["time_ms"].toInt();
+    }
 };
 
 
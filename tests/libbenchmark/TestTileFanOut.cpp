@@ -0,0 +1,153 @@
+#include "TileFanOut.h"
+#include <QtTest>
+#include <future>
+using namespace fbksd;
+
+
+namespace
+{
+
+// Renderer with a fixed sequence of tiles, recording the slots given back to it and the consumers whose
+// layout was restored.
+struct FakeRenderer
+{
+    explicit FakeRenderer(const std::vector<int64_t>& indices)
+    {
+        for(size_t i = 0; i < indices.size(); ++i)
+            tiles.emplace_back(Tile(CropWindow({0, 0}, {1, 1}), indices[i], 10), i + 1 < indices.size());
+    }
+
+    std::unique_ptr<TileFanOut> makeFanOut(int numConsumers, int numSlots)
+    {
+        return std::make_unique<TileFanOut>(numConsumers, numSlots,
+            [this](const std::vector<int64_t>& indices){ fetches.push_back(indices); return tiles.at(next++); },
+            [this](const std::vector<int64_t>& indices){ finished = indices; },
+            [this](const std::vector<int64_t>& indices){ canceled = indices; return INT64_C(0); },
+            [this](int consumer){ restored.push_back(consumer); });
+    }
+
+    std::function<TilePkg()> evaluate()
+    {
+        return [this](){ ++numEvaluations; return tiles.at(next++); };
+    }
+
+    std::vector<TilePkg> tiles;
+    size_t next = 0;
+    int numEvaluations = 0;
+    std::vector<std::vector<int64_t>> fetches;
+    std::vector<int64_t> finished {-1};
+    std::vector<int64_t> canceled {-1};
+    std::vector<int> restored;
+};
+
+}
+
+
+class TestTileFanOut : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void sharedEvaluation()
+    {
+        FakeRenderer renderer({0, 1, 0});
+        auto fanOut = renderer.makeFanOut(2, 2);
+        const auto key = TileFanOut::makeKey("EVALUATE_SAMPLES", INT64_C(1), INT64_C(0));
+
+        QCOMPARE(fanOut->evaluate(0, key, renderer.evaluate()).tile.index, INT64_C(0));
+        QCOMPARE(fanOut->releaseAndGetNextTile(0, {0}).tile.index, INT64_C(1));
+        // Slot 0 is still held by consumer 1.
+        QCOMPARE(renderer.fetches.back(), std::vector<int64_t>{});
+
+        QCOMPARE(fanOut->evaluate(1, key, renderer.evaluate()).tile.index, INT64_C(0));
+        QCOMPARE(renderer.numEvaluations, 1);
+        QCOMPARE(fanOut->releaseAndGetNextTile(1, {0}).tile.index, INT64_C(1));
+        QCOMPARE(renderer.fetches.size(), size_t(1));
+
+        auto last = fanOut->releaseAndGetNextTile(0, {1});
+        QCOMPARE(renderer.fetches.back(), std::vector<int64_t>{0});
+        QVERIFY(!last.hasNext);
+        fanOut->releaseLastTiles(0, {last.tile.index});
+        QCOMPARE(renderer.finished, std::vector<int64_t>{-1});
+
+        QCOMPARE(fanOut->releaseAndGetNextTile(1, {1}).tile.index, INT64_C(0));
+        fanOut->releaseLastTiles(1, {0});
+        QCOMPARE(renderer.finished, (std::vector<int64_t>{1, 0}));
+        QCOMPARE(renderer.fetches.size(), size_t(2));
+    }
+
+    void sharedRequest()
+    {
+        FakeRenderer renderer({0});
+        auto fanOut = renderer.makeFanOut(2, 20);
+        int numCalls = 0;
+        auto call = [&](){ ++numCalls; return INT64_C(7); };
+        QCOMPARE(fanOut->request(0, TileFanOut::makeKey("REGISTER_LAYOUT", 1), call), INT64_C(7));
+        QCOMPARE(fanOut->request(1, TileFanOut::makeKey("REGISTER_LAYOUT", 1), call), INT64_C(7));
+        QCOMPARE(numCalls, 1);
+    }
+
+    void divergentConsumer()
+    {
+        FakeRenderer renderer({0, 1, 5});
+        auto fanOut = renderer.makeFanOut(2, 20);
+        const auto key = TileFanOut::makeKey("EVALUATE_SAMPLES", 1);
+        QCOMPARE(fanOut->evaluate(0, key, renderer.evaluate()).tile.index, INT64_C(0));
+
+        // Consumer 1 leaves the group, and its own evaluation waits for the one of the group.
+        auto solo = std::async(std::launch::async, [&]()
+        {
+            return fanOut->evaluate(1, TileFanOut::makeKey("EVALUATE_SAMPLES", 2), renderer.evaluate());
+        });
+        QCOMPARE(fanOut->releaseAndGetNextTile(0, {0}).tile.index, INT64_C(1));
+        fanOut->releaseLastTiles(0, {1});
+
+        auto pkg = solo.get();
+        QCOMPARE(pkg.tile.index, INT64_C(5));
+        QVERIFY(!pkg.hasNext);
+        QCOMPARE(renderer.numEvaluations, 2);
+        QCOMPARE(renderer.restored, std::vector<int>{1});
+        fanOut->releaseLastTiles(1, {5});
+        QCOMPARE(renderer.finished, std::vector<int64_t>{5});
+
+        // The group gets its layout back with its next request, while consumer 1 makes its own.
+        int numCalls = 0;
+        auto call = [&](){ ++numCalls; return INT64_C(0); };
+        fanOut->request(0, TileFanOut::makeKey("SELECT_LAYOUT", 0), call);
+        fanOut->request(1, TileFanOut::makeKey("SELECT_LAYOUT", 0), call);
+        QCOMPARE(numCalls, 2);
+        QCOMPARE(renderer.restored, (std::vector<int>{1, 0, 1}));
+    }
+
+    void cancel()
+    {
+        FakeRenderer renderer({0, 1, 2});
+        auto fanOut = renderer.makeFanOut(2, 20);
+        const auto key = TileFanOut::makeKey("EVALUATE_SAMPLES", 1);
+        fanOut->evaluate(0, key, renderer.evaluate());
+        fanOut->evaluate(1, key, renderer.evaluate());
+        fanOut->releaseAndGetNextTile(1, {0});
+
+        QCOMPARE(fanOut->cancelEvaluation(0, {0}), INT64_C(10));
+        QCOMPARE(renderer.canceled, std::vector<int64_t>{-1});
+        // The renderer is only canceled when nobody uses the evaluation.
+        QCOMPARE(fanOut->cancelEvaluation(1, {}), INT64_C(20));
+        QCOMPARE(renderer.canceled, (std::vector<int64_t>{0, 1}));
+    }
+
+    void removeConsumer()
+    {
+        FakeRenderer renderer({0, 1});
+        auto fanOut = renderer.makeFanOut(2, 20);
+        const auto key = TileFanOut::makeKey("EVALUATE_SAMPLES", 1);
+        fanOut->evaluate(0, key, renderer.evaluate());
+        fanOut->releaseAndGetNextTile(0, {0});
+        fanOut->removeConsumer(1);
+        fanOut->releaseLastTiles(0, {1});
+        QCOMPARE(renderer.finished, (std::vector<int64_t>{0, 1}));
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestTileFanOut)
+#include "TestTileFanOut.moc"
@@ -0,0 +1,231 @@
+#include "TileMerger.h"
+#include <QtTest>
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <mutex>
+using namespace fbksd;
+
+
+namespace
+{
+
+// Shards with fixed sequences of tiles, recording the slots given back to them. The merger fetches tiles
+// from other threads, so the records are read with `mutex` locked.
+struct FakeShards
+{
+    explicit FakeShards(const std::vector<std::vector<int64_t>>& indices):
+        tiles(indices.size()),
+        next(indices.size(), 0),
+        fetches(indices.size()),
+        finished(indices.size(), {-1}),
+        canceled(indices.size(), {-1})
+    {
+        for(size_t shard = 0; shard < indices.size(); ++shard)
+            for(size_t i = 0; i < indices[shard].size(); ++i)
+                tiles[shard].emplace_back(Tile(CropWindow({0, 0}, {1, 1}), indices[shard][i], 10), i + 1 < indices[shard].size());
+    }
+
+    std::unique_ptr<TileMerger> makeMerger(int numSlots = 20)
+    {
+        return std::make_unique<TileMerger>(static_cast<int>(tiles.size()), numSlots,
+            [this](int shard, const std::vector<int64_t>& indices)
+            {
+                size_t i = 0;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    fetches[shard].push_back(indices);
+                    i = next[shard]++;
+                }
+                if(shard == slowShard && i == slowTile)
+                    slow.wait_for(std::chrono::seconds(5));
+                return tiles[shard].at(i);
+            },
+            [this](int shard, const std::vector<int64_t>& indices)
+            { std::lock_guard<std::mutex> lock(mutex); finished[shard] = indices; },
+            [this](int shard, const std::vector<int64_t>& indices)
+            { std::lock_guard<std::mutex> lock(mutex); canceled[shard] = indices; return INT64_C(0); });
+    }
+
+    TileMerger::Evaluate evaluate()
+    {
+        return [this](int shard){ return tiles[shard].empty() ? TilePkg() : tiles[shard].at(next[shard]++); };
+    }
+
+    std::vector<std::vector<TilePkg>> tiles;
+    std::vector<size_t> next;
+    std::vector<std::vector<std::vector<int64_t>>> fetches;
+    std::vector<std::vector<int64_t>> finished;
+    std::vector<std::vector<int64_t>> canceled;
+    std::mutex mutex;
+
+    // The fetch of the tile `slowTile` of `slowShard` waits for `slow` (up to a timeout).
+    int slowShard = -1;
+    size_t slowTile = 0;
+    std::shared_future<void> slow;
+};
+
+}
+
+
+class TestTileMerger : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void mergedStream()
+    {
+        FakeShards shards({{0, 1, 0}, {20, 21}});
+        auto merger = shards.makeMerger();
+
+        // Each tile is released in the next call, so slot 0 of shard 0 can be used again.
+        std::vector<int64_t> delivered;
+        auto pkg = merger->evaluate({0, 1}, shards.evaluate());
+        while(true)
+        {
+            QVERIFY(pkg.isValid);
+            delivered.push_back(pkg.tile.index);
+            if(!pkg.hasNext)
+                break;
+            pkg = merger->releaseAndGetNextTile({pkg.tile.index});
+        }
+        merger->releaseLastTiles({pkg.tile.index});
+
+        std::sort(delivered.begin(), delivered.end());
+        QCOMPARE(delivered, (std::vector<int64_t>{0, 0, 1, 20, 21}));
+        // Every slot went back to its own shard, with a request or when the evaluation finished.
+        for(size_t shard = 0; shard < 2; ++shard)
+        {
+            std::vector<int64_t> released = shards.finished[shard];
+            for(const auto& fetch: shards.fetches[shard])
+                released.insert(released.end(), fetch.begin(), fetch.end());
+            std::sort(released.begin(), released.end());
+            QCOMPARE(released, (shard == 0 ? std::vector<int64_t>{0, 0, 1} : std::vector<int64_t>{20, 21}));
+        }
+    }
+
+    void slowShard()
+    {
+        FakeShards shards({{0, 1}, {20, 21, 22}});
+        std::promise<void> slow;
+        shards.slowShard = 0;
+        shards.slowTile = 1;
+        shards.slow = slow.get_future().share();
+        auto merger = shards.makeMerger();
+
+        // Shard 1 keeps the client busy while shard 0 renders its second tile.
+        QCOMPARE(merger->evaluate({0, 1}, shards.evaluate()).tile.index, INT64_C(0));
+        QCOMPARE(merger->releaseAndGetNextTile({}).tile.index, INT64_C(20));
+        QCOMPARE(merger->releaseAndGetNextTile({}).tile.index, INT64_C(21));
+        auto pkg = merger->releaseAndGetNextTile({});
+        QCOMPARE(pkg.tile.index, INT64_C(22));
+        QVERIFY(pkg.hasNext);
+        slow.set_value();
+        pkg = merger->releaseAndGetNextTile({});
+        QCOMPARE(pkg.tile.index, INT64_C(1));
+        QVERIFY(!pkg.hasNext);
+        merger->releaseLastTiles({0, 1, 20, 21, 22});
+    }
+
+    void slotLimit()
+    {
+        FakeShards shards({{0, 1, 0}});
+        auto merger = shards.makeMerger(2);
+
+        // With both slots held by the client, the shard isn't asked for a tile until one is released.
+        merger->evaluate({0}, shards.evaluate());
+        QCOMPARE(merger->releaseAndGetNextTile({}).tile.index, INT64_C(1));
+        {
+            std::lock_guard<std::mutex> lock(shards.mutex);
+            QCOMPARE(shards.fetches[0].size(), size_t(1));
+        }
+        auto pkg = merger->releaseAndGetNextTile({0});
+        QCOMPARE(pkg.tile.index, INT64_C(0));
+        QVERIFY(!pkg.hasNext);
+        QCOMPARE(shards.fetches[0].back(), std::vector<int64_t>{0});
+        merger->releaseLastTiles({1, 0});
+        QCOMPARE(shards.finished[0], (std::vector<int64_t>{1, 0}));
+    }
+
+    void idleShards()
+    {
+        FakeShards shards({{}, {5}});
+        auto merger = shards.makeMerger();
+
+        // Shard 0 has no samples: the evaluation only has the tile of shard 1.
+        auto pkg = merger->evaluate({0, 1}, shards.evaluate());
+        QCOMPARE(pkg.tile.index, INT64_C(5));
+        QVERIFY(!pkg.hasNext);
+        merger->releaseLastTiles({5});
+        QCOMPARE(shards.finished[0], std::vector<int64_t>{-1});
+        QCOMPARE(shards.finished[1], std::vector<int64_t>{5});
+
+        QVERIFY(!merger->evaluate({0}, shards.evaluate()).isValid);
+    }
+
+    void cancel()
+    {
+        FakeShards shards({{0, 1}, {20, 21}});
+        auto merger = shards.makeMerger();
+
+        merger->evaluate({0, 1}, shards.evaluate());
+        // The tiles still waiting in the merger, or in flight, are released but not counted.
+        QCOMPARE(merger->cancelEvaluation({0}), INT64_C(10));
+        QCOMPARE(shards.canceled[0], (std::vector<int64_t>{0, 1}));
+        QCOMPARE(shards.canceled[1], (std::vector<int64_t>{20, 21}));
+    }
+
+    void failedShard()
+    {
+        FakeShards shards({{0, 1}, {20, 21}});
+        auto merger = shards.makeMerger();
+
+        auto evaluate = shards.evaluate();
+        auto failing = [&](int shard)
+        {
+            if(shard == 1)
+                throw std::runtime_error("shard failed");
+            return evaluate(shard);
+        };
+        const std::vector<int> all = {0, 1};
+        QVERIFY_EXCEPTION_THROWN(merger->evaluate(all, failing), std::runtime_error);
+        // The shard that started gives its slots back.
+        QCOMPARE(shards.canceled[0], std::vector<int64_t>{0});
+        QCOMPARE(shards.canceled[1], std::vector<int64_t>{-1});
+    }
+
+    void unknownSlot()
+    {
+        FakeShards shards({{0, 1}});
+        auto merger = shards.makeMerger();
+        merger->evaluate({0}, shards.evaluate());
+        QVERIFY_EXCEPTION_THROWN(merger->releaseAndGetNextTile({7}), std::logic_error);
+    }
+
+    void shardWindows()
+    {
+        QCOMPARE(TileMerger::getShardRows(10, 0, 3), std::make_pair(INT64_C(0), INT64_C(3)));
+        QCOMPARE(TileMerger::getShardRows(10, 2, 3), std::make_pair(INT64_C(6), INT64_C(10)));
+
+        std::vector<CropWindow> windows = {CropWindow({0, 0}, {4, 2}), CropWindow({1, 5}, {3, 9})};
+        auto first = TileMerger::getShardWindows(windows, 10, 0, 3);
+        QCOMPARE(first.size(), size_t(1));
+        QCOMPARE(first[0].end.y, INT64_C(2));
+
+        auto second = TileMerger::getShardWindows(windows, 10, 1, 3);
+        QCOMPARE(second.size(), size_t(1));
+        QCOMPARE(second[0].begin.y, INT64_C(5));
+        QCOMPARE(second[0].end.y, INT64_C(6));
+
+        // Every row of the windows goes to exactly one shard.
+        int64_t area = 0;
+        for(int shard = 0; shard < 3; ++shard)
+            for(auto& w: TileMerger::getShardWindows(windows, 10, shard, 3))
+                area += w.width() * w.height();
+        QCOMPARE(area, INT64_C(4 * 2 + 2 * 4));
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestTileMerger)
+#include "TestTileMerger.moc"
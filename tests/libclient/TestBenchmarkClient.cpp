@@ -1,8 +1,17 @@
 #include "fbksd/client/BenchmarkClient.h"
 #include "BenchmarkManager.h"
 #include "tcp_utils.h"
+#include "fbksd/core/session.h"
+#include "fbksd/core/SharedMemory.h"
 #include <QtTest>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstring>
+#include <mutex>
+#include <set>
+#include <thread>
 
 using namespace fbksd;
 
@@ -22,6 +31,9 @@ void startProcess(const QString& execPath, const QStringList& args, QProcess* pr
         exit(EXIT_FAILURE);
     }
 }
+
+// Sample budget of the client, enough for several evaluations.
+constexpr int BUDGET_SPP = 64;
 }
 
 
@@ -31,12 +43,16 @@ class TestBenchmarkClient : public QObject
 private slots:
     void initTestCase()
     {
+        ReadyListener listener;
+        QProcessEnvironment env = QProcessEnvironment::systemEnvironment();
+        env.insert(READY_PORT_ENV, QString::number(listener.port()));
         m_rendererProcess = std::make_unique<QProcess>();
-        startProcess(RENDERER_FILE, {"--img-size", "300x300"}, m_rendererProcess.get());
-        waitPortOpen(2227);
+        m_rendererProcess->setProcessEnvironment(env);
+        // The tile delay makes the rendering slow enough to be canceled half-way.
+        startProcess(RENDERER_FILE, {"--img-size", "300x300", "--tile-delay", "20"}, m_rendererProcess.get());
+        QVERIFY(listener.wait(10000));
         m_manager = std::make_unique<BenchmarkManager>();
-        m_manager->runPassive(4);
-        waitPortOpen(2226);
+        m_manager->runPassive(BUDGET_SPP);
         m_client = std::make_unique<BenchmarkClient>();
     }
 
@@ -48,7 +64,7 @@ private slots:
         m_spp = info.get<int64_t>("max_spp");
         QCOMPARE(m_width, INT64_C(300));
         QCOMPARE(m_height, INT64_C(300));
-        QCOMPARE(m_spp, INT64_C(4));
+        QCOMPARE(m_spp, static_cast<int64_t>(BUDGET_SPP));
     }
 
     void setSampleLayout()
@@ -57,6 +73,46 @@ private slots:
         layout("IMAGE_X")("IMAGE_Y")("COLOR_R")("COLOR_G")("COLOR_B");
         m_client->setSampleLayout(layout);
         m_sampleSize = layout.getSampleSize();
+        m_elements = {0, 1, 7, 8, 9};
+    }
+
+    void registerSampleLayout()
+    {
+        SampleLayout colorOnly;
+        colorOnly("COLOR_R")("COLOR_G")("COLOR_B");
+        SampleLayout full;
+        full("IMAGE_X")("IMAGE_Y")("COLOR_R")("COLOR_G")("COLOR_B");
+        int colorId = m_client->registerSampleLayout(colorOnly);
+        int fullId = m_client->registerSampleLayout(full);
+        QVERIFY(colorId != fullId);
+        m_client->setSampleLayout(colorId);
+        m_sampleSize = colorOnly.getSampleSize();
+        m_elements = {7, 8, 9};
+        int64_t ncp = 0;
+        int64_t numErrors = 0;
+        m_client->evaluateSamples(SPP(1), [&](const BufferTile& tile)
+        {
+            QCOMPARE(tile.getSampleSize(), INT64_C(3));
+            ncp += tile.numPixels();
+            numErrors += countErrors(tile, 1);
+        });
+        QCOMPARE(ncp, m_width * m_height);
+        QCOMPARE(numErrors, INT64_C(0));
+
+        // Leaves the same layout set by setSampleLayout() for the next tests.
+        m_client->setSampleLayout(fullId);
+        m_sampleSize = full.getSampleSize();
+        m_elements = {0, 1, 7, 8, 9};
+        ncp = 0;
+        m_client->evaluateSamples(SPP(1), [&](const BufferTile& tile)
+        {
+            QCOMPARE(tile.getSampleSize(), m_sampleSize);
+            ncp += tile.numPixels();
+            numErrors += countErrors(tile, 1);
+        });
+        QCOMPARE(ncp, m_width * m_height);
+        QCOMPARE(numErrors, INT64_C(0));
+        QVERIFY_EXCEPTION_THROWN(m_client->setSampleLayout(fullId + 1), std::invalid_argument);
     }
 
     void evaluateSamples()
@@ -74,7 +130,7 @@ private slots:
                 for(int64_t c = 0; c < m_sampleSize; ++c)
                 {
                     float v =  pixel[s*m_sampleSize + c];
-                    float exp = getValue(x, y, s, c);
+                    float exp = getValue(x, y, s, c, spp);
                     if(!qFuzzyCompare(v, exp))
                     {
                         QWARN(QString("pixel = (%1, %2); sample = %3; component = %4")
@@ -87,6 +143,374 @@ private slots:
         QCOMPARE(ncp, spp * m_width * m_height);
     }
 
+    void evaluateSamplesAsync()
+    {
+        // Canceled before it starts: no samples are requested.
+        int numCanceledCalls = 0;
+        auto canceled = m_client->evaluateSamplesAsync(SPP(1), [&](const BufferTile&){ ++numCanceledCalls; });
+        canceled.cancel();
+
+        // The consumer runs in the client worker thread.
+        const int spp = 2;
+        std::atomic<int64_t> ncp{0};
+        std::atomic<int64_t> numErrors{0};
+        auto eval = m_client->evaluateSamplesAsync(SPP(spp), [&](const BufferTile& tile)
+        {
+            ncp += tile.numPixels() * spp;
+            numErrors += countErrors(tile, spp);
+        });
+        QVERIFY(eval.isValid());
+        QVERIFY(canceled.isCanceled());
+        eval.wait();
+        canceled.wait();
+        QVERIFY(eval.isFinished());
+        QVERIFY(canceled.isFinished());
+        QCOMPARE(numCanceledCalls, 0);
+        QCOMPARE(canceled.getNumRefundedSamples(), INT64_C(0));
+        QCOMPARE(ncp.load(), spp * m_width * m_height);
+        QCOMPARE(numErrors.load(), INT64_C(0));
+    }
+
+    void consumerThreads()
+    {
+        QVERIFY_EXCEPTION_THROWN(m_client->setNumConsumerThreads(-1), std::invalid_argument);
+        m_client->setNumConsumerThreads(0);
+        QCOMPARE(m_client->getNumConsumerThreads(), std::max<int>(std::thread::hardware_concurrency(), 1));
+        const int numThreads = 4;
+        m_client->setNumConsumerThreads(numThreads);
+        QCOMPARE(m_client->getNumConsumerThreads(), numThreads);
+
+        // The first tile is the slowest, so the next ones are handed back to the renderer before it.
+        std::mutex mutex;
+        std::vector<int> finishOrder;
+        std::set<std::thread::id> threads;
+        int numRunning = 0;
+        int maxRunning = 0;
+        std::atomic<int> numStarted{0};
+        std::atomic<int64_t> ncp{0};
+        std::atomic<int64_t> numErrors{0};
+        m_client->evaluateSamples(SPP(1), [&](const BufferTile& tile)
+        {
+            const int order = numStarted++;
+            std::unique_lock<std::mutex> lock(mutex);
+            threads.insert(std::this_thread::get_id());
+            maxRunning = std::max(maxRunning, ++numRunning);
+            lock.unlock();
+
+            if(order == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            ncp += tile.numPixels();
+            numErrors += countErrors(tile, 1);
+
+            lock.lock();
+            --numRunning;
+            finishOrder.push_back(order);
+        });
+        QCOMPARE(ncp.load(), m_width * m_height);
+        QCOMPARE(numErrors.load(), INT64_C(0));
+        QCOMPARE(static_cast<int>(finishOrder.size()), numStarted.load());
+        QVERIFY(finishOrder.front() != 0);
+        QVERIFY(maxRunning > 1);
+        QVERIFY(maxRunning <= numThreads);
+        QVERIFY(static_cast<int>(threads.size()) <= numThreads);
+
+        // A consumer error cancels the evaluation, and the client can still be used.
+        QVERIFY_EXCEPTION_THROWN(m_client->evaluateSamples(SPP(1), [](const BufferTile&)
+        {
+            throw std::runtime_error("consumer error");
+        }), std::runtime_error);
+
+        m_client->setNumConsumerThreads(1);
+        QCOMPARE(m_client->getNumConsumerThreads(), 1);
+    }
+
+    void eagerTileRelease()
+    {
+        m_client->setEagerTileRelease(true);
+        QVERIFY(m_client->isEagerTileReleaseEnabled());
+
+        // Clears the tiles memory, so only the tiles of the next evaluation can be found in it.
+        SharedMemory tilesMemory(getTilesMemoryKey(getSessionId()));
+        QVERIFY(tilesMemory.attach());
+        std::memset(tilesMemory.data(), 0, tilesMemory.size());
+        tilesMemory.detach();
+
+        // The slot of the first tile is handed back before its consumer runs, so the renderer
+        // writes a later tile to it while the consumer still holds the copy.
+        const int spp = 3;
+        bool slotReused = false;
+        bool insideTilesMemory = false;
+        std::set<const float*> copies;
+        int64_t ncp = 0;
+        int64_t numErrors = 0;
+        m_client->evaluateSamples(SPP(spp), [&](const BufferTile& tile)
+        {
+            const float* data = tile(tile.beginX(), tile.beginY(), 0);
+            if(copies.empty())
+            {
+                tilesMemory.attach();
+                slotReused = waitSlotReused(tilesMemory, data);
+            }
+            const auto* begin = static_cast<const char*>(tilesMemory.data());
+            const auto* address = reinterpret_cast<const char*>(data);
+            insideTilesMemory = insideTilesMemory || (address >= begin && address < begin + tilesMemory.size());
+            copies.insert(data);
+            ncp += tile.numPixels() * spp;
+            numErrors += countErrors(tile, spp);
+        });
+        tilesMemory.detach();
+
+        QCOMPARE(ncp, spp * m_width * m_height);
+        QCOMPARE(numErrors, INT64_C(0));
+        QVERIFY(slotReused);
+        QVERIFY(!insideTilesMemory);
+        // The arena block is reused between tiles (a new one is only needed when a larger tile comes
+        // after a smaller one).
+        QVERIFY(copies.size() <= 2);
+
+        // A consumer error cancels the evaluation, and the next one runs normally.
+        QVERIFY_EXCEPTION_THROWN(m_client->evaluateSamples(SPP(1), [](const BufferTile&)
+        {
+            throw std::runtime_error("consumer error");
+        }), std::runtime_error);
+        ncp = 0;
+        m_client->evaluateSamples(SPP(1), [&](const BufferTile& tile)
+        {
+            ncp += tile.numPixels();
+            numErrors += countErrors(tile, 1);
+        });
+        QCOMPARE(ncp, m_width * m_height);
+        QCOMPARE(numErrors, INT64_C(0));
+        m_client->setEagerTileRelease(false);
+    }
+
+    void streamSamples()
+    {
+        const int spp = 1;
+        int64_t ncp = 0;
+        int64_t numErrors = 0;
+        auto stream = m_client->streamSamples(SPP(spp));
+        QVERIFY(stream.next());
+        ncp += stream.tile().numPixels() * spp;
+        numErrors += countErrors(stream.tile(), spp);
+
+        // Streams share the connection to the server: no other request can be interleaved with an open stream.
+        QVERIFY_EXCEPTION_THROWN(m_client->streamSamples(SPP(1)), std::logic_error);
+        QVERIFY_EXCEPTION_THROWN(m_client->evaluateFrame(SPP(1)), std::logic_error);
+
+        // The range-based for continues after the pulled tile.
+        for(const BufferTile& tile: stream)
+        {
+            ncp += tile.numPixels() * spp;
+            numErrors += countErrors(tile, spp);
+        }
+        QVERIFY(stream.isFinished());
+        QCOMPARE(ncp, spp * m_width * m_height);
+        QCOMPARE(numErrors, INT64_C(0));
+
+        // The next stream can be opened once the previous one finished. It's canceled half-way.
+        auto second = m_client->streamSamples(SPP(2));
+        int numTiles = 0;
+        for(const BufferTile& tile: second)
+        {
+            numErrors += countErrors(tile, 2);
+            if(++numTiles == 10)
+                break;
+        }
+        QVERIFY(!second.isFinished());
+        QVERIFY(second.cancel() > 0);
+        QVERIFY(second.isFinished());
+        QCOMPARE(numErrors, INT64_C(0));
+    }
+
+    void cancelEvaluation()
+    {
+        // Reference: time to render a whole evaluation.
+        using Clock = std::chrono::steady_clock;
+        auto start = Clock::now();
+        m_client->evaluateSamples(SPP(1), [](const BufferTile&){});
+        const auto fullTime = Clock::now() - start;
+
+        // Canceled after the first tile: the samples not delivered are refunded, and the renderer
+        // stops (the cancellation returns once its threads are done).
+        auto stream = m_client->streamSamples(SPP(1));
+        QVERIFY(stream.next());
+        const int64_t numDelivered = stream.tile().numPixels();
+        start = Clock::now();
+        const int64_t refund = stream.cancel();
+        const auto cancelTime = Clock::now() - start;
+        QCOMPARE(refund, m_width * m_height - numDelivered);
+        QVERIFY(cancelTime < fullTime / 2);
+
+        // An async evaluation canceled from another thread.
+        std::atomic<int> numTiles{0};
+        auto eval = m_client->evaluateSamplesAsync(SPP(1), [&](const BufferTile&){ ++numTiles; });
+        while(numTiles == 0 && !eval.isFinished())
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        eval.cancel();
+        eval.wait();
+        QVERIFY(eval.getNumRefundedSamples() > 0);
+        QVERIFY(eval.getNumRefundedSamples() < m_width * m_height);
+
+        // The refunded budget can be used.
+        int64_t ncp = 0;
+        m_client->evaluateSamples(SPP(1), [&](const BufferTile& tile){ ncp += tile.numPixels(); });
+        QCOMPARE(ncp, m_width * m_height);
+    }
+
+    void evaluateRegions()
+    {
+        // Windows partially outside, outside, empty and overlapping: each covered pixel is sampled once.
+        const std::vector<CropWindow> windows = {
+            CropWindow({-10, -10}, {20, 20}),
+            CropWindow({m_width, 0}, {m_width + 10, 10}),
+            CropWindow({50, 50}, {50, 60}),
+            CropWindow({10, 10}, {100, 40}),
+            CropWindow({m_width - 5, m_height - 5}, {m_width + 5, m_height + 5}),
+        };
+        const int64_t area = 20 * 20 + 90 * 30 - 10 * 10 + 5 * 5;
+        const int64_t spp = 2;
+        std::vector<int> coverage(m_width * m_height, 0);
+        int64_t numSamples = 0;
+        int64_t numErrors = 0;
+        m_client->evaluateSamples(SPP(spp), windows, [&](const BufferTile& tile)
+        {
+            QCOMPARE(tile.getSPP(), spp);
+            for(auto y = tile.beginY(); y < tile.endY(); ++y)
+            for(auto x = tile.beginX(); x < tile.endX(); ++x)
+                ++coverage[y * m_width + x];
+            numSamples += spp * (tile.endX() - tile.beginX()) * (tile.endY() - tile.beginY());
+            numErrors += countErrors(tile, spp);
+        });
+        QCOMPARE(numSamples, spp * area);
+        QCOMPARE(numErrors, INT64_C(0));
+        QCOMPARE(*std::max_element(coverage.begin(), coverage.end()), 1);
+        QCOMPARE(coverage[15 * m_width + 15], 1);
+        QCOMPARE(coverage[(m_height - 1) * m_width + m_width - 1], 1);
+        QCOMPARE(coverage[50 * m_width + 50], 0);
+    }
+
+    void evaluateFrame()
+    {
+        const int64_t spp = 2;
+        auto frame = m_client->evaluateFrame(SPP(spp));
+        QCOMPARE(frame.getSPP(), spp);
+        QCOMPARE(frame.beginX(), INT64_C(0));
+        QCOMPARE(frame.beginY(), INT64_C(0));
+        QCOMPARE(frame.endX(), m_width);
+        QCOMPARE(frame.endY(), m_height);
+        QCOMPARE(countErrors(frame, spp), INT64_C(0));
+    }
+
+    void featuresOnly()
+    {
+        SampleLayout color;
+        color("COLOR_R")("COLOR_G")("COLOR_B");
+        SampleLayout directLight;
+        directLight("NORMAL_X")("DIRECT_LIGHT_R");
+        SampleLayout diffuse;
+        diffuse("DEPTH")("DIFFUSE_COLOR_G");
+        SampleLayout features;
+        features("NORMAL_X")("NORMAL_Y")("NORMAL_Z")("DEPTH")("TEXTURE_COLOR_R");
+        QVERIFY(!color.isFeaturesOnly());
+        QVERIFY(!directLight.isFeaturesOnly());
+        QVERIFY(!diffuse.isFeaturesOnly());
+        QVERIFY(features.isFeaturesOnly());
+
+        // Only features of the primary hit, with at least one of them.
+        SampleLayout camera;
+        camera("IMAGE_X")("IMAGE_Y")("LENS_U")("WORLD_X");
+        QVERIFY(camera.isFeaturesOnly());
+        SampleLayout secondBounce;
+        secondBounce("NORMAL_X")("NORMAL_X_1");
+        QVERIFY(!secondBounce.isFeaturesOnly());
+        SampleLayout nonSpecular;
+        nonSpecular("TEXTURE_COLOR_R_NS");
+        QVERIFY(!nonSpecular.isFeaturesOnly());
+        SampleLayout light;
+        light("DEPTH")("LIGHT_X");
+        QVERIFY(!light.isFeaturesOnly());
+        SampleLayout parameters;
+        parameters("IMAGE_X")("IMAGE_Y");
+        QVERIFY(!parameters.isFeaturesOnly());
+        QVERIFY(!SampleLayout().isFeaturesOnly());
+
+        // mockrenderer supports features-only evaluations (SUPPORTS_FEATURES_ONLY).
+        const int64_t divisor = m_client->getSceneInfo().get<int64_t>("features_only_cost_divisor");
+        QCOMPARE(divisor, INT64_C(8));
+
+        // Canceled after the first tile: the refund is in features-only cost.
+        const int featuresId = m_client->registerSampleLayout(features);
+        m_client->setSampleLayout(featuresId);
+        m_sampleSize = features.getSampleSize();
+        m_elements = {17, 18, 19, 10, 20};
+        auto stream = m_client->streamSamples(SPP(1));
+        QVERIFY(stream.next());
+        QCOMPARE(countErrors(stream.tile(), 1), INT64_C(0));
+        const int64_t numDelivered = stream.tile().numPixels();
+        const int64_t refund = stream.cancel();
+        const int64_t numPixels = m_width * m_height;
+        QCOMPARE(refund, (numPixels + divisor - 1) / divisor - (numDelivered + divisor - 1) / divisor);
+
+        // Back to the layout of the other tests.
+        SampleLayout full;
+        full("IMAGE_X")("IMAGE_Y")("COLOR_R")("COLOR_G")("COLOR_B");
+        m_client->setSampleLayout(m_client->registerSampleLayout(full));
+        m_sampleSize = full.getSampleSize();
+        m_elements = {0, 1, 7, 8, 9};
+    }
+
+    void budgetExhausted()
+    {
+        // The budget is charged per covered pixel: a region request asking for more than the budget
+        // gets the spp that fits its area, leaving less than one sample per pixel of the area.
+        const CropWindow window({0, 0}, {m_width, 100});
+        const int64_t area = m_width * 100;
+        int64_t regionSamples = 0;
+        m_client->evaluateSamples(SPP(BUDGET_SPP * 10), {window}, [&](const BufferTile& tile)
+        {
+            regionSamples += tile.getSPP() * tile.numPixels();
+        });
+        QVERIFY(regionSamples > area);
+        QCOMPARE(regionSamples % area, INT64_C(0));
+        int64_t numSamples = 0;
+        m_client->evaluateSamples(SPP(BUDGET_SPP), [&](const BufferTile& tile)
+        {
+            for(const float* sample: tile)
+            {
+                (void)sample;
+                ++numSamples;
+            }
+        });
+        QVERIFY(numSamples < area);
+
+        // No region can be afforded anymore.
+        int numRegionCalls = 0;
+        m_client->evaluateSamples(SPP(1), {CropWindow({0, 0}, {1, 1})}, [&](const BufferTile&){ ++numRegionCalls; });
+        QCOMPARE(numRegionCalls, 0);
+
+        // No tiles should be delivered anymore.
+        int numCalls = 0;
+        auto eval = m_client->evaluateSamplesAsync(SPP(1), [&](const BufferTile&){ ++numCalls; });
+        eval.wait();
+        QVERIFY(eval.isFinished());
+        QCOMPARE(numCalls, 0);
+
+        auto stream = m_client->streamSamples(SPP(1));
+        int numTiles = 0;
+        for(const BufferTile& tile: stream)
+        {
+            (void)tile;
+            ++numTiles;
+        }
+        QCOMPARE(numTiles, 0);
+        QVERIFY(stream.isFinished());
+
+        auto frame = m_client->evaluateFrame(SPP(1));
+        QCOMPARE(frame.getSPP(), INT64_C(0));
+        QVERIFY(frame.beginX() == frame.endX());
+    }
+
     void cleanupTestCase()
     {
         m_client->sendResult();
@@ -95,19 +519,59 @@ private slots:
     }
 
 private:
-    float getValue(int64_t x, int64_t y, int64_t s, int64_t c)
+    // Value written by mockrenderer for the component `c` of the layout, in an evaluation with `spp`.
+    float getValue(int64_t x, int64_t y, int64_t s, int64_t c, int64_t spp)
     {
         // FIXME: This function produces subnormal floats,
         // that may not be very good (lower performance).
         constexpr int64_t totalSampleSize = 41;
-        constexpr int64_t map[] = {0, 1, 7, 8, 9};
-        int64_t i = y * m_width * m_spp * totalSampleSize;
-        i += x * totalSampleSize * m_spp;
-        i+= s * totalSampleSize + map[c];
+        int64_t i = y * m_width * spp * totalSampleSize;
+        i += x * totalSampleSize * spp;
+        i+= s * totalSampleSize + m_elements[c];
         int32_t k = i % std::numeric_limits<int32_t>::max();
         return *reinterpret_cast<float*>(&k);
     }
 
+    // Returns the number of values of the tile that differ from the ones written by mockrenderer.
+    // Unlike QCOMPARE, it can be called from the consumer threads.
+    int64_t countErrors(const BufferTile& tile, int64_t spp)
+    {
+        int64_t numErrors = 0;
+        for(auto y = tile.beginY(); y < tile.endY(); ++y)
+        for(auto x = tile.beginX(); x < tile.endX(); ++x)
+        {
+            float* pixel = tile(x, y, 0);
+            for(int64_t s = 0; s < spp; ++s)
+            for(int64_t c = 0; c < m_sampleSize; ++c)
+                if(!qFuzzyCompare(pixel[s*m_sampleSize + c], getValue(x, y, s, c, spp)))
+                    ++numErrors;
+        }
+        return numErrors;
+    }
+
+    // Waits until the slot holding the first sample of a tile copy is overwritten in the tiles memory.
+    // The sample values are unique in the memory, so the slot is found by its content.
+    bool waitSlotReused(const SharedMemory& tilesMemory, const float* copy)
+    {
+        const auto* memory = static_cast<const float*>(tilesMemory.data());
+        const auto numFloats = static_cast<int64_t>(tilesMemory.size() / sizeof(float));
+        const size_t sampleBytes = m_sampleSize * sizeof(float);
+        const float* slot = nullptr;
+        for(int64_t i = 0; i + m_sampleSize <= numFloats && !slot; i += m_sampleSize)
+            if(std::memcmp(&memory[i], copy, sampleBytes) == 0)
+                slot = &memory[i];
+        if(!slot)
+            return false;
+
+        for(int i = 0; i < 1000; ++i)
+        {
+            if(std::memcmp(slot, copy, sampleBytes) != 0)
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return false;
+    }
+
     std::unique_ptr<BenchmarkManager> m_manager;
     std::unique_ptr<QProcess> m_rendererProcess;
     std::unique_ptr<BenchmarkClient> m_client;
@@ -115,6 +579,7 @@ private:
     int64_t m_height = 0;
     int64_t m_spp = 0;
     int64_t m_sampleSize = 0;
+    std::vector<int64_t> m_elements; // index of each layout element in the mockrenderer samples
 };
 
 
@@ -0,0 +1,137 @@
+#include "fbksd/client/ImageAccumulator.h"
+#include <QtTest>
+#include <thread>
+#include <vector>
+using namespace fbksd;
+
+
+class TestImageAccumulator : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void pixelMean()
+    {
+        // layout: IMAGE_X, IMAGE_Y, COLOR_R, COLOR_G, COLOR_B
+        ImageAccumulator acc(3, 2, 5, 2, 3);
+        acc.setPositionChannels(0, 1);
+        std::vector<float> samples = {
+            0.5f, 0.5f, 1.f, 2.f, 3.f,
+            0.9f, 0.1f, 3.f, 4.f, 5.f,
+            2.5f, 1.5f, 7.f, 8.f, 9.f,
+        };
+        acc.add(3, samples.data());
+
+        std::vector<float> out(3 * 2 * 3, -1.f);
+        acc.resolve(out.data());
+        QCOMPARE(out[0], 2.f);
+        QCOMPARE(out[1], 3.f);
+        QCOMPARE(out[2], 4.f);
+        QCOMPARE(out[15], 7.f);
+        QCOMPARE(out[16], 8.f);
+        QCOMPARE(out[17], 9.f);
+        // pixels without samples
+        QCOMPARE(out[3], 0.f);
+        QCOMPARE(out[14], 0.f);
+    }
+
+    void splat_data()
+    {
+        QTest::addColumn<int>("filter");
+        QTest::newRow("box") << int(ImageAccumulator::BOX);
+        QTest::newRow("tent") << int(ImageAccumulator::TENT);
+        QTest::newRow("gaussian") << int(ImageAccumulator::GAUSSIAN);
+    }
+
+    void splat()
+    {
+        QFETCH(int, filter);
+        // A constant image must be reconstructed exactly, whatever the filter.
+        ImageAccumulator acc(8, 8, 3, 2, 1, ImageAccumulator::Filter(filter), 1.5f);
+        acc.setPositionChannels(0, 1);
+        std::vector<float> samples;
+        for(int y = 0; y < 8; ++y)
+        for(int x = 0; x < 8; ++x)
+            samples.insert(samples.end(), {x + 0.5f, y + 0.5f, 0.25f});
+        acc.add(64, samples.data());
+
+        std::vector<float> out(64);
+        acc.resolve(out.data());
+        for(float v: out)
+            QVERIFY(qAbs(v - 0.25f) < 1e-6f);
+    }
+
+    void addTile()
+    {
+        // Tiles of mockrenderer's scene 2, consumed in parallel while another thread adds loose samples.
+        const int64_t width = 30;
+        const int64_t height = 30;
+        auto client = makeClient(width, height);
+        SampleLayout layout;
+        layout("IMAGE_X")("IMAGE_Y")("COLOR_R")("COLOR_G")("COLOR_B");
+        client->setSampleLayout(layout);
+        client->setNumConsumerThreads(4);
+
+        ImageAccumulator acc(width, height, 5, 2, 3);
+        acc.setPositionChannels(0, 1);
+        std::thread loose([&]()
+        {
+            for(int64_t y = 0; y < height; ++y)
+            for(int64_t x = 0; x < width; ++x)
+            {
+                float sample[] = {x + 0.5f, y + 0.5f, 1.f, 1.f, 1.f};
+                acc.add(1, sample);
+            }
+        });
+        for(int spp: {2, 1})
+            client->evaluateSamples(SPP(spp), [&](const BufferTile& tile){ acc.add(tile); });
+        loose.join();
+
+        std::vector<float> out(width * height * 3);
+        acc.resolve(out.data());
+        for(int64_t y = 0; y < height; ++y)
+        for(int64_t x = 0; x < width; ++x)
+        for(int64_t c = 0; c < 3; ++c)
+        {
+            // COLOR_R is the element 7 of the full sample.
+            const float sum = getStatisticsValue(x, y, 0, 7 + c) + getStatisticsValue(x, y, 1, 7 + c) +
+                              getStatisticsValue(x, y, 0, 7 + c) + 1.f;
+            QVERIFY(qAbs(out[(y * width + x) * 3 + c] - sum / 4.f) < 1e-5f);
+        }
+    }
+
+    void clear()
+    {
+        ImageAccumulator acc(2, 2, 3, 2, 1);
+        acc.setPositionChannels(0, 1);
+        float sample[] = {1.5f, 1.5f, 4.f};
+        acc.add(1, sample);
+        acc.clear();
+        std::vector<float> out(4, -1.f);
+        acc.resolve(out.data());
+        QCOMPARE(out[3], 0.f);
+    }
+
+private:
+    // Runs mockrenderer's scene 2 as a plugin (see TestInProcessClient).
+    std::unique_ptr<BenchmarkClient> makeClient(int64_t width, int64_t height)
+    {
+        std::string plugin = std::string(PLUGIN_FILE) + " --scene 2 --img-size " +
+                             std::to_string(width) + "x" + std::to_string(height);
+        std::vector<std::string> args = {"TestImageAccumulator", "--fbksd-renderer-plugin", plugin, "--fbksd-spp", "3"};
+        std::vector<char*> argv;
+        for(auto& arg: args)
+            argv.push_back(&arg[0]);
+        return std::make_unique<BenchmarkClient>(static_cast<int>(argv.size()), argv.data());
+    }
+
+    // Same as mockrenderer's scene 2, for the element `c` of the full sample.
+    float getStatisticsValue(int64_t x, int64_t y, int64_t s, int64_t c)
+    {
+        return static_cast<float>((x * 7 + y * 13 + c * 5 + s * s * 3) % 17) * 0.25f;
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestImageAccumulator)
+#include "TestImageAccumulator.moc"
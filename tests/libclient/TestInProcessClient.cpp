@@ -0,0 +1,251 @@
+#include "fbksd/client/BenchmarkClient.h"
+#include "fbksd/core/session.h"
+#include <QtTest>
+#include <atomic>
+#include <cmath>
+
+using namespace fbksd;
+
+
+// Runs the client with mockrenderer loaded as a plugin (see RendererPlugin.h): no renderer process,
+// benchmark server, or shared memory are involved.
+class TestInProcessClient : public QObject
+{
+     Q_OBJECT
+private slots:
+    void initTestCase()
+    {
+        m_client = makeClient();
+    }
+
+    void getSceneInfo()
+    {
+        auto info = m_client->getSceneInfo();
+        m_width = info.get<int64_t>("width");
+        m_height = info.get<int64_t>("height");
+        m_spp = info.get<int64_t>("max_spp");
+        QCOMPARE(m_width, INT64_C(30));
+        QCOMPARE(m_height, INT64_C(30));
+        QCOMPARE(m_spp, INT64_C(4));
+        QCOMPARE(info.get<int64_t>("max_samples"), INT64_C(3600));
+        QVERIFY(m_client->getResultBuffer() != nullptr);
+    }
+
+    void setSampleLayout()
+    {
+        SampleLayout layout;
+        layout("IMAGE_X")("IMAGE_Y")("COLOR_R")("COLOR_G")("COLOR_B");
+        m_client->setSampleLayout(layout);
+        m_sampleSize = layout.getSampleSize();
+
+        SampleLayout invalid;
+        invalid("NOT_AN_ELEMENT");
+        QVERIFY_EXCEPTION_THROWN(m_client->registerSampleLayout(invalid), std::invalid_argument);
+    }
+
+    void evaluateSamples()
+    {
+        // Asks for more than the budget: only the budget is given.
+        int64_t ncp = 0;
+        int spp = 4;
+        m_client->evaluateSamples(SPP(spp + 1), [&](const BufferTile& tile)
+        {
+            for(auto y = tile.beginY(); y < tile.endY(); ++y)
+            for(auto x = tile.beginX(); x < tile.endX(); ++x)
+            {
+                ncp += spp;
+                float* pixel = tile(x, y, 0);
+                for(int64_t s = 0; s < spp; ++s)
+                for(int64_t c = 0; c < m_sampleSize; ++c)
+                    QCOMPARE(pixel[s*m_sampleSize + c], getValue(x, y, s, c));
+            }
+        });
+        QCOMPARE(ncp, spp * m_width * m_height);
+    }
+
+    void budgetExhausted()
+    {
+        int numTiles = 0;
+        m_client->evaluateSamples(SPP(1), [&](const BufferTile&){ ++numTiles; });
+        QCOMPARE(numTiles, 0);
+        auto frame = m_client->evaluateFrame(SPP(1));
+        QCOMPARE(frame.getSPP(), INT64_C(0));
+    }
+
+    void streamOutlivesClient()
+    {
+        // A new client, with a new budget.
+        m_client.reset();
+        m_client = makeClient();
+
+        // Destroying the client cancels the evaluation of its open stream.
+        auto stream = m_client->streamSamples(SPP(1));
+        QVERIFY(stream.next());
+        m_client.reset();
+        QVERIFY(stream.isFinished());
+        QVERIFY(!stream.next());
+        QVERIFY_EXCEPTION_THROWN(stream.tile(), std::logic_error);
+        QCOMPARE(stream.cancel(), INT64_C(0));
+    }
+
+    void pixelStatistics()
+    {
+        // Scene 2 has values in the normal float range, so the statistics can be checked with a tolerance.
+        m_client.reset();
+        m_client = makeClient("--scene 2");
+
+        SampleLayout layout;
+        layout("COLOR_R")("COLOR_G")("COLOR_B");
+        layout.setPixelStatistics();
+        m_client->setSampleLayout(layout);
+
+        // Welford's mean and variance against a two-pass computation, including 1-sample pixels.
+        for(int spp: {3, 1})
+        {
+            int64_t ncp = 0;
+            m_client->evaluateSamples(SPP(spp), [&](const BufferTile& tile)
+            {
+                for(auto y = tile.beginY(); y < tile.endY(); ++y)
+                for(auto x = tile.beginX(); x < tile.endX(); ++x)
+                {
+                    ++ncp;
+                    for(int64_t c = 0; c < 3; ++c)
+                    {
+                        double mean = 0.0;
+                        for(int64_t s = 0; s < spp; ++s)
+                            mean += getStatisticsValue(x, y, s, 7 + c);
+                        mean /= spp;
+                        double variance = 0.0;
+                        for(int64_t s = 0; s < spp; ++s)
+                            variance += std::pow(getStatisticsValue(x, y, s, 7 + c) - mean, 2.0);
+                        variance = spp > 1 ? variance / (spp - 1) : 0.0;
+                        QVERIFY(std::abs(tile.mean(x, y)[c] - mean) < 1e-5);
+                        QVERIFY(std::abs(tile.variance(x, y)[c] - variance) < 1e-5);
+                    }
+                }
+            });
+            QCOMPARE(ncp, m_width * m_height);
+        }
+    }
+
+    void asyncMovedClient()
+    {
+        // A new client, with a new budget.
+        m_client.reset();
+        auto client = makeClient();
+        SampleLayout layout;
+        layout("COLOR_R");
+        client->setSampleLayout(layout);
+
+        // The evaluation runs in another thread while the client is moved.
+        std::atomic<int64_t> ncp {0};
+        auto eval = client->evaluateSamplesAsync(SPP(1), [&](const BufferTile& tile)
+        {
+            ncp += (tile.endX() - tile.beginX()) * (tile.endY() - tile.beginY());
+        });
+        BenchmarkClient moved(std::move(*client));
+        client.reset();
+        eval.wait();
+        QCOMPARE(ncp.load(), m_width * m_height);
+    }
+
+    void inputGenerator()
+    {
+        // A new client, with a new budget. Its renderer only loads the generators in the given directory.
+        m_client.reset();
+        setenv(GENERATORS_ENV, GENERATOR_DIR, 1);
+        m_client = makeClient();
+
+        SampleLayout layout;
+        layout("IMAGE_X", SampleLayout::INPUT)("IMAGE_Y", SampleLayout::INPUT)("COLOR_R");
+        layout.setInputGenerator(GENERATOR_NAME);
+        m_client->setSampleLayout(layout);
+
+        // The renderer writes the input, so the samples are requested without it. The sample indices
+        // continue in the second evaluation.
+        int64_t firstIndex = 0;
+        for(int spp: {1, 2})
+        {
+            int64_t ncp = 0;
+            m_client->evaluateSamples(SPP(spp), [&](const BufferTile& tile)
+            {
+                for(auto y = tile.beginY(); y < tile.endY(); ++y)
+                for(auto x = tile.beginX(); x < tile.endX(); ++x)
+                {
+                    ++ncp;
+                    float* pixel = tile(x, y, 0);
+                    for(int64_t s = 0; s < spp; ++s)
+                    {
+                        QCOMPARE(pixel[s*3], x + 0.5f);
+                        QCOMPARE(pixel[s*3 + 1], y + (firstIndex + s + 1) / 16.f);
+                    }
+                }
+            });
+            QCOMPARE(ncp, m_width * m_height);
+            firstIndex += spp;
+        }
+
+        SampleLayout missing = layout;
+        missing.setInputGenerator("not_a_generator.so");
+        QVERIFY_EXCEPTION_THROWN(m_client->setSampleLayout(missing), std::runtime_error);
+
+        // Paths given by the client are refused, even to the generator directory.
+        SampleLayout path = layout;
+        for(const std::string& name: {std::string(GENERATOR_DIR) + "/" + GENERATOR_NAME, std::string("../") + GENERATOR_NAME})
+        {
+            path.setInputGenerator(name);
+            QVERIFY_EXCEPTION_THROWN(m_client->setSampleLayout(path), std::runtime_error);
+        }
+
+        // Without the directory, generators are disabled.
+        m_client.reset();
+        m_client = makeClient();
+        QVERIFY_EXCEPTION_THROWN(m_client->setSampleLayout(layout), std::runtime_error);
+    }
+
+    void cleanupTestCase()
+    {
+        // Unloads the plugin.
+        m_client.reset();
+    }
+
+private:
+    std::unique_ptr<BenchmarkClient> makeClient(const std::string& pluginArgs = "")
+    {
+        std::string plugin = std::string(PLUGIN_FILE) + " --img-size 30x30";
+        if(!pluginArgs.empty())
+            plugin += " " + pluginArgs;
+        std::vector<std::string> args = {"TestInProcessClient", "--fbksd-renderer-plugin", plugin, "--fbksd-spp", "4"};
+        std::vector<char*> argv;
+        for(auto& arg: args)
+            argv.push_back(&arg[0]);
+        return std::make_unique<BenchmarkClient>(static_cast<int>(argv.size()), argv.data());
+    }
+
+    float getValue(int64_t x, int64_t y, int64_t s, int64_t c)
+    {
+        constexpr int64_t totalSampleSize = 41;
+        constexpr int64_t map[] = {0, 1, 7, 8, 9};
+        int64_t i = y * m_width * m_spp * totalSampleSize;
+        i += x * totalSampleSize * m_spp;
+        i+= s * totalSampleSize + map[c];
+        int32_t k = i % std::numeric_limits<int32_t>::max();
+        return *reinterpret_cast<float*>(&k);
+    }
+
+    // Same as mockrenderer's scene 2, for the element `c` of the full sample.
+    float getStatisticsValue(int64_t x, int64_t y, int64_t s, int64_t c)
+    {
+        return static_cast<float>((x * 7 + y * 13 + c * 5 + s * s * 3) % 17) * 0.25f;
+    }
+
+    std::unique_ptr<BenchmarkClient> m_client;
+    int64_t m_width = 0;
+    int64_t m_height = 0;
+    int64_t m_spp = 0;
+    int64_t m_sampleSize = 0;
+};
+
+
+QTEST_APPLESS_MAIN(TestInProcessClient)
+#include "TestInProcessClient.moc"
@@ -0,0 +1,97 @@
+#include "fbksd/client/SampleGatherer.h"
+#include <QtTest>
+#include <limits>
+#include <vector>
+using namespace fbksd;
+
+
+class TestSampleGatherer : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void gather_data()
+    {
+        QTest::addColumn<int>("numThreads");
+        QTest::newRow("sequential") << 1;
+        QTest::newRow("parallel") << 4;
+    }
+
+    void gather()
+    {
+        QFETCH(int, numThreads);
+        constexpr int64_t width = 37;
+        constexpr int64_t height = 23;
+        constexpr int sampleSize = 4;
+        SampleGatherer gatherer(width, height, sampleSize);
+        gatherer.setNumThreads(numThreads);
+
+        // Two passes, each delivered in two chunks. The last components record the pass and the order.
+        std::vector<int64_t> counts(width * height, 0);
+        for(int pass = 0; pass < 2; ++pass)
+        {
+            const int64_t n = 150000 + pass;
+            std::vector<float> samples;
+            for(int64_t i = 0; i < n; ++i)
+            {
+                int64_t x = (i * 7 + pass) % width;
+                int64_t y = (i * 13) % height;
+                samples.insert(samples.end(), {x + 0.5f, y + 0.25f, float(pass), float(i)});
+                ++counts[y * width + x];
+            }
+            gatherer.add(n / 2, samples.data());
+            gatherer.add(n - n / 2, &samples[(n / 2) * sampleSize]);
+            gatherer.gather();
+        }
+
+        QCOMPARE(gatherer.getTotalNumSamples(), INT64_C(300001));
+        for(int64_t y = 0; y < height; ++y)
+        for(int64_t x = 0; x < width; ++x)
+        {
+            QCOMPARE(gatherer.getNumSamples(x, y), counts[y * width + x]);
+            const float* samples = gatherer.getSamples(x, y);
+            for(int64_t s = 0; s < gatherer.getNumSamples(x, y); ++s)
+            {
+                const float* sample = &samples[s * sampleSize];
+                QCOMPARE(int64_t(sample[0]), x);
+                QCOMPARE(int64_t(sample[1]), y);
+                // Samples keep the order they were added.
+                if(s > 0)
+                {
+                    const float* prev = sample - sampleSize;
+                    QVERIFY(prev[2] < sample[2] || (prev[2] == sample[2] && prev[3] < sample[3]));
+                }
+            }
+        }
+    }
+
+    void outsideSamples()
+    {
+        SampleGatherer gatherer(4, 4, 2);
+        const float inf = std::numeric_limits<float>::infinity();
+        const float nan = std::numeric_limits<float>::quiet_NaN();
+        float samples[] = {-1.f, 2.f, 10.f, 10.f, inf, 1.f, nan, 3.f, 2.f, nan};
+        gatherer.add(5, samples);
+        gatherer.gather();
+        QCOMPARE(gatherer.getNumSamples(0, 2), INT64_C(1));
+        QCOMPARE(gatherer.getNumSamples(3, 3), INT64_C(1));
+        QCOMPARE(gatherer.getNumSamples(3, 1), INT64_C(1));
+        QCOMPARE(gatherer.getNumSamples(0, 3), INT64_C(1));
+        QCOMPARE(gatherer.getNumSamples(2, 0), INT64_C(1));
+    }
+
+    void clear()
+    {
+        SampleGatherer gatherer(4, 4, 2);
+        float samples[] = {1.f, 1.f};
+        gatherer.add(1, samples);
+        gatherer.gather();
+        gatherer.clear();
+        QCOMPARE(gatherer.getTotalNumSamples(), INT64_C(0));
+        QCOMPARE(gatherer.getNumSamples(1, 1), INT64_C(0));
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestSampleGatherer)
+#include "TestSampleGatherer.moc"
@@ -0,0 +1,142 @@
+#include "fbksd/client/SampleStore.h"
+#include <QtTest>
+#include <QTemporaryDir>
+#include <vector>
+using namespace fbksd;
+
+
+// The tiles are produced by mockrenderer loaded as a plugin (see TestInProcessClient).
+class TestSampleStore : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void append()
+    {
+        auto client = makeClient(30, 30, 3);
+        SampleLayout layout;
+        layout("IMAGE_X")("IMAGE_Y")("COLOR_R");
+        client->setSampleLayout(layout);
+
+        // One span per appended tile covering the pixel, in the order they were appended.
+        SampleStore store(30, 30, layout.getSampleSize());
+        std::vector<std::vector<float>> expected(30 * 30);
+        for(int spp: {1, 2})
+        {
+            client->evaluateSamples(SPP(spp), [&](const BufferTile& tile)
+            {
+                store.append(tile);
+                keep(tile, 30, expected);
+            });
+        }
+        QCOMPARE(store.getTotalNumSamples(), INT64_C(3) * 30 * 30);
+        QCOMPARE(store.getSpilledBytes(), INT64_C(0));
+        for(int64_t y = 0; y < 30; ++y)
+        for(int64_t x = 0; x < 30; ++x)
+        {
+            QCOMPARE(store.getNumSamples(x, y), INT64_C(3));
+            int numSpans = 0;
+            store.forEachSpan(x, y, [&](const float*, int64_t){ ++numSpans; });
+            QCOMPARE(numSpans, 2);
+            QVERIFY(read(store, x, y, layout.getSampleSize()) == expected[y * 30 + x]);
+        }
+
+        store.clear();
+        QCOMPARE(store.getTotalNumSamples(), INT64_C(0));
+        QCOMPARE(store.getNumSamples(0, 0), INT64_C(0));
+        QCOMPARE(store.getResidentBytes(), INT64_C(0));
+    }
+
+    void invalidTile()
+    {
+        auto client = makeClient(30, 30, 2);
+        SampleLayout layout;
+        layout("COLOR_R")("COLOR_G")("COLOR_B");
+        client->setSampleLayout(layout);
+
+        SampleStore wrongSize(30, 30, 2);
+        SampleStore smaller(10, 10, 3);
+        client->evaluateSamples(SPP(1), [&](const BufferTile& tile)
+        {
+            QVERIFY_EXCEPTION_THROWN(wrongSize.append(tile), std::invalid_argument);
+            if(tile.endX() > 10 || tile.endY() > 10)
+                QVERIFY_EXCEPTION_THROWN(smaller.append(tile), std::invalid_argument);
+        });
+        QCOMPARE(wrongSize.getTotalNumSamples(), INT64_C(0));
+    }
+
+    void spill()
+    {
+        // Two passes take more than one chunk, so the oldest ones are spilled.
+        const int64_t width = 512;
+        const int64_t height = 512;
+        auto client = makeClient(width, height, 2);
+        SampleLayout layout;
+        layout("COLOR_R")("COLOR_G")("COLOR_B")("WORLD_X")("WORLD_Y")("WORLD_Z")("NORMAL_X")("NORMAL_Y")("NORMAL_Z");
+        client->setSampleLayout(layout);
+
+        QTemporaryDir dir;
+        QVERIFY(dir.isValid());
+        SampleStore store(width, height, layout.getSampleSize());
+        store.setMemoryCap(1, dir.path().toStdString());
+        std::vector<std::vector<float>> expected(width * height);
+        for(int pass = 0; pass < 2; ++pass)
+        {
+            client->evaluateSamples(SPP(1), [&](const BufferTile& tile)
+            {
+                store.append(tile);
+                keep(tile, width, expected);
+            });
+        }
+
+        const int64_t totalBytes = 2 * width * height * layout.getSampleSize() * static_cast<int64_t>(sizeof(float));
+        QVERIFY(store.getSpilledBytes() > 0);
+        QVERIFY(store.getResidentBytes() < totalBytes);
+        QVERIFY(store.getSpilledBytes() + store.getResidentBytes() >= totalBytes);
+        // The spill file is removed from the directory as soon as it's created.
+        QVERIFY(QDir(dir.path()).entryList(QDir::Files).isEmpty());
+        for(int64_t y = 0; y < height; ++y)
+        for(int64_t x = 0; x < width; ++x)
+            QVERIFY(read(store, x, y, layout.getSampleSize()) == expected[y * width + x]);
+    }
+
+private:
+    std::unique_ptr<BenchmarkClient> makeClient(int64_t width, int64_t height, int64_t budgetSpp)
+    {
+        std::string plugin = std::string(PLUGIN_FILE) + " --img-size " + std::to_string(width) + "x" + std::to_string(height);
+        std::vector<std::string> args = {"TestSampleStore", "--fbksd-renderer-plugin", plugin,
+                                         "--fbksd-spp", std::to_string(budgetSpp)};
+        std::vector<char*> argv;
+        for(auto& arg: args)
+            argv.push_back(&arg[0]);
+        return std::make_unique<BenchmarkClient>(static_cast<int>(argv.size()), argv.data());
+    }
+
+    // Appends the samples of each pixel of the tile to its expected samples.
+    void keep(const BufferTile& tile, int64_t width, std::vector<std::vector<float>>& expected)
+    {
+        const int64_t pixelSize = tile.getSPP() * tile.getSampleSize();
+        for(auto y = tile.beginY(); y < tile.endY(); ++y)
+        for(auto x = tile.beginX(); x < tile.endX(); ++x)
+        {
+            const float* pixel = tile(x, y, 0);
+            auto& samples = expected[y * width + x];
+            samples.insert(samples.end(), pixel, pixel + pixelSize);
+        }
+    }
+
+    // Returns the samples of the pixel, concatenating its spans.
+    std::vector<float> read(const SampleStore& store, int64_t x, int64_t y, int64_t sampleSize)
+    {
+        std::vector<float> samples;
+        store.forEachSpan(x, y, [&](const float* span, int64_t numSamples)
+        {
+            samples.insert(samples.end(), span, span + numSamples * sampleSize);
+        });
+        return samples;
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestSampleStore)
+#include "TestSampleStore.moc"
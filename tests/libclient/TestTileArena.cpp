@@ -0,0 +1,79 @@
+#include "TileArena.h"
+#include <QtTest>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+using namespace fbksd;
+
+
+class TestTileArena : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void reuse()
+    {
+        TileArena arena;
+        float* a = arena.acquire(100);
+        QCOMPARE(reinterpret_cast<uintptr_t>(a) % 64, uintptr_t(0));
+        arena.release(a);
+
+        // A released buffer that fits is given again.
+        QCOMPARE(arena.acquire(50), a);
+        float* b = arena.acquire(50);
+        QVERIFY(b != a);
+        arena.release(a);
+        arena.release(b);
+    }
+
+    void bestFit()
+    {
+        TileArena arena;
+        float* large = arena.acquire(1000);
+        float* small = arena.acquire(100);
+        arena.release(large);
+        arena.release(small);
+        QCOMPARE(arena.acquire(80), small);
+        QCOMPARE(arena.acquire(800), large);
+        arena.release(small);
+        arena.release(large);
+
+        // Nothing fits: a new buffer is allocated.
+        float* larger = arena.acquire(2000);
+        QVERIFY(larger != nullptr);
+        larger[1999] = 1.f;
+        arena.release(larger);
+    }
+
+    void invalidRelease()
+    {
+        TileArena arena;
+        float value = 0.f;
+        QVERIFY_EXCEPTION_THROWN(arena.release(&value), std::logic_error);
+        float* a = arena.acquire(10);
+        arena.release(a);
+        QVERIFY_EXCEPTION_THROWN(arena.release(a), std::logic_error);
+    }
+
+    void copy()
+    {
+        TileArena arena;
+        std::vector<float> src(64);
+        std::iota(src.begin(), src.end(), 1.f);
+        float* dst = arena.acquire(64);
+        // Every size, from an unaligned source.
+        for(int64_t size = 0; size < 63; ++size)
+        {
+            std::fill(dst, dst + 64, -1.f);
+            TileArena::copy(dst, src.data() + 1, size);
+            for(int64_t i = 0; i < size; ++i)
+                QCOMPARE(dst[i], src[i + 1]);
+            QCOMPARE(dst[size], -1.f);
+        }
+        arena.release(dst);
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestTileArena)
+#include "TestTileArena.moc"
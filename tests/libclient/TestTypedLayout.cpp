@@ -0,0 +1,65 @@
+#include "fbksd/client/TypedLayout.h"
+#include <QtTest>
+#include <vector>
+using namespace fbksd;
+
+
+class TestTypedLayout : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void offsets()
+    {
+        using Layout = TypedLayout<Element::IMAGE_X, Element::IMAGE_Y, Element::COLOR_R, Element::WORLD_X_1>;
+        static_assert(Layout::size == 4, "");
+        static_assert(Layout::offset<Element::IMAGE_X>() == 0, "");
+        static_assert(Layout::offset<Element::COLOR_R>() == 2, "");
+        static_assert(Layout::offset<Element::WORLD_X_1>() == 3, "");
+        QCOMPARE(Layout::layout().getSampleSize(), 4);
+    }
+
+    void runtimeLayout()
+    {
+        using Layout = TypedLayout<Element::IMAGE_X, Element::COLOR_R, Element::NORMAL_X_1>;
+        SampleLayout expected;
+        expected("IMAGE_X")("COLOR_R")("NORMAL_X")[1];
+        auto layout = Layout::layout();
+        QCOMPARE(layout.getSampleSize(), expected.getSampleSize());
+        // The serialized layouts have the same names and numbers.
+        QCOMPARE(pack(layout), pack(expected));
+        QVERIFY(!layout.hasInput());
+        layout.setElementIO("IMAGE_X", SampleLayout::INPUT);
+        QVERIFY(layout.hasInput("IMAGE_X"));
+    }
+
+    void elementNames()
+    {
+        using Layout = TypedLayout<Element::LIGHT_Y, Element::DEPTH, Element::TEXTURE_COLOR_B_1,
+                                   Element::WORLD_Z_NS, Element::TEXTURE_COLOR_R_NS, Element::DIFFUSE_COLOR_B>;
+        SampleLayout expected;
+        expected("LIGHT_Y")("DEPTH")("TEXTURE_COLOR_B")[1]("WORLD_Z_NS")("TEXTURE_COLOR_R_NS")("DIFFUSE_COLOR_B");
+        QCOMPARE(pack(Layout::layout()), pack(expected));
+    }
+
+    void sampleAccess()
+    {
+        using Layout = TypedLayout<Element::IMAGE_X, Element::IMAGE_Y, Element::DEPTH>;
+        std::vector<float> samples = {1.f, 2.f, 3.f, 4.f, 5.f, 6.f};
+        QCOMPARE(Layout::at(samples.data(), 1).get<Element::IMAGE_Y>(), 5.f);
+        Layout::at(samples.data(), 0).get<Element::DEPTH>() = 10.f;
+        QCOMPARE(samples[2], 10.f);
+    }
+
+private:
+    static std::string pack(const SampleLayout& layout)
+    {
+        clmdep_msgpack::sbuffer buffer;
+        clmdep_msgpack::pack(buffer, layout);
+        return std::string(buffer.data(), buffer.size());
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestTypedLayout)
+#include "TestTypedLayout.moc"
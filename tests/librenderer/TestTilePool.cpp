@@ -0,0 +1,79 @@
+#include "TilePool.h"
+#include <QtTest>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+using namespace fbksd;
+
+
+class TestTilePool : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void claimWork()
+    {
+        constexpr int numWorkers = 3;
+        constexpr int numUnits = 200;
+        void* memory = mmap(nullptr, numUnits * sizeof(std::atomic<int>), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        QVERIFY(memory != MAP_FAILED);
+        auto claims = static_cast<std::atomic<int>*>(memory);
+        for(int i = 0; i < numUnits; ++i)
+            new(&claims[i]) std::atomic<int>(0);
+
+        std::vector<float> tiles(TilePool::getNumTiles());
+        TilePool::setNumWorkers(numWorkers);
+        TilePool::init(0, 1, 1, 1, tiles.data(), false);
+
+        std::vector<pid_t> workers;
+        for(int i = 0; i < numWorkers; ++i)
+        {
+            pid_t pid = fork();
+            QVERIFY(pid != -1);
+            if(pid == 0)
+            {
+                for(int unit = 0; unit < numUnits; ++unit)
+                    if(TilePool::claimWork())
+                        ++claims[unit];
+                _exit(EXIT_SUCCESS);
+            }
+            workers.push_back(pid);
+        }
+        for(auto pid: workers)
+        {
+            int status = 0;
+            QCOMPARE(waitpid(pid, &status, 0), pid);
+            QVERIFY(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+        }
+
+        // Each unit was claimed by exactly one worker.
+        for(int i = 0; i < numUnits; ++i)
+            QCOMPARE(claims[i].load(), 1);
+        munmap(memory, numUnits * sizeof(std::atomic<int>));
+
+        // A single process claims everything.
+        TilePool::setNumWorkers(1);
+        TilePool::init(0, 1, 1, 1, tiles.data(), false);
+        for(int i = 0; i < numUnits; ++i)
+            QVERIFY(TilePool::claimWork());
+    }
+
+    void workerExited()
+    {
+        std::vector<float> tiles(TilePool::getNumTiles());
+        TilePool::init(10, 1, 1, 1, tiles.data(), false);
+
+        // Nobody renders the samples: the client gets an error instead of waiting forever.
+        TilePool::setWorkerMonitor([](){ return false; });
+        bool hasNext = false;
+        bool isInput = false;
+        QVERIFY_EXCEPTION_THROWN(TilePool::getClientTile(hasNext, isInput), std::runtime_error);
+        QVERIFY(TilePool::isCanceled());
+        TilePool::setWorkerMonitor(nullptr);
+    }
+};
+
+
+QTEST_APPLESS_MAIN(TestTilePool)
+#include "TestTilePool.moc"
@@ -0,0 +1,237 @@
+#include "TileRecord.h"
+#include "fbksd/client/BenchmarkClient.h"
+#include "fbksd/core/session.h"
+#include <QtTest>
+#include <QTemporaryDir>
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+using namespace fbksd;
+
+
+class TestTileRecord : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void initTestCase()
+    {
+        QVERIFY(m_dir.isValid());
+    }
+
+    void index_data()
+    {
+        QTest::addColumn<bool>("truncated");
+        QTest::newRow("footer") << false;
+        // Without the footer (e.g. the renderer was killed), the index is rebuilt by scanning the records.
+        QTest::newRow("scan") << true;
+    }
+
+    void index()
+    {
+        QFETCH(bool, truncated);
+        const std::string path = m_dir.filePath("index.rec").toStdString();
+
+        SceneInfo scene;
+        scene.set<int64_t>("width", 40);
+        scene.set<int64_t>("height", 30);
+        SampleLayout color;
+        color("COLOR_R")("COLOR_G")("COLOR_B");
+        SampleLayout normal;
+        normal("NORMAL_X")("NORMAL_Y")("NORMAL_Z");
+        {
+            TileRecorder recorder(path);
+            recorder.setScene(16, scene);
+            recorder.setLayout(color);
+            recorder.beginEvaluation(4, 0);
+            recorder.setLayout(normal);
+            recorder.beginEvaluation(1, 0, {CropWindow({0, 0}, {8, 8})});
+            // Already recorded layouts are reused.
+            recorder.setLayout(color);
+            recorder.setSeed(3);
+            recorder.beginEvaluation(2, 7);
+        }
+
+        if(truncated)
+        {
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            QVERIFY(truncate(path.c_str(), static_cast<off_t>(file.tellg()) - 16) == 0);
+        }
+
+        TileRecordReader reader(path);
+        const auto& recording = reader.getRecording();
+        QCOMPARE(recording.tileSize, 16);
+        QCOMPARE(recording.scene.get<int64_t>("width"), INT64_C(40));
+        QCOMPARE(recording.layouts.size(), size_t(2));
+        QCOMPARE(recording.layouts[1].getSampleSize(), 3);
+        QCOMPARE(recording.evaluations.size(), size_t(3));
+        QCOMPARE(recording.evaluations[0].layout, 0);
+        QCOMPARE(recording.evaluations[0].spp, INT64_C(4));
+        QCOMPARE(recording.evaluations[1].layout, 1);
+        QCOMPARE(recording.evaluations[1].windows.size(), size_t(1));
+        QCOMPARE(recording.evaluations[1].windows[0].end.x, INT64_C(8));
+        QCOMPARE(recording.evaluations[2].layout, 0);
+        QCOMPARE(recording.evaluations[2].remainingCount, INT64_C(7));
+        QCOMPARE(recording.evaluations[0].seed, INT64_C(0));
+        QCOMPARE(recording.evaluations[2].seed, INT64_C(3));
+    }
+
+    void recordTiles()
+    {
+        const std::string path = m_dir.filePath("tiles.rec").toStdString();
+        SampleLayout layout;
+        layout("IMAGE_X")("IMAGE_Y")("COLOR_R")("COLOR_G")("COLOR_B");
+        SampleLayout input;
+        input("IMAGE_X", SampleLayout::INPUT)("IMAGE_Y", SampleLayout::INPUT)("COLOR_R");
+        input.setInputGenerator(GENERATOR_NAME);
+
+        // The renderer records the tiles while the client gets them.
+        std::vector<std::vector<float>> expected(m_width * m_height);
+        {
+            setenv(RECORD_ENV, path.c_str(), 1);
+            setenv(GENERATORS_ENV, GENERATOR_DIR, 1);
+            auto client = makeClient();
+            client->setSampleLayout(layout);
+            client->evaluateSamples(SPP(1), [&](const BufferTile& tile)
+            {
+                const int64_t pixelSize = tile.getSPP() * tile.getSampleSize();
+                for(auto y = tile.beginY(); y < tile.endY(); ++y)
+                for(auto x = tile.beginX(); x < tile.endX(); ++x)
+                {
+                    const float* pixel = tile(x, y, 0);
+                    auto& samples = expected[y * m_width + x];
+                    samples.insert(samples.end(), pixel, pixel + pixelSize);
+                }
+            });
+            client->setSampleLayout(input);
+            client->evaluateSamples(SPP(1), [](const BufferTile&){});
+        }
+
+        TileRecordReader reader(path);
+        const auto& recording = reader.getRecording();
+        QCOMPARE(recording.evaluations.size(), size_t(2));
+        const auto& evaluation = recording.evaluations[0];
+        QVERIFY(!evaluation.input);
+        QVERIFY(!evaluation.tiles.empty());
+        QVERIFY(recording.evaluations[1].input);
+
+        // The samples read back are the ones the client got.
+        int64_t numSamples = 0;
+        std::vector<float> samples;
+        for(const auto& tile: evaluation.tiles)
+        {
+#ifdef FBKSD_HAS_ZSTD
+            // The values of the mock renderer are bit patterns of consecutive integers, so they compress well.
+            QCOMPARE(tile.codec, int(RecordedTile::SHUFFLE_ZSTD));
+            QVERIFY(tile.size < tile.numFloats * static_cast<int64_t>(sizeof(float)));
+#else
+            QCOMPARE(tile.codec, int(RecordedTile::RAW));
+#endif
+            reader.read(tile, samples);
+            QCOMPARE(static_cast<int64_t>(samples.size()), tile.numFloats);
+            QCOMPARE(tile.numFloats, tile.numSamples * layout.getSampleSize());
+            numSamples += tile.numSamples;
+
+            size_t i = 0;
+            for(auto y = tile.window.begin.y; y < tile.window.end.y; ++y)
+            for(auto x = tile.window.begin.x; x < tile.window.end.x; ++x)
+            {
+                const auto& pixel = expected[y * m_width + x];
+                QVERIFY(std::equal(pixel.begin(), pixel.end(), samples.begin() + i));
+                i += pixel.size();
+            }
+            QCOMPARE(i, samples.size());
+        }
+        QCOMPARE(numSamples, m_width * m_height);
+
+        // Samples rendered with input are never replayed: only the evaluation without it is found.
+        TileReplayer replayer(reader);
+        QVERIFY(replayer.find(replayer.findLayout(input), 1, 0, {}, true, -1) == nullptr);
+        QVERIFY(replayer.find(replayer.findLayout(layout), 1, 0, {}, true, -1) == &evaluation);
+    }
+
+    void sampleCache()
+    {
+        // Scene 1 has random values: samples served from the cache are the only way to get the same ones twice.
+        const std::string path = m_dir.filePath("cache.rec").toStdString();
+        SampleLayout layout;
+        layout("COLOR_R")("COLOR_G")("COLOR_B");
+        auto evaluate = [&](BenchmarkClient& client)
+        {
+            std::vector<float> samples(m_width * m_height * layout.getSampleSize());
+            client.evaluateSamples(SPP(1), [&](const BufferTile& tile)
+            {
+                for(auto y = tile.beginY(); y < tile.endY(); ++y)
+                for(auto x = tile.beginX(); x < tile.endX(); ++x)
+                    std::copy_n(tile(x, y, 0), layout.getSampleSize(), &samples[(y * m_width + x) * layout.getSampleSize()]);
+            });
+            return samples;
+        };
+
+        // Miss: the evaluation is rendered and recorded in a new file.
+        std::vector<float> first;
+        {
+            setenv(CACHE_ENV, path.c_str(), 1);
+            auto client = makeClient("--scene 1");
+            client->setSampleLayout(layout);
+            first = evaluate(*client);
+        }
+        {
+            TileRecordReader reader(path);
+            QCOMPARE(reader.getRecording().evaluations.size(), size_t(1));
+        }
+
+        // The file is reopened in append mode. The first evaluation is a hit, and the second one a miss:
+        // a cached evaluation isn't served twice to the same run.
+        {
+            setenv(CACHE_ENV, path.c_str(), 1);
+            auto client = makeClient("--scene 1");
+            client->setSampleLayout(layout);
+            QVERIFY(evaluate(*client) == first);
+            QVERIFY(evaluate(*client) != first);
+        }
+        TileRecordReader reader(path);
+        const auto& evaluations = reader.getRecording().evaluations;
+        QCOMPARE(evaluations.size(), size_t(2));
+
+        // Both recorded evaluations are served by a replayer, in the recorded order.
+        TileReplayer replayer(reader);
+        const int recordedLayout = replayer.findLayout(layout);
+        QVERIFY(recordedLayout != -1);
+        // Both were rendered for the first run: other runs don't get them.
+        QVERIFY(replayer.find(recordedLayout, 1, 0, {}, true, 1) == nullptr);
+        QVERIFY(replayer.find(recordedLayout, 1, 0, {}, false, 0) == &evaluations[0]);
+        QVERIFY(replayer.find(recordedLayout, 1, 0, {}, false, -1) == &evaluations[1]);
+        QVERIFY(replayer.find(recordedLayout, 1, 0, {}, false, -1) == nullptr);
+        QVERIFY(replayer.find(recordedLayout, 2, 0, {}, true, -1) == nullptr);
+    }
+
+    void invalidFile()
+    {
+        const std::string path = m_dir.filePath("invalid.rec").toStdString();
+        std::ofstream(path) << "not a record file";
+        QVERIFY_EXCEPTION_THROWN(TileRecordReader reader(path), std::runtime_error);
+        QVERIFY_EXCEPTION_THROWN(TileRecordReader reader(m_dir.filePath("missing.rec").toStdString()), std::runtime_error);
+    }
+
+private:
+    // A client with mockrenderer loaded as a plugin (see TestInProcessClient).
+    std::unique_ptr<BenchmarkClient> makeClient(const std::string& pluginArgs = "")
+    {
+        std::string plugin = std::string(PLUGIN_FILE) + " --img-size " + std::to_string(m_width) + "x" + std::to_string(m_height);
+        if(!pluginArgs.empty())
+            plugin += " " + pluginArgs;
+        std::vector<std::string> args = {"TestTileRecord", "--fbksd-renderer-plugin", plugin, "--fbksd-spp", "2"};
+        std::vector<char*> argv;
+        for(auto& arg: args)
+            argv.push_back(&arg[0]);
+        return std::make_unique<BenchmarkClient>(static_cast<int>(argv.size()), argv.data());
+    }
+
+    QTemporaryDir m_dir;
+    const int64_t m_width = 40;
+    const int64_t m_height = 30;
+};
+
+QTEST_APPLESS_MAIN(TestTileRecord)
+#include "TestTileRecord.moc"
@@ -0,0 +1,163 @@
+#include "fbksd/renderer/TileScheduler.h"
+#include "TilePool.h"
+#include <QtTest>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <thread>
+using namespace fbksd;
+
+
+class TestTileScheduler : public QObject
+{
+     Q_OBJECT
+private slots:
+
+    void splitImage_data()
+    {
+        QTest::addColumn<int>("width");
+        QTest::addColumn<int>("height");
+        QTest::addColumn<int>("spp");
+        QTest::addColumn<int>("remainingCount");
+        QTest::newRow("spp") << 100 << 70 << 4 << 0;
+        QTest::newRow("remaining") << 100 << 70 << 2 << 1234;
+        QTest::newRow("remaining only") << 37 << 91 << 0 << 3000;
+    }
+
+    void splitImage()
+    {
+        QFETCH(int, width);
+        QFETCH(int, height);
+        QFETCH(int, spp);
+        QFETCH(int, remainingCount);
+        const int tileSize = 16;
+        const int pipeSize = std::max(spp, 1) * tileSize * tileSize;
+
+        auto tiles = TileScheduler::splitImage(width, height, spp, remainingCount, pipeSize);
+        std::vector<int> covered(width * height, 0);
+        int64_t numSamples = 0;
+        for(const auto& tile: tiles)
+        {
+            QVERIFY(tile.numSamples <= pipeSize);
+            int64_t tileNumSamples = 0;
+            for(int64_t y = tile.window.begin.y; y < tile.window.end.y; ++y)
+            for(int64_t x = tile.window.begin.x; x < tile.window.end.x; ++x)
+            {
+                ++covered[y * width + x];
+                tileNumSamples += tile.getPixelNumSamples(x, y);
+                QVERIFY(tile.getPixelNumSamples(x, y) - spp <= 1);
+            }
+            QCOMPARE(tileNumSamples, tile.numSamples);
+            numSamples += tile.numSamples;
+        }
+        QVERIFY(std::all_of(covered.begin(), covered.end(), [](int n){ return n == 1; }));
+        QCOMPARE(numSamples, int64_t(spp) * width * height + remainingCount);
+    }
+
+    void mortonOrder()
+    {
+        // 4x4 tiles of 8x8 pixels.
+        auto tiles = TileScheduler::splitImage(32, 32, 1, 0, 64);
+        QCOMPARE(tiles.size(), size_t(16));
+        const int64_t expected[][2] = {{0, 0}, {8, 0}, {0, 8}, {8, 8}, {16, 0}, {24, 0}, {16, 8}, {24, 8}};
+        for(int i = 0; i < 8; ++i)
+        {
+            QCOMPARE(tiles[i].window.begin.x, expected[i][0]);
+            QCOMPARE(tiles[i].window.begin.y, expected[i][1]);
+        }
+    }
+
+    void splitRegions()
+    {
+        std::vector<CropWindow> windows = {CropWindow({3, 5}, {40, 9}), CropWindow({50, 50}, {51, 90})};
+        auto tiles = TileScheduler::splitRegions(100, 100, 3, windows, 3 * 16 * 16);
+        int64_t numSamples = 0;
+        for(auto& tile: tiles)
+        {
+            QVERIFY(tile.window.width() <= 16 && tile.window.height() <= 16);
+            numSamples += tile.numSamples;
+        }
+        QCOMPARE(numSamples, INT64_C(3) * (37 * 4 + 40));
+    }
+
+    void render()
+    {
+        // 64 tiles of 8x8 pixels, with 16 tiles in the run of each thread.
+        TilePool::init(64 * 64, 64, 0, 1, m_slots.data(), false);
+        TileScheduler scheduler(64, 64, 4);
+        std::mutex mutex;
+        std::map<std::pair<int64_t, int64_t>, int> numRenders;
+        std::vector<int> threadNumTiles(4, 0);
+        scheduler.evaluateSamples(1, 0, 64, [&](SamplesPipe& pipe, const TileTask& tile, int thread)
+        {
+            // Thread 0 is slow, so the others steal the end of its run.
+            if(thread == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++numRenders[{tile.window.begin.x, tile.window.begin.y}];
+                ++threadNumTiles[thread];
+            }
+            // The test has no sample layout: only the number of samples is written.
+            pipe.write(&m_sample, tile.numSamples);
+        });
+
+        QCOMPARE(consume(), INT64_C(64) * 64);
+        scheduler.wait();
+        QCOMPARE(numRenders.size(), size_t(64));
+        for(const auto& pair: numRenders)
+            QCOMPARE(pair.second, 1);
+        QVERIFY(threadNumTiles[0] < 16);
+    }
+
+    void renderError()
+    {
+        TilePool::init(64 * 64, 64, 0, 1, m_slots.data(), false);
+        TileScheduler scheduler(64, 64, 4);
+        scheduler.evaluateSamples(1, 0, 64, [&](SamplesPipe& pipe, const TileTask& tile, int)
+        {
+            // The pipe of the failed tile is left incomplete.
+            if(tile.window.begin.x == 8 && tile.window.begin.y == 8)
+                throw std::runtime_error("tile error");
+            pipe.write(&m_sample, tile.numSamples);
+        });
+
+        // The evaluation is canceled: the client gets an error instead of waiting for the missing tile.
+        QVERIFY_EXCEPTION_THROWN(consume(), std::runtime_error);
+        QVERIFY(TilePool::isCanceled());
+        QVERIFY_EXCEPTION_THROWN(scheduler.wait(), std::runtime_error);
+
+        // The next evaluation runs normally.
+        TilePool::init(64 * 64, 64, 0, 1, m_slots.data(), false);
+        scheduler.evaluateSamples(1, 0, 64, [&](SamplesPipe& pipe, const TileTask& tile, int)
+        {
+            pipe.write(&m_sample, tile.numSamples);
+        });
+        QCOMPARE(consume(), INT64_C(64) * 64);
+        scheduler.wait();
+    }
+
+private:
+    // Gets all tiles of the evaluation from the pool, as the client would, and returns their number of samples.
+    int64_t consume()
+    {
+        int64_t numSamples = 0;
+        bool hasNext = true;
+        while(hasNext)
+        {
+            bool isInput = false;
+            auto tile = TilePool::getClientTile(hasNext, isInput);
+            numSamples += tile.numSamples;
+            TilePool::releaseConsumedTile(tile.index);
+        }
+        return numSamples;
+    }
+
+    // Tile slots of the pool. Without a sample layout, the samples take no space.
+    std::vector<float> m_slots = std::vector<float>(TilePool::getNumTiles());
+    float m_sample = 0.f;
+};
+
+
+QTEST_APPLESS_MAIN(TestTileScheduler)
+#include "TestTileScheduler.moc"
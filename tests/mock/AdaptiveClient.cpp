@@ -8,6 +8,7 @@
  */
 
 #include <fbksd/client/BenchmarkClient.h>
+#include <fbksd/client/SampleGatherer.h>
 using namespace fbksd;
 #include <cmath>
 #include <iostream>
@@ -42,7 +43,7 @@ int main(int argc, char* argv[])
     std::cout << "samples per iteration = " << samplesPerIter << std::endl;
     std::cout << "remainder = " << rest << std::endl;
 
-    std::vector<int> samplesCount(w*h, 0);
+    SampleGatherer gatherer(w, h, sampleSize);
     for(int it = 0; it < numIterations; ++it)
     {
         int64_t numSamples = 0;
@@ -62,29 +63,27 @@ int main(int argc, char* argv[])
             },
             [&](int64_t n, float* samples)
             {
-                for(int64_t i = 0; i < n; ++i)
-                {
-                    float* sample = &samples[i*sampleSize];
-                    int x = sample[0];
-                    int y = sample[1];
-                    samplesCount[y*w + x] += 1;
-
-                    float* pixel = &result[y*w*3 + x*3];
-                    pixel[0] += sample[2];
-                    pixel[1] += sample[3];
-                    pixel[2] += sample[4];
-                }
+                gatherer.add(n, samples);
             }
         );
+        gatherer.gather();
     }
 
     for(int y = 0; y < h; ++y)
     for(int x = 0; x < w; ++x)
     {
-        int n = samplesCount[y*w + x];
+        int64_t n = gatherer.getNumSamples(x, y);
+        const float* samples = gatherer.getSamples(x, y);
+        float* pixel = &result[y*w*3 + x*3];
+        for(int64_t i = 0; i < n; ++i)
+        {
+            const float* sample = &samples[i*sampleSize];
+            pixel[0] += sample[2];
+            pixel[1] += sample[3];
+            pixel[2] += sample[4];
+        }
         if(n)
         {
-            float* pixel = &result[y*w*3 + x*3];
             pixel[0] /= float(n);
             pixel[1] /= float(n);
             pixel[2] /= float(n);
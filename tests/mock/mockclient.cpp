@@ -10,6 +10,9 @@
 #include <fbksd/client/BenchmarkClient.h>
 using namespace fbksd;
 
+#include <chrono>
+#include <thread>
+
 
 int main(int argc, char* argv[])
 {
@@ -28,6 +31,10 @@ int main(int argc, char* argv[])
 
     client.evaluateSamples(SPP(spp), [&](const BufferTile& tile)
     {
+#ifdef TILE_DELAY_MS
+        // Built as mockslowclient: a filter much slower than the others sharing the renderer.
+        std::this_thread::sleep_for(std::chrono::milliseconds(TILE_DELAY_MS));
+#endif
         for(auto y = tile.beginY(); y < tile.endY(); ++y)
         for(auto x = tile.beginX(); x < tile.endX(); ++x)
         {
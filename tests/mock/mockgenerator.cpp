@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2019 Jonas Deyson
+ *
+ * This software is released under the MIT License.
+ *
+ * You should have received a copy of the MIT License
+ * along with this program. If not, see <https://opensource.org/licenses/MIT>
+ */
+
+#include <fbksd/renderer/InputGeneratorPlugin.h>
+#include <fbksd/renderer/samples.h>
+using namespace fbksd;
+
+namespace
+{
+
+// Puts the samples at the pixel centers, and encodes the sample index of the pixel in IMAGE_Y: y + (index + 1) / 16.
+void generate(const InputTile& tile, int64_t sample, const int32_t* parameters, int32_t numParameters, float* values)
+{
+    const int64_t spp = tile.spp > 0 ? tile.spp : 1;
+    const int64_t width = tile.endX - tile.beginX;
+    const int64_t pixel = sample / spp;
+    const int64_t index = tile.firstSample + sample % spp;
+    for(int32_t i = 0; i < numParameters; ++i)
+    {
+        if(parameters[i] == IMAGE_X)
+            values[i] = tile.beginX + pixel % width + 0.5f;
+        else if(parameters[i] == IMAGE_Y)
+            values[i] = tile.beginY + pixel / width + (index + 1) / 16.f;
+        else
+            values[i] = 0.f;
+    }
+}
+
+}
+
+FBKSD_INPUT_GENERATOR(generate)
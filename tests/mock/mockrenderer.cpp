@@ -8,12 +8,18 @@
  */
 
 #include <fbksd/renderer/RenderingServer.h>
+#include <fbksd/renderer/RendererPlugin.h>
 #include <fbksd/renderer/samples.h>
+#include <fbksd/renderer/TileScheduler.h>
 using namespace fbksd;
 
 #include <random>
 #include <iostream>
+#include <thread>
+#include <csignal>
+#include <unistd.h>
 #include <QCommandLineParser>
+#include <QFile>
 #include <QTimer>
 
 namespace
@@ -22,15 +28,20 @@ namespace
 int64_t g_width = 200;
 int64_t g_height = 200;
 int64_t g_spp = 4;
+int g_tileSize = 32;
+int g_tileDelay = 0; // milliseconds spent on each tile
+bool g_killWorker = false; // the worker process rendering the first tile dies
+pid_t g_serverPid = 0;
 
 SampleLayout g_layout;
 
 
 float rand()
 {
-    static std::random_device rd;
-    static std::mt19937 gen(rd());
-    static std::uniform_real_distribution<float> dis(0.f, 1.f);
+    // Called by the rendering threads.
+    static thread_local std::random_device rd;
+    static thread_local std::mt19937 gen(rd());
+    static thread_local std::uniform_real_distribution<float> dis(0.f, 1.f);
     return dis(gen);
 }
 
@@ -46,6 +57,13 @@ float getValue(int64_t x, int64_t y, int64_t s, int64_t c)
     return *reinterpret_cast<float*>(&k);
 }
 
+// Values of scene 2: in the normal float range and varying with the sample, so the pixels
+// have a non-zero variance.
+float getStatisticsValue(int64_t x, int64_t y, int64_t s, int64_t c)
+{
+    return static_cast<float>((x * 7 + y * 13 + c * 5 + s * s * 3) % 17) * 0.25f;
+}
+
 float lerp(float v, float min, float max)
 {
     return (1.f - v)*min + v*max;
@@ -66,77 +84,109 @@ void setLayout(const SampleLayout& layout)
     g_layout = layout;
 }
 
-bool evaluateSamples(int64_t spp, int64_t remainingCount, int)
+using ValueFunction = float (*)(int64_t x, int64_t y, int64_t s, int64_t c);
+
+void setSample(SampleBuffer& sampleBuffer, int64_t x, int64_t y, int64_t s, ValueFunction value)
 {
-    g_spp = spp;
+    int i = 0;
+    sampleBuffer.set(IMAGE_X, value(x, y, s, i++));
+    sampleBuffer.set(IMAGE_Y, value(x, y, s, i++));
+    sampleBuffer.set(LENS_U, value(x, y, s, i++));
+    sampleBuffer.set(LENS_V, value(x, y, s, i++));
+    sampleBuffer.set(TIME, value(x, y, s, i++));
+    sampleBuffer.set(LIGHT_X, value(x, y, s, i++));
+    sampleBuffer.set(LIGHT_Y, value(x, y, s, i++));
+    sampleBuffer.set(COLOR_R, value(x, y, s, i++));
+    sampleBuffer.set(COLOR_G, value(x, y, s, i++));
+    sampleBuffer.set(COLOR_B, value(x, y, s, i++));
+    sampleBuffer.set(DEPTH, value(x, y, s, i++));
+    sampleBuffer.set(DIRECT_LIGHT_R, value(x, y, s, i++));
+    sampleBuffer.set(DIRECT_LIGHT_G, value(x, y, s, i++));
+    sampleBuffer.set(DIRECT_LIGHT_B, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_X, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_Y, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_Z, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_X, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_Y, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_Z, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_R, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_G, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_B, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_X_1, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_Y_1, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_Z_1, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_X_1, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_Y_1, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_Z_1, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_R_1, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_G_1, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_B_1, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_X_NS, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_Y_NS, value(x, y, s, i++));
+    sampleBuffer.set(WORLD_Z_NS, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_X_NS, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_Y_NS, value(x, y, s, i++));
+    sampleBuffer.set(NORMAL_Z_NS, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_R_NS, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_G_NS, value(x, y, s, i++));
+    sampleBuffer.set(TEXTURE_COLOR_B_NS, value(x, y, s, i++));
+}
 
-    SamplesPipe pipe({0, 0}, {g_width, g_height}, spp * g_width * g_height);
+// Simulates an expensive renderer, spending the tile delay before each tile.
+// Returns false if the evaluation was canceled meanwhile.
+bool simulateWork()
+{
+    for(int ms = 0; ms < g_tileDelay; ++ms)
+    {
+        if(SamplesPipe::isCanceled())
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return !SamplesPipe::isCanceled();
+}
 
-    for(int64_t y = 0; y < g_height; ++y)
-    for(int64_t x = 0; x < g_width; ++x)
+void renderTile(SamplesPipe& pipe, const TileTask& tile, ValueFunction value)
+{
+    // Simulates a crash of a worker process (see RenderingServer::setNumWorkers()) in the middle of an evaluation.
+    if(g_killWorker && getpid() != g_serverPid && tile.window.begin.x == 0 && tile.window.begin.y == 0)
+        raise(SIGKILL);
+    if(!simulateWork())
+        return;
+    for(int64_t y = tile.window.begin.y; y < tile.window.end.y; ++y)
+    for(int64_t x = tile.window.begin.x; x < tile.window.end.x; ++x)
     {
-        for(int64_t s = 0; s < spp; ++s)
+        // A canceled pipe may be left incomplete.
+        if(SamplesPipe::isCanceled())
+            return;
+        for(int64_t s = 0; s < tile.getPixelNumSamples(x, y); ++s)
         {
             SampleBuffer sampleBuffer = pipe.getBuffer();
-            int i = 0;
-            sampleBuffer.set(IMAGE_X, getValue(x, y, s, i++));
-            sampleBuffer.set(IMAGE_Y, getValue(x, y, s, i++));
-            sampleBuffer.set(LENS_U, getValue(x, y, s, i++));
-            sampleBuffer.set(LENS_V, getValue(x, y, s, i++));
-            sampleBuffer.set(TIME, getValue(x, y, s, i++));
-            sampleBuffer.set(LIGHT_X, getValue(x, y, s, i++));
-            sampleBuffer.set(LIGHT_Y, getValue(x, y, s, i++));
-            sampleBuffer.set(COLOR_R, getValue(x, y, s, i++));
-            sampleBuffer.set(COLOR_G, getValue(x, y, s, i++));
-            sampleBuffer.set(COLOR_B, getValue(x, y, s, i++));
-            sampleBuffer.set(DEPTH, getValue(x, y, s, i++));
-            sampleBuffer.set(DIRECT_LIGHT_R, getValue(x, y, s, i++));
-            sampleBuffer.set(DIRECT_LIGHT_G, getValue(x, y, s, i++));
-            sampleBuffer.set(DIRECT_LIGHT_B, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_X, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_Y, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_Z, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_X, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_Y, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_Z, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_R, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_G, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_B, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_X_1, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_Y_1, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_Z_1, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_X_1, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_Y_1, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_Z_1, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_R_1, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_G_1, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_B_1, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_X_NS, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_Y_NS, getValue(x, y, s, i++));
-            sampleBuffer.set(WORLD_Z_NS, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_X_NS, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_Y_NS, getValue(x, y, s, i++));
-            sampleBuffer.set(NORMAL_Z_NS, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_R_NS, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_G_NS, getValue(x, y, s, i++));
-            sampleBuffer.set(TEXTURE_COLOR_B_NS, getValue(x, y, s, i++));
+            setSample(sampleBuffer, x, y, s, value);
             pipe << sampleBuffer;
         }
     }
-
-    return true;
 }
 
-bool evaluateSamples1(int64_t spp, int64_t remainingCount, int)
+void renderTile0(SamplesPipe& pipe, const TileTask& tile, int)
 {
-    g_spp = spp;
+    renderTile(pipe, tile, &getValue);
+}
 
-    SamplesPipe pipe({0, 0}, {g_width, g_height}, spp * g_width * g_height);
+void renderTile2(SamplesPipe& pipe, const TileTask& tile, int)
+{
+    renderTile(pipe, tile, &getStatisticsValue);
+}
 
-    for(int64_t y = 0; y < g_height; ++y)
-    for(int64_t x = 0; x < g_width; ++x)
+void renderTile1(SamplesPipe& pipe, const TileTask& tile, int)
+{
+    if(!simulateWork())
+        return;
+    for(int64_t y = tile.window.begin.y; y < tile.window.end.y; ++y)
+    for(int64_t x = tile.window.begin.x; x < tile.window.end.x; ++x)
     {
-        for(int64_t s = 0; s < spp; ++s)
+        if(SamplesPipe::isCanceled())
+            return;
+        for(int64_t s = 0; s < tile.getPixelNumSamples(x, y); ++s)
         {
             SampleBuffer sampleBuffer = pipe.getBuffer();
             sampleBuffer.set(IMAGE_X, x);
@@ -184,18 +234,17 @@ bool evaluateSamples1(int64_t spp, int64_t remainingCount, int)
         }
     }
 
-    return true;
 }
 
 void finish()
 {
 }
-}
-
 
-int main(int argc, char* argv[])
+void setup(RenderingServer& server, int argc, char* argv[])
 {
-    QCoreApplication app(argc, argv);
+    QStringList arguments;
+    for(int i = 0; i < argc; ++i)
+        arguments << argv[i];
     QCommandLineParser parser;
 
     parser.addHelpOption();
@@ -209,7 +258,29 @@ int main(int argc, char* argv[])
     QCommandLineOption sceneOpt("scene", "Scene number.", "scene");
     sceneOpt.setDefaultValue("0");
     parser.addOption(sceneOpt);
-    parser.process(app);
+    QCommandLineOption tileSizeOpt("tile-size", "Tile size.", "size");
+    tileSizeOpt.setDefaultValue("32");
+    parser.addOption(tileSizeOpt);
+    QCommandLineOption tileDelayOpt("tile-delay", "Time spent on each tile, in milliseconds.", "ms");
+    tileDelayOpt.setDefaultValue("0");
+    parser.addOption(tileDelayOpt);
+    QCommandLineOption workersOpt("workers", "Number of worker processes.", "workers");
+    workersOpt.setDefaultValue("1");
+    parser.addOption(workersOpt);
+    QCommandLineOption killWorkerOpt("kill-worker", "A worker process dies while rendering the first tile.");
+    parser.addOption(killWorkerOpt);
+    parser.process(arguments);
+
+    // The scene file, given by the benchmark manager, holds more options (e.g. "--workers 3").
+    if(!parser.positionalArguments().isEmpty())
+    {
+        QFile sceneFile(parser.positionalArguments().first());
+        if(sceneFile.open(QIODevice::ReadOnly | QIODevice::Text))
+        {
+            arguments << QString(sceneFile.readAll()).split(QRegExp("\\s+"), QString::SkipEmptyParts);
+            parser.process(arguments);
+        }
+    }
 
     if(parser.isSet(sizeOpt))
     {
@@ -227,22 +298,71 @@ int main(int argc, char* argv[])
 
     std::cout << "img size = " << g_width << " x " << g_height << std::endl;
     std::cout << "spp = " << g_spp << std::endl;
+    if(parser.isSet(tileSizeOpt))
+        g_tileSize = parser.value(tileSizeOpt).toInt();
+
+    if(parser.isSet(tileDelayOpt))
+        g_tileDelay = parser.value(tileDelayOpt).toInt();
+
+    int workers = 1;
+    if(parser.isSet(workersOpt))
+        workers = parser.value(workersOpt).toInt();
+    g_killWorker = parser.isSet(killWorkerOpt);
+    g_serverPid = getpid();
+
     std::cout << "scene = " << scene << std::endl;
 
-    RenderingServer server;
-    server.onGetTileSize([](){return g_width;});
+    server.onGetTileSize([](){return g_tileSize;});
     server.onGetSceneInfo(&getSceneInfo);
     server.onSetParameters(&setLayout);
+    auto scheduler = std::make_shared<TileScheduler>(g_width, g_height);
     switch (scene)
     {
         case 0:
-            server.onEvaluateSamples(&evaluateSamples);
+            // Opts in to the features-only evaluations, which the mock renders like the full ones.
+            server.onEvaluateSamplesWithMode([scheduler](int64_t spp, int64_t remainingCount, int pipeSize,
+                                                         RenderingServer::EvaluationMode)
+            {
+                g_spp = spp;
+                scheduler->evaluateSamples(spp, remainingCount, pipeSize, &renderTile0);
+            });
+            server.onEvaluateRegions([scheduler](int64_t spp, const std::vector<CropWindow>& windows, int pipeSize)
+            {
+                g_spp = spp;
+                scheduler->evaluateRegions(spp, windows, pipeSize, &renderTile0);
+            });
             break;
         case 1:
-            server.onEvaluateSamples(&evaluateSamples1);
+            server.onEvaluateSamples([scheduler](int64_t spp, int64_t remainingCount, int pipeSize)
+            {
+                g_spp = spp;
+                scheduler->evaluateSamples(spp, remainingCount, pipeSize, &renderTile1);
+            });
+            break;
+        case 2:
+            server.onEvaluateSamples([scheduler](int64_t spp, int64_t remainingCount, int pipeSize)
+            {
+                g_spp = spp;
+                scheduler->evaluateSamples(spp, remainingCount, pipeSize, &renderTile2);
+            });
             break;
     }
+    server.onLastTileConsumed([scheduler](){ scheduler->wait(); });
+    if(workers > 1)
+        server.setNumWorkers(workers);
     server.onFinish(&finish);
+}
+}
+
+// The same renderer can be loaded into the client process (see TestInProcessClient).
+FBKSD_RENDERER_PLUGIN(setup)
+
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+    RenderingServer server;
+    setup(server, argc, argv);
     server.run();
     return 0;
 }